@@ -0,0 +1,298 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file checksum_bench.c
+ * @brief Checksum module micro-benchmark
+ *
+ * Compares every checksum implementation supported by the CPU with the byte-wise reference (the algorithm kiwitun used before)
+ * on random data of all lengths and alignments, then measures time per checksum for typical packet sizes.
+ * Incremental updates (RFC 1624) are compared with full recalculation as well.
+ * Exits with non-zero status if any implementation gives a different result.
+*/
+
+#include "checksum.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#define BENCH_MAX_SIZE 65536 //maximum buffer size
+#define BENCH_VERIFY_MAX_SIZE 2048 //all lengths up to this one are verified
+#define BENCH_VERIFY_RANDOM 20000 //number of additional verified buffers with random length
+#define BENCH_MAX_ALIGN 8 //buffers are verified at every offset below this one
+#define BENCH_VERIFY_UPDATES 1000000 //number of verified incremental updates
+#define BENCH_HEADER_SIZE 20 //header size for incremental update tests
+#define BENCH_HEADER_CHECKSUM_POS 10 //checksum field position in header
+
+static const size_t defaultSizes[] = {20, 40, 64, 128, 576, 1500, 9000, 65535};
+
+static uint64_t rngState = 0x9E3779B97F4A7C15ULL; //xorshift PRNG state
+
+static uint64_t rng()
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return rngState;
+}
+
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Byte-wise reference implementation
+ * @return Checksum in host byte order
+**/
+static uint16_t referenceChecksum(const uint8_t *buf, size_t size)
+{
+    uint32_t sum = 0;
+    for(size_t i = 0; i < size; i += 2) //group data in 16-bit words
+    {
+        uint32_t low = ((i + 1) < size) ? buf[i + 1] : 0; //odd byte is padded with zero byte
+        sum += (((uint32_t)buf[i] << 8) | low);
+        sum = (sum & 0xFFFF) + (sum >> 16); //fold carry at once, so that any length is fine
+    }
+    return ~sum & 0xFFFF;
+}
+
+/**
+ * @brief Wrapper for reference implementation, so that it can be benchmarked like the others
+**/
+static uint64_t referencePartial(const void *data, size_t size, uint64_t sum)
+{
+    return htons(~referenceChecksum(data, size) & 0xFFFF) + sum;
+}
+
+/**
+ * @brief Compare all supported implementations with the reference one
+ * @return Number of mismatches
+**/
+static uint64_t verify(uint8_t *buf, const struct ChecksumImpl_s *impl, size_t implCount)
+{
+    uint64_t mismatches = 0, checked = 0;
+
+    for(uint64_t n = 0; n < (BENCH_VERIFY_MAX_SIZE + BENCH_VERIFY_RANDOM); n++)
+    {
+        size_t size = (n < BENCH_VERIFY_MAX_SIZE) ? n : (rng() % (BENCH_MAX_SIZE - BENCH_MAX_ALIGN));
+        size_t offset = rng() % BENCH_MAX_ALIGN;
+        uint8_t *p = buf + offset;
+        if((rng() % 4) == 0) //all ones and all zeros trigger carry corner cases
+            memset(p, (rng() & 1) ? 0xFF : 0x00, size);
+        else
+        {
+            for(size_t i = 0; i < size; i++)
+                p[i] = rng();
+        }
+
+        uint16_t expected = referenceChecksum(p, size);
+        for(size_t k = 0; k < implCount; k++)
+        {
+            if(!impl[k].supported())
+                continue;
+
+            //whole buffer at once and split into two parts at an even position
+            size_t split = (size / 2) ? (2 * (rng() % (size / 2 + 1))) : 0;
+            uint16_t whole = ntohs(Checksum_finish(impl[k].partial(p, size, 0)));
+            uint16_t parts = ntohs(Checksum_finish(impl[k].partial(p + split, size - split, impl[k].partial(p, split, 0))));
+            if((whole != expected) || (parts != expected))
+            {
+                if(mismatches < 10)
+                    printf("Mismatch: %s, size %zu, offset %zu: expected 0x%04X, got 0x%04X (split at %zu: 0x%04X)\n",
+                        impl[k].name, size, offset, expected, whole, split, parts);
+                mismatches++;
+            }
+            checked++;
+        }
+
+        uint16_t dispatched = ntohs(Checksum_compute(p, size));
+        if(dispatched != expected)
+        {
+            if(mismatches < 10)
+                printf("Mismatch: Checksum_compute(), size %zu, offset %zu: expected 0x%04X, got 0x%04X\n", size, offset, expected, dispatched);
+            mismatches++;
+        }
+        checked++;
+    }
+
+    printf("Verified %llu checksums, %llu mismatches\n", (unsigned long long)checked, (unsigned long long)mismatches);
+    return mismatches;
+}
+
+/**
+ * @brief Compare incremental checksum updates with full recalculation
+ * @return Number of mismatches
+**/
+static uint64_t verifyUpdates()
+{
+    uint8_t hdr[BENCH_HEADER_SIZE];
+    uint16_t check;
+    uint64_t mismatches = 0;
+
+    for(uint64_t n = 0; n < BENCH_VERIFY_UPDATES; n++)
+    {
+        if((n % 64) == 0) //new random header every few updates, so that updates are chained
+        {
+            for(size_t i = 0; i < sizeof(hdr); i++)
+                hdr[i] = ((n / 64) % 4) ? rng() : 0xFF; //all ones header is the -0 corner case
+            memset(&hdr[BENCH_HEADER_CHECKSUM_POS], 0, sizeof(check));
+            check = Checksum_compute(hdr, sizeof(hdr));
+            memcpy(&hdr[BENCH_HEADER_CHECKSUM_POS], &check, sizeof(check));
+        }
+
+        size_t offset;
+        do
+            offset = rng() % sizeof(hdr);
+        while((offset & ~1) == BENCH_HEADER_CHECKSUM_POS);
+
+        uint16_t updated;
+        memcpy(&updated, &hdr[BENCH_HEADER_CHECKSUM_POS], sizeof(updated));
+        Checksum_replace8(&updated, hdr, offset, ((rng() % 8) == 0) ? (uint8_t)(hdr[offset] - 1) : (uint8_t)rng());
+        memcpy(&hdr[BENCH_HEADER_CHECKSUM_POS], &updated, sizeof(updated));
+
+        //updated header must verify, incremental update may give -0 (0xFFFF) where full recalculation gives +0, both are valid
+        if(Checksum_compute(hdr, sizeof(hdr)) != 0)
+        {
+            if(mismatches < 10)
+                printf("Incremental update mismatch at offset %zu\n", offset);
+            mismatches++;
+        }
+    }
+
+    printf("Verified %llu incremental updates, %llu mismatches\n", (unsigned long long)BENCH_VERIFY_UPDATES, (unsigned long long)mismatches);
+    return mismatches;
+}
+
+/**
+ * @brief Measure one implementation for one size
+ * @return Time per checksum in nanoseconds
+**/
+static double measure(uint64_t (*partial)(const void*, size_t, uint64_t), const uint8_t *buf, size_t size, uint64_t bytes)
+{
+    uint64_t iterations = bytes / (size ? size : 1) + 1;
+    volatile uint64_t sink = 0;
+    uint64_t start = nowNs();
+    for(uint64_t i = 0; i < iterations; i++)
+        sink += partial(buf, size, i);
+    uint64_t time = nowNs() - start;
+    (void)sink;
+    return (double)time / iterations;
+}
+
+static const char usage[] = "Usage: checksum_bench [options]\n"\
+                            " -s, --size=bytes\tmeasure given buffer size (can be repeated, default: common packet sizes)\n"\
+                            " -b, --bytes=count\tnumber of bytes to checksum per measurement (default 1000000000)\n"\
+                            " --seed=value\t\tPRNG seed\n"\
+                            " -h, --help\t\tprint this help page\n";
+
+int main(int argc, char **argv)
+{
+    #define ARG_SEED 128
+    struct option options[] =
+    {
+        {"size", required_argument, 0, 's'},
+        {"bytes", required_argument, 0, 'b'},
+        {"seed", required_argument, 0, ARG_SEED},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    size_t sizes[sizeof(defaultSizes) / sizeof(*defaultSizes)];
+    size_t sizeCount = 0;
+    uint64_t bytes = 1000000000ULL;
+
+    int c;
+    while((c = getopt_long(argc, argv, "s:b:h", options, NULL)) != -1)
+    {
+        switch(c)
+        {
+            case 's':
+            if(sizeCount < (sizeof(sizes) / sizeof(*sizes)))
+            {
+                sizes[sizeCount] = strtoull(optarg, NULL, 0);
+                if(sizes[sizeCount] > (BENCH_MAX_SIZE - BENCH_MAX_ALIGN))
+                    sizes[sizeCount] = BENCH_MAX_SIZE - BENCH_MAX_ALIGN;
+                sizeCount++;
+            }
+            break;
+            case 'b':
+            bytes = strtoull(optarg, NULL, 0);
+            break;
+            case ARG_SEED:
+            rngState = strtoull(optarg, NULL, 0) | 1;
+            break;
+            case 'h':
+            printf("%s", usage);
+            return 0;
+            default:
+            printf("%s", usage);
+            return -1;
+        }
+    }
+
+    if(sizeCount == 0)
+    {
+        memcpy(sizes, defaultSizes, sizeof(defaultSizes));
+        sizeCount = sizeof(defaultSizes) / sizeof(*defaultSizes);
+    }
+
+    uint8_t *buf = malloc(BENCH_MAX_SIZE);
+    if(buf == NULL)
+    {
+        printf("malloc failure\n");
+        return -1;
+    }
+
+    size_t implCount;
+    const struct ChecksumImpl_s *impl = Checksum_getImplementations(&implCount);
+    printf("Selected implementation: %s\n", Checksum_getName());
+
+    if(verify(buf, impl, implCount) || verifyUpdates())
+    {
+        free(buf);
+        return 1;
+    }
+
+    for(size_t i = 0; i < BENCH_MAX_SIZE; i++)
+        buf[i] = rng();
+
+    printf("\n%-10s %8s %12s %10s\n", "impl", "size", "ns/checksum", "GB/s");
+    for(size_t s = 0; s < sizeCount; s++)
+    {
+        double t = measure(&referencePartial, buf, sizes[s], bytes / 10); //reference is slow
+        printf("%-10s %8zu %12.2f %10.2f\n", "reference", sizes[s], t, sizes[s] / t);
+        for(size_t k = 0; k < implCount; k++)
+        {
+            if(!impl[k].supported())
+                continue;
+            t = measure(impl[k].partial, buf, sizes[s], bytes);
+            printf("%-10s %8zu %12.2f %10.2f\n", impl[k].name, sizes[s], t, sizes[s] / t);
+        }
+        t = measure(&Checksum_partial, buf, sizes[s], bytes);
+        printf("%-10s %8zu %12.2f %10.2f\n", "dispatched", sizes[s], t, sizes[s] / t);
+    }
+
+    free(buf);
+    return 0;
+}
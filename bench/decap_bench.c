@@ -0,0 +1,270 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file decap_bench.c
+ * @brief Decapsulation micro-benchmark
+ *
+ * Measures time per decapsulated IPIP and IP6IP packet for every decapsulation check policy.
+ * Decapsulated packets are written to /dev/null (or a given file) instead of a TUN interface, so root privileges are not needed.
+ * The time of a bare write is reported as well, so that the validation cost can be separated from the system call.
+ * Before measuring, checks that each policy accepts and rejects packets with broken checksums as documented.
+*/
+
+#include "ipip.h"
+#include "tunnel.h"
+#include "common.h"
+#include "checksum.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+
+//decapsulation routines are internal to ipip.c
+int ipip_decap(uint8_t *buf, int size);
+int ip6ip_decap(uint8_t *buf, int size);
+
+static const int defaultSizes[] = {60, 576, 1500};
+static const char *policyNames[] = {"strict", "outer-trust", "minimal"};
+
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Build encapsulated packet with valid headers
+ * @param buf Buffer
+ * @param size Total packet size (outer header included)
+ * @param family Inner packet family
+**/
+static void buildPacket(uint8_t *buf, int size, int family)
+{
+    memset(buf, 0xA5, size);
+    struct ip *outer = (struct ip*)buf;
+    memset(outer, 0, IPV4_HEADER_SIZE);
+    outer->ip_v = IPVX_HEADER_VERSION_4;
+    outer->ip_hl = IPV4_HEADER_SIZE / 4;
+    outer->ip_len = htons(size);
+    outer->ip_ttl = 64;
+    outer->ip_p = (family == AF_INET) ? IPV4_HEADER_PROTO_IPIP : IPV4_HEADER_PROTO_IP6IP;
+    outer->ip_src.s_addr = inet_addr("192.0.2.1");
+    outer->ip_dst.s_addr = inet_addr("192.0.2.2");
+    outer->ip_sum = Checksum_compute(outer, IPV4_HEADER_SIZE);
+
+    if(family == AF_INET)
+    {
+        struct ip *inner = (struct ip*)(buf + IPV4_HEADER_SIZE);
+        memset(inner, 0, IPV4_HEADER_SIZE);
+        inner->ip_v = IPVX_HEADER_VERSION_4;
+        inner->ip_hl = IPV4_HEADER_SIZE / 4;
+        inner->ip_len = htons(size - IPV4_HEADER_SIZE);
+        inner->ip_ttl = 63;
+        inner->ip_p = IPPROTO_UDP;
+        inner->ip_src.s_addr = inet_addr("10.0.0.1");
+        inner->ip_dst.s_addr = inet_addr("10.0.0.2");
+        inner->ip_sum = Checksum_compute(inner, IPV4_HEADER_SIZE);
+    }
+    else
+    {
+        struct ip6_hdr *inner = (struct ip6_hdr*)(buf + IPV4_HEADER_SIZE);
+        memset(inner, 0, IPV6_HEADER_SIZE);
+        inner->ip6_vfc = IPVX_HEADER_VERSION_6 << 4;
+        inner->ip6_plen = htons(size - IPV4_HEADER_SIZE - IPV6_HEADER_SIZE);
+        inner->ip6_nxt = IPPROTO_UDP;
+        inner->ip6_hlim = 63;
+        inet_pton(AF_INET6, "2001:db8::1", &(inner->ip6_src));
+        inet_pton(AF_INET6, "2001:db8::2", &(inner->ip6_dst));
+    }
+}
+
+/**
+ * @brief Check that policies accept and reject packets as documented
+ * @return 0 if all results are as expected, -1 otherwise
+**/
+static int checkPolicies(uint8_t *buf)
+{
+    int ret = 0;
+    //expected result for: valid packet, broken outer checksum, broken inner checksum
+    static const int expected[3][3] = {{0, -1, -1}, {0, 0, -1}, {0, 0, 0}};
+
+    for(uint8_t p = DECAP_CHECK_STRICT; p <= DECAP_CHECK_MINIMAL; p++)
+    {
+        config.decapCheck = p;
+        for(uint8_t k = 0; k < 3; k++)
+        {
+            buildPacket(buf, 100, AF_INET);
+            if(k == 1)
+                ((struct ip*)buf)->ip_sum ^= 0x0101;
+            else if(k == 2)
+                ((struct ip*)(buf + IPV4_HEADER_SIZE))->ip_sum ^= 0x0101;
+
+            int r = ipip_decap(buf, 100);
+            if(r != expected[p][k])
+            {
+                printf("Policy %s: unexpected result %d for %s packet\n", policyNames[p], r, (k == 0) ? "valid" : ((k == 1) ? "broken outer" : "broken inner"));
+                ret = -1;
+            }
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief Measure decapsulation
+ * @return Time per packet in nanoseconds
+**/
+static double measure(int (*decap)(uint8_t*, int), uint8_t *buf, int size, uint64_t packets)
+{
+    uint64_t start = nowNs();
+    for(uint64_t i = 0; i < packets; i++)
+        decap(buf, size);
+    return (double)(nowNs() - start) / packets;
+}
+
+static const char usage[] = "Usage: decap_bench [options]\n"\
+                            " -s, --size=bytes\tmeasure given encapsulated packet size (can be repeated, default: 60, 576 and 1500)\n"\
+                            " -n, --packets=count\tnumber of packets per measurement (default 1000000)\n"\
+                            " -o, --output=file\twrite decapsulated packets to given file instead of /dev/null\n"\
+                            " -h, --help\t\tprint this help page\n";
+
+int main(int argc, char **argv)
+{
+    struct option options[] =
+    {
+        {"size", required_argument, 0, 's'},
+        {"packets", required_argument, 0, 'n'},
+        {"output", required_argument, 0, 'o'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int sizes[16];
+    size_t sizeCount = 0;
+    uint64_t packets = 1000000;
+    const char *output = "/dev/null";
+
+    config.noDaemon = 1;
+    config.logLevel = LOG_WARNING;
+    config.ttl = DEFAULT_IPV4_TTL;
+    Runtime_publish(config.ttl, config.logLevel);
+
+    int c;
+    while((c = getopt_long(argc, argv, "s:n:o:h", options, NULL)) != -1)
+    {
+        switch(c)
+        {
+            case 's':
+            if(sizeCount < (sizeof(sizes) / sizeof(*sizes)))
+            {
+                sizes[sizeCount] = atoi(optarg);
+                if(sizes[sizeCount] < (IPV4_HEADER_SIZE + IPV6_HEADER_SIZE))
+                    sizes[sizeCount] = IPV4_HEADER_SIZE + IPV6_HEADER_SIZE;
+                if(sizes[sizeCount] > IP_MAX_PACKET_SIZE)
+                    sizes[sizeCount] = IP_MAX_PACKET_SIZE;
+                sizeCount++;
+            }
+            break;
+            case 'n':
+            packets = strtoull(optarg, NULL, 0);
+            if(packets == 0)
+                packets = 1;
+            break;
+            case 'o':
+            output = optarg;
+            break;
+            case 'h':
+            printf("%s", usage);
+            return 0;
+            default:
+            printf("%s", usage);
+            return -1;
+        }
+    }
+
+    if(sizeCount == 0)
+    {
+        memcpy(sizes, defaultSizes, sizeof(defaultSizes));
+        sizeCount = sizeof(defaultSizes) / sizeof(*defaultSizes);
+    }
+
+    int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        perror("Output file open failed");
+        return -1;
+    }
+
+    //no tunneling mode is enabled, so no raw sockets are created
+    if((Tunnel_add(fd, "bench", INADDR_ANY, INADDR_ANY) < 0) || (Ipip_init() < 0))
+    {
+        printf("Tunnel initialization failed\n");
+        return -1;
+    }
+
+    uint8_t *buf = malloc(IP_MAX_PACKET_SIZE);
+    if(buf == NULL)
+    {
+        printf("malloc failure\n");
+        return -1;
+    }
+
+    if(checkPolicies(buf) < 0)
+    {
+        free(buf);
+        return 1;
+    }
+    printf("Policy checks passed\n\n");
+
+    printf("%-6s %6s %-12s %12s %12s\n", "inner", "size", "policy", "ns/packet", "validation");
+    for(size_t s = 0; s < sizeCount; s++)
+    {
+        //bare write of the decapsulated packet - the part of decapsulation every policy has to do
+        uint64_t start = nowNs();
+        for(uint64_t i = 0; i < packets; i++)
+        {
+            if(write(fd, buf + IPV4_HEADER_SIZE, sizes[s] - IPV4_HEADER_SIZE) < 0)
+                break;
+        }
+        double writeTime = (double)(nowNs() - start) / packets;
+        printf("%-6s %6d %-12s %12.1f %12s\n", "-", sizes[s], "write only", writeTime, "-");
+
+        for(int family = AF_INET; family != 0; family = (family == AF_INET) ? AF_INET6 : 0)
+        {
+            buildPacket(buf, sizes[s], family);
+            for(uint8_t p = DECAP_CHECK_STRICT; p <= DECAP_CHECK_MINIMAL; p++)
+            {
+                config.decapCheck = p;
+                double t = measure((family == AF_INET) ? &ipip_decap : &ip6ip_decap, buf, sizes[s], packets);
+                printf("%-6s %6d %-12s %12.1f %12.1f\n", (family == AF_INET) ? "IPv4" : "IPv6", sizes[s], policyNames[p], t, t - writeTime);
+            }
+        }
+    }
+
+    free(buf);
+    close(fd);
+    return 0;
+}
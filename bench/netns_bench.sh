@@ -0,0 +1,273 @@
+#!/bin/bash
+#
+#    This file is part of kiwitun.
+#
+#    Kiwitun is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation; either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    Kiwitun is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Full datapath throughput benchmark.
+#
+# Two network namespaces (kbench-a, kbench-b) are joined by a veth pair (the underlay). A tunnel engine runs at both ends:
+# kiwitun, or the kernel ipip/sit drivers as a baseline. traffic_gen sends UDP packets through the tunnel from one
+# namespace and counts them in the other, for each packet size, flow count, tunneling mode and direction.
+# Results are printed to stdout as CSV (default) or JSON Lines, one record per case:
+#  label, engine, mode, direction, size (inner IP packet size), flows, sent, received, loss_pct, pps, gbps (inner packets),
+#  cpu_ns_per_pkt (busy time of all CPUs, generator included), engine_cpu_ns_per_pkt (kiwitun processes only),
+#  gen_cpu_ns_per_pkt (generator processes only).
+# kiwitun output goes to netns_bench-a.log and netns_bench-b.log in $TMPDIR (or /tmp).
+# CPU time is taken from /proc/stat, so other load on the machine skews cpu_ns_per_pkt. Must be run as root.
+
+set -u
+
+KIWITUN=./kiwitun
+GEN=./bench/traffic_gen
+SIZES="64 512 1400"
+FLOWS="1 64"
+MODES="4in4 6in4"
+ENGINES="kiwitun kernel"
+DIRECTIONS="a-b b-a"
+TIME=5
+RATE=0
+FORMAT=csv
+LABEL=""
+EXTRA=""
+LOGDIR=${TMPDIR:-/tmp}
+
+NS_A=kbench-a
+NS_B=kbench-b
+UNDERLAY_A=198.51.100.1
+UNDERLAY_B=198.51.100.2
+INNER_A=10.200.0.1
+INNER_B=10.200.0.2
+INNER6_A=fd00:6b62::1
+INNER6_B=fd00:6b62::2
+PORT=9000
+HZ=$(getconf CLK_TCK)
+PIDS=""
+
+usage()
+{
+    cat <<EOF
+Usage: netns_bench.sh [options]
+ -k path	kiwitun executable (default $KIWITUN)
+ -g path	traffic_gen executable (default $GEN)
+ -e engines	tunnel engines: kiwitun, kernel (default "$ENGINES")
+ -m modes	tunneling modes: 4in4, 6in4 (default "$MODES")
+ -d directions	traffic directions: a-b, b-a (default "$DIRECTIONS")
+ -s sizes	inner IP packet sizes in bytes (default "$SIZES")
+ -f flows	flow counts (default "$FLOWS")
+ -t seconds	sending time per case (default $TIME)
+ -r pps		packet rate limit (default 0 - none)
+ -x args	additional kiwitun arguments, e.g. "--encap=fou" or "--decap-check=minimal"
+ -l label	label put in every record, to tell builds apart
+ -o format	output format: csv, json (default $FORMAT)
+ -h		print help page
+EOF
+}
+
+while getopts "k:g:e:m:d:s:f:t:r:x:l:o:h" opt; do
+    case $opt in
+        k) KIWITUN=$OPTARG ;;
+        g) GEN=$OPTARG ;;
+        e) ENGINES=$OPTARG ;;
+        m) MODES=$OPTARG ;;
+        d) DIRECTIONS=$OPTARG ;;
+        s) SIZES=$OPTARG ;;
+        f) FLOWS=$OPTARG ;;
+        t) TIME=$OPTARG ;;
+        r) RATE=$OPTARG ;;
+        x) EXTRA=$OPTARG ;;
+        l) LABEL=$OPTARG ;;
+        o) FORMAT=$OPTARG ;;
+        h) usage; exit 0 ;;
+        *) usage; exit 1 ;;
+    esac
+done
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "Root privileges are required" >&2
+    exit 1
+fi
+if [ ! -x "$GEN" ]; then
+    echo "traffic_gen not found at $GEN (build with -DKIWITUN_BENCHMARKS=ON)" >&2
+    exit 1
+fi
+
+# Stop engine processes and remove namespaces (veth and tunnel interfaces go with them)
+cleanup()
+{
+    for pid in $PIDS; do
+        kill -INT "$pid" 2>/dev/null # kiwitun cleans up on SIGINT
+        wait "$pid" 2>/dev/null
+    done
+    PIDS=""
+    ip netns del $NS_A 2>/dev/null
+    ip netns del $NS_B 2>/dev/null
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+setup_underlay()
+{
+    cleanup
+    ip netns add $NS_A && ip netns add $NS_B || return 1
+    ip -n $NS_A link set lo up
+    ip -n $NS_B link set lo up
+    ip -n $NS_A link add kbench0 type veth peer name kbench0 netns $NS_B || return 1
+    ip -n $NS_A addr add $UNDERLAY_A/24 dev kbench0
+    ip -n $NS_B addr add $UNDERLAY_B/24 dev kbench0
+    ip -n $NS_A link set kbench0 up
+    ip -n $NS_B link set kbench0 up
+}
+
+# Add inner addresses to interface(s): namespace, IPv4 interface, IPv6 interface, IPv4 address, IPv6 address
+add_inner()
+{
+    ip -n "$1" addr add "$4/30" dev "$2"
+    ip -n "$1" addr add "$5/64" dev "$3" nodad
+    ip -n "$1" link set "$2" up
+    ip -n "$1" link set "$3" up
+}
+
+start_kiwitun()
+{
+    # shellcheck disable=SC2086
+    ip netns exec $NS_A "$KIWITUN" -4 -6 -r $UNDERLAY_B -l $UNDERLAY_A -i kbtun -d --log-level=3 --stats-shm=/kbench-a $EXTRA > "$LOGDIR/netns_bench-a.log" 2>&1 &
+    PIDS="$PIDS $!"
+    # shellcheck disable=SC2086
+    ip netns exec $NS_B "$KIWITUN" -4 -6 -r $UNDERLAY_A -l $UNDERLAY_B -i kbtun -d --log-level=3 --stats-shm=/kbench-b $EXTRA > "$LOGDIR/netns_bench-b.log" 2>&1 &
+    PIDS="$PIDS $!"
+    for _ in $(seq 50); do
+        if ip -n $NS_A link show kbtun >/dev/null 2>&1 && ip -n $NS_B link show kbtun >/dev/null 2>&1; then
+            add_inner $NS_A kbtun kbtun $INNER_A $INNER6_A
+            add_inner $NS_B kbtun kbtun $INNER_B $INNER6_B
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "kiwitun did not start" >&2
+    return 1
+}
+
+start_kernel()
+{
+    ip -n $NS_A link add kbipip type ipip local $UNDERLAY_A remote $UNDERLAY_B 2>/dev/null &&
+    ip -n $NS_A link add kbsit type sit local $UNDERLAY_A remote $UNDERLAY_B 2>/dev/null &&
+    ip -n $NS_B link add kbipip type ipip local $UNDERLAY_B remote $UNDERLAY_A &&
+    ip -n $NS_B link add kbsit type sit local $UNDERLAY_B remote $UNDERLAY_A || {
+        echo "Kernel ipip/sit tunnels are not available, skipping kernel baseline" >&2
+        return 1
+    }
+    add_inner $NS_A kbipip kbsit $INNER_A $INNER6_A
+    add_inner $NS_B kbipip kbsit $INNER_B $INNER6_B
+}
+
+# Busy time of all CPUs in clock ticks
+cpu_busy()
+{
+    awk '/^cpu / {print $2 + $3 + $4 + $7 + $8 + $9}' /proc/stat
+}
+
+# CPU time of engine processes in clock ticks
+engine_cpu()
+{
+    local sum=0 pid
+    for pid in $PIDS; do
+        [ -r /proc/$pid/stat ] && sum=$((sum + $(awk '{print $14 + $15}' /proc/$pid/stat)))
+    done
+    echo $sum
+}
+
+# Get value of key from traffic_gen output line
+field()
+{
+    echo "$1" | tr ' ' '\n' | awk -F= -v k="$2" '$1 == k {print $2}'
+}
+
+# Run one case: engine, mode, direction, size, flows
+run_case()
+{
+    local src=$NS_A dst=$NS_B dstAddr
+    [ "$3" = "b-a" ] && { src=$NS_B; dst=$NS_A; }
+    if [ "$2" = "4in4" ]; then
+        dstAddr=$INNER_B; [ "$3" = "b-a" ] && dstAddr=$INNER_A
+    else
+        dstAddr=$INNER6_B; [ "$3" = "b-a" ] && dstAddr=$INNER6_A
+    fi
+
+    local out
+    out=$(mktemp)
+    ip netns exec $dst "$GEN" recv -a $dstAddr -p $PORT -t $((TIME + 10)) > "$out" &
+    local sink=$!
+    sleep 0.3
+    local busy0 eng0 busy1 eng1 tx rx
+    busy0=$(cpu_busy); eng0=$(engine_cpu)
+    tx=$(ip netns exec $src "$GEN" send -a $dstAddr -p $PORT -s "$4" -f "$5" -t "$TIME" -r "$RATE")
+    wait $sink
+    busy1=$(cpu_busy); eng1=$(engine_cpu)
+    rx=$(cat "$out")
+    rm -f "$out"
+    if [ -z "$tx" ] || [ -z "$rx" ]; then
+        echo "Case $1 $2 $3 size $4 flows $5 failed" >&2
+        return
+    fi
+
+    awk -v label="$LABEL" -v engine="$1" -v mode="$2" -v dir="$3" -v size="$4" -v flows="$5" -v fmt="$FORMAT" \
+        -v sent="$(field "$tx" packets)" -v seconds="$(field "$tx" seconds)" -v txCpu="$(field "$tx" cpu_ns)" \
+        -v recv="$(field "$rx" packets)" -v bytes="$(field "$rx" bytes)" -v rxCpu="$(field "$rx" cpu_ns)" \
+        -v busy=$((busy1 - busy0)) -v eng=$((eng1 - eng0)) -v hz="$HZ" 'BEGIN {
+        loss = (sent > 0) ? (100 * (sent - recv) / sent) : 0
+        if(loss < 0) loss = 0
+        pps = (seconds > 0) ? (recv / seconds) : 0
+        gbps = (seconds > 0) ? (bytes * 8 / seconds / 1e9) : 0
+        n = (recv > 0) ? recv : 1
+        cpu = sprintf("%.1f", busy * 1e9 / hz / n)
+        engCpu = (engine == "kiwitun") ? sprintf("%.1f", eng * 1e9 / hz / n) : ""
+        genCpu = sprintf("%.1f", (txCpu + rxCpu) / n)
+        if(fmt == "json")
+            printf("{\"label\":\"%s\",\"engine\":\"%s\",\"mode\":\"%s\",\"direction\":\"%s\",\"size\":%d,\"flows\":%d,\"sent\":%d,\"received\":%d,\"loss_pct\":%.3f,\"pps\":%.0f,\"gbps\":%.4f,\"cpu_ns_per_pkt\":%s,\"engine_cpu_ns_per_pkt\":%s,\"gen_cpu_ns_per_pkt\":%s}\n",
+                label, engine, mode, dir, size, flows, sent, recv, loss, pps, gbps, cpu, (engCpu == "") ? "null" : engCpu, genCpu)
+        else
+            printf("%s,%s,%s,%s,%d,%d,%d,%d,%.3f,%.0f,%.4f,%s,%s,%s\n",
+                label, engine, mode, dir, size, flows, sent, recv, loss, pps, gbps, cpu, engCpu, genCpu)
+    }'
+}
+
+if [ "$FORMAT" = "csv" ]; then
+    echo "label,engine,mode,direction,size,flows,sent,received,loss_pct,pps,gbps,cpu_ns_per_pkt,engine_cpu_ns_per_pkt,gen_cpu_ns_per_pkt"
+fi
+
+for engine in $ENGINES; do
+    setup_underlay || { echo "Namespace setup failed" >&2; exit 1; }
+    case $engine in
+        kiwitun) start_kiwitun || continue ;;
+        kernel) start_kernel || continue ;;
+        *) echo "Unknown engine $engine" >&2; continue ;;
+    esac
+    sleep 1
+    for mode in $MODES; do
+        for dir in $DIRECTIONS; do
+            # resolve underlay neighbors and let routes settle before measuring
+            addr=$INNER_B; ns=$NS_A
+            [ "$mode" = "6in4" ] && addr=$INNER6_B
+            [ "$dir" = "b-a" ] && { ns=$NS_B; addr=$INNER_A; [ "$mode" = "6in4" ] && addr=$INNER6_A; }
+            ip netns exec $ns "$GEN" send -a $addr -p $PORT -t 1 -r 100 >/dev/null
+            for size in $SIZES; do
+                for flows in $FLOWS; do
+                    run_case "$engine" "$mode" "$dir" "$size" "$flows"
+                done
+            done
+        done
+    done
+    cleanup
+done
@@ -0,0 +1,772 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file route_bench.c
+ * @brief Routing module micro-benchmark
+ *
+ * Fills the routing module with synthetic prefixes, an "ip route" text dump or an MRT (TABLE_DUMP_V2) RIB file
+ * and measures lookup rate, lookup latency percentiles, memory per route, bulk load time and update throughput under churn.
+ * Does not need root privileges nor access to the kernel routing table.
+*/
+
+#include "route.h"
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#define BENCH_LATENCY_BATCH 16 //number of lookups timed together when measuring latency
+#define BENCH_HIT_RATIO 90 //percentage of lookup keys taken from stored prefixes
+#define BENCH_MRT_TABLE_DUMP_V2 13 //MRT type
+#define BENCH_MRT_RIB_IPV4_UNICAST 2 //MRT TABLE_DUMP_V2 subtype
+#define BENCH_MRT_RIB_IPV6_UNICAST 4 //MRT TABLE_DUMP_V2 subtype
+#define BENCH_BGP_ATTR_NEXT_HOP 3 //BGP path attribute type
+#define BENCH_BGP_ATTR_MP_REACH_NLRI 14 //BGP path attribute type
+#define BENCH_BGP_ATTR_FLAG_EXTENDED 0x10 //BGP path attribute flag: 2-byte length
+
+/**
+ * @brief Route loaded by the benchmark (a copy is kept for key generation and churn)
+**/
+struct BenchRoute_s
+{
+    int family; //AF_INET or AF_INET6
+    uint8_t prefixLen; //prefix length
+    union
+    {
+        struct in_addr a4;
+        struct in6_addr a6;
+    } address, gateway;
+};
+
+static struct BenchRoute_s *benchRoutes = NULL; //loaded routes
+static uint64_t benchRouteCount = 0; //loaded route count
+static uint64_t benchRouteMax = 0; //allocated route slots
+
+static uint64_t rngState = 0x9E3779B97F4A7C15ULL; //xorshift PRNG state
+
+static volatile int churnRunning = 0; //set while churn is in progress
+
+static uint64_t rng()
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return rngState;
+}
+
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int storeRoute(struct BenchRoute_s *r)
+{
+    if(benchRouteCount == benchRouteMax)
+    {
+        benchRouteMax = benchRouteMax ? (benchRouteMax * 2) : 4096;
+        benchRoutes = realloc(benchRoutes, benchRouteMax * sizeof(*benchRoutes));
+        if(benchRoutes == NULL)
+        {
+            printf("malloc failure\n");
+            return -1;
+        }
+    }
+    benchRoutes[benchRouteCount++] = *r;
+    return 0;
+}
+
+/**
+ * @brief Add route to the routing module
+**/
+static int addRoute(struct BenchRoute_s *r)
+{
+    if(r->family == AF_INET)
+        return Route_add(r->address.a4, r->prefixLen, r->gateway.a4);
+    else
+        return Route_add6(r->address.a6, r->prefixLen, r->gateway.a6);
+}
+
+/**
+ * @brief Pick prefix length from a distribution resembling the Internet routing table
+**/
+static uint8_t syntheticLength(int family)
+{
+    uint64_t p = rng() % 100;
+    if(family == AF_INET)
+    {
+        if(p < 60)
+            return 24;
+        else if(p < 80)
+            return 22 + (rng() % 2);
+        else if(p < 98)
+            return 16 + (rng() % 6);
+        else
+            return 8 + (rng() % 8);
+    }
+    else
+    {
+        if(p < 45)
+            return 48;
+        else if(p < 60)
+            return 32;
+        else if(p < 85)
+            return 40 + (rng() % 8);
+        else if(p < 90)
+            return 29 + (rng() % 3);
+        else
+            return 56 + (rng() % 9);
+    }
+}
+
+static int loadSynthetic(uint64_t count, uint64_t count6, uint32_t gateways)
+{
+    struct BenchRoute_s r;
+    for(uint64_t i = 0; i < count; i++)
+    {
+        memset(&r, 0, sizeof(r));
+        r.family = AF_INET;
+        r.prefixLen = syntheticLength(AF_INET);
+        //unicast space only (1.0.0.0 - 223.255.255.255)
+        uint32_t a = (uint32_t)(rng() % (223U << 24)) + (1U << 24);
+        r.address.a4.s_addr = htonl(a & (uint32_t)(~((1ULL << (32 - r.prefixLen)) - 1)));
+        r.gateway.a4.s_addr = htonl(0xC6120000U + 1 + (uint32_t)(rng() % gateways)); //198.18.0.0/15 benchmark range
+        if(storeRoute(&r) < 0)
+            return -1;
+    }
+    for(uint64_t i = 0; i < count6; i++)
+    {
+        memset(&r, 0, sizeof(r));
+        r.family = AF_INET6;
+        r.prefixLen = syntheticLength(AF_INET6);
+        uint64_t hi = rng();
+        hi = (hi & 0x1FFFFFFFFFFFFFFFULL) | 0x2000000000000000ULL; //2000::/3
+        if(r.prefixLen < 64)
+            hi &= ~((1ULL << (64 - r.prefixLen)) - 1);
+        for(int k = 0; k < 8; k++)
+            r.address.a6.s6_addr[k] = (hi >> (56 - 8 * k)) & 0xFF;
+        //IPv4-mapped gateway, as used for 6in4 routes
+        r.gateway.a6.s6_addr[10] = 0xFF;
+        r.gateway.a6.s6_addr[11] = 0xFF;
+        uint32_t gw = htonl(0xC6120000U + 1 + (uint32_t)(rng() % gateways));
+        memcpy(&r.gateway.a6.s6_addr[12], &gw, 4);
+        if(storeRoute(&r) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Load routes from "ip route" / "ip -6 route" text output
+**/
+static int loadIpRoute(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if(f == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    static const char *skipTypes[] = {"default", "local", "broadcast", "unreachable", "blackhole", "prohibit", "throw", "anycast", "multicast", "nat", NULL};
+    char line[1024];
+    while(fgets(line, sizeof(line), f) != NULL)
+    {
+        if((line[0] == ' ') || (line[0] == '\t')) //multipath nexthop continuation
+            continue;
+
+        char *save = NULL;
+        char *tok = strtok_r(line, " \t\n", &save);
+        if(tok == NULL)
+            continue;
+        if(strcmp(tok, "unicast") == 0)
+            tok = strtok_r(NULL, " \t\n", &save);
+        if(tok == NULL)
+            continue;
+
+        int skip = 0;
+        for(int i = 0; skipTypes[i] != NULL; i++)
+        {
+            if(strcmp(tok, skipTypes[i]) == 0)
+                skip = 1;
+        }
+        if(skip)
+            continue;
+
+        struct BenchRoute_s r;
+        memset(&r, 0, sizeof(r));
+        r.family = (strchr(tok, ':') != NULL) ? AF_INET6 : AF_INET;
+        char *slash = strchr(tok, '/');
+        if(slash != NULL)
+        {
+            *slash = '\0';
+            r.prefixLen = atoi(slash + 1);
+        }
+        else
+            r.prefixLen = (r.family == AF_INET) ? 32 : 128;
+
+        if(inet_pton(r.family, tok, &r.address) < 1)
+            continue;
+
+        while((tok = strtok_r(NULL, " \t\n", &save)) != NULL)
+        {
+            if(strcmp(tok, "via") == 0)
+            {
+                tok = strtok_r(NULL, " \t\n", &save);
+                if((tok != NULL) && ((strcmp(tok, "inet") == 0) || (strcmp(tok, "inet6") == 0))) //"via inet6 <address>" form
+                    tok = strtok_r(NULL, " \t\n", &save);
+                if(tok != NULL)
+                    inet_pton(r.family, tok, &r.gateway);
+                break;
+            }
+        }
+
+        if(storeRoute(&r) < 0)
+        {
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+/**
+ * @brief Find next hop in BGP path attributes of a TABLE_DUMP_V2 RIB entry
+**/
+static void mrtNextHop(uint8_t *attr, uint16_t len, struct BenchRoute_s *r)
+{
+    uint32_t i = 0;
+    while((i + 3) <= len)
+    {
+        uint8_t flags = attr[i];
+        uint8_t type = attr[i + 1];
+        uint16_t alen;
+        uint32_t hdr;
+        if(flags & BENCH_BGP_ATTR_FLAG_EXTENDED)
+        {
+            if((i + 4) > len)
+                return;
+            alen = ((uint16_t)attr[i + 2] << 8) | attr[i + 3];
+            hdr = 4;
+        }
+        else
+        {
+            alen = attr[i + 2];
+            hdr = 3;
+        }
+        if((i + hdr + alen) > len)
+            return;
+
+        uint8_t *v = &attr[i + hdr];
+        if((r->family == AF_INET) && (type == BENCH_BGP_ATTR_NEXT_HOP) && (alen == 4))
+        {
+            memcpy(&r->gateway.a4, v, 4);
+            return;
+        }
+        //in TABLE_DUMP_V2 MP_REACH_NLRI holds only next hop length and next hop (RFC 6396 4.3.4)
+        if((r->family == AF_INET6) && (type == BENCH_BGP_ATTR_MP_REACH_NLRI) && (alen >= 17) && (v[0] >= 16))
+        {
+            memcpy(&r->gateway.a6, &v[1], 16);
+            return;
+        }
+        i += hdr + alen;
+    }
+}
+
+/**
+ * @brief Load routes from MRT TABLE_DUMP_V2 RIB file (uncompressed)
+**/
+static int loadMrt(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if(f == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    uint8_t hdr[12];
+    uint8_t *body = NULL;
+    uint32_t bodyMax = 0;
+
+    while(fread(hdr, 1, sizeof(hdr), f) == sizeof(hdr))
+    {
+        uint16_t type = ((uint16_t)hdr[4] << 8) | hdr[5];
+        uint16_t subtype = ((uint16_t)hdr[6] << 8) | hdr[7];
+        uint32_t len = ((uint32_t)hdr[8] << 24) | ((uint32_t)hdr[9] << 16) | ((uint32_t)hdr[10] << 8) | hdr[11];
+
+        if(len > bodyMax)
+        {
+            bodyMax = len;
+            body = realloc(body, bodyMax);
+            if(body == NULL)
+            {
+                printf("malloc failure\n");
+                fclose(f);
+                return -1;
+            }
+        }
+        if(fread(body, 1, len, f) != len)
+            break;
+
+        if((type != BENCH_MRT_TABLE_DUMP_V2) || ((subtype != BENCH_MRT_RIB_IPV4_UNICAST) && (subtype != BENCH_MRT_RIB_IPV6_UNICAST)))
+            continue;
+
+        struct BenchRoute_s r;
+        memset(&r, 0, sizeof(r));
+        r.family = (subtype == BENCH_MRT_RIB_IPV4_UNICAST) ? AF_INET : AF_INET6;
+
+        //sequence number (4), prefix length (1), prefix, entry count (2), entries
+        if(len < 5)
+            continue;
+        r.prefixLen = body[4];
+        uint32_t plen = (r.prefixLen + 7) / 8;
+        if((r.prefixLen > ((r.family == AF_INET) ? 32 : 128)) || (len < (5 + plen + 2)))
+            continue;
+        memcpy(&r.address, &body[5], plen);
+        uint32_t pos = 5 + plen;
+        uint16_t entries = ((uint16_t)body[pos] << 8) | body[pos + 1];
+        pos += 2;
+        //use first RIB entry: peer index (2), originated time (4), attribute length (2), attributes
+        if((entries > 0) && ((pos + 8) <= len))
+        {
+            uint16_t alen = ((uint16_t)body[pos + 6] << 8) | body[pos + 7];
+            if((pos + 8 + alen) <= len)
+                mrtNextHop(&body[pos + 8], alen, &r);
+        }
+
+        if((r.prefixLen == 0) || (storeRoute(&r) < 0)) //omit default routes, the same way kernel routes are handled
+            continue;
+    }
+
+    free(body);
+    fclose(f);
+    return 0;
+}
+
+/**
+ * @brief Generate lookup key: address inside a random stored prefix or a fully random address
+ * @param family Address family
+ * @param key Buffer for generated address
+ * @param idx Indexes of stored routes of given family
+ * @param idxCount Index count
+**/
+static void makeKey(int family, void *key, uint64_t *idx, uint64_t idxCount)
+{
+    uint64_t pick = rng();
+    if((idxCount > 0) && ((pick % 100) < BENCH_HIT_RATIO))
+    {
+        struct BenchRoute_s *r = &benchRoutes[idx[rng() % idxCount]];
+        if(family == AF_INET)
+        {
+            uint32_t a = ntohl(r->address.a4.s_addr);
+            if(r->prefixLen < 32)
+                a |= (uint32_t)rng() & (uint32_t)((1ULL << (32 - r->prefixLen)) - 1);
+            ((struct in_addr*)key)->s_addr = htonl(a);
+        }
+        else
+        {
+            struct in6_addr a = r->address.a6;
+            for(int b = r->prefixLen; b < 128; b++)
+            {
+                if(rng() & 1)
+                    a.s6_addr[b / 8] |= (0x80 >> (b % 8));
+            }
+            *(struct in6_addr*)key = a;
+        }
+        return;
+    }
+    if(family == AF_INET)
+        ((struct in_addr*)key)->s_addr = (uint32_t)rng();
+    else
+    {
+        uint64_t a = rng(), b = rng();
+        memcpy(key, &a, 8);
+        memcpy((uint8_t*)key + 8, &b, 8);
+    }
+}
+
+/**
+ * @brief Find gateway for address by linear longest prefix match over loaded routes (reference implementation)
+**/
+static void referenceLookup(int family, void *key, void *gateway)
+{
+    int best = -1;
+    memset(gateway, 0, (family == AF_INET) ? 4 : 16);
+    for(uint64_t i = 0; i < benchRouteCount; i++)
+    {
+        struct BenchRoute_s *r = &benchRoutes[i];
+        if((r->family != family) || (r->prefixLen <= best))
+            continue;
+        const uint8_t *a = (const uint8_t*)&r->address, *k = (const uint8_t*)key;
+        int match = 1;
+        for(int b = 0; b < r->prefixLen; b++)
+        {
+            if(((a[b / 8] ^ k[b / 8]) >> (7 - (b % 8))) & 1)
+            {
+                match = 0;
+                break;
+            }
+        }
+        if(match)
+        {
+            best = r->prefixLen;
+            memcpy(gateway, &r->gateway, (family == AF_INET) ? 4 : 16);
+        }
+    }
+}
+
+/**
+ * @brief Compare routing module lookups with reference lookups
+ * @return 0 if all results are equal, -1 otherwise
+**/
+static int benchVerify(int family, uint64_t count)
+{
+    uint64_t *idx = malloc((benchRouteCount + 1) * sizeof(uint64_t));
+    if(idx == NULL)
+        return -1;
+    uint64_t idxCount = 0;
+    for(uint64_t i = 0; i < benchRouteCount; i++)
+    {
+        if(benchRoutes[i].family == family)
+            idx[idxCount++] = i;
+    }
+
+    uint64_t errors = 0;
+    for(uint64_t i = 0; i < count; i++)
+    {
+        struct in6_addr key, expected, got;
+        memset(&key, 0, sizeof(key));
+        makeKey(family, &key, idx, idxCount);
+        referenceLookup(family, &key, &expected);
+        memset(&got, 0, sizeof(got));
+        if(family == AF_INET)
+        {
+            in_addr_t gw = Route_get(((struct in_addr*)&key)->s_addr);
+            memcpy(&got, &gw, 4);
+        }
+        else
+            got = Route_get6(key);
+        if(memcmp(&expected, &got, (family == AF_INET) ? 4 : 16))
+            errors++;
+    }
+    free(idx);
+
+    printf("%s verification: %llu lookups, %llu mismatches\n", (family == AF_INET) ? "IPv4" : "IPv6", (unsigned long long)count, (unsigned long long)errors);
+    return errors ? -1 : 0;
+}
+
+static int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Run lookups and report rate and latency percentiles
+**/
+static void benchLookups(int family, uint64_t count)
+{
+    uint64_t batches = count / BENCH_LATENCY_BATCH;
+    if(batches == 0)
+        return;
+
+    size_t keySize = (family == AF_INET) ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+    uint8_t *keys = malloc(batches * BENCH_LATENCY_BATCH * keySize);
+    double *lat = malloc(batches * sizeof(double));
+    uint64_t *idx = malloc((benchRouteCount + 1) * sizeof(uint64_t));
+    if((keys == NULL) || (lat == NULL) || (idx == NULL))
+    {
+        printf("malloc failure\n");
+        free(keys);
+        free(lat);
+        free(idx);
+        return;
+    }
+    uint64_t idxCount = 0;
+    for(uint64_t i = 0; i < benchRouteCount; i++)
+    {
+        if(benchRoutes[i].family == family)
+            idx[idxCount++] = i;
+    }
+    for(uint64_t i = 0; i < (batches * BENCH_LATENCY_BATCH); i++)
+        makeKey(family, &keys[i * keySize], idx, idxCount);
+    free(idx);
+
+    volatile uint32_t sink = 0;
+    uint64_t hits = 0;
+    uint64_t start = nowNs();
+    for(uint64_t b = 0; b < batches; b++)
+    {
+        uint64_t t0 = nowNs();
+        for(int i = 0; i < BENCH_LATENCY_BATCH; i++)
+        {
+            uint8_t *k = &keys[(b * BENCH_LATENCY_BATCH + i) * keySize];
+            if(family == AF_INET)
+            {
+                in_addr_t gw = Route_get(((struct in_addr*)k)->s_addr);
+                hits += (gw != 0);
+                sink += gw;
+            }
+            else
+            {
+                struct in6_addr gw = Route_get6(*(struct in6_addr*)k);
+                hits += !ipv6_isEqual(gw, in6addr_any);
+                sink += gw.s6_addr32[3];
+            }
+        }
+        lat[b] = (double)(nowNs() - t0) / BENCH_LATENCY_BATCH;
+    }
+    uint64_t total = nowNs() - start;
+    (void)sink;
+
+    qsort(lat, batches, sizeof(double), compareDouble);
+    uint64_t n = batches * BENCH_LATENCY_BATCH;
+    printf("%s lookups: %llu, hits: %.1f%%, %.0f lookups/s\n", (family == AF_INET) ? "IPv4" : "IPv6",
+        (unsigned long long)n, 100.0 * hits / n, (double)n * 1e9 / total);
+    printf("%s ns/lookup: p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n", (family == AF_INET) ? "IPv4" : "IPv6",
+        lat[batches / 2], lat[(batches * 90) / 100], lat[(batches * 99) / 100], lat[(batches * 999) / 1000], lat[batches - 1]);
+
+    free(keys);
+    free(lat);
+}
+
+/**
+ * @brief Build rtnetlink route message, as sent by the kernel to route change listeners
+**/
+static struct nlmsghdr *buildMessage(uint8_t *buf, uint16_t type, struct BenchRoute_s *r)
+{
+    size_t alen = (r->family == AF_INET) ? 4 : 16;
+    struct nlmsghdr *nl = (struct nlmsghdr*)buf;
+    memset(buf, 0, NLMSG_SPACE(sizeof(struct rtmsg)) + 2 * RTA_SPACE(alen));
+    nl->nlmsg_type = type;
+    nl->nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+
+    struct rtmsg *rt = (struct rtmsg*)NLMSG_DATA(nl);
+    rt->rtm_family = r->family;
+    rt->rtm_dst_len = r->prefixLen;
+    rt->rtm_type = RTN_UNICAST;
+    rt->rtm_table = RT_TABLE_MAIN;
+
+    struct rtattr *rta = (struct rtattr*)((uint8_t*)nl + NLMSG_ALIGN(nl->nlmsg_len));
+    rta->rta_type = RTA_DST;
+    rta->rta_len = RTA_LENGTH(alen);
+    memcpy(RTA_DATA(rta), &r->address, alen);
+    nl->nlmsg_len = NLMSG_ALIGN(nl->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+
+    rta = (struct rtattr*)((uint8_t*)nl + NLMSG_ALIGN(nl->nlmsg_len));
+    rta->rta_type = RTA_GATEWAY;
+    rta->rta_len = RTA_LENGTH(alen);
+    memcpy(RTA_DATA(rta), &r->gateway, alen);
+    nl->nlmsg_len = NLMSG_ALIGN(nl->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+
+    return nl;
+}
+
+static void *churnLookupThread(void *arg)
+{
+    uint64_t *count = (uint64_t*)arg;
+    uint32_t a = 0x0A000000;
+    volatile in_addr_t sink = 0;
+    while(churnRunning)
+    {
+        for(int i = 0; i < 64; i++)
+            sink += Route_get(htonl(a + i * 2654435761U));
+        a += 64;
+        *count += 64;
+    }
+    (void)sink;
+    return NULL;
+}
+
+/**
+ * @brief Withdraw and re-announce random routes through the netlink update path while looking up concurrently
+**/
+static void benchChurn(uint64_t ops)
+{
+    if((ops == 0) || (benchRouteCount == 0))
+        return;
+
+    uint8_t buf[NLMSG_SPACE(sizeof(struct rtmsg)) + 2 * RTA_SPACE(16)];
+    uint64_t lookups = 0;
+    pthread_t th;
+    churnRunning = 1;
+    if(pthread_create(&th, NULL, churnLookupThread, &lookups) != 0)
+    {
+        churnRunning = 0;
+        printf("Lookup thread creation failed\n");
+        return;
+    }
+
+    uint64_t start = nowNs();
+    for(uint64_t i = 0; i < ops; i++)
+    {
+        struct BenchRoute_s *r = &benchRoutes[rng() % benchRouteCount];
+        Route_update(buildMessage(buf, RTM_DELROUTE, r));
+        Route_update(buildMessage(buf, RTM_NEWROUTE, r));
+    }
+    uint64_t total = nowNs() - start;
+    churnRunning = 0;
+    pthread_join(th, NULL);
+
+    printf("Churn: %llu updates, %.0f updates/s, concurrent IPv4 lookups: %.0f lookups/s\n", (unsigned long long)(2 * ops),
+        (double)(2 * ops) * 1e9 / total, (double)lookups * 1e9 / total);
+}
+
+static const char usage[] = "Usage: route_bench [options]\n"\
+                            "Route sources (may be combined):\n"\
+                            " -s, --synthetic=count\tadd given number of synthetic IPv4 routes\n"\
+                            " -S, --synthetic6=count\tadd given number of synthetic IPv6 routes\n"\
+                            " -r, --ip-route=file\tload routes from \"ip route\" or \"ip -6 route\" output\n"\
+                            " -m, --mrt=file\t\tload routes from uncompressed MRT TABLE_DUMP_V2 RIB file\n"\
+                            "Benchmark settings:\n"\
+                            " -g, --gateways=count\tnumber of distinct endpoints for synthetic routes (default 16)\n"\
+                            " -n, --lookups=count\tnumber of lookups per address family (default 100000)\n"\
+                            " -c, --churn=count\tnumber of withdraw/announce pairs (default 1000)\n"\
+                            " --seed=value\t\tPRNG seed\n"\
+                            " --verify\t\tcompare lookup results with a reference linear lookup over all loaded routes\n"\
+                            " -h, --help\t\tprint help page\n"\
+                            "When no source is given, 10000 IPv4 and 1000 IPv6 synthetic routes are used.\n";
+
+int main(int argc, char **argv)
+{
+    #define ARG_SEED 128
+    #define ARG_VERIFY 129
+    struct option options[] =
+    {
+        {"synthetic", required_argument, 0, 's'},
+        {"synthetic6", required_argument, 0, 'S'},
+        {"ip-route", required_argument, 0, 'r'},
+        {"mrt", required_argument, 0, 'm'},
+        {"gateways", required_argument, 0, 'g'},
+        {"lookups", required_argument, 0, 'n'},
+        {"churn", required_argument, 0, 'c'},
+        {"seed", required_argument, 0, ARG_SEED},
+        {"verify", no_argument, 0, ARG_VERIFY},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    uint64_t synthetic = 0, synthetic6 = 0, lookups = 100000, churn = 1000;
+    uint32_t gateways = 16;
+    int verify = 0;
+    const char *ipRouteFile = NULL, *mrtFile = NULL;
+
+    config.noDaemon = 1;
+    config.logLevel = LOG_WARNING;
+    Runtime_publish(DEFAULT_IPV4_TTL, config.logLevel);
+
+    int c;
+    while((c = getopt_long(argc, argv, "s:S:r:m:g:n:c:h", options, NULL)) != -1)
+    {
+        switch(c)
+        {
+            case 's':
+            synthetic = strtoull(optarg, NULL, 0);
+            break;
+            case 'S':
+            synthetic6 = strtoull(optarg, NULL, 0);
+            break;
+            case 'r':
+            ipRouteFile = optarg;
+            break;
+            case 'm':
+            mrtFile = optarg;
+            break;
+            case 'g':
+            gateways = strtoul(optarg, NULL, 0);
+            if(gateways == 0)
+                gateways = 1;
+            break;
+            case 'n':
+            lookups = strtoull(optarg, NULL, 0);
+            break;
+            case 'c':
+            churn = strtoull(optarg, NULL, 0);
+            break;
+            case ARG_SEED:
+            rngState = strtoull(optarg, NULL, 0) | 1;
+            break;
+            case ARG_VERIFY:
+            verify = 1;
+            break;
+            case 'h':
+            printf("%s", usage);
+            return 0;
+            default:
+            printf("%s", usage);
+            return -1;
+        }
+    }
+
+    if(!synthetic && !synthetic6 && (ipRouteFile == NULL) && (mrtFile == NULL))
+    {
+        synthetic = 10000;
+        synthetic6 = 1000;
+    }
+
+    if(loadSynthetic(synthetic, synthetic6, gateways) < 0)
+        return -1;
+    if((ipRouteFile != NULL) && (loadIpRoute(ipRouteFile) < 0))
+        return -1;
+    if((mrtFile != NULL) && (loadMrt(mrtFile) < 0))
+        return -1;
+
+    uint64_t start = nowNs();
+    for(uint64_t i = 0; i < benchRouteCount; i++)
+    {
+        if(addRoute(&benchRoutes[i]) < 0)
+            return -1;
+    }
+    Route_rebuild();
+    uint64_t loadTime = nowNs() - start;
+
+    struct RouteStats_s stats;
+    Route_getStats(&stats);
+    printf("Routes: %llu IPv4, %llu IPv6\n", (unsigned long long)stats.entries, (unsigned long long)stats.entries6);
+    printf("Bulk load: %.3f ms, %.0f routes/s\n", loadTime / 1e6, (loadTime > 0) ? ((double)benchRouteCount * 1e9 / loadTime) : 0.0);
+    printf("Memory: IPv4 %zu bytes (%.1f bytes/route), IPv6 %zu bytes (%.1f bytes/route)\n",
+        stats.memory, stats.entries ? ((double)stats.memory / stats.entries) : 0.0,
+        stats.memory6, stats.entries6 ? ((double)stats.memory6 / stats.entries6) : 0.0);
+    printf("Lookup tables: IPv4 %llu entries, %zu bytes (%.1f bytes/route), IPv6 %llu entries, %zu bytes (%.1f bytes/route)\n",
+        (unsigned long long)stats.lookupEntries, stats.lookupMemory, stats.entries ? ((double)stats.lookupMemory / stats.entries) : 0.0,
+        (unsigned long long)stats.lookupEntries6, stats.lookupMemory6, stats.entries6 ? ((double)stats.lookupMemory6 / stats.entries6) : 0.0);
+
+    if(verify && (benchVerify(AF_INET, lookups) < 0 || benchVerify(AF_INET6, lookups) < 0))
+        return -1;
+
+    if(stats.entries)
+        benchLookups(AF_INET, lookups);
+    if(stats.entries6)
+        benchLookups(AF_INET6, lookups);
+
+    benchChurn(churn);
+
+    Route_flush();
+    free(benchRoutes);
+    return 0;
+}
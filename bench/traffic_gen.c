@@ -0,0 +1,343 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file traffic_gen.c
+ * @brief UDP traffic generator and sink for tunnel throughput benchmarks
+ *
+ * In send mode, sends UDP packets of given IP packet size to a destination address for given time, as fast as possible
+ * or at given rate. Flows differ in source port (one socket per flow), so that they are hashed like real traffic.
+ * In recv mode, counts packets arriving at a UDP port until no packet comes for the idle time.
+ * Both modes print a single line of key=value pairs when done, for benchmark scripts (bench/netns_bench.sh).
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define GEN_BATCH 64 //number of packets per sendmmsg()/recvmmsg() call
+#define GEN_MAX_FLOWS 65536 //maximum number of flows
+#define GEN_MAX_SIZE 65535 //maximum IP packet size
+#define GEN_RCVBUF (16 * 1024 * 1024) //receive buffer size in bytes
+#define GEN_POLL_INTERVAL 100 //receive timeout for idle checks in milliseconds
+
+static uint8_t payload[GEN_MAX_SIZE];
+static uint8_t rxBuffers[GEN_BATCH][GEN_MAX_SIZE];
+
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Get CPU time (user and system) used by this process in nanoseconds
+**/
+static uint64_t cpuNs()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ((uint64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL + ((uint64_t)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+/**
+ * @brief Parse IPv4 or IPv6 address
+ * @return IP header size (20 or 40) with UDP header size (8) on success, -1 on failure
+**/
+static int parseAddress(const char *text, uint16_t port, struct sockaddr_storage *addr, socklen_t *len)
+{
+    memset(addr, 0, sizeof(*addr));
+    struct sockaddr_in *a4 = (struct sockaddr_in*)addr;
+    struct sockaddr_in6 *a6 = (struct sockaddr_in6*)addr;
+    if(inet_pton(AF_INET, text, &(a4->sin_addr)) == 1)
+    {
+        a4->sin_family = AF_INET;
+        a4->sin_port = htons(port);
+        *len = sizeof(*a4);
+        return 20 + 8;
+    }
+    if(inet_pton(AF_INET6, text, &(a6->sin6_addr)) == 1)
+    {
+        a6->sin6_family = AF_INET6;
+        a6->sin6_port = htons(port);
+        *len = sizeof(*a6);
+        return 40 + 8;
+    }
+    fprintf(stderr, "Invalid address %s\n", text);
+    return -1;
+}
+
+static int genSend(const struct sockaddr_storage *dst, socklen_t dstLen, size_t size, int overhead, uint32_t flows, uint32_t seconds, uint64_t rate)
+{
+    //one socket per flow, raise open file limit if needed
+    struct rlimit rl;
+    if((getrlimit(RLIMIT_NOFILE, &rl) == 0) && (rl.rlim_cur < (flows + 16)))
+    {
+        rl.rlim_cur = flows + 16;
+        if(rl.rlim_max < rl.rlim_cur)
+            rl.rlim_max = rl.rlim_cur;
+        if(setrlimit(RLIMIT_NOFILE, &rl) < 0)
+        {
+            perror("Open file limit change failed");
+            return -1;
+        }
+    }
+
+    int *fds = malloc(flows * sizeof(*fds));
+    if(fds == NULL)
+    {
+        perror("Socket table allocation failed");
+        return -1;
+    }
+    for(uint32_t i = 0; i < flows; i++)
+    {
+        fds[i] = socket(dst->ss_family, SOCK_DGRAM, 0);
+        if((fds[i] < 0) || (connect(fds[i], (const struct sockaddr*)dst, dstLen) < 0)) //connecting binds an ephemeral source port
+        {
+            perror("Flow socket creation failed");
+            return -1;
+        }
+    }
+
+    struct iovec iov = {.iov_base = payload, .iov_len = size - overhead};
+    struct mmsghdr msgs[GEN_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for(int i = 0; i < GEN_BATCH; i++)
+    {
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    uint64_t packets = 0, errors = 0;
+    uint32_t flow = 0;
+    uint64_t cpuStart = cpuNs();
+    uint64_t start = nowNs(), end = start + (uint64_t)seconds * 1000000000ULL, now = start;
+    while(now < end)
+    {
+        int n = GEN_BATCH;
+        if(rate)
+        {
+            //packets due by now, sleep until the next one when ahead of schedule
+            uint64_t due = (uint64_t)((double)(now - start) * rate / 1e9) + 1;
+            if(due <= packets)
+            {
+                struct timespec ts = {.tv_sec = 0, .tv_nsec = 1e9 / rate};
+                nanosleep(&ts, NULL);
+                now = nowNs();
+                continue;
+            }
+            if((due - packets) < (uint64_t)n)
+                n = due - packets;
+        }
+        int ret = sendmmsg(fds[flow], msgs, n, 0);
+        if(ret > 0)
+            packets += ret;
+        else if((errno == ENOBUFS) || (errno == EAGAIN) || (errno == ECONNREFUSED)) //queue full or ICMP Port Unreachable from a missing sink
+            errors++;
+        else if(errno != EINTR)
+        {
+            perror("Send failed");
+            return -1;
+        }
+        flow = (flow + 1) % flows;
+        now = nowNs();
+    }
+    uint64_t elapsed = nowNs() - start;
+    uint64_t cpu = cpuNs() - cpuStart;
+
+    printf("packets=%llu bytes=%llu seconds=%.6f cpu_ns=%llu errors=%llu\n", (unsigned long long)packets,
+        (unsigned long long)(packets * size), elapsed / 1e9, (unsigned long long)cpu, (unsigned long long)errors);
+    for(uint32_t i = 0; i < flows; i++)
+        close(fds[i]);
+    free(fds);
+    return 0;
+}
+
+static int genRecv(const struct sockaddr_storage *addr, socklen_t addrLen, int overhead, uint32_t seconds, uint32_t idle)
+{
+    int fd = socket(addr->ss_family, SOCK_DGRAM, 0);
+    if(fd < 0)
+    {
+        perror("Socket creation failed");
+        return -1;
+    }
+    int buf = GEN_RCVBUF;
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &buf, sizeof(buf)) < 0) //needs CAP_NET_ADMIN, limited by rmem_max otherwise
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+    struct timeval tv = {.tv_sec = 0, .tv_usec = GEN_POLL_INTERVAL * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if(bind(fd, (const struct sockaddr*)addr, addrLen) < 0)
+    {
+        perror("Socket bind failed");
+        return -1;
+    }
+
+    struct iovec iov[GEN_BATCH];
+    struct mmsghdr msgs[GEN_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for(int i = 0; i < GEN_BATCH; i++)
+    {
+        iov[i].iov_base = rxBuffers[i];
+        iov[i].iov_len = sizeof(rxBuffers[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    uint64_t packets = 0, bytes = 0;
+    uint64_t first = 0, last = 0;
+    uint64_t cpuStart = cpuNs();
+    uint64_t end = nowNs() + (uint64_t)seconds * 1000000000ULL;
+    while(1)
+    {
+        int ret = recvmmsg(fd, msgs, GEN_BATCH, MSG_WAITFORONE, NULL);
+        uint64_t now = nowNs();
+        if(ret > 0)
+        {
+            if(packets == 0)
+                first = now;
+            last = now;
+            packets += ret;
+            for(int i = 0; i < ret; i++)
+                bytes += msgs[i].msg_len + overhead;
+        }
+        else if((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+        {
+            perror("Receive failed");
+            return -1;
+        }
+        if((now >= end) || (packets && ((now - last) >= ((uint64_t)idle * 1000000ULL))))
+            break;
+    }
+    uint64_t cpu = cpuNs() - cpuStart;
+
+    printf("packets=%llu bytes=%llu seconds=%.6f cpu_ns=%llu\n", (unsigned long long)packets, (unsigned long long)bytes,
+        (last - first) / 1e9, (unsigned long long)cpu);
+    close(fd);
+    return 0;
+}
+
+static const char usage[] = "Usage: traffic_gen send|recv [options]\n"\
+                            " -a, --address=address\tdestination address (send) or local address (recv), IPv4 or IPv6\n"\
+                            " -p, --port=port\tUDP destination port (default 9000)\n"\
+                            " -s, --size=bytes\tIP packet size including IP and UDP headers (default 64, send only)\n"\
+                            " -f, --flows=count\tnumber of flows (source ports) (default 1, send only)\n"\
+                            " -t, --time=seconds\tsending time (send) or maximum receiving time (recv) (default 5)\n"\
+                            " -r, --rate=pps\t\tpacket rate limit (default 0 - none, send only)\n"\
+                            " -i, --idle=ms\t\tstop receiving when no packet comes for given time (default 1000, recv only)\n"\
+                            " -h, --help\t\tprint help page\n"\
+                            "Prints one line of key=value pairs: packets, bytes (IP packet bytes), seconds (from first to last packet for recv),\n"\
+                            "cpu_ns (CPU time used by the generator) and errors (failed send calls, send only).\n";
+
+int main(int argc, char **argv)
+{
+    struct option options[] =
+    {
+        {"address", required_argument, 0, 'a'},
+        {"port", required_argument, 0, 'p'},
+        {"size", required_argument, 0, 's'},
+        {"flows", required_argument, 0, 'f'},
+        {"time", required_argument, 0, 't'},
+        {"rate", required_argument, 0, 'r'},
+        {"idle", required_argument, 0, 'i'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    const char *address = NULL;
+    uint16_t port = 9000;
+    size_t size = 64;
+    uint32_t flows = 1, seconds = 5, idle = 1000;
+    uint64_t rate = 0;
+
+    int c;
+    while((c = getopt_long(argc, argv, "a:p:s:f:t:r:i:h", options, NULL)) != -1)
+    {
+        switch(c)
+        {
+            case 'a':
+            address = optarg;
+            break;
+            case 'p':
+            port = strtoul(optarg, NULL, 0);
+            break;
+            case 's':
+            size = strtoul(optarg, NULL, 0);
+            break;
+            case 'f':
+            flows = strtoul(optarg, NULL, 0);
+            if(flows == 0)
+                flows = 1;
+            if(flows > GEN_MAX_FLOWS)
+                flows = GEN_MAX_FLOWS;
+            break;
+            case 't':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+            case 'r':
+            rate = strtoull(optarg, NULL, 0);
+            break;
+            case 'i':
+            idle = strtoul(optarg, NULL, 0);
+            break;
+            case 'h':
+            printf("%s", usage);
+            return 0;
+            default:
+            printf("%s", usage);
+            return -1;
+        }
+    }
+
+    if((optind != (argc - 1)) || (address == NULL))
+    {
+        printf("%s", usage);
+        return -1;
+    }
+
+    struct sockaddr_storage addr;
+    socklen_t addrLen;
+    int overhead = parseAddress(address, port, &addr, &addrLen);
+    if(overhead < 0)
+        return -1;
+
+    if(!strcmp(argv[optind], "send"))
+    {
+        if((size < (size_t)overhead) || (size > GEN_MAX_SIZE))
+        {
+            fprintf(stderr, "Packet size must be between %d and %d bytes for this address family\n", overhead, GEN_MAX_SIZE);
+            return -1;
+        }
+        return genSend(&addr, addrLen, size, overhead, flows, seconds, rate);
+    }
+    else if(!strcmp(argv[optind], "recv"))
+        return genRecv(&addr, addrLen, overhead, seconds, idle);
+
+    printf("%s", usage);
+    return -1;
+}
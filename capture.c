@@ -0,0 +1,331 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file capture.c
+ * @brief Packet capture ring module
+ *
+ * The file starts with a section header and three interface descriptions (TUN, underlay, dropped packets),
+ * all of them raw IP link type. The rest is a ring of fixed-size slots. Each slot holds an enhanced packet block
+ * followed by a custom block filling the rest of the slot, which pcapng readers skip, so the file is valid at any time
+ * and can be copied and opened while kiwitun runs. Packets are in ring order, sort them by time after the ring wraps.
+ * Threads claim slots with an atomic increment and write them without locks.
+**/
+
+#include "capture.h"
+#include "common.h"
+#include "drop.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define CAPTURE_BLOCK_SHB 0x0A0D0D0A //section header block
+#define CAPTURE_BLOCK_IDB 0x00000001 //interface description block
+#define CAPTURE_BLOCK_EPB 0x00000006 //enhanced packet block
+#define CAPTURE_BLOCK_CUSTOM 0x40000BAD //custom block, not to be copied
+#define CAPTURE_LINKTYPE_RAW 101 //raw IPv4/IPv6 packet
+
+#define CAPTURE_IF_TUN 0 //inner packets
+#define CAPTURE_IF_UNDERLAY 1 //outer packets
+#define CAPTURE_IF_DROPPED 2 //dropped packets
+
+#define CAPTURE_INBOUND 1 //epb_flags direction
+#define CAPTURE_OUTBOUND 2
+
+#define CAPTURE_MAX_COMMENT 64 //maximum comment length
+#define CAPTURE_MAX_BLOCK (32 + CAPTURE_SNAPLEN + 8 + 4 + CAPTURE_MAX_COMMENT + 4) //enhanced packet block with options
+_Static_assert((CAPTURE_MAX_BLOCK + 16) <= CAPTURE_SLOT_SIZE, "Capture slot can't hold packet block and filler block");
+
+/**
+ * @brief Packet read from TUN interface, kept until it is known whether it is captured
+**/
+struct CaptureStash_s
+{
+    uint64_t time; //read time in nanoseconds
+    int size; //packet size
+    uint8_t stored; //packet is stored
+    uint8_t data[CAPTURE_SNAPLEN];
+};
+
+uint8_t captureEnabled = 0;
+__thread uint8_t captureSampled = 0;
+static __thread uint32_t captureCount = 0; //packets since the last sampled one
+static __thread struct CaptureStash_s stash;
+static uint8_t *ring = NULL; //first ring slot
+static uint32_t slots = 0; //number of ring slots
+static uint32_t next = 0; //next slot to use (modulo number of slots)
+
+/**
+ * @brief Get current time in nanoseconds since UNIX epoch
+**/
+static inline uint64_t capture_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint8_t* capture_put32(uint8_t *p, uint32_t value)
+{
+    memcpy(p, &value, 4);
+    return p + 4;
+}
+
+/**
+ * @brief Put block option, padded to 32 bits
+ * @return Pointer after option
+**/
+static uint8_t* capture_option(uint8_t *p, uint16_t code, const void *value, uint16_t len)
+{
+    memcpy(p, &code, 2);
+    memcpy(&p[2], &len, 2);
+    memcpy(&p[4], value, len);
+    memset(&p[4 + len], 0, (4 - (len & 3)) & 3);
+    return p + 4 + ((len + 3) & ~3);
+}
+
+/**
+ * @brief Put block header and trailer
+ * @param block Block start
+ * @param type Block type
+ * @param len Block length (with header and trailer)
+**/
+static void capture_block(uint8_t *block, uint32_t type, uint32_t len)
+{
+    capture_put32(block, type);
+    capture_put32(&block[4], len);
+    capture_put32(&block[len - 4], len);
+}
+
+/**
+ * @brief Write packet to ring
+ * @param interface Interface ID
+ * @param flags Packet flags (direction)
+ * @param time Timestamp in nanoseconds
+ * @param iov Packet parts
+ * @param count Number of packet parts
+ * @param comment Comment (path and verdict)
+**/
+static void capture_write(uint32_t interface, uint32_t flags, uint64_t time, const struct iovec *iov, int count, const char *comment)
+{
+    uint32_t size = 0;
+    for(int i = 0; i < count; i++)
+        size += iov[i].iov_len;
+    uint32_t caplen = (size < CAPTURE_SNAPLEN) ? size : CAPTURE_SNAPLEN;
+
+    uint8_t *slot = &ring[(uint64_t)(__atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % slots) * CAPTURE_SLOT_SIZE];
+    capture_block(slot, CAPTURE_BLOCK_CUSTOM, CAPTURE_SLOT_SIZE); //slot is skipped by readers while it is written
+
+    uint8_t *p = &slot[8];
+    p = capture_put32(p, interface);
+    p = capture_put32(p, time >> 32);
+    p = capture_put32(p, time & 0xFFFFFFFF);
+    p = capture_put32(p, caplen);
+    p = capture_put32(p, size);
+    uint32_t left = caplen;
+    for(int i = 0; (i < count) && (left > 0); i++)
+    {
+        uint32_t len = (iov[i].iov_len < left) ? iov[i].iov_len : left;
+        memcpy(p, iov[i].iov_base, len);
+        p += len;
+        left -= len;
+    }
+    memset(p, 0, (4 - (caplen & 3)) & 3);
+    p += (4 - (caplen & 3)) & 3;
+    p = capture_option(p, 2, &flags, 4); //epb_flags
+    uint16_t len = strnlen(comment, CAPTURE_MAX_COMMENT);
+    p = capture_option(p, 1, comment, len); //opt_comment
+    p = capture_option(p, 0, NULL, 0); //opt_endofopt
+
+    uint32_t blockLen = (p - slot) + 4;
+    capture_put32(&slot[blockLen - 4], blockLen);
+    capture_block(&slot[blockLen], CAPTURE_BLOCK_CUSTOM, CAPTURE_SLOT_SIZE - blockLen); //the rest of the slot
+    capture_put32(&slot[blockLen + 8], 0); //private enterprise number
+    capture_put32(&slot[4], blockLen);
+    __atomic_store_n((uint32_t*)slot, CAPTURE_BLOCK_EPB, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Check remote endpoint against --capture-endpoint
+ * @return 1 if the packet is captured, 0 otherwise
+**/
+static int capture_match(int family, const void *remote)
+{
+    if(config.captureEndpoint != INADDR_ANY)
+        return (family == AF_INET) && (*(const in_addr_t*)remote == config.captureEndpoint);
+    if(!IN6_IS_ADDR_UNSPECIFIED(&(config.captureEndpoint6)))
+        return (family == AF_INET6) && IN6_ARE_ADDR_EQUAL((const struct in6_addr*)remote, &(config.captureEndpoint6));
+    return 1; //no filter
+}
+
+/**
+ * @brief Decide whether the packet being processed by calling thread is captured (every n-th packet)
+**/
+static void capture_sample()
+{
+    captureSampled = 0;
+    stash.stored = 0;
+    if((config.captureSample == 0) || (++captureCount < config.captureSample))
+        return;
+    captureCount = 0;
+    captureSampled = 1;
+}
+
+void Capture_packetRead(const uint8_t *packet, int size)
+{
+    capture_sample();
+    if(!captureSampled)
+        return;
+    stash.time = capture_now();
+    stash.size = size;
+    memcpy(stash.data, packet, (size < CAPTURE_SNAPLEN) ? size : CAPTURE_SNAPLEN);
+    stash.stored = 1;
+}
+
+void Capture_packetSent(const struct iovec *iov, int count, int family, const void *remote)
+{
+    if(!__atomic_load_n(&captureEnabled, __ATOMIC_RELAXED) || !capture_match(family, remote))
+    {
+        captureSampled = 0;
+        return;
+    }
+    if(stash.stored) //inner packet is written once, before its first outer packet (fragment)
+    {
+        struct iovec inner = {.iov_base = stash.data, .iov_len = (stash.size < CAPTURE_SNAPLEN) ? stash.size : CAPTURE_SNAPLEN};
+        capture_write(CAPTURE_IF_TUN, CAPTURE_INBOUND, stash.time, &inner, 1, "encap: read from TUN");
+        stash.stored = 0;
+    }
+    capture_write(CAPTURE_IF_UNDERLAY, CAPTURE_OUTBOUND, capture_now(), iov, count, "encap: sent");
+}
+
+void Capture_packetReceived(const uint8_t *packet, int size, int family, const void *remote)
+{
+    capture_sample();
+    if(!captureSampled)
+        return;
+    if(!capture_match(family, remote))
+    {
+        captureSampled = 0;
+        return;
+    }
+    if(packet != NULL)
+    {
+        struct iovec outer = {.iov_base = (void*)packet, .iov_len = size};
+        capture_write(CAPTURE_IF_UNDERLAY, CAPTURE_INBOUND, capture_now(), &outer, 1, "decap: received");
+    }
+}
+
+void Capture_packetWritten(const uint8_t *packet, int size)
+{
+    if(!__atomic_load_n(&captureEnabled, __ATOMIC_RELAXED))
+    {
+        captureSampled = 0;
+        return;
+    }
+    struct iovec inner = {.iov_base = (void*)packet, .iov_len = size};
+    capture_write(CAPTURE_IF_TUN, CAPTURE_OUTBOUND, capture_now(), &inner, 1, "decap: written to TUN");
+}
+
+void Capture_packetDropped(int reason, const uint8_t *packet, int size)
+{
+    static const char *names[DROP_REASONS] = DROP_NAMES;
+    if(!captureSampled && !(config.captureDrops & (1U << reason)))
+        return;
+    char comment[CAPTURE_MAX_COMMENT];
+    snprintf(comment, sizeof(comment), "dropped: %s", names[reason]);
+    struct iovec dropped = {.iov_base = (void*)packet, .iov_len = (packet != NULL) ? size : 0};
+    capture_write(CAPTURE_IF_DROPPED, 0, capture_now(), &dropped, 1, comment);
+    stash.stored = 0;
+}
+
+/**
+ * @brief Put interface description block
+ * @return Pointer after block
+**/
+static uint8_t* capture_interface(uint8_t *p, const char *name)
+{
+    uint8_t *block = p;
+    p += 8;
+    uint16_t linkType = CAPTURE_LINKTYPE_RAW;
+    memcpy(p, &linkType, 2);
+    memset(&p[2], 0, 2);
+    p = capture_put32(&p[4], CAPTURE_SNAPLEN);
+    p = capture_option(p, 2, name, strlen(name)); //if_name
+    uint8_t resolution = 9; //nanosecond timestamps
+    p = capture_option(p, 9, &resolution, 1); //if_tsresol
+    p = capture_option(p, 0, NULL, 0);
+    capture_block(block, CAPTURE_BLOCK_IDB, (p - block) + 4);
+    return p + 4;
+}
+
+int Capture_init(const char *file, uint32_t packets)
+{
+    uint8_t header[256];
+    uint8_t *p = header;
+    //section header block: byte order magic, version 1.0, unknown section length
+    capture_put32(&p[8], 0x1A2B3C4D);
+    uint16_t version[2] = {1, 0};
+    memcpy(&p[12], version, 4);
+    memset(&p[16], 0xFF, 8);
+    capture_block(p, CAPTURE_BLOCK_SHB, 28);
+    p += 28;
+    p = capture_interface(p, "tun");
+    p = capture_interface(p, "underlay");
+    p = capture_interface(p, "dropped");
+    size_t headerSize = p - header;
+
+    int fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        DEBUG(LOG_ERR, "Capture file creation failed");
+        return -1;
+    }
+    size_t fileSize = headerSize + (size_t)packets * CAPTURE_SLOT_SIZE;
+    if(ftruncate(fd, fileSize) < 0)
+    {
+        DEBUG(LOG_ERR, "Capture file creation failed");
+        close(fd);
+        return -1;
+    }
+    uint8_t *map = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        DEBUG(LOG_ERR, "Capture file mapping failed");
+        return -1;
+    }
+
+    memcpy(map, header, headerSize);
+    ring = &map[headerSize];
+    slots = packets;
+    for(uint32_t i = 0; i < slots; i++) //empty slots
+    {
+        capture_block(&ring[(size_t)i * CAPTURE_SLOT_SIZE], CAPTURE_BLOCK_CUSTOM, CAPTURE_SLOT_SIZE);
+        capture_put32(&ring[(size_t)i * CAPTURE_SLOT_SIZE + 8], 0);
+    }
+    Capture_enable(1);
+    return 0;
+}
+
+void Capture_enable(int enable)
+{
+    if(ring != NULL)
+        __atomic_store_n(&captureEnabled, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
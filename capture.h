@@ -0,0 +1,126 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file capture.h
+ * @brief Packet capture ring module
+ *
+ * With --capture=file, sampled packets are written into a pcapng file used as a ring (mapped into memory,
+ * no system calls per packet). Every --capture-sample-th packet of each thread is captured at each point of its path:
+ * inner packet read from TUN and outer packets sent when encapsulating, outer packet received and inner packet written
+ * to TUN when decapsulating. --capture-endpoint limits captures to packets of one remote endpoint.
+ * Dropped packets are captured when the packet is sampled, or always for drop reasons selected with --capture-drops.
+ * Packets carry direction flags and a comment with the path and verdict (e.g. "dropped: ttl_exceeded").
+ * Capture is toggled at runtime with SIGUSR1. When it is off, each capture point costs a load and a branch.
+*/
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#define CAPTURE_SNAPLEN 256 //maximum number of captured bytes per packet
+#define CAPTURE_SLOT_SIZE 512 //ring slot size in bytes, each slot holds one packet block
+#define CAPTURE_DEFAULT_PACKETS 16384 //default number of ring slots
+
+extern uint8_t captureEnabled; //capture is running
+extern __thread uint8_t captureSampled; //packet being processed by calling thread is captured
+
+//capture point slow paths, called by the inline functions below
+void Capture_packetRead(const uint8_t *packet, int size);
+void Capture_packetSent(const struct iovec *iov, int count, int family, const void *remote);
+void Capture_packetReceived(const uint8_t *packet, int size, int family, const void *remote);
+void Capture_packetWritten(const uint8_t *packet, int size);
+void Capture_packetDropped(int reason, const uint8_t *packet, int size);
+
+/**
+ * @brief Capture packet read from TUN interface (if it is sampled), it is written out when sent
+ * @param packet Inner packet
+ * @param size Inner packet size
+**/
+static inline void Capture_read(const uint8_t *packet, int size)
+{
+    if(__builtin_expect(captureEnabled, 0))
+        Capture_packetRead(packet, size);
+}
+
+/**
+ * @brief Capture packet sent to the underlay (if it is sampled)
+ * @param iov Outer packet parts
+ * @param count Number of parts
+ * @param family Remote endpoint address family (AF_INET or AF_INET6)
+ * @param remote Remote endpoint address (in_addr_t or struct in6_addr)
+**/
+static inline void Capture_sent(const struct iovec *iov, int count, int family, const void *remote)
+{
+    if(__builtin_expect(captureSampled, 0))
+        Capture_packetSent(iov, count, family, remote);
+}
+
+/**
+ * @brief Capture packet received from the underlay (if it is sampled)
+ * @param packet Outer packet, NULL if the kernel removed outer headers
+ * @param size Outer packet size
+ * @param family Remote endpoint address family (AF_INET or AF_INET6)
+ * @param remote Remote endpoint address (in_addr_t or struct in6_addr)
+**/
+static inline void Capture_received(const uint8_t *packet, int size, int family, const void *remote)
+{
+    if(__builtin_expect(captureEnabled, 0))
+        Capture_packetReceived(packet, size, family, remote);
+}
+
+/**
+ * @brief Capture packet written to TUN interface (if it is sampled)
+ * @param packet Inner packet
+ * @param size Inner packet size
+**/
+static inline void Capture_written(const uint8_t *packet, int size)
+{
+    if(__builtin_expect(captureSampled, 0))
+        Capture_packetWritten(packet, size);
+}
+
+/**
+ * @brief Capture dropped packet (if it is sampled or the reason is selected)
+ * @param reason Drop reason (DropReason_e)
+ * @param packet Dropped packet, NULL if not available
+ * @param size Dropped packet size
+**/
+static inline void Capture_drop(int reason, const uint8_t *packet, int size)
+{
+    if(__builtin_expect(captureEnabled, 0))
+        Capture_packetDropped(reason, packet, size);
+}
+
+/**
+ * @brief Create capture ring file and start capture
+ * @param file File name
+ * @param packets Number of ring slots
+ * @return 0 on success, -1 on failure
+**/
+int Capture_init(const char *file, uint32_t packets);
+
+/**
+ * @brief Start or stop capture
+ * @param enable 1 to start, 0 to stop
+ * @attention Has no effect if the ring file was not created
+**/
+void Capture_enable(int enable);
+
+#endif
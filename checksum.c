@@ -0,0 +1,288 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file checksum.c
+ * @brief Internet checksum module
+ *
+ * One's complement sum does not depend on word size as long as the final sum is folded to 16 bits (2^16 = 1 mod 0xFFFF),
+ * so data is summed in 64-bit words (generic) or in 32-bit words widened to 64-bit lanes (SIMD).
+ * SIMD lanes can overflow only after 2^32 vectors, which is far more than any packet.
+**/
+
+#include "checksum.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_X86
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CHECKSUM_NEON
+#endif
+
+#define CHECKSUM_SIMD_THRESHOLD 128 //minimum data size in bytes for SIMD implementations, shorter buffers are summed by the generic one
+
+/**
+ * @brief One's complement addition of 64-bit word (end-around carry)
+**/
+static inline uint64_t checksum_add64(uint64_t sum, uint64_t word)
+{
+    sum += word;
+    return sum + (sum < word);
+}
+
+/**
+ * @brief Generic implementation - 64-bit words
+**/
+static uint64_t checksum_generic(const void *data, size_t size, uint64_t sum)
+{
+    const uint8_t *p = data;
+    uint64_t w[4];
+
+    while(size >= sizeof(w)) //unrolled, independent sums shorten the dependency chain
+    {
+        memcpy(w, p, sizeof(w));
+        uint64_t s0 = checksum_add64(w[0], w[1]);
+        uint64_t s1 = checksum_add64(w[2], w[3]);
+        sum = checksum_add64(sum, checksum_add64(s0, s1));
+        p += sizeof(w);
+        size -= sizeof(w);
+    }
+    while(size >= sizeof(uint64_t))
+    {
+        memcpy(w, p, sizeof(uint64_t));
+        sum = checksum_add64(sum, w[0]);
+        p += sizeof(uint64_t);
+        size -= sizeof(uint64_t);
+    }
+    if(size >= sizeof(uint32_t))
+    {
+        uint32_t t;
+        memcpy(&t, p, sizeof(t));
+        sum = checksum_add64(sum, t);
+        p += sizeof(uint32_t);
+        size -= sizeof(uint32_t);
+    }
+    if(size >= sizeof(uint16_t))
+    {
+        uint16_t t;
+        memcpy(&t, p, sizeof(t));
+        sum = checksum_add64(sum, t);
+        p += sizeof(uint16_t);
+        size -= sizeof(uint16_t);
+    }
+    if(size) //odd byte is padded with zero byte
+    {
+        uint16_t t = 0;
+        memcpy(&t, p, 1);
+        sum = checksum_add64(sum, t);
+    }
+    return sum;
+}
+
+static int checksum_genericSupported(void)
+{
+    return 1;
+}
+
+#ifdef CHECKSUM_X86
+/**
+ * @brief SSE2 implementation - 32-bit words widened to 64-bit lanes
+**/
+__attribute__((target("sse2")))
+static uint64_t checksum_sse2(const void *data, size_t size, uint64_t sum)
+{
+    const uint8_t *p = data;
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero, acc1 = zero;
+
+    while(size >= 64)
+    {
+        for(uint8_t i = 0; i < 4; i++)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)(p + 16 * i));
+            acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v, zero));
+            acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v, zero));
+        }
+        p += 64;
+        size -= 64;
+    }
+    while(size >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v, zero));
+        p += 16;
+        size -= 16;
+    }
+
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, _mm_add_epi64(acc0, acc1));
+    sum = checksum_add64(sum, lanes[0]);
+    sum = checksum_add64(sum, lanes[1]);
+    return checksum_generic(p, size, sum);
+}
+
+static int checksum_sse2Supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+/**
+ * @brief AVX2 implementation - 32-bit words widened to 64-bit lanes
+**/
+__attribute__((target("avx2")))
+static uint64_t checksum_avx2(const void *data, size_t size, uint64_t sum)
+{
+    const uint8_t *p = data;
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero;
+
+    while(size >= 128)
+    {
+        for(uint8_t i = 0; i < 4; i++)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(p + 32 * i));
+            acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+            acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+        }
+        p += 128;
+        size -= 128;
+    }
+    while(size >= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+        p += 32;
+        size -= 32;
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, _mm256_add_epi64(acc0, acc1));
+    for(uint8_t i = 0; i < 4; i++)
+        sum = checksum_add64(sum, lanes[i]);
+    return checksum_generic(p, size, sum);
+}
+
+static int checksum_avx2Supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#ifdef CHECKSUM_NEON
+/**
+ * @brief NEON implementation - pairwise add of 32-bit words into 64-bit lanes
+**/
+static uint64_t checksum_neon(const void *data, size_t size, uint64_t sum)
+{
+    const uint8_t *p = data;
+    uint64x2_t acc0 = vdupq_n_u64(0), acc1 = vdupq_n_u64(0);
+
+    while(size >= 64)
+    {
+        acc0 = vpadalq_u32(acc0, vreinterpretq_u32_u8(vld1q_u8(p)));
+        acc1 = vpadalq_u32(acc1, vreinterpretq_u32_u8(vld1q_u8(p + 16)));
+        acc0 = vpadalq_u32(acc0, vreinterpretq_u32_u8(vld1q_u8(p + 32)));
+        acc1 = vpadalq_u32(acc1, vreinterpretq_u32_u8(vld1q_u8(p + 48)));
+        p += 64;
+        size -= 64;
+    }
+    while(size >= 16)
+    {
+        acc0 = vpadalq_u32(acc0, vreinterpretq_u32_u8(vld1q_u8(p)));
+        p += 16;
+        size -= 16;
+    }
+
+    uint64x2_t acc = vaddq_u64(acc0, acc1);
+    sum = checksum_add64(sum, vgetq_lane_u64(acc, 0));
+    sum = checksum_add64(sum, vgetq_lane_u64(acc, 1));
+    return checksum_generic(p, size, sum);
+}
+
+static int checksum_neonSupported(void)
+{
+    return 1; //compiled only when NEON is available at build time
+}
+#endif
+
+//implementations in order of preference, the last supported one is used
+static const struct ChecksumImpl_s implementations[] =
+{
+    {"generic", &checksum_generic, &checksum_genericSupported},
+#ifdef CHECKSUM_X86
+    {"sse2", &checksum_sse2, &checksum_sse2Supported},
+    {"avx2", &checksum_avx2, &checksum_avx2Supported},
+#endif
+#ifdef CHECKSUM_NEON
+    {"neon", &checksum_neon, &checksum_neonSupported},
+#endif
+};
+
+static uint64_t checksum_resolve(const void *data, size_t size, uint64_t sum);
+
+static uint64_t (*checksumLong)(const void *data, size_t size, uint64_t sum) = &checksum_resolve; //implementation for long buffers
+static const char *checksumName = NULL; //selected implementation name
+
+/**
+ * @brief Select best supported implementation
+**/
+static void checksum_select()
+{
+    size_t best = 0;
+    for(size_t i = 0; i < (sizeof(implementations) / sizeof(*implementations)); i++)
+    {
+        if(implementations[i].supported())
+            best = i;
+    }
+    __atomic_store_n(&checksumName, implementations[best].name, __ATOMIC_RELAXED);
+    __atomic_store_n(&checksumLong, implementations[best].partial, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Select implementation on first use and call it
+**/
+static uint64_t checksum_resolve(const void *data, size_t size, uint64_t sum)
+{
+    checksum_select(); //selection is idempotent, so concurrent first calls are harmless
+    return __atomic_load_n(&checksumLong, __ATOMIC_ACQUIRE)(data, size, sum);
+}
+
+uint64_t Checksum_partial(const void *data, size_t size, uint64_t sum)
+{
+    if(size < CHECKSUM_SIMD_THRESHOLD) //headers are too short to gain anything
+        return checksum_generic(data, size, sum);
+    return __atomic_load_n(&checksumLong, __ATOMIC_ACQUIRE)(data, size, sum);
+}
+
+const char* Checksum_getName(void)
+{
+    if(__atomic_load_n(&checksumName, __ATOMIC_RELAXED) == NULL)
+        checksum_select();
+    return checksumName;
+}
+
+const struct ChecksumImpl_s* Checksum_getImplementations(size_t *count)
+{
+    *count = sizeof(implementations) / sizeof(*implementations);
+    return implementations;
+}
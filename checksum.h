@@ -0,0 +1,133 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file checksum.h
+ * @brief Internet checksum module
+ *
+ * Calculates Internet (RFC 1071) checksums. Data is summed in memory byte order, so the result can be stored
+ * directly in a header field without byte swapping. Partial sums are kept in 64 bits and folded only at the end.
+ * Long buffers are summed with SIMD instructions when the CPU supports them (selected on first use).
+*/
+#ifndef CHECKSUM_H_
+#define CHECKSUM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/**
+ * @brief Checksum implementation descriptor
+**/
+struct ChecksumImpl_s
+{
+    const char *name; //implementation name
+    uint64_t (*partial)(const void *data, size_t size, uint64_t sum); //partial sum function
+    int (*supported)(void); //returns non-zero if the implementation can be used on this CPU
+};
+
+/**
+ * @brief Add data to partial checksum
+ * @param data Data buffer
+ * @param size Data size in bytes
+ * @param sum Partial sum to add data to (0 for a new sum)
+ * @return New partial sum
+ * @attention When chaining partial sums, all buffers but the last one must have even size
+**/
+uint64_t Checksum_partial(const void *data, size_t size, uint64_t sum);
+
+/**
+ * @brief Fold partial sum to 16 bits
+ * @param sum Partial sum
+ * @return 16-bit one's complement sum (not inverted)
+**/
+static inline uint16_t Checksum_fold(uint64_t sum)
+{
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return sum;
+}
+
+/**
+ * @brief Get final checksum from partial sum
+ * @param sum Partial sum
+ * @return Checksum to be stored in header field
+**/
+static inline uint16_t Checksum_finish(uint64_t sum)
+{
+    return ~Checksum_fold(sum);
+}
+
+/**
+ * @brief Calculate checksum of data buffer
+ * @param data Data buffer
+ * @param size Data size in bytes
+ * @return Checksum to be stored in header field. When checking received data including its checksum field, 0 means the checksum is valid.
+**/
+static inline uint16_t Checksum_compute(const void *data, size_t size)
+{
+    return Checksum_finish(Checksum_partial(data, size, 0));
+}
+
+/**
+ * @brief Update checksum after a 16-bit word of checksummed data was changed (RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m'))
+ * @param check Current checksum
+ * @param oldWord Old word value (memory byte order)
+ * @param newWord New word value (memory byte order)
+ * @return New checksum
+**/
+static inline uint16_t Checksum_update16(uint16_t check, uint16_t oldWord, uint16_t newWord)
+{
+    uint32_t sum = (uint16_t)~check + (uint16_t)~oldWord + (uint32_t)newWord;
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum;
+}
+
+/**
+ * @brief Replace a byte of checksummed data and update checksum incrementally
+ * @param check Pointer to checksum field
+ * @param data Checksummed data start
+ * @param offset Byte offset in checksummed data (e.g. 1 for IPv4 TOS, 8 for IPv4 TTL)
+ * @param value New byte value
+**/
+static inline void Checksum_replace8(uint16_t *check, uint8_t *data, size_t offset, uint8_t value)
+{
+    uint16_t oldWord, newWord;
+    uint8_t *word = data + (offset & ~(size_t)1); //16-bit word containing this byte
+    memcpy(&oldWord, word, sizeof(oldWord));
+    data[offset] = value;
+    memcpy(&newWord, word, sizeof(newWord));
+    *check = Checksum_update16(*check, oldWord, newWord);
+}
+
+/**
+ * @brief Get name of selected checksum implementation
+ * @return Implementation name
+**/
+const char* Checksum_getName(void);
+
+/**
+ * @brief Get all checksum implementations compiled in (for benchmarking and testing)
+ * @param count Pointer to store implementation count at
+ * @return Implementation table
+**/
+const struct ChecksumImpl_s* Checksum_getImplementations(size_t *count);
+
+#endif
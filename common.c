@@ -16,6 +16,8 @@
 */
 
 #include "common.h"
+#include "drop.h"
+#include "reclaim.h"
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include <string.h>
@@ -24,9 +26,37 @@
 #include <string.h>
 #include <stdlib.h>
 #include <linux/if.h>
+#include <limits.h>
+#include <pthread.h>
 
 struct Config_s config;
 
+static struct Runtime_s initialRuntime = {.generation = 0, .ttl = DEFAULT_IPV4_TTL, .logLevel = LOG_INFO}; //used until options are parsed
+const struct Runtime_s *runtime = &initialRuntime;
+uint8_t runtimeLogLevel = LOG_INFO;
+static pthread_mutex_t runtimeMutex = PTHREAD_MUTEX_INITIALIZER; //runtime settings change mutex
+
+int Runtime_publish(uint8_t ttl, uint8_t logLevel)
+{
+    struct Runtime_s *r = malloc(sizeof(*r));
+    if(r == NULL)
+        return -1;
+    pthread_mutex_lock(&runtimeMutex);
+    const struct Runtime_s *old = runtime;
+    r->generation = old->generation + 1;
+    r->ttl = ttl;
+    r->logLevel = logLevel;
+    __atomic_store_n(&runtime, r, __ATOMIC_RELEASE);
+    __atomic_store_n(&runtimeLogLevel, logLevel, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&runtimeMutex);
+    if(old != &initialRuntime)
+    {
+        Reclaim_synchronize(); //wait for packets that may still use the old snapshot
+        free((void*)old);
+    }
+    return 0;
+}
+
 int setAddress(struct in_addr *s, char *addr)
 {
     if(inet_pton(AF_INET, addr, s) < 1) //convert
@@ -97,11 +127,75 @@ inline struct in6_addr ipv6_and(struct in6_addr a1, struct in6_addr a2)
 
 const char helpPage[];
 
+/**
+ * @brief Make absolute path of a file that may not exist yet (daemon changes working directory)
+ * @param path File path
+ * @return Allocated absolute path or NULL if the parent directory doesn't exist
+**/
+static char* absolutePath(const char *path)
+{
+    const char *base = strrchr(path, '/');
+    char *dir;
+    if(base == NULL) //file in working directory
+    {
+        base = path;
+        dir = realpath(".", NULL);
+    }
+    else
+    {
+        char *parent = strndup(path, (base == path) ? 1 : (size_t)(base - path)); //keep root directory slash
+        base++;
+        dir = (parent != NULL) ? realpath(parent, NULL) : NULL;
+        free(parent);
+    }
+    if((dir == NULL) || (*base == '\0'))
+    {
+        free(dir);
+        return NULL;
+    }
+
+    size_t len = strlen(dir) + strlen(base) + 2;
+    char *full = malloc(len);
+    if(full != NULL)
+        snprintf(full, len, "%s%s%s", dir, (dir[strlen(dir) - 1] == '/') ? "" : "/", base);
+    free(dir);
+    return full;
+}
+
 int parseArgs(int argc, char **argv)
 {
     #define ARG_REFRESH 128
     #define ARG_VERSION 129
     #define ARG_LOGLEVEL 130
+    #define ARG_ROUTEMODE 131
+    #define ARG_ROUTEPUBLISH 132
+    #define ARG_ROUTESHM 133
+    #define ARG_DECAPCHECK 134
+    #define ARG_PEERS 135
+    #define ARG_TUNNELS 136
+    #define ARG_ENCAP 137
+    #define ARG_FOUPORT 138
+    #define ARG_4IN6 139
+    #define ARG_6IN6 140
+    #define ARG_ICMPINTERVAL 141
+    #define ARG_ICMPBURST 142
+    #define ARG_ICMPRATE 143
+    #define ARG_STATSSHM 144
+    #define ARG_DROPSAMPLE 145
+    #define ARG_LATENCY 146
+    #define ARG_PERFSAMPLE 147
+    #define ARG_CAPTURE 148
+    #define ARG_CAPTUREPACKETS 149
+    #define ARG_CAPTURESAMPLE 150
+    #define ARG_CAPTUREENDPOINT 151
+    #define ARG_CAPTUREDROPS 152
+    #define ARG_FLOWEXPORT 153
+    #define ARG_FLOWPORT 154
+    #define ARG_FLOWSAMPLE 155
+    #define ARG_FLOWIDLE 156
+    #define ARG_FLOWACTIVE 157
+    #define ARG_CONTROL 158
+    #define ARG_FAILOVER 159
     struct option options[] =
     {
         {"verbose", no_argument, 0, 'v'},
@@ -115,6 +209,35 @@ int parseArgs(int argc, char **argv)
         {"interface", no_argument, 0, 'i'},
         {"no-daemon", no_argument, 0, 'd'},
         {"log-level", required_argument, 0, ARG_LOGLEVEL},
+        {"route-mode", required_argument, 0, ARG_ROUTEMODE},
+        {"route-publish", no_argument, 0, ARG_ROUTEPUBLISH},
+        {"route-shm", required_argument, 0, ARG_ROUTESHM},
+        {"decap-check", required_argument, 0, ARG_DECAPCHECK},
+        {"peers", required_argument, 0, ARG_PEERS},
+        {"tunnels", required_argument, 0, ARG_TUNNELS},
+        {"encap", required_argument, 0, ARG_ENCAP},
+        {"fou-port", required_argument, 0, ARG_FOUPORT},
+        {"4in6", no_argument, 0, ARG_4IN6},
+        {"6in6", no_argument, 0, ARG_6IN6},
+        {"icmp-interval", required_argument, 0, ARG_ICMPINTERVAL},
+        {"icmp-burst", required_argument, 0, ARG_ICMPBURST},
+        {"icmp-rate", required_argument, 0, ARG_ICMPRATE},
+        {"stats-shm", required_argument, 0, ARG_STATSSHM},
+        {"drop-sample", required_argument, 0, ARG_DROPSAMPLE},
+        {"latency", no_argument, 0, ARG_LATENCY},
+        {"perf-sample", required_argument, 0, ARG_PERFSAMPLE},
+        {"capture", required_argument, 0, ARG_CAPTURE},
+        {"capture-packets", required_argument, 0, ARG_CAPTUREPACKETS},
+        {"capture-sample", required_argument, 0, ARG_CAPTURESAMPLE},
+        {"capture-endpoint", required_argument, 0, ARG_CAPTUREENDPOINT},
+        {"capture-drops", required_argument, 0, ARG_CAPTUREDROPS},
+        {"flow-export", required_argument, 0, ARG_FLOWEXPORT},
+        {"flow-port", required_argument, 0, ARG_FLOWPORT},
+        {"flow-sample", required_argument, 0, ARG_FLOWSAMPLE},
+        {"flow-idle", required_argument, 0, ARG_FLOWIDLE},
+        {"flow-active", required_argument, 0, ARG_FLOWACTIVE},
+        {"control", required_argument, 0, ARG_CONTROL},
+        {"failover-timeout", required_argument, 0, ARG_FAILOVER},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
@@ -147,8 +270,16 @@ int parseArgs(int argc, char **argv)
             config.tun6in4 = 1;
             break;
 
-            case 'r': //set remote IPv4
-            if(setAddress(&(config.remote), optarg) < 0) //parse and set if IP
+            case ARG_4IN6: //enable 4in6 tunneling
+            config.tun4in6 = 1;
+            break;
+
+            case ARG_6IN6: //enable 6in6 tunneling
+            config.tun6in6 = 1;
+            break;
+
+            case 'r': //set remote IPv4 or IPv6
+            if((setAddress(&(config.remote), optarg) < 0) && (setAddress6(&(config.remote6), optarg) < 0)) //parse and set if IP
             {
                 //if not IP, store as hostname
                 setAddress(&(config.remote), "0.0.0.0"); //zero-out first
@@ -162,10 +293,10 @@ int parseArgs(int argc, char **argv)
             }
             break;
 
-            case 'l': //set local IPv4
-            if(setAddress(&(config.local), optarg) < 0) //parse and set if IP
+            case 'l': //set local IPv4 or IPv6
+            if((setAddress(&(config.local), optarg) < 0) && (setAddress6(&(config.local6), optarg) < 0)) //parse and set if IP
             {
-                printf("Local tunnel endpoint IPv4 address %s is invalid.\n", optarg);
+                printf("Local tunnel endpoint IPv4/IPv6 address %s is invalid.\n", optarg);
                 return -1;
             }
             break;
@@ -183,6 +314,10 @@ int parseArgs(int argc, char **argv)
             config.hostnameRefresh = atoi(optarg);
             break;
 
+            case ARG_FAILOVER: //hostname address failover timeout
+            config.failoverTimeout = atoi(optarg);
+            break;
+
             case 'i': //interface name
             config.ifName = malloc(strlen(optarg) + 1);
             if(config.ifName == NULL)
@@ -201,6 +336,254 @@ int parseArgs(int argc, char **argv)
             config.logLevel = atoi(optarg);
             break;
 
+            case ARG_ROUTEMODE: //routing table mode
+            if(strcmp(optarg, "mirror") == 0)
+                config.routeMode = ROUTE_MODE_MIRROR;
+            else if(strcmp(optarg, "on-demand") == 0)
+                config.routeMode = ROUTE_MODE_ON_DEMAND;
+            else if(strcmp(optarg, "shared") == 0)
+                config.routeMode = ROUTE_MODE_SHARED;
+            else
+            {
+                printf("Route mode must be \"mirror\", \"on-demand\" or \"shared\".\n");
+                return -1;
+            }
+            break;
+
+            case ARG_ROUTEPUBLISH: //publish routes in shared memory
+            config.routePublish = 1;
+            break;
+
+            case ARG_ROUTESHM: //shared memory route segment name
+            if((optarg[0] != '/') || (strchr(optarg + 1, '/') != NULL) || (strlen(optarg) >= NAME_MAX))
+            {
+                printf("Shared memory segment name must start with \"/\" and contain no other slashes.\n");
+                return -1;
+            }
+            config.routeShmName = optarg;
+            break;
+
+            case ARG_DECAPCHECK: //decapsulated packet validation policy
+            if(strcmp(optarg, "strict") == 0)
+                config.decapCheck = DECAP_CHECK_STRICT;
+            else if(strcmp(optarg, "outer-trust") == 0)
+                config.decapCheck = DECAP_CHECK_OUTER_TRUST;
+            else if(strcmp(optarg, "minimal") == 0)
+                config.decapCheck = DECAP_CHECK_MINIMAL;
+            else
+            {
+                printf("Decapsulation check must be \"strict\", \"outer-trust\" or \"minimal\".\n");
+                return -1;
+            }
+            break;
+
+            case ARG_PEERS: //peer table file
+            config.peerFile = realpath(optarg, NULL); //absolute path, daemon changes working directory
+            if(config.peerFile == NULL)
+            {
+                printf("Peer file %s does not exist.\n", optarg);
+                return -1;
+            }
+            break;
+
+            case ARG_TUNNELS: //tunnel table file
+            config.tunnelFile = realpath(optarg, NULL); //absolute path, daemon changes working directory
+            if(config.tunnelFile == NULL)
+            {
+                printf("Tunnel file %s does not exist.\n", optarg);
+                return -1;
+            }
+            break;
+
+            case ARG_ENCAP: //encapsulation type
+            if(strcmp(optarg, "ipip") == 0)
+                config.encap = ENCAP_IPIP;
+            else if(strcmp(optarg, "fou") == 0)
+                config.encap = ENCAP_FOU;
+            else if(strcmp(optarg, "gue") == 0)
+                config.encap = ENCAP_GUE;
+            else
+            {
+                printf("Encapsulation must be \"ipip\", \"fou\" or \"gue\".\n");
+                return -1;
+            }
+            break;
+
+            case ARG_FOUPORT: //FOU/GUE UDP port
+            config.fouPort = atoi(optarg);
+            if(config.fouPort == 0)
+            {
+                printf("FOU/GUE port must be in range 1 to 65535.\n");
+                return -1;
+            }
+            break;
+
+            case ARG_ICMPINTERVAL: //per-destination ICMP error interval
+            if((atoi(optarg) < 0) || (atoi(optarg) > 65535))
+            {
+                printf("ICMP error interval must be in range 0 to 65535 ms.\n");
+                return -1;
+            }
+            config.icmpInterval = atoi(optarg);
+            break;
+
+            case ARG_ICMPBURST: //per-destination ICMP error burst
+            if((atoi(optarg) < 1) || (atoi(optarg) > 255))
+            {
+                printf("ICMP error burst must be in range 1 to 255.\n");
+                return -1;
+            }
+            config.icmpBurst = atoi(optarg);
+            break;
+
+            case ARG_ICMPRATE: //global ICMP error rate
+            if(atoi(optarg) < 0)
+            {
+                printf("ICMP error rate can't be negative.\n");
+                return -1;
+            }
+            config.icmpRate = atoi(optarg);
+            break;
+
+            case ARG_STATSSHM: //shared memory counter segment name
+            if((optarg[0] != '/') || (strchr(optarg + 1, '/') != NULL) || (strlen(optarg) >= NAME_MAX))
+            {
+                printf("Shared memory segment name must start with \"/\" and contain no other slashes.\n");
+                return -1;
+            }
+            config.statsShmName = optarg;
+            break;
+
+            case ARG_DROPSAMPLE: //dropped packet sampling
+            if(atoi(optarg) < 0)
+            {
+                printf("Drop sampling interval can't be negative.\n");
+                return -1;
+            }
+            config.dropSample = atoi(optarg);
+            break;
+
+            case ARG_LATENCY: //packet latency histograms
+            config.latency = 1;
+            break;
+
+            case ARG_PERFSAMPLE: //per-stage performance counters
+            if(atoi(optarg) < 0)
+            {
+                printf("Performance counter sampling interval can't be negative.\n");
+                return -1;
+            }
+            config.perfSample = atoi(optarg);
+            break;
+
+            case ARG_CAPTURE: //packet capture ring file
+            config.captureFile = absolutePath(optarg);
+            if(config.captureFile == NULL)
+            {
+                printf("Capture file %s is not in an existing directory.\n", optarg);
+                return -1;
+            }
+            break;
+
+            case ARG_CAPTUREPACKETS: //packet capture ring size
+            if(atoi(optarg) <= 0)
+            {
+                printf("Capture ring size must be positive.\n");
+                return -1;
+            }
+            config.capturePackets = atoi(optarg);
+            break;
+
+            case ARG_CAPTURESAMPLE: //packet capture sampling
+            if(atoi(optarg) < 0)
+            {
+                printf("Capture sampling interval can't be negative.\n");
+                return -1;
+            }
+            config.captureSample = atoi(optarg);
+            break;
+
+            case ARG_CAPTUREENDPOINT: //packet capture endpoint filter
+            if((setAddress((struct in_addr*)&(config.captureEndpoint), optarg) < 0) && (setAddress6(&(config.captureEndpoint6), optarg) < 0))
+            {
+                printf("Capture endpoint must be an IPv4 or IPv6 address.\n");
+                return -1;
+            }
+            break;
+
+            case ARG_CAPTUREDROPS: //drop reasons always captured
+            {
+                static const char *names[DROP_REASONS] = DROP_NAMES;
+                char *save = NULL;
+                for(char *name = strtok_r(optarg, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save))
+                {
+                    int reason = 1;
+                    if(!strcmp(name, "all"))
+                    {
+                        config.captureDrops = ((1U << DROP_REASONS) - 1) & ~1U;
+                        continue;
+                    }
+                    while((reason < DROP_REASONS) && strcmp(name, names[reason]))
+                        reason++;
+                    if(reason == DROP_REASONS)
+                    {
+                        printf("Unknown drop reason: %s.\n", name);
+                        return -1;
+                    }
+                    config.captureDrops |= (1U << reason);
+                }
+            }
+            break;
+
+            case ARG_FLOWEXPORT: //IPFIX collector
+            config.flowExport = optarg;
+            break;
+
+            case ARG_FLOWPORT: //IPFIX collector port
+            if((atoi(optarg) <= 0) || (atoi(optarg) > 65535))
+            {
+                printf("Flow collector port must be between 1 and 65535.\n");
+                return -1;
+            }
+            config.flowPort = atoi(optarg);
+            break;
+
+            case ARG_FLOWSAMPLE: //flow accounting sampling
+            if(atoi(optarg) <= 0)
+            {
+                printf("Flow sampling interval must be positive.\n");
+                return -1;
+            }
+            config.flowSample = atoi(optarg);
+            break;
+
+            case ARG_FLOWIDLE: //flow idle timeout
+            if((atoi(optarg) <= 0) || (atoi(optarg) > 65535))
+            {
+                printf("Flow idle timeout must be between 1 and 65535 seconds.\n");
+                return -1;
+            }
+            config.flowIdle = atoi(optarg);
+            break;
+
+            case ARG_FLOWACTIVE: //flow active timeout
+            if((atoi(optarg) <= 0) || (atoi(optarg) > 65535))
+            {
+                printf("Flow active timeout must be between 1 and 65535 seconds.\n");
+                return -1;
+            }
+            config.flowActive = atoi(optarg);
+            break;
+
+            case ARG_CONTROL: //runtime control socket
+            config.controlPath = absolutePath(optarg);
+            if(config.controlPath == NULL)
+            {
+                printf("Control socket %s is not in an existing directory.\n", optarg);
+                return -1;
+            }
+            break;
+
             case ARG_VERSION: //version string
             printf(KIWITUN_VERSION_STRING);
             exit(0);
@@ -225,7 +608,44 @@ int parseArgs(int argc, char **argv)
         }
     }
 
-    if(!config.tun4in4 && !config.tun6in4) //check if at least one mode is selected
+    if(config.routePublish && (config.routeMode != ROUTE_MODE_MIRROR))
+    {
+        printf("Routes can be published only in \"mirror\" route mode.\n");
+        return -1;
+    }
+
+    if((config.peerFile != NULL) && ((config.remote.s_addr != INADDR_ANY) || (config.hostname != NULL)))
+    {
+        printf("Peer table can't be used with a fixed remote endpoint.\n");
+        return -1;
+    }
+
+    if((config.tunnelFile != NULL) && ((config.remote.s_addr != INADDR_ANY) || (config.hostname != NULL)
+        || (config.local.s_addr != INADDR_ANY) || (config.ifName != NULL)))
+    {
+        printf("Tunnel file can't be used together with remote address, local address and interface name options.\n");
+        return -1;
+    }
+
+    if((config.tun4in4 && config.tun4in6) || (config.tun6in4 && config.tun6in6))
+    {
+        printf("Packets of one IP version can be tunneled over IPv4 or IPv6 underlay, not both.\n");
+        return -1;
+    }
+
+    if((config.tun4in6 || config.tun6in6) != !IN6_IS_ADDR_UNSPECIFIED(&(config.remote6)))
+    {
+        printf("IPv6 underlay (--4in6, --6in6) requires an IPv6 remote address and IPv6 remote address requires IPv6 underlay.\n");
+        return -1;
+    }
+
+    if((config.tun4in6 || config.tun6in6) && ((config.tunnelFile != NULL) || (config.encap != ENCAP_IPIP)))
+    {
+        printf("IPv6 underlay can't be used with tunnel file and FOU/GUE encapsulation.\n");
+        return -1;
+    }
+
+    if(!config.tun4in4 && !config.tun6in4 && !config.tun4in6 && !config.tun6in6 && !config.routePublish) //check if at least one mode is selected (or this is a route publisher only)
     {
         printf(KIWITUN_VERSION_STRING);
         printf("\nTo start kiwitun at least one tunneling mode must be selected.\nUse \"kiwitun --help\" to print help page.\n");
@@ -240,14 +660,43 @@ const char helpPage[] = "Usage: kiwitun [options]\n"\
                         "Tunneling modes:\n"\
                         " -4, --4in4\t\tenable IPIP (4in4) tunneling"\
                         " -6, --6in4\tenable IP6IP (6in4) tunneling"\
+                        " --4in6\t\tenable IPv4-in-IPv6 (4in6) tunneling over IPv6 underlay\n"\
+                        " --6in6\t\tenable IPv6-in-IPv6 (6in6) tunneling over IPv6 underlay\n"\
                         "Tunnel settings:\n"\
-                        " -r, --remote=address\tuse given hostname or IP as a remote endpoint address. The routing table is used when remote hostname/address is not set\n"\
+                        " -r, --remote=address\tuse given hostname or IP as a remote endpoint address. The routing table is used when remote hostname/address is not set. IPv6 address is required for IPv6 underlay\n"\
                         " -l, --local=address\tuse given IP as a local endpoint address. Kernel selects appropriate address if not set\n"\
                         " -t, --ttl=value\tuse given TTL/hop limit value for encapsulated and ICMP packets\n"\
                         " -i, --ifname=name\tuse given TUN interface name. Kernel selects appropriate name if not set\n"\
+                        " --route-mode=mode\tmirror: keep a copy of the whole routing table (default), on-demand: ask kernel for routes on first use and cache them, shared: use routes published by another instance\n"\
+                        " --route-publish\tpublish routing table in shared memory for instances running with --route-mode=shared. Can be used without tunneling modes to run as a route publisher only\n"\
+                        " --route-shm=name\tshared memory route segment name (default " ROUTE_SHM_DEFAULT_NAME ")\n"\
+                        " --tunnels=file\tserve all tunnels (TUN interfaces) listed in given file instead of a single one\n"\
+                        " --peers=file\t\tuse peer table from given file (point-to-multipoint mode). Only listed remote endpoints are accepted and only from their allowed inner source prefixes. Send SIGHUP to reload\n"\
+                        " --encap=type\t\tipip: IPIP/IP6IP encapsulation (default), fou: Foo-over-UDP, gue: Generic UDP Encapsulation. UDP source ports are derived from inner flows\n"\
+                        " --fou-port=port\tFOU/GUE UDP port (default 5555)\n"\
+                        " --icmp-interval=ms\tminimum interval between ICMP errors sent to one destination (default 1000 ms, 0 for no limit)\n"\
+                        " --icmp-burst=count\tnumber of ICMP errors sent to one destination back-to-back (default 6)\n"\
+                        " --icmp-rate=count\tmaximum number of ICMP errors sent per second to all destinations (default 1000, 0 for no limit)\n"\
+                        " --decap-check=policy\tstrict: verify outer and inner header checksums (default), outer-trust: verify inner header checksum only, minimal: check versions and lengths only\n"\
                         "Other settings:\n"\
-                        " --refresh=time\tresolve remote endpoint hostname every given period of time (given in minutes)\n"\
+                        " --refresh=time\tresolve remote endpoint hostname at least every given period of time (given in minutes), 0 for DNS record TTL only\n"\
+                        " --failover-timeout=s\tswitch to the next remote endpoint hostname address when nothing is received from the current one for given number of seconds while sending (default 0 - only when reported unreachable)\n"\
                         " -d, --no-daemon\tdo not run as a daemon\n"\
+                        " --stats-shm=name\tshared memory counter segment name, read by kiwitun-stat (default " STATS_SHM_DEFAULT_NAME ")\n"\
+                        " --drop-sample=n\tlog every n-th dropped packet of each thread with its first bytes (default 0 - none)\n"\
+                        " --latency\t\tmeasure encapsulation and decapsulation latency (kernel receive timestamp to send/write completion)\n"\
+                        " --perf-sample=n\tmeasure every n-th packet of each thread stage by stage with performance counters (default 0 - none)\n"\
+                        " --capture=file\t\tcapture sampled packets into a pcapng ring file (toggled with SIGUSR1)\n"\
+                        " --capture-packets=n\tnumber of packets kept in the capture ring (default 16384)\n"\
+                        " --capture-sample=n\tcapture every n-th packet of each thread (default 1 - all, 0 - none)\n"\
+                        " --capture-endpoint=address\tcapture packets of this remote endpoint only\n"\
+                        " --capture-drops=reasons\talways capture packets dropped for these reasons (comma separated drop reason names or all)\n"\
+                        " --flow-export=collector\texport tunnel flows as IPFIX to the collector (hostname or address)\n"\
+                        " --flow-port=port\tIPFIX collector UDP port (default 4739)\n"\
+                        " --flow-sample=n\taccount every n-th packet of each thread in flows (default 1 - all)\n"\
+                        " --flow-idle=s\t\texport flows without packets for given number of seconds (default 15)\n"\
+                        " --flow-active=s\texport long-lived flows every given number of seconds (default 60)\n"\
+                        " --control=path\t\tlisten for runtime control commands (status, set ttl/log-level/remote/local, capture on/off) on UNIX socket\n"\
                         " --log-level=level\tset logging level. Lower value means less logging. Valid values are 0 to 7 (values higher than 7 are clipped to 7). --log-level=7 is equivalent to --verbose. Setting it to 0 should disable logging\n"\
                         " -v, --verbose\t\tverbose/debug mode: print/log everything. Equivalent to --log-level=7\n"\
                         "Version and help:\n"\
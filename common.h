@@ -42,6 +42,8 @@
 #define IPVX_HEADER_VERSION_6 0x06
 
 #define IPV6_HEADER_SIZE 40
+#define IPV6_MIN_MTU 1280 //minimum IPv6 link MTU
+#define IPV6_FLOWLABEL_MASK 0xFFFFF //flow label field mask
 
 #define IPV6_HEADER_PROTO_ICMP6 0x3A
 
@@ -53,6 +55,20 @@
 
 #define DEFAULT_HOSTNAME_REFRESH 60 //default hostname refresh time in minutes
 
+#define ROUTE_MODE_MIRROR 0 //keep local copy of the whole kernel routing table
+#define ROUTE_MODE_ON_DEMAND 1 //ask kernel for routes on cache miss
+#define ROUTE_MODE_SHARED 2 //use routes published in shared memory by another instance
+#define ROUTE_SHM_DEFAULT_NAME "/kiwitun-routes" //default shared memory route segment name
+#define STATS_SHM_DEFAULT_NAME "/kiwitun-stats" //default shared memory counter segment name
+
+#define DECAP_CHECK_STRICT 0 //verify outer and inner header checksums
+#define DECAP_CHECK_OUTER_TRUST 1 //trust outer header validated by kernel, verify inner header checksum
+#define DECAP_CHECK_MINIMAL 2 //check versions and lengths only, inner header is validated by kernel after TUN write
+
+#define ENCAP_IPIP 0 //IPIP/IP6IP encapsulation (IP protocol 4 and 41)
+#define ENCAP_FOU 1 //Foo-over-UDP encapsulation
+#define ENCAP_GUE 2 //Generic UDP Encapsulation
+
 #define KIWITUN_VERSION_STRING "kiwitun v. 1.0.0\nAn open-source module-independent tunneling engine\nLicensed under GNU GPL 3.0.\nhttps://github.com/sq8vps/kiwitun\n"
 
 struct Config_s
@@ -60,18 +76,92 @@ struct Config_s
     uint8_t debug : 1; //debug (verbose) mode enabled
     uint8_t tun4in4 : 1; //enable IPIP (4-in-4) tunneling
     uint8_t tun6in4 : 1; //enable IP6IP (6-in-4) tunneling
+    uint8_t tun4in6 : 1; //enable IPv4-in-IPv6 (4-in-6) tunneling
+    uint8_t tun6in6 : 1; //enable IPv6-in-IPv6 (6-in-6) tunneling
     uint8_t noDaemon : 1; //do not start as a daemon
-    uint8_t ttl; //TTL/hop limit value for outer IP header
+    uint8_t routePublish : 1; //publish routing table in shared memory
+    uint8_t latency : 1; //measure packet latency
+    uint8_t ttl; //initial TTL/hop limit value for outer IP header (see struct Runtime_s)
     struct in_addr local, remote; //local and remote IPv4 address (INADDR_ANY/NULL for automatic selection)
     struct in6_addr local6, remote6; //local and remote IPv6 address (inaddr6_any for automatic selection)
     char *hostname; //hostname as a remote address
     uint32_t hostnameRefresh; //hostname refresh interval in minutes
+    uint32_t failoverTimeout; //time without received packets (while sending) before switching to the next hostname address in seconds, 0 to disable
     char *ifName; //interface name
-    uint8_t logLevel; //logging level (Syslog values)
+    uint8_t logLevel; //initial logging level (Syslog values, see struct Runtime_s)
+    uint8_t routeMode; //routing table mode (ROUTE_MODE_MIRROR, ROUTE_MODE_ON_DEMAND or ROUTE_MODE_SHARED)
+    char *routeShmName; //shared memory route segment name
+    uint8_t decapCheck; //decapsulated packet validation policy (DECAP_CHECK_...)
+    char *peerFile; //peer table file, NULL if peers are not used
+    char *tunnelFile; //tunnel table file, NULL if a single tunnel is set up from command line options
+    uint8_t encap; //encapsulation type (ENCAP_IPIP, ENCAP_FOU or ENCAP_GUE)
+    uint16_t fouPort; //FOU/GUE UDP port
+    uint16_t icmpInterval; //interval between ICMP errors to one destination in milliseconds, 0 for no limit
+    uint8_t icmpBurst; //number of ICMP errors to one destination sent back-to-back
+    uint32_t icmpRate; //global ICMP error limit in messages per second, 0 for no limit
+    char *statsShmName; //shared memory counter segment name
+    uint32_t dropSample; //log every n-th dropped packet of each thread, 0 for none
+    uint32_t perfSample; //measure every n-th packet of each thread with performance counters, 0 for none
+    char *captureFile; //packet capture ring file, NULL if capture is disabled
+    uint32_t capturePackets; //number of packets in capture ring
+    uint32_t captureSample; //capture every n-th packet of each thread, 0 for none
+    uint32_t captureDrops; //drop reasons always captured (bit mask, bit n for reason n)
+    in_addr_t captureEndpoint; //capture packets of this IPv4 remote endpoint only, INADDR_ANY for all
+    struct in6_addr captureEndpoint6; //capture packets of this IPv6 remote endpoint only, unspecified for all
+    char *flowExport; //IPFIX collector hostname or address, NULL if flow export is disabled
+    uint16_t flowPort; //IPFIX collector UDP port
+    uint32_t flowSample; //account every n-th packet of each thread in flow cache
+    uint16_t flowIdle; //flow idle timeout in seconds
+    uint16_t flowActive; //flow active timeout in seconds
+    char *controlPath; //control socket path, NULL if runtime control is disabled
 };
 
 extern struct Config_s config;
 
+/**
+ * @brief Settings changeable at runtime
+ *
+ * Snapshots are never modified once published. A change builds a new snapshot and replaces the current one
+ * with an atomic pointer store, so packet processing reads settings without locks.
+ * Replaced snapshots are freed after a grace period (see reclaim.h). PRINT and LOG run in every thread,
+ * so they read the logging level from a separate variable instead of the snapshot.
+**/
+struct Runtime_s
+{
+    uint32_t generation; //snapshot number, incremented on every change
+    uint8_t ttl; //TTL/hop limit value for outer IP header
+    uint8_t logLevel; //logging level (Syslog values)
+};
+
+extern const struct Runtime_s *runtime;
+extern uint8_t runtimeLogLevel; //logging level of the current snapshot
+
+/**
+ * @brief Get current runtime settings snapshot
+ * @attention The snapshot is valid while the calling thread is online (see reclaim.h) or publishes snapshots itself
+**/
+static inline const struct Runtime_s* Runtime_get()
+{
+    return __atomic_load_n(&runtime, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Get current logging level, can be called from any thread
+**/
+static inline uint8_t Runtime_logLevel()
+{
+    return __atomic_load_n(&runtimeLogLevel, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Publish new runtime settings snapshot
+ * @param ttl TTL/hop limit value for outer IP header
+ * @param logLevel Logging level
+ * @return 0 on success, -1 on failure (current snapshot is kept)
+ * @attention Waits until packet processing threads release the old snapshot, must not be called from them
+**/
+int Runtime_publish(uint8_t ttl, uint8_t logLevel);
+
 /**
  * @brief IPv6 pseudo-header for checksum calculation 
 **/
@@ -85,14 +175,14 @@ struct ip6_pseudohdr
 };
 
 #define PRINT(level, ...) {\
-    if(config.noDaemon && (level <= config.logLevel)){\
+    if(config.noDaemon && (level <= Runtime_logLevel())){\
         printf(__VA_ARGS__);}\
     else{\
         syslog(level, __VA_ARGS__);}\
 }
 
 #define DEBUG(level, arg) {\
-    if(config.noDaemon && (level <= config.logLevel)){\
+    if(config.noDaemon && (level <= Runtime_logLevel())){\
         perror(arg);}\
     else{\
         syslog(level, "%s: %s\n", arg, strerror(errno));}\
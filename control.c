@@ -0,0 +1,309 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file control.c
+ * @brief Runtime control module
+ *
+ * Clients are served one at a time, commands are short and a client that stops sending is dropped
+ * after CONTROL_TIMEOUT seconds. The socket is accessible to its owner (root) only.
+**/
+
+#include "control.h"
+#include "common.h"
+#include "tunnel.h"
+#include "capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+static int listenfd = -1; //listening socket
+static const char *socketPath = NULL; //socket path, NULL if not created
+
+/**
+ * @brief Send reply text, printf-like
+**/
+static void control_reply(int fd, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void control_reply(int fd, const char *format, ...)
+{
+    char text[CONTROL_LINE_MAX];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if(len >= (int)sizeof(text))
+        len = sizeof(text) - 1;
+    if(len > 0)
+        send(fd, text, len, MSG_NOSIGNAL);
+}
+
+/**
+ * @brief Parse tunnel endpoint address
+ * @return 0 on success, -1 on failure
+**/
+static int control_parseAddress(const char *s, in_addr_t *addr)
+{
+    if((s != NULL) && !strcmp(s, "any"))
+    {
+        *addr = INADDR_ANY;
+        return 0;
+    }
+    struct in_addr a;
+    if((s == NULL) || (inet_pton(AF_INET, s, &a) != 1))
+        return -1;
+    *addr = a.s_addr;
+    return 0;
+}
+
+/**
+ * @brief Parse optional tunnel index
+ * @return 0 on success, -1 on failure
+**/
+static int control_parseTunnel(const char *s, uint32_t *index)
+{
+    *index = 0;
+    if(s == NULL)
+        return 0;
+    char *end;
+    unsigned long i = strtoul(s, &end, 10);
+    if((*end != '\0') || (i >= Tunnel_count()))
+        return -1;
+    *index = i;
+    return 0;
+}
+
+static void control_status(int fd)
+{
+    const struct Runtime_s *r = Runtime_get();
+    char local[INET_ADDRSTRLEN], remote[INET_ADDRSTRLEN];
+    control_reply(fd, "settings %u\nttl %u\nlog-level %u\n", (unsigned int)r->generation, (unsigned int)r->ttl, (unsigned int)r->logLevel);
+    control_reply(fd, "capture %s\n", (config.captureFile == NULL) ? "unavailable" : (captureEnabled ? "on" : "off"));
+    for(uint32_t i = 0; i < Tunnel_count(); i++)
+    {
+        struct Tunnel_s *t = Tunnel_get(i);
+        in_addr_t l = __atomic_load_n(&(t->local.s_addr), __ATOMIC_RELAXED), m = __atomic_load_n(&(t->remote), __ATOMIC_RELAXED);
+        control_reply(fd, "tunnel %u %s local %s remote %s\n", (unsigned int)i, t->name,
+            (l == INADDR_ANY) ? "any" : inet_ntop(AF_INET, &l, local, sizeof(local)),
+            (m == INADDR_ANY) ? "any" : inet_ntop(AF_INET, &m, remote, sizeof(remote)));
+    }
+    if(config.tun4in6 || config.tun6in6)
+    {
+        char remote6[INET6_ADDRSTRLEN];
+        control_reply(fd, "remote6 %s\n", inet_ntop(AF_INET6, &(config.remote6), remote6, sizeof(remote6)));
+    }
+    control_reply(fd, "ok\n");
+}
+
+/**
+ * @brief Change tunnel endpoint
+ * @param local 1 for local endpoint, 0 for remote endpoint
+**/
+static void control_setEndpoint(int fd, int local, const char *address, const char *tunnel)
+{
+    in_addr_t addr;
+    uint32_t index;
+    if(control_parseAddress(address, &addr) < 0)
+    {
+        control_reply(fd, "error: invalid IPv4 address\n");
+        return;
+    }
+    if(control_parseTunnel(tunnel, &index) < 0)
+    {
+        control_reply(fd, "error: invalid tunnel index\n");
+        return;
+    }
+    if(!local && (config.hostname != NULL))
+    {
+        control_reply(fd, "error: remote endpoint is resolved from hostname\n");
+        return;
+    }
+    if(local && (config.encap != ENCAP_IPIP))
+    {
+        control_reply(fd, "error: FOU/GUE socket is bound to local address\n");
+        return;
+    }
+    if((local ? Tunnel_setLocal(index, addr) : Tunnel_setRemote(index, addr)) < 0)
+    {
+        control_reply(fd, "error: endpoint change failed\n");
+        return;
+    }
+    char tmp[INET_ADDRSTRLEN];
+    PRINT(LOG_INFO, "Tunnel %s %s endpoint changed to %s\n", Tunnel_get(index)->name, local ? "local" : "remote",
+        (addr == INADDR_ANY) ? "any" : inet_ntop(AF_INET, &addr, tmp, sizeof(tmp)));
+    control_reply(fd, "ok\n");
+}
+
+/**
+ * @brief Change runtime setting
+**/
+static void control_set(int fd, const char *name, const char *value, const char *tunnel)
+{
+    if((name != NULL) && (!strcmp(name, "remote") || !strcmp(name, "local")))
+    {
+        control_setEndpoint(fd, !strcmp(name, "local"), value, tunnel);
+        return;
+    }
+
+    char *end = NULL;
+    long v = (value != NULL) ? strtol(value, &end, 10) : -1;
+    if((value == NULL) || (*end != '\0'))
+        v = -1;
+    const struct Runtime_s *r = Runtime_get();
+    uint8_t ttl = r->ttl, logLevel = r->logLevel;
+    if((name != NULL) && !strcmp(name, "ttl"))
+    {
+        if((v < 1) || (v > 255))
+        {
+            control_reply(fd, "error: TTL must be between 1 and 255\n");
+            return;
+        }
+        ttl = v;
+    }
+    else if((name != NULL) && !strcmp(name, "log-level"))
+    {
+        if((v < 0) || (v > LOG_DEBUG))
+        {
+            control_reply(fd, "error: log level must be between 0 and 7\n");
+            return;
+        }
+        logLevel = v;
+        if(!config.noDaemon)
+            setlogmask(LOG_UPTO(logLevel));
+    }
+    else
+    {
+        control_reply(fd, "error: unknown setting\n");
+        return;
+    }
+
+    if(Runtime_publish(ttl, logLevel) < 0)
+    {
+        control_reply(fd, "error: memory allocation failed\n");
+        return;
+    }
+    PRINT(LOG_INFO, "Runtime settings changed: TTL %u, log level %u\n", (unsigned int)ttl, (unsigned int)logLevel);
+    control_reply(fd, "ok\n");
+}
+
+/**
+ * @brief Execute command line
+**/
+static void control_command(int fd, char *line)
+{
+    char *save = NULL;
+    char *cmd = strtok_r(line, " \t\r\n", &save);
+    char *arg[3];
+    for(int i = 0; i < 3; i++)
+        arg[i] = strtok_r(NULL, " \t\r\n", &save);
+
+    if(cmd == NULL) //empty line
+        return;
+    else if(!strcmp(cmd, "status"))
+        control_status(fd);
+    else if(!strcmp(cmd, "set"))
+        control_set(fd, arg[0], arg[1], arg[2]);
+    else if(!strcmp(cmd, "capture") && (arg[0] != NULL) && (!strcmp(arg[0], "on") || !strcmp(arg[0], "off")))
+    {
+        if(config.captureFile == NULL)
+        {
+            control_reply(fd, "error: packet capture is not configured (--capture)\n");
+            return;
+        }
+        Capture_enable(!strcmp(arg[0], "on"));
+        PRINT(LOG_INFO, "Packet capture %s\n", captureEnabled ? "started" : "stopped");
+        control_reply(fd, "ok\n");
+    }
+    else
+        control_reply(fd, "error: unknown command\n");
+}
+
+static void *control_exec(void *arg)
+{
+    while(1)
+    {
+        int fd = accept(listenfd, NULL, NULL);
+        if(fd < 0)
+            continue;
+        struct timeval tv = {.tv_sec = CONTROL_TIMEOUT, .tv_usec = 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        FILE *f = fdopen(fd, "r");
+        if(f == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        char line[CONTROL_LINE_MAX];
+        while(fgets(line, sizeof(line), f) != NULL)
+            control_command(fd, line);
+        fclose(f);
+    }
+    return NULL;
+}
+
+int Control_start(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        PRINT(LOG_ERR, "Control socket path is too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listenfd < 0)
+    {
+        DEBUG(LOG_ERR, "Control socket creation failed");
+        return -1;
+    }
+    unlink(path); //socket left by previous instance
+    mode_t mask = umask(0077); //owner only
+    int ret = bind(listenfd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(mask);
+    if((ret < 0) || (listen(listenfd, 4) < 0))
+    {
+        DEBUG(LOG_ERR, "Control socket creation failed");
+        close(listenfd);
+        return -1;
+    }
+    socketPath = path;
+
+    pthread_t th;
+    if(pthread_create(&th, NULL, &control_exec, NULL) != 0)
+    {
+        PRINT(LOG_ERR, "Control thread creation failed\n");
+        Control_close();
+        return -1;
+    }
+    pthread_detach(th);
+    return 0;
+}
+
+void Control_close()
+{
+    if(socketPath != NULL)
+        unlink(socketPath);
+}
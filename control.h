@@ -0,0 +1,52 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file control.h
+ * @brief Runtime control module
+ *
+ * With --control=path, kiwitun listens on a UNIX stream socket for text commands, one per line.
+ * Each reply ends with a line "ok" or "error: <reason>". Commands:
+ *  status - runtime settings, tunnels and their endpoints
+ *  set ttl <1-255> - outer header TTL/hop limit
+ *  set log-level <0-7> - logging level
+ *  set remote <IPv4 address|any> [tunnel index] - tunnel remote endpoint (the first tunnel by default)
+ *  set local <IPv4 address|any> [tunnel index] - tunnel local endpoint
+ *  capture on|off - start or stop packet capture
+ * TTL and log level changes publish a new runtime settings snapshot (see struct Runtime_s),
+ * endpoint changes go through the tunnel table, so packet processing never waits for the control thread.
+ * Raw sockets are not connected to fixed endpoints when the control socket is enabled, as they couldn't change then.
+*/
+#ifndef CONTROL_H_
+#define CONTROL_H_
+
+#define CONTROL_LINE_MAX 256 //maximum command length
+#define CONTROL_TIMEOUT 5 //client inactivity timeout in seconds
+
+/**
+ * @brief Create control socket and start control thread
+ * @param path Socket path, an existing file is replaced
+ * @return 0 on success, -1 on failure
+**/
+int Control_start(const char *path);
+
+/**
+ * @brief Remove control socket
+**/
+void Control_close();
+
+#endif
@@ -0,0 +1,41 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file drop.c
+ * @brief Packet drop accounting module
+**/
+
+#include "drop.h"
+#include "log.h"
+#include <stdio.h>
+
+static __thread uint32_t dropCount = 0; //drops since the last sampled one (per thread, no shared state)
+
+void Drop_sample(int reason, const uint8_t *packet, int size)
+{
+    static const char *names[DROP_REASONS] = DROP_NAMES;
+    if(++dropCount < config.dropSample)
+        return;
+    dropCount = 0;
+
+    char hex[DROP_SAMPLE_SIZE * 2 + DROP_SAMPLE_SIZE / 4 + 1] = ""; //space after every 4 bytes
+    int len = 0;
+    for(int i = 0; (packet != NULL) && (i < size) && (i < DROP_SAMPLE_SIZE); i++)
+        len += sprintf(&hex[len], ((i % 4) == 3) ? "%02x " : "%02x", (unsigned int)packet[i]);
+    LOG(LOG_INFO, "Dropped packet (%s, %d bytes): %s\n", names[reason], size, hex);
+}
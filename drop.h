@@ -0,0 +1,97 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file drop.h
+ * @brief Packet drop accounting module
+ *
+ * Every place where the datapath discards a packet marks it with DROP(), which counts the drop by reason
+ * in the calling thread counter shard (see stats.h) and fires the kiwitun:drop probe.
+ * With --drop-sample=N, every N-th dropped packet of each thread is logged with a hex dump of its first bytes.
+ * Dropped packets are also passed to the capture ring (see capture.h).
+*/
+#ifndef DROP_H_
+#define DROP_H_
+
+#include <stdint.h>
+#include "common.h"
+#include "probe.h"
+#include "stats.h"
+#include "capture.h"
+
+#define DROP_SAMPLE_SIZE 64 //number of packet bytes dumped for sampled drops
+
+/**
+ * @brief Packet drop reason
+**/
+enum DropReason_e
+{
+    DROP_NOT_IP = 1, //IP version field doesn't match
+    DROP_HEADER_LENGTH, //IPv4 header with options
+    DROP_TOO_SHORT, //packet shorter than headers
+    DROP_LENGTH_MISMATCH, //length field doesn't match packet size
+    DROP_TTL_ZERO, //TTL/hop limit is 0
+    DROP_TTL_EXCEEDED, //TTL/hop limit would reach 0, ICMP Time Exceeded sent
+    DROP_NO_ROUTE, //remote endpoint not known
+    DROP_LOOP, //remote endpoint is inner packet source
+    DROP_NOT_PEER, //remote endpoint or sender is not a configured peer
+    DROP_TOO_BIG, //packet bigger than path MTU and cannot be fragmented
+    DROP_TX_ERROR, //sending encapsulated packet failed
+    DROP_TX_SHORT, //encapsulated packet sent partially
+    DROP_OUTER_CHECKSUM, //outer header checksum mismatch
+    DROP_INNER_CHECKSUM, //inner header checksum mismatch
+    DROP_NO_TUNNEL, //outer addresses don't match any tunnel
+    DROP_SOURCE_NOT_ALLOWED, //inner source address not allowed for peer
+    DROP_WRITE_ERROR, //writing decapsulated packet to TUN interface failed
+    DROP_WRITE_SHORT, //decapsulated packet written partially
+    DROP_BAD_ENCAP_HEADER, //FOU/GUE header doesn't carry IP packet
+    DROP_HOLD_OVERFLOW, //held packet queue full while remote endpoint is being resolved
+    DROP_MODE_DISABLED, //inner protocol belongs to a disabled tunneling mode
+    DROP_REASONS, //number of drop reasons + 1
+};
+
+_Static_assert(DROP_REASONS <= STATS_DROP_REASONS, "Drop reasons don't fit in counter shard");
+
+//drop reason names, in DropReason_e order
+#define DROP_NAMES {"", "not_ip", "header_length", "too_short", "length_mismatch", "ttl_zero", "ttl_exceeded",\
+    "no_route", "loop", "not_peer", "too_big", "tx_error", "tx_short", "outer_checksum", "inner_checksum",\
+    "no_tunnel", "source_not_allowed", "write_error", "write_short", "bad_encap_header", "hold_overflow",\
+    "mode_disabled"}
+
+/**
+ * @brief Log dropped packet if it is the sampled one
+ * @param reason Drop reason
+ * @param packet Dropped packet, NULL if not available
+ * @param size Dropped packet size
+**/
+void Drop_sample(int reason, const uint8_t *packet, int size);
+
+/**
+ * @brief Mark packet drop
+ * @param reason Drop reason (DropReason_e)
+ * @param packet Dropped packet (as far as it is known at the drop site), NULL if not available
+ * @param size Dropped packet size
+**/
+#define DROP(reason, packet, size) {\
+    PROBE3(drop, reason, packet, size);\
+    Stats_drop(reason);\
+    if(__builtin_expect(config.dropSample != 0, 0))\
+        Drop_sample(reason, packet, size);\
+    Capture_drop(reason, packet, size);\
+}
+
+#endif
@@ -0,0 +1,98 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file flow.h
+ * @brief Flow hash module
+ *
+ * Hashes inner packet flow identifiers (addresses, protocol and ports) into a value used to spread flows
+ * over underlay paths and receive queues. All packets of a flow, including fragments, get the same hash.
+*/
+#ifndef FLOW_H_
+#define FLOW_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include "common.h"
+
+/**
+ * @brief Mix 32-bit word into hash
+**/
+static inline uint32_t flow_mix(uint32_t h, uint32_t w)
+{
+    h = (h ^ w) * 0x9E3779B1U; //multiplicative hash
+    return h ^ (h >> 15);
+}
+
+/**
+ * @brief Check if transport protocol has ports in the first 4 bytes
+**/
+static inline int flow_hasPorts(uint8_t protocol)
+{
+    return (protocol == IPPROTO_TCP) || (protocol == IPPROTO_UDP) || (protocol == IPPROTO_SCTP) || (protocol == IPPROTO_UDPLITE);
+}
+
+/**
+ * @brief Calculate flow hash of IP packet
+ * @param packet IPv4 or IPv6 packet
+ * @param size Packet size
+ * @return Flow hash
+ * @attention Packet must contain the whole IP header
+**/
+static inline uint32_t Flow_hash(const uint8_t *packet, int size)
+{
+    uint32_t h = 0, w;
+    if((packet[0] >> 4) == IPVX_HEADER_VERSION_4)
+    {
+        const struct ip *ip = (const struct ip*)packet;
+        int hl = ip->ip_hl * 4;
+        h = flow_mix(h, ip->ip_src.s_addr);
+        h = flow_mix(h, ip->ip_dst.s_addr);
+        h = flow_mix(h, ip->ip_p);
+        //ports are used only when the packet is not a fragment, other fragments don't contain them
+        if(((ip->ip_off & htons(IP_MF | IP_OFFMASK)) == 0) && flow_hasPorts(ip->ip_p) && (size >= (hl + 4)))
+        {
+            memcpy(&w, &packet[hl], sizeof(w));
+            h = flow_mix(h, w);
+        }
+    }
+    else
+    {
+        const struct ip6_hdr *ip6 = (const struct ip6_hdr*)packet;
+        for(int i = 0; i < 4; i++)
+        {
+            h = flow_mix(h, ip6->ip6_src.s6_addr32[i]);
+            h = flow_mix(h, ip6->ip6_dst.s6_addr32[i]);
+        }
+        h = flow_mix(h, ip6->ip6_nxt);
+        //extension headers are not parsed, fragments and packets with extension headers are hashed by addresses only
+        if(flow_hasPorts(ip6->ip6_nxt) && (size >= (IPV6_HEADER_SIZE + 4)))
+        {
+            memcpy(&w, &packet[IPV6_HEADER_SIZE], sizeof(w));
+            h = flow_mix(h, w);
+        }
+    }
+    //final avalanche, so that all bits depend on all inputs
+    h ^= h >> 16;
+    h *= 0x85EBCA6BU;
+    return h ^ (h >> 13);
+}
+
+#endif
@@ -0,0 +1,158 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file fou.c
+ * @brief Foo-over-UDP / GUE encapsulation module
+**/
+
+#include "fou.h"
+#include "flow.h"
+#include "common.h"
+#include "latency.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/udp.h>
+
+#ifndef UDP_GRO
+#define UDP_GRO 104 //older C library headers don't have it, kernel support is checked at runtime
+#endif
+
+int Fou_headerSize()
+{
+    return FOU_UDP_HEADER_SIZE + ((config.encap == ENCAP_GUE) ? FOU_GUE_HEADER_SIZE : 0);
+}
+
+int Fou_buildHeader(uint8_t *hdr, const uint8_t *inner, int size, uint8_t protocol)
+{
+    struct udphdr *udp = (struct udphdr*)hdr;
+    int len = Fou_headerSize();
+    udp->uh_sport = htons(FOU_SOURCE_PORT_MIN + (Flow_hash(inner, size) & FOU_SOURCE_PORT_MASK));
+    udp->uh_dport = htons(config.fouPort);
+    udp->uh_ulen = htons(size + len);
+    udp->uh_sum = 0; //no checksum (RFC 768), inner packet has its own checksums
+    if(config.encap == ENCAP_GUE)
+    {
+        hdr[FOU_UDP_HEADER_SIZE] = 0; //variant 0, not a control message, no optional fields
+        hdr[FOU_UDP_HEADER_SIZE + 1] = protocol;
+        hdr[FOU_UDP_HEADER_SIZE + 2] = 0; //no flags
+        hdr[FOU_UDP_HEADER_SIZE + 3] = 0;
+    }
+    return len;
+}
+
+int Fou_open(in_addr_t local)
+{
+    int s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(s < 0)
+        return -1;
+
+    int enable = 1;
+    if(setsockopt(s, IPPROTO_IP, IP_PKTINFO, &enable, sizeof(enable)) < 0) //outer destination address is needed to find tunnel
+    {
+        close(s);
+        return -1;
+    }
+    if(setsockopt(s, IPPROTO_UDP, UDP_GRO, &enable, sizeof(enable)) < 0) //optional, receive coalesced packets if kernel supports it
+        PRINT(LOG_INFO, "UDP GRO is not supported, encapsulated packets are received one by one\n");
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = local;
+    addr.sin_port = htons(config.fouPort);
+    if(bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+int Fou_receive(int s, uint8_t *buf, int size, in_addr_t *source, in_addr_t *destination, int *segment)
+{
+    struct sockaddr_in from;
+    uint8_t control[CMSG_SPACE(sizeof(struct in_pktinfo)) + CMSG_SPACE(sizeof(int)) + LATENCY_CONTROL_SIZE];
+    struct iovec iov = {.iov_base = buf, .iov_len = size};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &from;
+    msg.msg_namelen = sizeof(from);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int received = recvmsg(s, &msg, 0);
+    if(received < 0)
+        return -1;
+
+    *source = from.sin_addr.s_addr;
+    *destination = INADDR_ANY;
+    *segment = received; //not coalesced
+    latencyStart = 0;
+    for(struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c))
+    {
+        if((c->cmsg_level == IPPROTO_IP) && (c->cmsg_type == IP_PKTINFO))
+        {
+            struct in_pktinfo info;
+            memcpy(&info, CMSG_DATA(c), sizeof(info));
+            *destination = info.ipi_addr.s_addr; //header destination address
+        }
+        else if((c->cmsg_level == IPPROTO_UDP) && (c->cmsg_type == UDP_GRO))
+        {
+            int gso;
+            memcpy(&gso, CMSG_DATA(c), sizeof(gso));
+            if(gso > 0)
+                *segment = gso;
+        }
+        else if(config.latency && (c->cmsg_level == SOL_SOCKET)) //receive timestamp
+            latencyStart = Latency_parse(c);
+    }
+    return received;
+}
+
+uint8_t* Fou_parse(uint8_t *payload, int *size, uint8_t *protocol)
+{
+    if(*size < 1)
+        return NULL;
+
+    //GUE variant 0 header, variant 1 is an IP packet directly (first bits of IPv4 and IPv6 version field are 01)
+    if((config.encap == ENCAP_GUE) && ((payload[0] >> 6) == 0))
+    {
+        if((*size < FOU_GUE_HEADER_SIZE) || (payload[0] & 0x20)) //too short or control message
+            return NULL;
+        int len = FOU_GUE_HEADER_SIZE + (payload[0] & 0x1F) * 4; //header with optional fields
+        if(*size < len)
+            return NULL;
+        if((payload[1] != IPV4_HEADER_PROTO_IPIP) && (payload[1] != IPV4_HEADER_PROTO_IP6IP))
+            return NULL;
+        *protocol = payload[1];
+        *size -= len;
+        return &payload[len];
+    }
+
+    //FOU or GUE variant 1: inner protocol is given by IP version
+    if((payload[0] >> 4) == IPVX_HEADER_VERSION_4)
+        *protocol = IPV4_HEADER_PROTO_IPIP;
+    else if((payload[0] >> 4) == IPVX_HEADER_VERSION_6)
+        *protocol = IPV4_HEADER_PROTO_IP6IP;
+    else
+        return NULL;
+    return payload;
+}
@@ -0,0 +1,85 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file fou.h
+ * @brief Foo-over-UDP / GUE encapsulation module
+ *
+ * In FOU mode the inner packet directly follows the outer UDP header. In GUE mode a 4-byte GUE header
+ * (variant 0, no optional fields) carrying the inner protocol number is placed between them.
+ * The UDP source port is derived from the inner flow hash, so that the underlay (ECMP) and the remote endpoint NIC (RSS)
+ * spread flows over paths and receive queues. UDP checksum is not used (zero) for IPv4 underlay.
+ * Received packets are coalesced by kernel (UDP GRO) when supported and split back into segments here.
+*/
+#ifndef FOU_H_
+#define FOU_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define FOU_DEFAULT_PORT 5555 //default UDP destination port
+#define FOU_UDP_HEADER_SIZE 8 //UDP header size
+#define FOU_GUE_HEADER_SIZE 4 //GUE header size (without optional fields)
+#define FOU_MAX_HEADER_SIZE (FOU_UDP_HEADER_SIZE + FOU_GUE_HEADER_SIZE) //maximum size of headers following outer IP header
+#define FOU_SOURCE_PORT_MIN 49152 //flow source ports are taken from the dynamic port range 49152-65535
+#define FOU_SOURCE_PORT_MASK 0x3FFF //flow source port range size - 1
+
+/**
+ * @brief Get size of headers following outer IP header
+ * @return UDP (and GUE) header size
+**/
+int Fou_headerSize();
+
+/**
+ * @brief Build UDP (and GUE) header for inner packet
+ * @param hdr Header buffer (at least FOU_MAX_HEADER_SIZE bytes)
+ * @param inner Inner packet
+ * @param size Inner packet size
+ * @param protocol Inner packet protocol (IPV4_HEADER_PROTO_IPIP or IPV4_HEADER_PROTO_IP6IP)
+ * @return Header size
+**/
+int Fou_buildHeader(uint8_t *hdr, const uint8_t *inner, int size, uint8_t protocol);
+
+/**
+ * @brief Open UDP socket receiving encapsulated packets
+ * @param local Local address to bind to, INADDR_ANY for all addresses
+ * @return Socket descriptor or -1 on failure
+**/
+int Fou_open(in_addr_t local);
+
+/**
+ * @brief Receive encapsulated packets
+ * @param s UDP socket descriptor
+ * @param buf Buffer
+ * @param size Buffer size
+ * @param source Outer source address
+ * @param destination Outer destination address
+ * @param segment Size of coalesced segments (UDP payload of each received packet), the last one can be shorter
+ * @return Number of bytes received or -1 on failure
+**/
+int Fou_receive(int s, uint8_t *buf, int size, in_addr_t *source, in_addr_t *destination, int *segment);
+
+/**
+ * @brief Get inner packet from received UDP payload
+ * @param payload UDP payload
+ * @param size UDP payload size, inner packet size on return
+ * @param protocol Inner packet protocol (IPV4_HEADER_PROTO_IPIP or IPV4_HEADER_PROTO_IP6IP)
+ * @return Inner packet or NULL if the payload doesn't contain an IP packet
+**/
+uint8_t* Fou_parse(uint8_t *payload, int *size, uint8_t *protocol);
+
+#endif
@@ -16,7 +16,93 @@
 */
 
 #include "icmp.h"
+#include "checksum.h"
+#include "log.h"
+#include "stats.h"
 #include <sys/socket.h>
+#include <arpa/inet.h>
+#include <time.h>
+
+#define ICMP_LIMIT_SLOTS 4096 //number of per-destination rate limit slots (must be a power of 2)
+
+/*
+ * Token buckets are implemented as GCRA (virtual scheduling): a bucket is just the theoretical arrival time (TAT)
+ * of the next message. A message is allowed if TAT is at most (burst - 1) intervals in the future, then TAT advances
+ * by one interval. This is equivalent to a token bucket, but needs a single word per bucket, updated with compare-and-swap.
+ * Per-destination slots hold destination key (bits 63-32) and TAT in milliseconds modulo 2^32 (bits 31-0).
+ * Colliding destinations evict each other, the global bucket still limits the total rate.
+*/
+static uint64_t limits[ICMP_LIMIT_SLOTS]; //per-destination buckets
+static uint64_t globalTat = 0; //global bucket TAT in nanoseconds
+
+/**
+ * @brief Get current monotonic time in nanoseconds
+**/
+static inline uint64_t icmp_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Check per-destination and global rate limits and take a token from both
+ * @param key Destination key (IPv4 address or IPv6 address hash)
+ * @param family Inner packet family (STATS_IPV4 or STATS_IPV6), for counters
+ * @return 1 if the error can be sent, 0 if it must be suppressed
+ * @attention Suppressed errors are counted in the calling thread counter shard, so they write no shared memory
+**/
+static int icmp_allow(uint32_t key, int family)
+{
+    uint64_t now = icmp_now();
+
+    if(config.icmpInterval != 0)
+    {
+        uint64_t *slot = &limits[((key * 2654435761U) >> 16) & (ICMP_LIMIT_SLOTS - 1)]; //multiplicative hash
+        uint32_t nowMs = now / 1000000;
+        uint32_t tolerance = (uint32_t)(config.icmpBurst - 1) * config.icmpInterval;
+        uint64_t s = __atomic_load_n(slot, __ATOMIC_RELAXED);
+        while(1)
+        {
+            uint32_t tat = nowMs;
+            if((uint32_t)(s >> 32) == key)
+            {
+                uint32_t ahead = (uint32_t)s - nowMs; //how far TAT is in the future, modulo 2^32
+                if(ahead <= tolerance) //within burst
+                    tat = (uint32_t)s;
+                else if(ahead <= (tolerance + config.icmpInterval)) //burst used up
+                {
+                    Stats_add(family, STATS_ICMP_LIMITED, 1);
+                    return 0;
+                }
+                //otherwise TAT is in the past (bucket is full)
+            }
+            uint64_t n = ((uint64_t)key << 32) | (uint32_t)(tat + config.icmpInterval);
+            if(__atomic_compare_exchange_n(slot, &s, n, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+    }
+
+    if(config.icmpRate != 0)
+    {
+        uint64_t interval = 1000000000ULL / config.icmpRate;
+        uint64_t tolerance = (ICMP_GLOBAL_BURST - 1) * interval;
+        uint64_t tat = __atomic_load_n(&globalTat, __ATOMIC_RELAXED);
+        while(1)
+        {
+            if(tat > (now + tolerance))
+            {
+                Stats_add(family, STATS_ICMP_GLOBAL_LIMITED, 1);
+                return 0;
+            }
+            if(__atomic_compare_exchange_n(&globalTat, &tat, ((tat > now) ? tat : now) + interval, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+    }
+
+    Stats_add(family, STATS_ICMP_SENT, 1);
+    return 1;
+}
 
 /**
  * @brief Calculate ICMP packet checksum
@@ -27,23 +113,9 @@
 **/
 int icmp_checksum(uint8_t *buf, uint16_t size)
 {
-    uint32_t sum = 0;
-    for(uint16_t i = 0; i < size; i += 2) //group data in 16-bit words
-    {
-        if(i == ICMP_HEADER_CHECKSUM_POS) //skip checksum field itself (treat is a 0x0000)
-            continue;
-
-        sum += (((uint32_t)buf[i] << 8) | (uint32_t)buf[i + 1]); //convert to 16-bit words and add to the sum
-    }
-    sum = (sum & 0xFFFF) + (sum >> 16); //cut carry bits, shift them and add to the checksum
-    if(sum & 0x10000) //check if addition generated carry bit
-    {
-        sum &= 0xFFFF; //if so, remove it
-        sum++; //and add one to the checksum
-    }
-    sum = ~sum; //bitwise negate (one's complement)
-    buf[ICMP_HEADER_CHECKSUM_POS] = (sum >> 8) & 0xFF; //store checksum
-    buf[ICMP_HEADER_CHECKSUM_POS + 1] = sum & 0xFF;
+    struct icmphdr *icmp = (struct icmphdr*)buf;
+    icmp->checksum = 0; //checksum field itself is treated as 0x0000
+    icmp->checksum = Checksum_compute(buf, size); //store checksum
 
     return 0;
 }
@@ -63,32 +135,15 @@ int icmp_checksum6(uint8_t *buf, uint16_t size)
     phdr.ip6_src = hdr->ip6_src; //fill pseudo-header
     phdr.ip6_dst = hdr->ip6_dst;
     phdr.ip6_next = hdr->ip6_nxt;
-    phdr.ip6_len = hdr->ip6_plen;
+    phdr.ip6_len = htonl(ntohs(hdr->ip6_plen));
     memset(&(phdr.zeros), 0, sizeof(phdr.zeros));
 
-    uint32_t sum = 0; //calculated checksum
+    struct icmp6_hdr *icmp = (struct icmp6_hdr*)(&(buf[IPV6_HEADER_SIZE]));
+    icmp->icmp6_cksum = 0; //checksum field itself is treated as 0x0000
 
-    for(uint8_t i = 0; i < sizeof(phdr); i += 2) //calculate for pseudo IP header
-    {
-       sum += (((uint32_t)(((uint8_t*)&phdr)[i])) << 8) | (uint32_t)(((uint8_t*)&phdr)[i + 1]); //convert to 16-bit words and add to the sum 
-    }
-
-    for(uint16_t i = IPV6_HEADER_SIZE; i < size; i += 2) //group data in 16-bit words (skip real IP header)
-    {
-        if(i == (ICMP_HEADER_CHECKSUM_POS + IPV6_HEADER_SIZE)) //skip checksum field itself (treat is a 0x0000)
-            continue;
-
-        sum += ((((uint32_t)buf[i]) << 8) | (uint32_t)buf[i + 1]); //convert to 16-bit words and add to the sum
-    }
-    sum = (sum & 0xFFFF) + (sum >> 16); //cut carry bits, shift them and add to the checksum
-    if(sum & 0x10000) //check if addition generated carry bit
-    {
-        sum &= 0xFFFF; //if so, remove it
-        sum++; //and add one to the checksum
-    }
-    sum = ~sum; //bitwise negate (one's complement)
-    buf[IPV6_HEADER_SIZE + ICMP_HEADER_CHECKSUM_POS] = (sum >> 8) & 0xFF; //store checksum
-    buf[IPV6_HEADER_SIZE + ICMP_HEADER_CHECKSUM_POS + 1] = sum & 0xFF;
+    uint64_t sum = Checksum_partial(&phdr, sizeof(phdr), 0); //pseudo IP header
+    sum = Checksum_partial(&(buf[IPV6_HEADER_SIZE]), size - IPV6_HEADER_SIZE, sum); //ICMPv6 header and data (skip real IP header)
+    icmp->icmp6_cksum = Checksum_finish(sum); //store checksum
 
     return 0;
 }
@@ -98,9 +153,13 @@ int ICMP_send(int s, uint8_t *data, int size, in_addr_t source, uint8_t type, ui
     uint8_t buf[2 * IPV4_HEADER_SIZE + ICMP_HEADER_SIZE + ICMP_ADDITIONAL_DATA_SIZE]; //prepare buffer
     if(size < (IPV4_HEADER_SIZE + ICMP_ADDITIONAL_DATA_SIZE)) //check if there is enough data to send ICMP message
     {
-        PRINT(LOG_DEBUG, "Not enough data to send ICMP message\n");
+        LOG(LOG_DEBUG, "Not enough data to send ICMP message\n");
         return -1;
     }
+
+    //path MTU discovery must not be limited
+    if(!((type == ICMP_DEST_UNREACH) && (code == ICMP_FRAG_NEEDED)) && !icmp_allow(((struct ip*)data)->ip_src.s_addr, STATS_IPV4))
+        return 0;
     
     memcpy(buf, data, IPV4_HEADER_SIZE); //copy IP header
     struct ip *hdr = (struct ip*)buf; //get header
@@ -133,12 +192,12 @@ int ICMP_send(int s, uint8_t *data, int size, in_addr_t source, uint8_t type, ui
 
     if(sent < 0) //error
     {
-        DEBUG(LOG_ERR, "ICMP packet TX failed");
+        LOG_ERRNO(LOG_ERR, "ICMP packet TX failed");
         return -1;
     }
     else if(sent != (2 * IPV4_HEADER_SIZE + ICMP_HEADER_SIZE + ICMP_ADDITIONAL_DATA_SIZE)) //number of bytes actually sent is different than number of bytes to be sent
     {
-        PRINT(LOG_WARNING, "ICMP packet TX problem: %d bytes to send, %d actually sent\n", 2 * IPV4_HEADER_SIZE + ICMP_HEADER_SIZE + ICMP_ADDITIONAL_DATA_SIZE, sent);
+        LOG(LOG_WARNING, "ICMP packet TX problem: %d bytes to send, %d actually sent\n", 2 * IPV4_HEADER_SIZE + ICMP_HEADER_SIZE + ICMP_ADDITIONAL_DATA_SIZE, sent);
         return -1;
     }
 
@@ -149,12 +208,24 @@ int ICMP_send(int s, uint8_t *data, int size, in_addr_t source, uint8_t type, ui
 
 int ICMP_send6(int s, uint8_t *data, int size, struct in6_addr source, uint8_t type, uint8_t code, uint32_t rest)
 {
-    uint8_t buf[2 * IPV6_HEADER_SIZE + ICMP_HEADER_SIZE + ICMP_ADDITIONAL_DATA_SIZE]; //prepare buffer
+    uint8_t buf[IPV6_MIN_MTU]; //prepare buffer
     if(size < (IPV6_HEADER_SIZE + ICMP_ADDITIONAL_DATA_SIZE)) //check if there is enough data to send ICMP message
     {
-        PRINT(LOG_ERR, "Not enough data to send ICMP message\n");
+        LOG(LOG_ERR, "Not enough data to send ICMP message\n");
         return -1;
     }
+
+    const struct in6_addr *dst = &(((struct ip6_hdr*)data)->ip6_src);
+    //path MTU discovery must not be limited
+    if((type != ICMP6_PACKET_TOO_BIG) && !icmp_allow(dst->s6_addr32[0] ^ dst->s6_addr32[1] ^ dst->s6_addr32[2] ^ dst->s6_addr32[3], STATS_IPV6))
+        return 0;
+
+    //include as much of the original packet as fits in the minimum IPv6 MTU (RFC 4443),
+    //so that upper layer headers behind extension headers (e.g. fragment header) are included
+    int quoted = size;
+    if(quoted > (IPV6_MIN_MTU - IPV6_HEADER_SIZE - ICMP_HEADER_SIZE))
+        quoted = IPV6_MIN_MTU - IPV6_HEADER_SIZE - ICMP_HEADER_SIZE;
+    int total = IPV6_HEADER_SIZE + ICMP_HEADER_SIZE + quoted;
     
     memcpy(buf, data, IPV6_HEADER_SIZE); //copy IP header
     struct ip6_hdr *hdr = (struct ip6_hdr*)buf; //get header
@@ -166,35 +237,35 @@ int ICMP_send6(int s, uint8_t *data, int size, struct in6_addr source, uint8_t t
     hdr->ip6_src = source; //store soure IP
     hdr->ip6_ctlun.ip6_un2_vfc = (IPVX_HEADER_VERSION_6 << 4); //to be sure
     hdr->ip6_ctlun.ip6_un1.ip6_un1_hlim = ICMP_DEFAULT_TTL; //hop limit
-    hdr->ip6_ctlun.ip6_un1.ip6_un1_plen = htons(ICMP_HEADER_SIZE + IPV6_HEADER_SIZE + ICMP_ADDITIONAL_DATA_SIZE);
+    hdr->ip6_ctlun.ip6_un1.ip6_un1_plen = htons(ICMP_HEADER_SIZE + quoted);
 
     struct icmp6_hdr *icmp = (struct icmp6_hdr*)(&(buf[IPV6_HEADER_SIZE])); //get ICMP header
     icmp->icmp6_type = type; //set type
     icmp->icmp6_code = code; //set code
     icmp->icmp6_dataun.icmp6_un_data32[0] = rest; //set rest of data
     icmp->icmp6_cksum = 0; //zero-out before calculation
-    memcpy(&(buf[IPV6_HEADER_SIZE + ICMP_HEADER_SIZE]), data, IPV6_HEADER_SIZE + ICMP_ADDITIONAL_DATA_SIZE); //copy original packet header and first 8 bytes
-    icmp_checksum6(buf, ICMP_HEADER_SIZE + 2 * IPV6_HEADER_SIZE + ICMP_ADDITIONAL_DATA_SIZE); //calculate and insert ICMPv6 checksum
+    memcpy(&(buf[IPV6_HEADER_SIZE + ICMP_HEADER_SIZE]), data, quoted); //copy original packet
+    icmp_checksum6(buf, total); //calculate and insert ICMPv6 checksum
     
     struct sockaddr_in6 dest; //prepare structure for sendto()
     memset(&dest, 0, sizeof(dest));
     dest.sin6_family = AF_INET6;
     dest.sin6_addr = hdr->ip6_dst; //copy address
 
-    int sent = sendto(s, buf, 2 * IPV6_HEADER_SIZE + ICMP_HEADER_SIZE + ICMP_ADDITIONAL_DATA_SIZE, 0, (struct sockaddr*)(&dest), sizeof(dest)); //send packet
+    int sent = sendto(s, buf, total, 0, (struct sockaddr*)(&dest), sizeof(dest)); //send packet
 
     if(sent < 0) //error
     {
-        DEBUG(LOG_ERR, "ICMPv6 packet TX failed");
+        LOG_ERRNO(LOG_ERR, "ICMPv6 packet TX failed");
         return -1;
     }
-    else if(sent != (2 * IPV6_HEADER_SIZE + ICMP_HEADER_SIZE + ICMP_ADDITIONAL_DATA_SIZE)) //number of bytes actually sent is different than number of bytes to be sent
+    else if(sent != total) //number of bytes actually sent is different than number of bytes to be sent
     {
-        PRINT(LOG_WARNING, "ICMPv6 packet TX problem: %d bytes to send, %d actually sent\n", 2 * IPV6_HEADER_SIZE + ICMP_HEADER_SIZE + ICMP_ADDITIONAL_DATA_SIZE, sent);
+        LOG(LOG_WARNING, "ICMPv6 packet TX problem: %d bytes to send, %d actually sent\n", total, sent);
         return -1;
     }
 
     return 0;
 
 
-}
\ No newline at end of file
+}
@@ -20,6 +20,10 @@
  * @brief ICMP module
  * 
  * Routines for sending ICMP and ICMPv6 packets.
+ *
+ * ICMP errors are rate limited like in the kernel (icmp_ratelimit, icmp_msgs_per_sec): each destination has its own
+ * token bucket and all destinations share a global one. Fragmentation Needed and Packet Too Big are not limited,
+ * as path MTU discovery depends on them. Suppressed errors cost a single hash table probe.
 */
 
 #ifndef ICMP_H_
@@ -33,6 +37,11 @@
 #include <netinet/in.h>
 #include "common.h"
 
+#define ICMP_DEFAULT_INTERVAL 1000 //default interval between ICMP errors to one destination in milliseconds
+#define ICMP_DEFAULT_BURST 6 //default number of ICMP errors to one destination sent back-to-back
+#define ICMP_DEFAULT_RATE 1000 //default global ICMP error rate limit in messages per second
+#define ICMP_GLOBAL_BURST 50 //number of ICMP errors sent back-to-back before the global limit applies
+
 /**
  * @brief Send ICMP(v4) response for given IPv4 packet 
  * @param s Raw IP (!) socket handler
@@ -42,7 +51,7 @@
  * @param type ICMP response type
  * @param code ICMP response code
  * @param rest ICMP respose rest of header (or 0 if not used)
- * @return 0 on success, -1 on failure
+ * @return 0 on success (also when the error is suppressed by rate limiting), -1 on failure
  * @warning Sanity check of input IPv4 packet is the responsibility of a caller.
 **/
 int ICMP_send(int s, uint8_t *data, int size, in_addr_t source, uint8_t type, uint8_t code, uint32_t rest);
@@ -56,7 +65,7 @@ int ICMP_send(int s, uint8_t *data, int size, in_addr_t source, uint8_t type, ui
  * @param type ICMP response type
  * @param code ICMP response code
  * @param rest ICMP respose rest of header (or 0 if not used)
- * @return 0 on success, -1 on failure
+ * @return 0 on success (also when the error is suppressed by rate limiting), -1 on failure
  * @warning Sanity check of input IPv6 packet is the responsibility of a caller.
 **/
 int ICMP_send6(int s, uint8_t *data, int size, struct in6_addr source, uint8_t type, uint8_t code, uint32_t rest);
@@ -0,0 +1,556 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file ipfix.c
+ * @brief Flow export module
+ *
+ * Flow caches are direct-mapped and owned by their threads, so they are updated without locks or atomics.
+ * A thread checks all its flows for expiry once per second, when it accounts a packet.
+ * Expired flows are copied into the thread export ring (single producer, single consumer, as in log.c),
+ * the export thread builds IPFIX messages from them and sends a message when it is full or a second old.
+ * There are four templates, one for each combination of inner and remote endpoint address families.
+ * Templates are sent in the first message and again every IPFIX_TEMPLATE_INTERVAL seconds, as required for UDP.
+ * The remote endpoint is exported as ipNextHopIPv4Address/ipNextHopIPv6Address in both directions,
+ * ICMP type and code as destinationTransportPort (type * 256 + code).
+**/
+
+#include "ipfix.h"
+#include "common.h"
+#include "flow.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#define IPFIX_VERSION 10 //IPFIX message version
+#define IPFIX_SET_TEMPLATE 2 //template set ID
+#define IPFIX_TEMPLATE_ID 256 //first template ID
+#define IPFIX_TEMPLATE_FIELDS 12 //number of fields in each template
+#define IPFIX_HEADER_SIZE 16 //message header size
+#define IPFIX_MESSAGE_SIZE 1400 //maximum message size, so that messages are not fragmented
+#define IPFIX_TEMPLATE_INTERVAL 60 //template retransmission interval in seconds
+#define IPFIX_FLUSH_INTERVAL 1000 //maximum time between first record in a message and sending it in milliseconds
+#define IPFIX_POLL_INTERVAL 100 //export thread sleep time when all rings are empty in milliseconds
+
+//flowEndReason values
+#define IPFIX_END_IDLE 1 //idle timeout
+#define IPFIX_END_ACTIVE 2 //active timeout
+#define IPFIX_END_RESOURCES 5 //cache slot taken by another flow
+
+//flowDirection values
+#define IPFIX_INGRESS 0 //decapsulated packets
+#define IPFIX_EGRESS 1 //encapsulated packets
+
+/**
+ * @brief Flow key
+**/
+struct IpfixKey_s
+{
+    uint8_t source[16]; //inner source address (IPv4 address in the first 4 bytes)
+    uint8_t destination[16]; //inner destination address
+    uint8_t remote[16]; //remote endpoint address
+    uint16_t sourcePort; //inner source port, 0 if none
+    uint16_t destinationPort; //inner destination port or ICMP type and code, 0 if none
+    uint8_t family; //inner address family (AF_INET or AF_INET6)
+    uint8_t remoteFamily; //remote endpoint address family
+    uint8_t protocol; //inner transport protocol
+    uint8_t direction; //IPFIX_INGRESS or IPFIX_EGRESS
+};
+
+/**
+ * @brief Flow cache entry / exported flow
+**/
+struct IpfixFlow_s
+{
+    struct IpfixKey_s key;
+    uint64_t packets; //number of packets, 0 if the cache slot is empty
+    uint64_t bytes; //number of inner packet bytes
+    uint64_t start; //first packet time in milliseconds since UNIX epoch
+    uint64_t end; //last packet time in milliseconds since UNIX epoch
+    uint8_t reason; //flowEndReason
+};
+
+/**
+ * @brief Per-thread flow cache and export ring
+**/
+struct IpfixCache_s
+{
+    uint32_t head __attribute__((aligned(64))); //next ring entry to write, written by producer only
+    uint32_t tail __attribute__((aligned(64))); //next ring entry to read, written by consumer only
+    uint64_t dropped; //number of flows dropped because the ring was full
+    uint64_t sweep; //time of the last expiry check in seconds
+    struct IpfixCache_s *next; //next cache in cache list
+    struct IpfixFlow_s ring[IPFIX_RING_SIZE]; //expired flows
+    struct IpfixFlow_s flows[IPFIX_CACHE_SIZE]; //active flows
+};
+
+/**
+ * @brief IPFIX message being built
+**/
+struct IpfixMessage_s
+{
+    uint8_t data[IPFIX_MESSAGE_SIZE];
+    int size; //message size, 0 if no message is being built
+    int set; //current data set offset, 0 if none
+    uint16_t setId; //current data set template ID
+    uint32_t records; //number of data records in message
+    uint64_t deadline; //time to send message in milliseconds
+};
+
+uint8_t ipfixEnabled = 0;
+__thread const uint8_t *ipfixPacket = NULL;
+static __thread int ipfixSize = 0; //marked inner packet size
+static __thread uint32_t ipfixCount = 0; //packets since the last sampled one
+static __thread uint8_t ipfixRemoteFamily = AF_INET; //remote endpoint of packets being decapsulated
+static __thread uint8_t ipfixRemote[16];
+static __thread struct IpfixCache_s *cache = NULL; //calling thread cache
+static struct IpfixCache_s *caches = NULL; //all caches
+static int sock = -1; //collector socket
+
+/**
+ * @brief Get current time in milliseconds since UNIX epoch
+**/
+static inline uint64_t ipfix_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Decide whether the packet being processed by calling thread is accounted (every n-th packet)
+ * @return 1 if the packet is accounted, 0 otherwise
+**/
+static inline int ipfix_sample()
+{
+    if(++ipfixCount < config.flowSample)
+        return 0;
+    ipfixCount = 0;
+    return 1;
+}
+
+/**
+ * @brief Get calling thread cache, allocate it on first use
+ * @return Cache or NULL on failure
+**/
+static struct IpfixCache_s* ipfix_cache()
+{
+    struct IpfixCache_s *c = cache;
+    if(c == NULL)
+    {
+        c = calloc(1, sizeof(*c));
+        if(c == NULL)
+            return NULL;
+        c->next = __atomic_load_n(&caches, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&caches, &(c->next), c, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+        cache = c;
+    }
+    return c;
+}
+
+/**
+ * @brief Pass flow to export thread and free its cache slot
+**/
+static void ipfix_expire(struct IpfixCache_s *c, struct IpfixFlow_s *f, uint8_t reason)
+{
+    uint32_t head = c->head;
+    if((head - __atomic_load_n(&(c->tail), __ATOMIC_ACQUIRE)) == IPFIX_RING_SIZE) //full
+        __atomic_fetch_add(&(c->dropped), 1, __ATOMIC_RELAXED);
+    else
+    {
+        struct IpfixFlow_s *e = &(c->ring[head & (IPFIX_RING_SIZE - 1)]);
+        *e = *f;
+        e->reason = reason;
+        __atomic_store_n(&(c->head), head + 1, __ATOMIC_RELEASE); //publish flow
+    }
+    f->packets = 0;
+}
+
+/**
+ * @brief Expire flows that reached idle or active timeout
+**/
+static void ipfix_sweep(struct IpfixCache_s *c, uint64_t now)
+{
+    for(int i = 0; i < IPFIX_CACHE_SIZE; i++)
+    {
+        struct IpfixFlow_s *f = &(c->flows[i]);
+        if(f->packets == 0)
+            continue;
+        if((now - f->end) >= (uint64_t)config.flowIdle * 1000)
+            ipfix_expire(c, f, IPFIX_END_IDLE);
+        else if((now - f->start) >= (uint64_t)config.flowActive * 1000)
+            ipfix_expire(c, f, IPFIX_END_ACTIVE);
+    }
+}
+
+/**
+ * @brief Get flow key of inner packet
+ * @attention Packet must contain the whole IP header
+**/
+static void ipfix_key(struct IpfixKey_s *key, const uint8_t *packet, int size)
+{
+    memset(key, 0, sizeof(*key)); //keys are compared with memcmp()
+    int hl; //header size
+    uint8_t icmp;
+    if((packet[0] >> 4) == IPVX_HEADER_VERSION_4)
+    {
+        const struct ip *ip = (const struct ip*)packet;
+        key->family = AF_INET;
+        memcpy(key->source, &(ip->ip_src), 4);
+        memcpy(key->destination, &(ip->ip_dst), 4);
+        key->protocol = ip->ip_p;
+        if(ip->ip_off & htons(IP_MF | IP_OFFMASK)) //fragments are accounted by addresses only, as in Flow_hash()
+            return;
+        hl = ip->ip_hl * 4;
+        icmp = IPPROTO_ICMP;
+    }
+    else
+    {
+        const struct ip6_hdr *ip6 = (const struct ip6_hdr*)packet;
+        key->family = AF_INET6;
+        memcpy(key->source, &(ip6->ip6_src), 16);
+        memcpy(key->destination, &(ip6->ip6_dst), 16);
+        key->protocol = ip6->ip6_nxt; //extension headers are not parsed
+        hl = IPV6_HEADER_SIZE;
+        icmp = IPPROTO_ICMPV6;
+    }
+    if(flow_hasPorts(key->protocol) && (size >= (hl + 4)))
+    {
+        key->sourcePort = (packet[hl] << 8) | packet[hl + 1];
+        key->destinationPort = (packet[hl + 2] << 8) | packet[hl + 3];
+    }
+    else if((key->protocol == icmp) && (size >= (hl + 2)))
+        key->destinationPort = (packet[hl] << 8) | packet[hl + 1]; //type and code
+}
+
+/**
+ * @brief Account packet in calling thread cache
+ * @param packet Inner packet
+ * @param size Inner packet size
+ * @param direction IPFIX_INGRESS or IPFIX_EGRESS
+ * @param family Remote endpoint address family
+ * @param remote Remote endpoint address
+**/
+static void ipfix_account(const uint8_t *packet, int size, uint8_t direction, int family, const void *remote)
+{
+    struct IpfixCache_s *c = ipfix_cache();
+    if(c == NULL)
+        return;
+
+    struct IpfixKey_s key;
+    ipfix_key(&key, packet, size);
+    key.direction = direction;
+    key.remoteFamily = family;
+    memcpy(key.remote, remote, (family == AF_INET) ? 4 : 16);
+    uint32_t h = Flow_hash(packet, size);
+    for(int i = 0; i < 16; i += 4)
+    {
+        uint32_t w;
+        memcpy(&w, &(key.remote[i]), 4);
+        h = flow_mix(h, w);
+    }
+    h = flow_mix(h, direction);
+
+    uint64_t now = ipfix_now();
+    struct IpfixFlow_s *f = &(c->flows[h & (IPFIX_CACHE_SIZE - 1)]);
+    if((f->packets != 0) && memcmp(&(f->key), &key, sizeof(key))) //colliding flow is exported early
+        ipfix_expire(c, f, IPFIX_END_RESOURCES);
+    if(f->packets == 0)
+    {
+        f->key = key;
+        f->bytes = 0;
+        f->start = now;
+    }
+    f->packets += config.flowSample;
+    f->bytes += (uint64_t)size * config.flowSample;
+    f->end = now;
+
+    if((now / 1000) != c->sweep) //once per second
+    {
+        c->sweep = now / 1000;
+        ipfix_sweep(c, now);
+    }
+}
+
+void Ipfix_packetRead(const uint8_t *packet, int size)
+{
+    ipfixPacket = ipfix_sample() ? packet : NULL;
+    ipfixSize = size;
+}
+
+void Ipfix_packetSent(int family, const void *remote)
+{
+    const uint8_t *packet = ipfixPacket;
+    ipfixPacket = NULL; //fragments are accounted once
+    ipfix_account(packet, ipfixSize, IPFIX_EGRESS, family, remote);
+}
+
+void Ipfix_packetReceived(int family, const void *remote)
+{
+    ipfixRemoteFamily = family;
+    memcpy(ipfixRemote, remote, (family == AF_INET) ? 4 : 16);
+}
+
+void Ipfix_packetWritten(const uint8_t *packet, int size)
+{
+    if(ipfix_sample())
+        ipfix_account(packet, size, IPFIX_INGRESS, ipfixRemoteFamily, ipfixRemote);
+}
+
+static inline uint8_t* ipfix_put16(uint8_t *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value;
+    return p + 2;
+}
+
+static inline uint8_t* ipfix_put32(uint8_t *p, uint32_t value)
+{
+    p = ipfix_put16(p, value >> 16);
+    return ipfix_put16(p, value);
+}
+
+static inline uint8_t* ipfix_put64(uint8_t *p, uint64_t value)
+{
+    p = ipfix_put32(p, value >> 32);
+    return ipfix_put32(p, value);
+}
+
+static inline uint16_t ipfix_templateId(int family, int remoteFamily)
+{
+    return IPFIX_TEMPLATE_ID + ((family == AF_INET6) ? 2 : 0) + ((remoteFamily == AF_INET6) ? 1 : 0);
+}
+
+/**
+ * @brief Get data record size
+**/
+static inline int ipfix_recordSize(int family, int remoteFamily)
+{
+    return ((family == AF_INET) ? 8 : 32) + 6 + ((remoteFamily == AF_INET) ? 4 : 16) + 33;
+}
+
+/**
+ * @brief Put template record, fields are in the order written by ipfix_record()
+ * @return Pointer after template record
+**/
+static uint8_t* ipfix_template(uint8_t *p, int family, int remoteFamily)
+{
+    uint16_t a = (family == AF_INET) ? 4 : 16, r = (remoteFamily == AF_INET) ? 4 : 16;
+    const uint16_t fields[IPFIX_TEMPLATE_FIELDS][2] = {
+        {(family == AF_INET) ? 8 : 27, a}, //sourceIPv4Address/sourceIPv6Address
+        {(family == AF_INET) ? 12 : 28, a}, //destinationIPv4Address/destinationIPv6Address
+        {7, 2}, //sourceTransportPort
+        {11, 2}, //destinationTransportPort
+        {4, 1}, //protocolIdentifier
+        {61, 1}, //flowDirection
+        {(remoteFamily == AF_INET) ? 15 : 62, r}, //ipNextHopIPv4Address/ipNextHopIPv6Address
+        {152, 8}, //flowStartMilliseconds
+        {153, 8}, //flowEndMilliseconds
+        {2, 8}, //packetDeltaCount
+        {1, 8}, //octetDeltaCount
+        {136, 1}, //flowEndReason
+    };
+    p = ipfix_put16(p, ipfix_templateId(family, remoteFamily));
+    p = ipfix_put16(p, IPFIX_TEMPLATE_FIELDS);
+    for(int i = 0; i < IPFIX_TEMPLATE_FIELDS; i++)
+    {
+        p = ipfix_put16(p, fields[i][0]);
+        p = ipfix_put16(p, fields[i][1]);
+    }
+    return p;
+}
+
+/**
+ * @brief Put data record
+ * @return Pointer after data record
+**/
+static uint8_t* ipfix_record(uint8_t *p, const struct IpfixFlow_s *f)
+{
+    int a = (f->key.family == AF_INET) ? 4 : 16;
+    memcpy(p, f->key.source, a);
+    memcpy(&p[a], f->key.destination, a);
+    p = ipfix_put16(&p[2 * a], f->key.sourcePort);
+    p = ipfix_put16(p, f->key.destinationPort);
+    *(p++) = f->key.protocol;
+    *(p++) = f->key.direction;
+    int r = (f->key.remoteFamily == AF_INET) ? 4 : 16;
+    memcpy(p, f->key.remote, r);
+    p = ipfix_put64(&p[r], f->start);
+    p = ipfix_put64(p, f->end);
+    p = ipfix_put64(p, f->packets);
+    p = ipfix_put64(p, f->bytes);
+    *(p++) = f->reason;
+    return p;
+}
+
+/**
+ * @brief Finish and send message
+ * @param sequence Number of data records sent before
+**/
+static void ipfix_send(struct IpfixMessage_s *msg, uint32_t *sequence)
+{
+    if(msg->size == 0)
+        return;
+    if(msg->set != 0)
+        ipfix_put16(&(msg->data[msg->set + 2]), msg->size - msg->set); //set length
+    uint8_t *p = ipfix_put16(msg->data, IPFIX_VERSION);
+    p = ipfix_put16(p, msg->size);
+    p = ipfix_put32(p, time(NULL)); //export time
+    p = ipfix_put32(p, *sequence);
+    ipfix_put32(p, 0); //observation domain ID
+    if(send(sock, msg->data, msg->size, 0) < 0)
+        LOG_ERRNO(LOG_WARNING, "Flow export failed");
+    *sequence += msg->records;
+    msg->size = 0;
+}
+
+/**
+ * @brief Start message, with templates if they are due
+**/
+static void ipfix_begin(struct IpfixMessage_s *msg, uint64_t now, uint64_t *nextTemplate)
+{
+    msg->size = IPFIX_HEADER_SIZE;
+    msg->set = 0;
+    msg->records = 0;
+    msg->deadline = now + IPFIX_FLUSH_INTERVAL;
+    if(now < *nextTemplate)
+        return;
+    uint8_t *set = &(msg->data[msg->size]);
+    uint8_t *p = ipfix_put16(set, IPFIX_SET_TEMPLATE);
+    p += 2; //length
+    p = ipfix_template(p, AF_INET, AF_INET);
+    p = ipfix_template(p, AF_INET, AF_INET6);
+    p = ipfix_template(p, AF_INET6, AF_INET);
+    p = ipfix_template(p, AF_INET6, AF_INET6);
+    ipfix_put16(&set[2], p - set);
+    msg->size += p - set;
+    *nextTemplate = now + IPFIX_TEMPLATE_INTERVAL * 1000;
+}
+
+/**
+ * @brief Add flow to message, send the message first if the flow doesn't fit
+**/
+static void ipfix_add(struct IpfixMessage_s *msg, const struct IpfixFlow_s *f, uint64_t now, uint64_t *nextTemplate, uint32_t *sequence)
+{
+    uint16_t id = ipfix_templateId(f->key.family, f->key.remoteFamily);
+    int size = ipfix_recordSize(f->key.family, f->key.remoteFamily);
+    if((msg->size != 0) && ((msg->size + size + (((msg->set != 0) && (msg->setId == id)) ? 0 : 4)) > IPFIX_MESSAGE_SIZE))
+        ipfix_send(msg, sequence);
+    if(msg->size == 0)
+        ipfix_begin(msg, now, nextTemplate);
+    if((msg->set == 0) || (msg->setId != id)) //start data set
+    {
+        if(msg->set != 0)
+            ipfix_put16(&(msg->data[msg->set + 2]), msg->size - msg->set);
+        msg->set = msg->size;
+        msg->setId = id;
+        ipfix_put16(&(msg->data[msg->size]), id);
+        msg->size += 4;
+    }
+    msg->size = ipfix_record(&(msg->data[msg->size]), f) - msg->data;
+    msg->records++;
+}
+
+static void *ipfix_exec(void *arg)
+{
+    struct IpfixMessage_s msg = {.size = 0};
+    uint64_t nextTemplate = 0;
+    uint32_t sequence = 0;
+    uint64_t nextReport = ipfix_now() + 1000;
+    while(1)
+    {
+        int count = 0;
+        uint64_t now = ipfix_now();
+        for(struct IpfixCache_s *c = __atomic_load_n(&caches, __ATOMIC_ACQUIRE); c != NULL; c = c->next)
+        {
+            uint32_t tail = c->tail;
+            uint32_t head = __atomic_load_n(&(c->head), __ATOMIC_ACQUIRE);
+            for(; tail != head; tail++, count++)
+                ipfix_add(&msg, &(c->ring[tail & (IPFIX_RING_SIZE - 1)]), now, &nextTemplate, &sequence);
+            __atomic_store_n(&(c->tail), tail, __ATOMIC_RELEASE); //release ring entries
+        }
+        if((msg.size != 0) && (now >= msg.deadline))
+            ipfix_send(&msg, &sequence);
+
+        if(now >= nextReport) //once per second
+        {
+            for(struct IpfixCache_s *c = __atomic_load_n(&caches, __ATOMIC_ACQUIRE); c != NULL; c = c->next)
+            {
+                uint64_t n = __atomic_exchange_n(&(c->dropped), 0, __ATOMIC_RELAXED);
+                if(n != 0)
+                    LOG(LOG_WARNING, "Dropped %llu flow records (export ring full)\n", (unsigned long long)n);
+            }
+            nextReport = now + 1000;
+        }
+
+        if(count == 0)
+        {
+            struct timespec ts = {.tv_sec = 0, .tv_nsec = IPFIX_POLL_INTERVAL * 1000000};
+            nanosleep(&ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+int Ipfix_start(const char *collector, uint16_t port)
+{
+    struct addrinfo hints, *results;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    char service[6];
+    snprintf(service, sizeof(service), "%u", (unsigned int)port);
+    if(getaddrinfo(collector, service, &hints, &results) != 0)
+    {
+        PRINT(LOG_ERR, "Flow collector %s resolution failed\n", collector);
+        return -1;
+    }
+    for(struct addrinfo *r = results; (r != NULL) && (sock < 0); r = r->ai_next)
+    {
+        sock = socket(r->ai_family, SOCK_DGRAM, 0);
+        if((sock >= 0) && (connect(sock, r->ai_addr, r->ai_addrlen) < 0))
+        {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(results);
+    if(sock < 0)
+    {
+        PRINT(LOG_ERR, "Flow collector socket creation failed\n");
+        return -1;
+    }
+
+    pthread_t th;
+    if(pthread_create(&th, NULL, &ipfix_exec, NULL) != 0)
+    {
+        PRINT(LOG_ERR, "Flow export thread creation failed\n");
+        close(sock);
+        sock = -1;
+        return -1;
+    }
+    pthread_detach(th);
+    ipfixEnabled = 1;
+    return 0;
+}
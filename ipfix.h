@@ -0,0 +1,106 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file ipfix.h
+ * @brief Flow export module
+ *
+ * With --flow-export=collector, every --flow-sample-th packet of each thread is accounted in a per-thread flow cache
+ * keyed by the inner 5-tuple, the remote endpoint and the direction (encapsulated or decapsulated).
+ * Flows are expired after --flow-idle seconds without packets or --flow-active seconds after they started,
+ * and when another flow takes their cache slot. Expired flows are passed through a per-thread ring to the export thread,
+ * which sends them as IPFIX (RFC 7011) over UDP to the collector (--flow-port, default 4739).
+ * Packet and byte counts are multiplied by the sampling interval.
+ * Caches are maintained by their threads while they process packets, so flows of a thread that stopped receiving
+ * packets are exported when it gets the next one.
+*/
+#ifndef IPFIX_H_
+#define IPFIX_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#define IPFIX_DEFAULT_PORT 4739 //default collector UDP port
+#define IPFIX_DEFAULT_IDLE 15 //default idle timeout in seconds
+#define IPFIX_DEFAULT_ACTIVE 60 //default active timeout in seconds
+#define IPFIX_CACHE_SIZE 4096 //number of flow cache slots per thread (must be a power of 2)
+#define IPFIX_RING_SIZE 1024 //number of expired flows in a per-thread export ring (must be a power of 2)
+
+extern uint8_t ipfixEnabled; //flow export is running
+extern __thread const uint8_t *ipfixPacket; //sampled inner packet being encapsulated by calling thread, NULL if none
+
+//accounting point slow paths, called by the inline functions below
+void Ipfix_packetRead(const uint8_t *packet, int size);
+void Ipfix_packetSent(int family, const void *remote);
+void Ipfix_packetReceived(int family, const void *remote);
+void Ipfix_packetWritten(const uint8_t *packet, int size);
+
+/**
+ * @brief Mark inner packet read from TUN interface, it is accounted when sent (if it is sampled)
+ * @param packet Inner packet
+ * @param size Inner packet size
+ * @attention The packet must stay in place until it is sent
+**/
+static inline void Ipfix_read(const uint8_t *packet, int size)
+{
+    if(__builtin_expect(ipfixEnabled, 0))
+        Ipfix_packetRead(packet, size);
+}
+
+/**
+ * @brief Account marked inner packet when its (first) outer packet is sent
+ * @param family Remote endpoint address family (AF_INET or AF_INET6)
+ * @param remote Remote endpoint address (in_addr_t or struct in6_addr)
+**/
+static inline void Ipfix_sent(int family, const void *remote)
+{
+    if(__builtin_expect(ipfixPacket != NULL, 0))
+        Ipfix_packetSent(family, remote);
+}
+
+/**
+ * @brief Set remote endpoint of packets being decapsulated by calling thread
+ * @param family Remote endpoint address family (AF_INET or AF_INET6)
+ * @param remote Remote endpoint address (in_addr_t or struct in6_addr)
+**/
+static inline void Ipfix_received(int family, const void *remote)
+{
+    if(__builtin_expect(ipfixEnabled, 0))
+        Ipfix_packetReceived(family, remote);
+}
+
+/**
+ * @brief Account inner packet written to TUN interface (if it is sampled)
+ * @param packet Inner packet
+ * @param size Inner packet size
+**/
+static inline void Ipfix_written(const uint8_t *packet, int size)
+{
+    if(__builtin_expect(ipfixEnabled, 0))
+        Ipfix_packetWritten(packet, size);
+}
+
+/**
+ * @brief Open collector socket, start export thread and enable flow accounting
+ * @param collector Collector hostname or address
+ * @param port Collector UDP port
+ * @return 0 on success, -1 on failure
+**/
+int Ipfix_start(const char *collector, uint16_t port);
+
+#endif
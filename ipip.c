@@ -32,18 +32,148 @@
 #include "common.h"
 #include "icmp.h"
 #include "route.h"
+#include "checksum.h"
+#include "peer.h"
+#include "tunnel.h"
+#include "pmtu.h"
+#include "fou.h"
+#include "flow.h"
+#include "resolver.h"
+#include "log.h"
+#include "drop.h"
+#include "stats.h"
+#include "capture.h"
+#include "ipfix.h"
+#include "latency.h"
+#include "perf.h"
+#include "reclaim.h"
 #include <pthread.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <stdlib.h>
+#include <linux/errqueue.h>
+#include <arpa/inet.h>
 
 static int sockfd = 0; //IPIP socket descriptor (IPv4 socket receiving all IPIP packets) - needed also for ICMP packets
 static int sock6in4fd = 0; //IP6IP socket descriptor (IPv4 socket receiving all IP6IP packets)
 static int sock6fd = 0; //IPIP6 socket descriptor (IPv6 socket receiving all IPIP6 packets) - needed also for ICMPv6 packets
-static int tunfd = 0; //tun descriptor
+static int sock4in6fd = 0; //4in6 socket descriptor (IPv6 socket connected to IPv6 remote endpoint)
+static int sock6in6fd = 0; //6in6 socket descriptor (IPv6 socket connected to IPv6 remote endpoint)
+static struct ip6_hdr template4in6, template6in6; //outer IPv6 header templates, IPv6 underlay has a single fixed remote endpoint
+static uint32_t fragmentId6 = 0; //ID of outer IPv6 packets fragmented by kiwitun
+static uint8_t connected = 0; //IPv4 sockets are connected to fixed remote endpoint
+static uint16_t fragmentId = 0; //ID of outer packets fragmented by kiwitun
+static int foufd = 0; //FOU/GUE socket descriptor (UDP socket receiving all encapsulated packets)
+static int overhead = IPV4_HEADER_SIZE; //size of headers added in front of inner packet
 
-int Ipip_init(int tun)
+#define IPIP_TEMPLATE_CACHE_SIZE 256 //number of cached outer header templates per protocol and thread (must be a power of 2)
+
+//template caches are per thread, so that the tunnel thread and the route resolver thread (held packets) need no locking
+//templates are keyed by local and remote address and carry the runtime settings generation they were built with (TTL),
+//a template with another generation is rebuilt on its next use, so settings changes need no cache flush
+static __thread struct OuterTemplate_s templates[IPIP_TEMPLATE_CACHE_SIZE]; //IPIP templates
+static __thread struct OuterTemplate_s templates6[IPIP_TEMPLATE_CACHE_SIZE]; //IP6IP templates
+
+#define IPIP_SEND_TOO_BIG -2 //send result: packet bigger than path MTU (EMSGSIZE), drop not counted yet
+
+#define IPIP_HOLD_QUEUE_SIZE 64 //maximum number of packets held while their remote endpoints are being resolved
+
+/**
+ * @brief Packet held until its remote endpoint is resolved
+**/
+struct HeldPacket_s
+{
+    uint8_t *buf; //packet buffer with space for outer header, NULL if slot is empty
+    struct Tunnel_s *tunnel; //tunnel the packet was received from
+    int size; //inner packet size
+    int family; //inner packet family (AF_INET or AF_INET6)
+    struct in6_addr destination; //inner destination address (in_addr_t for IPv4 is stored at the beginning)
+};
+
+static struct HeldPacket_s held[IPIP_HOLD_QUEUE_SIZE]; //held packet ring, the oldest packet is overwritten when full
+static uint16_t heldNext = 0; //next ring slot to use
+static pthread_mutex_t heldMutex = PTHREAD_MUTEX_INITIALIZER; //held packet ring access mutex
+
+int ipip_encap(struct Tunnel_s *tunnel, uint8_t *buf, int size);
+int ip6ip_encap(struct Tunnel_s *tunnel, uint8_t *buf, int size);
+void ipip_release(int family, const void *destination);
+
+/**
+ * @brief Get source address selected by kernel for IPv6 remote endpoint
+ * @param local Source address
+ * @return 0 on success, -1 on failure
+**/
+static int ipip_getSource6(struct in6_addr *local)
 {
-    tunfd = tun;
+    int s = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+    if(s < 0)
+        return -1;
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = config.remote6;
+    addr.sin6_port = htons(9);
+    socklen_t len = sizeof(addr);
+    //connecting UDP socket sends nothing, but selects source address
+    if((connect(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) || (getsockname(s, (struct sockaddr*)&addr, &len) < 0))
+    {
+        close(s);
+        return -1;
+    }
+    close(s);
+    *local = addr.sin6_addr;
+    return 0;
+}
+
+/**
+ * @brief Open raw IPv6 socket bound and connected to IPv6 underlay endpoints
+ * @param protocol Inner packet protocol (IPV4_HEADER_PROTO_IPIP or IPV4_HEADER_PROTO_IP6IP)
+ * @param t Outer header template to build
+ * @return Socket descriptor or -1 on failure
+**/
+static int ipip_open6(uint8_t protocol, struct ip6_hdr *t)
+{
+    int s = socket(AF_INET6, SOCK_RAW, protocol);
+    if(s < 0)
+        return -1;
+
+    struct sockaddr_in6 local, remote;
+    memset(&local, 0, sizeof(local));
+    local.sin6_family = AF_INET6;
+    local.sin6_addr = config.local6;
+    memset(&remote, 0, sizeof(remote));
+    remote.sin6_family = AF_INET6;
+    remote.sin6_addr = config.remote6;
+    int enable = 1;
+    //IPv6 raw sockets receive packets without IPv6 header, header is included only when sending
+    //bound and connected socket receives packets from the remote endpoint to the local endpoint only
+    if((setsockopt(s, IPPROTO_IPV6, IPV6_HDRINCL, &enable, sizeof(enable)) < 0)
+    || (setsockopt(s, IPPROTO_IPV6, IPV6_RECVERR, &enable, sizeof(enable)) < 0) //queue ICMPv6 errors (Packet Too Big)
+    || (bind(s, (struct sockaddr*)&local, sizeof(local)) < 0) || (connect(s, (struct sockaddr*)&remote, sizeof(remote)) < 0))
+    {
+        close(s);
+        return -1;
+    }
+
+    int mtu;
+    socklen_t len = sizeof(mtu);
+    if((getsockopt(s, IPPROTO_IPV6, IPV6_MTU, &mtu, &len) == 0) && (mtu > 0)) //initial path MTU
+        Pmtu_update6(&(config.remote6), (mtu > IP_MAX_PACKET_SIZE) ? IP_MAX_PACKET_SIZE : mtu);
+
+    memset(t, 0, sizeof(*t));
+    t->ip6_vfc = IPVX_HEADER_VERSION_6 << 4;
+    t->ip6_nxt = protocol;
+    t->ip6_hlim = Runtime_get()->ttl; //updated for each packet, TTL can change at runtime
+    t->ip6_src = config.local6;
+    t->ip6_dst = config.remote6;
+    return s;
+}
+
+int Ipip_init()
+{
+    Route_setCallback(&ipip_release); //send held packets when their remote endpoints are resolved
     
-    if(config.tun4in4) //enable 4-in-4 tunneling
+    if(config.tun4in4 && (config.encap == ENCAP_IPIP)) //enable 4-in-4 tunneling
     {
         if((sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_IPIP)) < 0) //try to create raw IPv4 socket
         {
@@ -51,14 +181,16 @@ int Ipip_init(int tun)
         }
 
         int enable = 1;
-        if(setsockopt(sockfd, IPPROTO_IP, IP_HDRINCL, &enable, sizeof(enable)) < 0) //tell kernel to not add IP header
+        if((setsockopt(sockfd, IPPROTO_IP, IP_HDRINCL, &enable, sizeof(enable)) < 0) //tell kernel to not add IP header
+        || (setsockopt(sockfd, IPPROTO_IP, IP_RECVERR, &enable, sizeof(enable)) < 0)) //queue ICMP errors (Fragmentation Needed)
         {
             close(sockfd);
             return -1;
         }
+        Latency_enable(sockfd);
     }
 
-    if(config.tun6in4) //enable 6-in-4 tunneling
+    if(config.tun6in4 && (config.encap == ENCAP_IPIP)) //enable 6-in-4 tunneling
     {
         if((sock6in4fd = socket(AF_INET, SOCK_RAW, IPPROTO_IPV6)) < 0) //try to create raw IPv4 socket
         {
@@ -66,14 +198,68 @@ int Ipip_init(int tun)
         }
 
         int enable = 1;
-        if(setsockopt(sock6in4fd, IPPROTO_IP, IP_HDRINCL, &enable, sizeof(enable)) < 0) //tell kernel to not add IP header
+        if((setsockopt(sock6in4fd, IPPROTO_IP, IP_HDRINCL, &enable, sizeof(enable)) < 0) //tell kernel to not add IP header
+        || (setsockopt(sock6in4fd, IPPROTO_IP, IP_RECVERR, &enable, sizeof(enable)) < 0)) //queue ICMP errors (Fragmentation Needed)
+        {
+            close(sockfd);
+            return -1;
+        }
+        Latency_enable(sock6in4fd);
+    }
+
+    if(config.encap != ENCAP_IPIP) //FOU/GUE: UDP socket receives all encapsulated packets, one raw socket sends them
+    {
+        if((sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) < 0) //send-only raw socket, IP header is always included
+        {
+            return -1; //return if failure
+        }
+
+        int enable = 1;
+        if(setsockopt(sockfd, IPPROTO_IP, IP_RECVERR, &enable, sizeof(enable)) < 0) //queue local errors (packet bigger than interface MTU)
         {
             close(sockfd);
             return -1;
         }
+        sock6in4fd = sockfd;
+        overhead = IPV4_HEADER_SIZE + Fou_headerSize();
+
+        if((foufd = Fou_open((Tunnel_count() == 1) ? Tunnel_get(0)->local.s_addr : INADDR_ANY)) < 0)
+        {
+            DEBUG(LOG_ERR, "FOU/GUE socket creation failed");
+            return -1;
+        }
+        Latency_enable(foufd);
     }
 
-    if(/*config.tun4in6 ||*/ config.tun6in4) //enable 4-in-6 tunneling (enable socket also if 6-in-4)
+    if(config.tun4in6 || config.tun6in6) //IPv6 underlay with fixed remote endpoint
+    {
+        //outer header is built by kiwitun, so the source address must be known
+        if(IN6_IS_ADDR_UNSPECIFIED(&(config.local6)) && (ipip_getSource6(&(config.local6)) < 0))
+        {
+            DEBUG(LOG_ERR, "No IPv6 source address for remote endpoint");
+            return -1;
+        }
+        if((config.tun4in6 && ((sock4in6fd = ipip_open6(IPV4_HEADER_PROTO_IPIP, &template4in6)) < 0))
+        || (config.tun6in6 && ((sock6in6fd = ipip_open6(IPV4_HEADER_PROTO_IP6IP, &template6in6)) < 0)))
+        {
+            DEBUG(LOG_ERR, "IPv6 underlay socket creation failed");
+            return -1;
+        }
+        if(config.tun4in6)
+            Latency_enable(sock4in6fd);
+        if(config.tun6in6)
+            Latency_enable(sock6in6fd);
+    }
+
+    if(config.tun4in6) //4in6 tunneling needs IPv4 socket for ICMP packets
+    {
+        if((sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) < 0) //send-only raw socket, IP header is always included
+        {
+            return -1; //return if failure
+        }
+    }
+
+    if(config.tun6in4 || config.tun6in6) //IPv6 socket for ICMPv6 packets
     {
         if((sock6fd = socket(AF_INET6, SOCK_RAW, IPPROTO_RAW)) < 0) //try to create raw IPv6 socket
         {
@@ -88,249 +274,1219 @@ int Ipip_init(int tun)
         }
     }
 
-    
+    //single tunnel with fixed local and remote IP address (not a hostname or set through the control socket, which can change): bind and connect sockets,
+    //so that packets are sent without destination lookup. Bound and connected raw sockets receive packets
+    //from the remote endpoint to the local endpoint only, which is what decapsulation accepts anyway.
+    //Connecting unbound socket would bind it to the source address selected by kernel, so local address is required.
+    if((config.encap == ENCAP_IPIP) && (Tunnel_count() == 1) && (Tunnel_get(0)->remote != INADDR_ANY) && (Tunnel_get(0)->local.s_addr != INADDR_ANY) && (config.hostname == NULL) && (config.controlPath == NULL))
+    {
+        struct sockaddr_in local, remote;
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_addr = Tunnel_get(0)->local;
+        memset(&remote, 0, sizeof(remote));
+        remote.sin_family = AF_INET;
+        remote.sin_addr.s_addr = Tunnel_get(0)->remote;
+        if((config.tun4in4 && ((bind(sockfd, (struct sockaddr*)&local, sizeof(local)) < 0) || (connect(sockfd, (struct sockaddr*)&remote, sizeof(remote)) < 0)))
+        || (config.tun6in4 && ((bind(sock6in4fd, (struct sockaddr*)&local, sizeof(local)) < 0) || (connect(sock6in4fd, (struct sockaddr*)&remote, sizeof(remote)) < 0))))
+        {
+            DEBUG(LOG_ERR, "Socket connection to remote endpoint failed");
+            return -1;
+        }
+        connected = 1;
+
+        int mtu;
+        socklen_t len = sizeof(mtu);
+        if((getsockopt(config.tun4in4 ? sockfd : sock6in4fd, IPPROTO_IP, IP_MTU, &mtu, &len) == 0) && (mtu > 0)) //initial path MTU
+            Pmtu_update(remote.sin_addr.s_addr, (mtu > IP_MAX_PACKET_SIZE) ? IP_MAX_PACKET_SIZE : mtu);
+    }
 
     return 0;
 }
 
+void Ipip_buildTemplate(struct OuterTemplate_s *t, in_addr_t local, in_addr_t remote, uint8_t protocol)
+{
+    const struct Runtime_s *r = Runtime_get();
+    memset(&(t->hdr), 0, sizeof(t->hdr));
+    t->hdr.ip_v = IPVX_HEADER_VERSION_4; //IPv4 packet
+    t->hdr.ip_hl = IPV4_HEADER_SIZE / 4; //header size in 32-bit units
+    t->hdr.ip_ttl = r->ttl; //set TTL
+    t->generation = r->generation;
+    t->hdr.ip_p = (config.encap == ENCAP_IPIP) ? protocol : IPPROTO_UDP; //FOU/GUE header carries inner protocol
+    t->hdr.ip_id = 0; //let kernel fill ID field
+    t->hdr.ip_src.s_addr = local; //INADDR_ANY lets kernel fill source IP (and recalculate checksum)
+    t->hdr.ip_dst.s_addr = remote;
+    //TTL, protocol, checksum (zero), source and destination address
+    t->partial = Checksum_partial(&(t->hdr.ip_ttl), IPV4_HEADER_SIZE - offsetof(struct ip, ip_ttl), 0);
+}
+
+/**
+ * @brief Get outer header template for given remote endpoint, build it if not cached
+ * @param cache Template cache for outer header protocol
+ * @param local Local endpoint address
+ * @param remote Remote endpoint address
+ * @param protocol Outer header protocol
+ * @return Template
+**/
+static struct OuterTemplate_s* ipip_getTemplate(struct OuterTemplate_s *cache, in_addr_t local, in_addr_t remote, uint8_t protocol)
+{
+    struct OuterTemplate_s *t = &cache[(((remote ^ local) * 2654435761U) >> 24) & (IPIP_TEMPLATE_CACHE_SIZE - 1)]; //direct-mapped, multiplicative hash
+    if((t->hdr.ip_v != IPVX_HEADER_VERSION_4) || (t->hdr.ip_dst.s_addr != remote) || (t->hdr.ip_src.s_addr != local)
+    || (t->generation != Runtime_get()->generation))
+        Ipip_buildTemplate(t, local, remote, protocol);
+    return t;
+}
+
+/**
+ * @brief Select outer header template for packet being encapsulated
+ * @param peerTemplate Peer template or NULL if there is no peer
+ * @param cache Template cache used if there is no matching peer template
+ * @param local Local endpoint address
+ * @param remote Remote endpoint address
+ * @param protocol Outer header protocol
+ * @return Template
+**/
+static inline const struct OuterTemplate_s* ipip_selectTemplate(const struct OuterTemplate_s *peerTemplate, struct OuterTemplate_s *cache,
+    in_addr_t local, in_addr_t remote, uint8_t protocol)
+{
+    //peer templates are built for the global local address and the runtime settings at peer table load
+    if((peerTemplate != NULL) && (peerTemplate->hdr.ip_src.s_addr == local) && (peerTemplate->generation == Runtime_get()->generation))
+        return peerTemplate;
+    return ipip_getTemplate(cache, local, remote, protocol);
+}
+
+/**
+ * @brief Fill outer header from template
+ * @param outer Outer header
+ * @param t Template
+ * @param tos TOS field value
+ * @param id ID field value (network byte order), 0 lets kernel fill it
+ * @param off Fragment offset field value (network byte order)
+ * @param size Inner packet size
+**/
+static inline void ipip_fillOuter(struct ip *outer, const struct OuterTemplate_s *t, uint8_t tos, uint16_t id, uint16_t off, int size)
+{
+    memcpy(outer, &(t->hdr), IPV4_HEADER_SIZE);
+    outer->ip_tos = tos;
+    outer->ip_len = htons(size + IPV4_HEADER_SIZE); //whole packet is the inner packet + outer header (kernel fills it anyway)
+    outer->ip_id = id;
+    outer->ip_off = off;
+
+    uint32_t w[2];
+    memcpy(w, outer, sizeof(w));
+    //variable words: version, header length, TOS and total length; ID and fragment offset
+    outer->ip_sum = Checksum_finish(t->partial + w[0] + w[1]);
+}
+
+/**
+ * @brief Add packet to peer counters
+ * @param packets Packet counter
+ * @param bytes Byte counter
+ * @param size Packet size
+**/
+static inline void ipip_count(uint64_t *packets, uint64_t *bytes, int size)
+{
+    __atomic_fetch_add(packets, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(bytes, size, __ATOMIC_RELAXED);
+}
+
 /**
- * @brief Calculate IPv4 header checksum
- * @param hdr Header data pointer
- * @param size Header size in bytes
- * @return 0 if success, -1 otherwise (size not a multiplicity of 4)
- * @warning New checksum is inserted into the header.
+ * @brief Get peer for remote endpoint of packet being encapsulated
+ * @param tunnel Tunnel
+ * @param remote Remote endpoint address
+ * @param peer Peer or NULL if the peer table is not used
+ * @return 0 if packet can be sent, -1 if the remote endpoint is not a configured peer
 **/
-int ipv4_checksum(uint8_t *hdr, uint16_t size)
+static int ipip_getPeer(struct Tunnel_s *tunnel, in_addr_t remote, struct Peer_s **peer)
 {
-    if(size & 3) //size must be divisible by 4 
+    *peer = NULL;
+    if(__atomic_load_n(&(tunnel->remote), __ATOMIC_RELAXED) != INADDR_ANY) //peer table is used by tunnels without fixed remote endpoint only
+        return 0;
+    *peer = Peer_find(remote);
+    if((*peer == NULL) && Peer_enabled())
+    {
+        LOG(LOG_DEBUG, "Remote address is not a configured peer!\n");
         return -1;
+    }
+    return 0;
+}
 
-    uint32_t sum = 0;
-    for(uint16_t i = 0; i < size; i += 2) //group data in 16-bit words
+/**
+ * @brief Read socket error queue and update path MTU cache
+ * @param s Raw socket descriptor
+ * @return Number of errors read
+**/
+static int ipip_readErrors(int s)
+{
+    int ipv6 = (config.tun4in6 && (s == sock4in6fd)) || (config.tun6in6 && (s == sock6in6fd)); //IPv6 underlay socket
+    int count = 0;
+    while(1)
     {
-        if(i == IPV4_HEADER_CHECKSUM_POS) //skip checksum field itself (treat is a 0x0000)
-            continue;
+        uint8_t control[256];
+        struct sockaddr_in6 dest; //big enough for both families
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &dest;
+        msg.msg_namelen = sizeof(dest);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(s, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) //error queue is empty
+            break;
+        count++;
+
+        for(struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c))
+        {
+            if(!((c->cmsg_level == IPPROTO_IP) && (c->cmsg_type == IP_RECVERR)) && !((c->cmsg_level == IPPROTO_IPV6) && (c->cmsg_type == IPV6_RECVERR)))
+                continue;
+            struct sock_extended_err *e = (struct sock_extended_err*)CMSG_DATA(c);
+            //ICMP Fragmentation Needed/Packet Too Big from the underlay or local error (packet bigger than interface MTU)
+            if((e->ee_errno == EMSGSIZE) && (e->ee_info != 0))
+            {
+                uint16_t mtu = (e->ee_info > IP_MAX_PACKET_SIZE) ? IP_MAX_PACKET_SIZE : e->ee_info;
+                char tmp[INET6_ADDRSTRLEN];
+                if(ipv6 && (dest.sin6_family == AF_INET6))
+                {
+                    LOG(LOG_DEBUG, "Path MTU to %s is %u\n", inet_ntop(AF_INET6, &(dest.sin6_addr), tmp, sizeof(tmp)), (unsigned int)mtu);
+                    Pmtu_update6(&(dest.sin6_addr), mtu);
+                }
+                else if(!ipv6 && (dest.sin6_family == AF_INET))
+                {
+                    struct sockaddr_in *dest4 = (struct sockaddr_in*)&dest;
+                    LOG(LOG_DEBUG, "Path MTU to %s is %u\n", inet_ntop(AF_INET, &(dest4->sin_addr), tmp, sizeof(tmp)), (unsigned int)mtu);
+                    Pmtu_update(dest4->sin_addr.s_addr, mtu);
+                }
+            }
+            else
+            {
+                LOG(LOG_DEBUG, "Remote endpoint error: %s\n", strerror(e->ee_errno));
+                //remote endpoint address of hostname is unreachable (or doesn't support IPIP), try another one
+                if((config.hostname != NULL) && !ipv6 && (dest.sin6_family == AF_INET) && (e->ee_origin == SO_EE_ORIGIN_ICMP)
+                && ((e->ee_errno == EHOSTUNREACH) || (e->ee_errno == ENETUNREACH) || (e->ee_errno == ECONNREFUSED)))
+                    Resolver_unreachable(((struct sockaddr_in*)&dest)->sin_addr.s_addr);
+            }
+        }
+    }
 
-        sum += (((uint32_t)hdr[i] << 8) | (uint32_t)hdr[i + 1]); //convert to 16-bit words and add to the sum
+    int mtu;
+    socklen_t len = sizeof(mtu);
+    //connected socket knows path MTU learned by kernel
+    if(ipv6 && (count > 0) && (getsockopt(s, IPPROTO_IPV6, IPV6_MTU, &mtu, &len) == 0) && (mtu > 0))
+        Pmtu_update6(&(config.remote6), (mtu > IP_MAX_PACKET_SIZE) ? IP_MAX_PACKET_SIZE : mtu);
+    else if(!ipv6 && connected && (count > 0) && (getsockopt(s, IPPROTO_IP, IP_MTU, &mtu, &len) == 0) && (mtu > 0))
+        Pmtu_update(Tunnel_get(0)->remote, (mtu > IP_MAX_PACKET_SIZE) ? IP_MAX_PACKET_SIZE : mtu);
+    return count;
+}
+
+/**
+ * @brief Check send result
+ * @param s Raw socket descriptor
+ * @param sent Send function result
+ * @param size Number of bytes to be sent
+ * @param protocol Inner packet protocol (IPV4_HEADER_PROTO_IPIP or IPV4_HEADER_PROTO_IP6IP), for counters
+ * @return 0 if success, IPIP_SEND_TOO_BIG if the packet is bigger than path MTU, -1 otherwise
+ * @attention Packets bigger than path MTU are not counted as dropped, the caller decides whether they are sent again
+**/
+static int ipip_checkSent(int s, int sent, int size, uint8_t protocol)
+{
+    int family = (protocol == IPV4_HEADER_PROTO_IPIP) ? STATS_IPV4 : STATS_IPV6;
+    if(sent < 0) //error
+    {
+        if(errno == EMSGSIZE) //packet bigger than interface MTU, kernel reports the MTU in the error queue
+        {
+            ipip_readErrors(s);
+            return IPIP_SEND_TOO_BIG;
+        }
+        else
+        {
+            DROP(DROP_TX_ERROR, NULL, 0);
+            Stats_add(family, STATS_TX_ERRORS, 1);
+            LOG_ERRNO(LOG_ERR, "Encapsulated packet TX failed");
+        }
+        return -1;
     }
-    sum = (sum & 0xFFFF) + (sum >> 16); //cut carry bits, shift them and add to the checksum
-    if(sum & 0x10000) //check if addition generated carry bit
+    else if(sent != size) //number of bytes actually sent is different than number of bytes to be sent
     {
-        sum &= 0xFFFF; //if so, remove it
-        sum++; //and add one to the checksum
+        DROP(DROP_TX_SHORT, NULL, 0);
+        Stats_add(family, STATS_TX_ERRORS, 1);
+        LOG(LOG_WARNING, "Encapsulated packet TX problem: %d bytes to send, %d actually sent\n", size, sent);
+        return -1;
     }
-    sum = ~sum; //bitwise negate (one's complement)
-    hdr[IPV4_HEADER_CHECKSUM_POS] = (sum >> 8) & 0xFF; //store checksum
-    hdr[IPV4_HEADER_CHECKSUM_POS + 1] = sum & 0xFF;
 
+    Stats_count(family, STATS_TX_PACKETS, size);
+    Latency_done(STATS_ENCAP);
+    Perf_done();
     return 0;
 }
 
+/**
+ * @brief Send encapsulated packet
+ * @param s Raw socket descriptor
+ * @param buf Encapsulated packet buffer
+ * @param size Encapsulated packet size
+ * @param remote Remote endpoint address (ignored if the socket is connected)
+ * @param protocol Inner packet protocol (IPV4_HEADER_PROTO_IPIP or IPV4_HEADER_PROTO_IP6IP)
+ * @return 0 if success, IPIP_SEND_TOO_BIG if the packet is bigger than path MTU, -1 otherwise
+**/
+static int ipip_send(int s, uint8_t *buf, int size, in_addr_t remote, uint8_t protocol)
+{
+    int sent;
+    Perf_stage(STATS_STAGE_SEND);
+    if(connected)
+        sent = send(s, buf, size, 0); //send encapsulated packet
+    else
+    {
+        struct sockaddr_in dest;
+        memset(&dest, 0, sizeof(dest));
+        dest.sin_family = AF_INET;
+        dest.sin_addr.s_addr = remote;
+        sent = sendto(s, buf, size, 0, (struct sockaddr*)(&dest), sizeof(dest)); //send encapsulated packet
+    }
+    if((sent = ipip_checkSent(s, sent, size, protocol)) < 0)
+        return sent;
+    struct iovec iov = {.iov_base = buf, .iov_len = size};
+    Capture_sent(&iov, 1, AF_INET, &remote);
+    Ipfix_sent(AF_INET, &remote);
+    return 0;
+}
+
+/**
+ * @brief Send encapsulated packet gathered from more buffers
+ * @param s Raw socket descriptor
+ * @param iov Packet parts, the first one starts with outer header
+ * @param count Number of packet parts
+ * @param remote Remote endpoint address (ignored if the socket is connected)
+ * @param protocol Inner packet protocol (IPV4_HEADER_PROTO_IPIP or IPV4_HEADER_PROTO_IP6IP)
+ * @return 0 if success, IPIP_SEND_TOO_BIG if the packet is bigger than path MTU, -1 otherwise
+**/
+static int ipip_sendv(int s, struct iovec *iov, int count, in_addr_t remote, uint8_t protocol)
+{
+    int size = 0;
+    for(int i = 0; i < count; i++)
+        size += iov[i].iov_len;
+
+    struct sockaddr_in dest;
+    memset(&dest, 0, sizeof(dest));
+    dest.sin_family = AF_INET;
+    dest.sin_addr.s_addr = remote;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    if(!connected)
+    {
+        msg.msg_name = &dest;
+        msg.msg_namelen = sizeof(dest);
+    }
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    Perf_stage(STATS_STAGE_SEND);
+    int sent = ipip_checkSent(s, sendmsg(s, &msg, 0), size, protocol);
+    if(sent < 0)
+        return sent;
+    Capture_sent(iov, count, AF_INET, &remote);
+    Ipfix_sent(AF_INET, &remote);
+    return 0;
+}
+
+/**
+ * @brief Fill outer headers in front of inner packet and send it
+ * @param s Raw socket descriptor
+ * @param buf Packet buffer with space for outer header (inner packet must be at buf + IPV4_HEADER_SIZE)
+ * @param size Inner packet size
+ * @param t Outer header template
+ * @param tos TOS field value
+ * @param off Fragment offset field value (network byte order)
+ * @param remote Remote endpoint address
+ * @param protocol Inner packet protocol (IPV4_HEADER_PROTO_IPIP or IPV4_HEADER_PROTO_IP6IP)
+ * @return 0 if success, IPIP_SEND_TOO_BIG if the packet is bigger than path MTU, -1 otherwise
+**/
+static int ipip_output(int s, uint8_t *buf, int size, const struct OuterTemplate_s *t, uint8_t tos, uint16_t off, in_addr_t remote, uint8_t protocol)
+{
+    if(config.encap == ENCAP_IPIP)
+    {
+        ipip_fillOuter((struct ip*)buf, t, tos, 0, off, size);
+        return ipip_send(s, buf, size + IPV4_HEADER_SIZE, remote, protocol);
+    }
+
+    //FOU/GUE headers don't fit in the space left in front of inner packet, so headers are sent from separate buffer
+    uint8_t hdr[IPV4_HEADER_SIZE + FOU_MAX_HEADER_SIZE];
+    int len = Fou_buildHeader(&hdr[IPV4_HEADER_SIZE], &buf[IPV4_HEADER_SIZE], size, protocol);
+    ipip_fillOuter((struct ip*)hdr, t, tos, 0, off, size + len);
+    struct iovec iov[2] = {{.iov_base = hdr, .iov_len = IPV4_HEADER_SIZE + len}, {.iov_base = &buf[IPV4_HEADER_SIZE], .iov_len = size}};
+    return ipip_sendv(s, iov, 2, remote, protocol);
+}
+
 /**
  * @brief Get IPIP tunnel destination (remote) address for packet being encapsulated
+ * @param tunnel Tunnel
  * @param addr Inner packet destination address
- * @return Tunnel remote address 
+ * @param remote Tunnel remote address or 0 if not known
+ * @return ROUTE_FOUND, ROUTE_NOT_FOUND or ROUTE_PENDING
 **/
-in_addr_t ipip_getDestination(in_addr_t addr)
+int ipip_getDestination(struct Tunnel_s *tunnel, in_addr_t addr, in_addr_t *remote)
 {
-    if(config.remote.s_addr != 0) //there is a fixed remote IP address defined
-        return config.remote.s_addr; //use it
+    *remote = __atomic_load_n(&(tunnel->remote), __ATOMIC_RELAXED);
+    if(*remote != 0) //there is a fixed remote IP address defined
+        return ROUTE_FOUND; //use it
+    if(config.hostname != NULL) //remote endpoint hostname not resolved yet
+        return ROUTE_NOT_FOUND;
 
-    return Route_get(addr); //else get from routing table
+    return Route_lookup(addr, remote); //else get from routing table
 }
 
 /**
  * @brief Get IP6IP tunnel destination (remote) address for packet being encapsulated
+ * @param tunnel Tunnel
  * @param addr Inner packet destination address
- * @return Tunnel remote address 
+ * @param remote Tunnel remote address or 0 if not known
+ * @return ROUTE_FOUND, ROUTE_NOT_FOUND or ROUTE_PENDING
+**/
+int ipip_getDestination6(struct Tunnel_s *tunnel, struct in6_addr addr, in_addr_t *remote)
+{
+    *remote = __atomic_load_n(&(tunnel->remote), __ATOMIC_RELAXED);
+    if(*remote != 0) //there is a fixed remote IP address defined
+        return ROUTE_FOUND; //use it
+    if(config.hostname != NULL) //remote endpoint hostname not resolved yet
+        return ROUTE_NOT_FOUND;
+
+    struct in6_addr gateway;
+    int ret = Route_lookup6(addr, &gateway); //else get IPv4-mapped IPv6 address from routing table
+    *remote = Route_unmap(gateway); //and unmap it
+    if((ret == ROUTE_FOUND) && (*remote == 0)) //not an IPv4-mapped address
+        ret = ROUTE_NOT_FOUND;
+    return ret;
+}
+
+/**
+ * @brief Hold packet until its remote endpoint is resolved
+ * @param tunnel Tunnel the packet was received from
+ * @param buf Packet buffer with space for outer header (inner header must at buf + IPV4_HEADER_SIZE)
+ * @param size Size of packet being encapsulated
+ * @param family Inner packet family (AF_INET or AF_INET6)
+ * @param destination Inner destination address (in_addr_t or struct in6_addr)
+ * @return 0 on success, -1 on failure
+**/
+int ipip_hold(struct Tunnel_s *tunnel, uint8_t *buf, int size, int family, const void *destination)
+{
+    uint8_t *copy = malloc(size + IPV4_HEADER_SIZE);
+    if(copy == NULL)
+    {
+        DROP(DROP_HOLD_OVERFLOW, &(buf[IPV4_HEADER_SIZE]), size);
+        return -1;
+    }
+    memcpy(copy, buf, size + IPV4_HEADER_SIZE);
+
+    pthread_mutex_lock(&heldMutex);
+    struct HeldPacket_s *h = &held[heldNext];
+    heldNext = (heldNext + 1) % IPIP_HOLD_QUEUE_SIZE;
+    if(h->buf != NULL) //ring is full, drop the oldest packet
+    {
+        LOG(LOG_DEBUG, "Held packet queue full, dropping oldest packet\n");
+        DROP(DROP_HOLD_OVERFLOW, &(h->buf[IPV4_HEADER_SIZE]), h->size);
+        free(h->buf);
+    }
+    h->buf = copy;
+    h->tunnel = tunnel;
+    h->size = size;
+    h->family = family;
+    memset(&(h->destination), 0, sizeof(h->destination));
+    memcpy(&(h->destination), destination, (family == AF_INET) ? sizeof(in_addr_t) : sizeof(struct in6_addr));
+    pthread_mutex_unlock(&heldMutex);
+    return 0;
+}
+
+/**
+ * @brief Encapsulate and send packets held for given destination (route resolution callback)
+ * @param family Destination family (AF_INET or AF_INET6)
+ * @param destination Destination address (in_addr_t or struct in6_addr)
+**/
+void ipip_release(int family, const void *destination)
+{
+    struct HeldPacket_s ready[IPIP_HOLD_QUEUE_SIZE];
+    int count = 0;
+
+    pthread_mutex_lock(&heldMutex);
+    for(uint16_t i = 0; i < IPIP_HOLD_QUEUE_SIZE; i++)
+    {
+        if((held[i].buf != NULL) && (held[i].family == family)
+        && !memcmp(&(held[i].destination), destination, (family == AF_INET) ? sizeof(in_addr_t) : sizeof(struct in6_addr)))
+        {
+            ready[count++] = held[i];
+            held[i].buf = NULL;
+        }
+    }
+    pthread_mutex_unlock(&heldMutex);
+
+    Reclaim_online(); //route resolver thread reads peer and tunnel tables only here
+    for(int i = 0; i < count; i++)
+    {
+        Ipfix_read(&(ready[i].buf[IPV4_HEADER_SIZE]), ready[i].size);
+        if(family == AF_INET)
+            ipip_encap(ready[i].tunnel, ready[i].buf, ready[i].size);
+        else
+            ip6ip_encap(ready[i].tunnel, ready[i].buf, ready[i].size);
+        free(ready[i].buf);
+    }
+    Reclaim_offline();
+}
+
+/**
+ * @brief Get outer IPv6 flow label for inner packet
+ * @param inner Inner packet
+ * @param size Inner packet size
+ * @return Flow label (never 0, which means no flow label)
+**/
+static inline uint32_t ipip_flowLabel(const uint8_t *inner, int size)
+{
+    uint32_t label = Flow_hash(inner, size) & IPV6_FLOWLABEL_MASK;
+    return (label != 0) ? label : 1;
+}
+
+/**
+ * @brief Fill outer IPv6 header and send packet over IPv6 underlay
+ * @param s IPv6 underlay socket descriptor
+ * @param t Outer header template
+ * @param inner Inner packet
+ * @param size Inner packet size
+ * @param tclass Traffic class field value
+ * @return 0 if success, IPIP_SEND_TOO_BIG if the packet is bigger than path MTU, -1 otherwise
+**/
+static int ipip_output6(int s, const struct ip6_hdr *t, uint8_t *inner, int size, uint8_t tclass)
+{
+    struct ip6_hdr outer = *t;
+    //flow label from inner flow hash spreads flows over underlay paths and receive queues (RFC 6438)
+    outer.ip6_flow = htonl((IPVX_HEADER_VERSION_6 << 28) | ((uint32_t)tclass << 20) | ipip_flowLabel(inner, size));
+    outer.ip6_hlim = Runtime_get()->ttl;
+    outer.ip6_plen = htons(size);
+    struct iovec iov[2] = {{.iov_base = &outer, .iov_len = IPV6_HEADER_SIZE}, {.iov_base = inner, .iov_len = size}};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg)); //socket is connected
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    Perf_stage(STATS_STAGE_SEND);
+    int sent = ipip_checkSent(s, sendmsg(s, &msg, 0), size + IPV6_HEADER_SIZE, (s == sock6in6fd) ? IPV4_HEADER_PROTO_IP6IP : IPV4_HEADER_PROTO_IPIP);
+    if(sent < 0)
+        return sent;
+    Capture_sent(iov, 2, AF_INET6, &(config.remote6));
+    Ipfix_sent(AF_INET6, &(config.remote6));
+    return 0;
+}
+
+/**
+ * @brief Fragment inner IPv4 packet to fit path MTU and send fragments (RFC 2003)
+ * @param buf Packet buffer with space for outer header, fragments are built in place and overwrite the packet
+ * @param size Inner packet size
+ * @param t Outer header template (not used for IPv6 underlay)
+ * @param remote Remote endpoint address (not used for IPv6 underlay)
+ * @param peer Peer or NULL if the peer table is not used
+ * @param mtu Path MTU
+ * @return 0 if success, -1 otherwise
+**/
+static int ipip_fragment(uint8_t *buf, int size, const struct OuterTemplate_s *t, in_addr_t remote, struct Peer_s *peer, uint16_t mtu)
+{
+    struct ip hdr;
+    memcpy(&hdr, &buf[IPV4_HEADER_SIZE], IPV4_HEADER_SIZE); //original inner header
+    uint16_t off = ntohs(hdr.ip_off);
+    int payload = size - IPV4_HEADER_SIZE;
+    int chunk = (mtu - (config.tun4in6 ? IPV6_HEADER_SIZE : overhead) - IPV4_HEADER_SIZE) & ~7; //fragment data size must be a multiple of 8 bytes
+
+    for(int pos = 0; pos < payload; pos += chunk)
+    {
+        //headers are placed just before fragment data, over data of fragments already sent
+        uint8_t *frag = &buf[pos];
+        struct ip *inner = (struct ip*)(&frag[IPV4_HEADER_SIZE]);
+        int last = (payload - pos) <= chunk;
+        int len = last ? (payload - pos) : chunk;
+
+        memcpy(inner, &hdr, IPV4_HEADER_SIZE);
+        inner->ip_len = htons(len + IPV4_HEADER_SIZE);
+        //offset is relative to the original packet, which can be a fragment itself; the last fragment keeps its more fragments flag
+        inner->ip_off = htons(((off & IP_OFFMASK) + (pos / 8)) | (last ? (off & IP_MF) : IP_MF));
+        inner->ip_sum = 0;
+        inner->ip_sum = Checksum_compute(inner, IPV4_HEADER_SIZE);
+
+        int sent;
+        if(config.tun4in6) //IPv6 underlay
+            sent = ipip_output6(sock4in6fd, &template4in6, (uint8_t*)inner, len + IPV4_HEADER_SIZE, hdr.ip_tos);
+        else
+            sent = ipip_output(sockfd, frag, len + IPV4_HEADER_SIZE, t, hdr.ip_tos, 0, remote, IPV4_HEADER_PROTO_IPIP);
+        if(sent == IPIP_SEND_TOO_BIG) //path MTU decreased meanwhile
+            DROP(DROP_TOO_BIG, NULL, 0);
+        if(sent < 0)
+            return -1;
+
+        if(peer != NULL)
+            ipip_count(&(peer->stats.txPackets), &(peer->stats.txBytes), len + IPV4_HEADER_SIZE + overhead);
+    }
+    return 0;
+}
+
+/**
+ * @brief Fragment outer IPv4 packet carrying IPv6 packet to fit path MTU and send fragments (RFC 4213)
+ * @param buf Packet buffer with space for outer header
+ * @param size Inner packet size
+ * @param t Outer header template
+ * @param remote Remote endpoint address
+ * @param peer Peer or NULL if the peer table is not used
+ * @param mtu Path MTU
+ * @return 0 if success, -1 otherwise
+**/
+static int ip6ip_fragment(uint8_t *buf, int size, const struct OuterTemplate_s *t, in_addr_t remote, struct Peer_s *peer, uint16_t mtu)
+{
+    uint8_t fou[FOU_MAX_HEADER_SIZE]; //FOU/GUE headers, sent in the first fragment
+    int prefix = (config.encap == ENCAP_IPIP) ? 0 : Fou_buildHeader(fou, &buf[IPV4_HEADER_SIZE], size, IPV4_HEADER_PROTO_IP6IP);
+    int total = prefix + size; //outer packet data size
+    int chunk = (mtu - IPV4_HEADER_SIZE) & ~7; //fragment data size must be a multiple of 8 bytes, always bigger than FOU/GUE headers
+    //kernel fills zero ID separately for each packet, so fragments need an ID set here
+    uint16_t id;
+    do
+    {
+        id = __atomic_add_fetch(&fragmentId, 1, __ATOMIC_RELAXED);
+    }
+    while(id == 0);
+
+    for(int pos = 0; pos < total; pos += chunk)
+    {
+        int last = (total - pos) <= chunk;
+        int len = last ? (total - pos) : chunk;
+        struct ip outer;
+        ipip_fillOuter(&outer, t, 0, htons(id), htons((pos / 8) | (last ? 0 : IP_MF)), len);
+
+        struct iovec iov[3];
+        int count = 0;
+        iov[count].iov_base = &outer;
+        iov[count++].iov_len = IPV4_HEADER_SIZE;
+        if((pos == 0) && (prefix > 0))
+        {
+            iov[count].iov_base = fou;
+            iov[count++].iov_len = prefix;
+        }
+        int start = (pos == 0) ? 0 : (pos - prefix); //inner packet data in this fragment
+        iov[count].iov_base = &buf[IPV4_HEADER_SIZE + start];
+        iov[count++].iov_len = pos + len - prefix - start;
+        int sent = ipip_sendv(sock6in4fd, iov, count, remote, IPV4_HEADER_PROTO_IP6IP);
+        if(sent == IPIP_SEND_TOO_BIG) //path MTU decreased meanwhile
+            DROP(DROP_TOO_BIG, NULL, 0);
+        if(sent < 0)
+            return -1;
+
+        if(peer != NULL)
+            ipip_count(&(peer->stats.txPackets), &(peer->stats.txBytes), len + IPV4_HEADER_SIZE);
+    }
+    return 0;
+}
+
+/**
+ * @brief Fragment outer IPv6 packet carrying IPv6 packet to fit path MTU and send fragments (RFC 2473)
+ * @param inner Inner packet
+ * @param size Inner packet size
+ * @param tclass Traffic class field value
+ * @param mtu Path MTU
+ * @return 0 if success, -1 otherwise
 **/
-in_addr_t ipip_getDestination6(struct in6_addr addr)
+static int ip6in6_fragment(uint8_t *inner, int size, uint8_t tclass, uint16_t mtu)
 {
-    if(config.remote.s_addr != 0) //there is a fixed remote IP address defined
-        return config.remote.s_addr; //use it
+    int chunk = (mtu - IPV6_HEADER_SIZE - sizeof(struct ip6_frag)) & ~7; //fragment data size must be a multiple of 8 bytes
+    struct ip6_hdr outer = template6in6;
+    outer.ip6_flow = htonl((IPVX_HEADER_VERSION_6 << 28) | ((uint32_t)tclass << 20) | ipip_flowLabel(inner, size));
+    outer.ip6_hlim = Runtime_get()->ttl;
+    outer.ip6_nxt = IPPROTO_FRAGMENT;
+    struct ip6_frag frag;
+    frag.ip6f_nxt = IPV4_HEADER_PROTO_IP6IP;
+    frag.ip6f_reserved = 0;
+    frag.ip6f_ident = htonl(__atomic_add_fetch(&fragmentId6, 1, __ATOMIC_RELAXED));
+
+    for(int pos = 0; pos < size; pos += chunk)
+    {
+        int last = (size - pos) <= chunk;
+        int len = last ? (size - pos) : chunk;
+        outer.ip6_plen = htons(sizeof(frag) + len);
+        frag.ip6f_offlg = htons(pos) | (last ? 0 : IP6F_MORE_FRAG); //offset is a multiple of 8, so it is already in place
+
+        struct iovec iov[3] = {{.iov_base = &outer, .iov_len = IPV6_HEADER_SIZE}, {.iov_base = &frag, .iov_len = sizeof(frag)},
+            {.iov_base = &inner[pos], .iov_len = len}};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg)); //socket is connected
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 3;
+        int sent = ipip_checkSent(sock6in6fd, sendmsg(sock6in6fd, &msg, 0), IPV6_HEADER_SIZE + sizeof(frag) + len, IPV4_HEADER_PROTO_IP6IP);
+        if(sent == IPIP_SEND_TOO_BIG) //path MTU decreased meanwhile
+            DROP(DROP_TOO_BIG, NULL, 0);
+        if(sent < 0)
+            return -1;
+        Capture_sent(iov, 3, AF_INET6, &(config.remote6));
+        Ipfix_sent(AF_INET6, &(config.remote6));
+    }
+    return 0;
+}
 
-    return Route_unmap(Route_get6(addr)); //else get IPv4-mapped IPv6 address from routing table and unmap it
+/**
+ * @brief Encapsulate IPv4 packet and send over IPv6 underlay (RFC 2473)
+ * @param tunnel Tunnel the packet was received from
+ * @param buf Packet buffer (inner header must at buf + IPV4_HEADER_SIZE)
+ * @param size Size of packet being encapsulated
+ * @return 0 if success, -1 otherwise
+ * @attention TTL must be already checked
+**/
+static int ip4in6_encap(struct Tunnel_s *tunnel, uint8_t *buf, int size)
+{
+    struct ip *inner = (struct ip*)(&buf[IPV4_HEADER_SIZE]); //get inner IP header
+
+    Perf_stage(STATS_STAGE_ROUTE);
+    uint16_t mtu = Pmtu_get6(&(config.remote6)); //0 if not known, kernel reports interface MTU when the packet doesn't fit
+    while(1) //second pass only when path MTU has just been learned from send error
+    {
+        int tooBig = (mtu != 0) && ((size + IPV6_HEADER_SIZE) > mtu);
+        if(tooBig && (inner->ip_off & htons(IP_DF))) //too big and fragmentation not allowed
+        {
+            LOG(LOG_DEBUG, "Packet too big for path MTU %u\n", (unsigned int)mtu);
+            DROP(DROP_TOO_BIG, &(buf[IPV4_HEADER_SIZE]), size);
+            //send ICMP destination unreachable - fragmentation needed with tunnel MTU (RFC 1191)
+            ICMP_send(sockfd, &(buf[IPV4_HEADER_SIZE]), size, __atomic_load_n(&(tunnel->local.s_addr), __ATOMIC_RELAXED),
+                ICMP_DEST_UNREACH, ICMP_FRAG_NEEDED, htonl(mtu - IPV6_HEADER_SIZE));
+            return -1;
+        }
+
+        //decrement TTL and update checksum incrementally
+        Perf_stage(STATS_STAGE_CHECKSUM);
+        Checksum_replace8(&(inner->ip_sum), (uint8_t*)inner, offsetof(struct ip, ip_ttl), inner->ip_ttl - 1);
+
+        if(tooBig) //fragment inner packet, so that the underlay doesn't have to
+            return ipip_fragment(buf, size, NULL, INADDR_ANY, NULL, mtu);
+
+        int sent = ipip_output6(sock4in6fd, &template4in6, (uint8_t*)inner, size, inner->ip_tos);
+        if((sent == IPIP_SEND_TOO_BIG) && (mtu == 0) && ((mtu = Pmtu_get6(&(config.remote6))) != 0))
+        {
+            //path MTU has just been learned from send error, restore TTL and fragment or reject the packet
+            Checksum_replace8(&(inner->ip_sum), (uint8_t*)inner, offsetof(struct ip, ip_ttl), inner->ip_ttl + 1);
+            continue;
+        }
+        if(sent == IPIP_SEND_TOO_BIG)
+            DROP(DROP_TOO_BIG, &(buf[IPV4_HEADER_SIZE]), size);
+        return (sent < 0) ? -1 : 0;
+    }
+}
+
+/**
+ * @brief Encapsulate IPv6 packet and send over IPv6 underlay (RFC 2473)
+ * @param buf Packet buffer (inner header must at buf + IPV4_HEADER_SIZE)
+ * @param size Size of packet being encapsulated
+ * @return 0 if success, -1 otherwise
+ * @attention Hop limit must be already checked
+**/
+static int ip6in6_encap(uint8_t *buf, int size)
+{
+    struct ip6_hdr *inner = (struct ip6_hdr*)(&buf[IPV4_HEADER_SIZE]); //get inner IP header
+    uint8_t tclass = (ntohl(inner->ip6_flow) >> 20) & 0xFF;
+
+    Perf_stage(STATS_STAGE_ROUTE);
+    uint16_t mtu = Pmtu_get6(&(config.remote6)); //0 if not known, kernel reports interface MTU when the packet doesn't fit
+    while(1) //second pass only when path MTU has just been learned from send error
+    {
+        int tooBig = (mtu != 0) && ((size + IPV6_HEADER_SIZE) > mtu);
+        if(tooBig && (size > IPV6_MIN_MTU)) //too big, IPv6 sender must reduce packet size (RFC 2473)
+        {
+            LOG(LOG_DEBUG, "Packet too big for path MTU %u\n", (unsigned int)mtu);
+            DROP(DROP_TOO_BIG, &(buf[IPV4_HEADER_SIZE]), size);
+            //send ICMPv6 Packet Too Big with tunnel MTU, but not lower than IPv6 minimum MTU
+            ICMP_send6(sock6fd, &(buf[IPV4_HEADER_SIZE]), size, config.local6,
+                ICMP6_PACKET_TOO_BIG, 0, htonl(((mtu - IPV6_HEADER_SIZE) < IPV6_MIN_MTU) ? IPV6_MIN_MTU : (mtu - IPV6_HEADER_SIZE)));
+            return -1;
+        }
+
+        Perf_stage(STATS_STAGE_CHECKSUM);
+        inner->ip6_ctlun.ip6_un1.ip6_un1_hlim--; //decrement hop limit
+
+        if(tooBig) //tunnel MTU is lower than IPv6 minimum MTU: fragment outer packet (RFC 2473)
+            return ip6in6_fragment((uint8_t*)inner, size, tclass, mtu);
+
+        int sent = ipip_output6(sock6in6fd, &template6in6, (uint8_t*)inner, size, tclass);
+        if((sent == IPIP_SEND_TOO_BIG) && (mtu == 0) && ((mtu = Pmtu_get6(&(config.remote6))) != 0))
+        {
+            //path MTU has just been learned from send error, restore hop limit and fragment or reject the packet
+            inner->ip6_ctlun.ip6_un1.ip6_un1_hlim++;
+            continue;
+        }
+        if(sent == IPIP_SEND_TOO_BIG)
+            DROP(DROP_TOO_BIG, &(buf[IPV4_HEADER_SIZE]), size);
+        return (sent < 0) ? -1 : 0;
+    }
 }
 
 /**
  * @brief Encapsulate IPv4 packet and send as IPv4 packet
+ * @param tunnel Tunnel the packet was received from
  * @param buf Packet buffer with additional space for outer header (inner header must at buf + IPV4_HEADER_SIZE)
  * @param size Size of packet being encapsulated (inner data excluding space left for outer header)
+ * @param endpoint Remote endpoint address, set when known
  * @return 0 if success, -1 otherwise
 **/
-int ipip_encap(uint8_t *buf, int size)
+static int ipip_encapPacket(struct Tunnel_s *tunnel, uint8_t *buf, int size, in_addr_t *endpoint)
 {
-    struct ip *outer = (struct ip*)buf; //set pointer to outer IP header
     struct ip *inner = (struct ip*)(&buf[IPV4_HEADER_SIZE]); //get inner IP header
 
-    if(inner->ip_v != IPVX_HEADER_VERSION_4) //not IPv4 packet somehow
+    if(inner->ip_v != IPVX_HEADER_VERSION_4) //not IPv4 packet somehow
+    {
+        DROP(DROP_NOT_IP, &(buf[IPV4_HEADER_SIZE]), size);
+        return -1;
+    }
+
+    if(inner->ip_hl != (IPV4_HEADER_SIZE / 4)) //drop packets than don't have standard headers
+    {
+        LOG(LOG_DEBUG, "Blocking IPv4 packet with header length other than %d bytes.\n", IPV4_HEADER_SIZE);
+        DROP(DROP_HEADER_LENGTH, &(buf[IPV4_HEADER_SIZE]), size);
+        return -1;
+    }
+
+    //when receiving packet its length is restricted to (max IP packet size - IPv4 header size), so that it can be encapsulated
+    //check if packet is too big for encapsulation (or length field in header is broken)
+    if(ntohs(inner->ip_len) != size)
+    {
+        LOG(LOG_DEBUG, "Packet received on tunnel interface has inconsistent size or is too big to be tunneled\n");
+        DROP(DROP_LENGTH_MISMATCH, &(buf[IPV4_HEADER_SIZE]), size);
+        return -1;
+    }
+
+    //TTL behavior according to RFC 2003
+    if(inner->ip_ttl == 0) //TTL=0, drop packet
+    {
+        DROP(DROP_TTL_ZERO, &(buf[IPV4_HEADER_SIZE]), size);
+        return 0;
+    }
+    else if(inner->ip_ttl == 1) //TTL=1, will be 0 after decrementation, send ICMP Time Exceeded
+    {
+        //time exceeded, send ICMP response: Time Exceeded
+        LOG(LOG_DEBUG, "Time exceeded during IPIP encapsulation\n");
+        DROP(DROP_TTL_EXCEEDED, &(buf[IPV4_HEADER_SIZE]), size);
+        return ICMP_send(sockfd, &(buf[IPV4_HEADER_SIZE]), size, __atomic_load_n(&(tunnel->local.s_addr), __ATOMIC_RELAXED),
+                    ICMP_TIME_EXCEEDED, ICMP_EXC_TTL, 0);
+    }
+
+    if(config.tun4in6) //IPv6 underlay with fixed remote endpoint
+        return ip4in6_encap(tunnel, buf, size);
+
+    Perf_stage(STATS_STAGE_ROUTE);
+    in_addr_t remote;
+    int found = ipip_getDestination(tunnel, inner->ip_dst.s_addr, &remote); //get tunnel (outer) destination
+    *endpoint = remote;
+
+    if(found == ROUTE_PENDING) //remote address is being resolved, hold unmodified packet until it is known
+        return ipip_hold(tunnel, buf, size, AF_INET, &(inner->ip_dst.s_addr));
+
+    if(remote == 0) //do not send when remote address is not known
+    {
+        LOG(LOG_DEBUG, "Unknown remote address!\n");
+        DROP(DROP_NO_ROUTE, &(buf[IPV4_HEADER_SIZE]), size);
+        //set ICMP destination unreachable - host unknown
+        ICMP_send(sockfd, &(buf[IPV4_HEADER_SIZE]), size, __atomic_load_n(&(tunnel->local.s_addr), __ATOMIC_RELAXED),
+            ICMP_DEST_UNREACH, ICMP_HOST_UNKNOWN, 0);
+        return -1;
+    }
+
+    if(remote == inner->ip_src.s_addr) //drop if tunnel destination is the same as inner packet source (RFC 2003)
+    {
+        LOG(LOG_DEBUG, "Dropping packet: tunnel destination = datagram source\n");
+        DROP(DROP_LOOP, &(buf[IPV4_HEADER_SIZE]), size);
+        return -1;
+    }
+
+    struct Peer_s *peer;
+    if(ipip_getPeer(tunnel, remote, &peer) < 0)
+    {
+        DROP(DROP_NOT_PEER, &(buf[IPV4_HEADER_SIZE]), size);
+        //set ICMP destination unreachable - host unknown
+        ICMP_send(sockfd, &(buf[IPV4_HEADER_SIZE]), size, __atomic_load_n(&(tunnel->local.s_addr), __ATOMIC_RELAXED),
+            ICMP_DEST_UNREACH, ICMP_HOST_UNKNOWN, 0);
+        return -1;
+    }
+
+    const struct OuterTemplate_s *t = ipip_selectTemplate((peer != NULL) ? &(peer->template) : NULL, templates,
+        __atomic_load_n(&(tunnel->local.s_addr), __ATOMIC_RELAXED), remote, IPV4_HEADER_PROTO_IPIP);
+    uint16_t mtu = Pmtu_get(remote); //0 if not known, kernel reports interface MTU when the packet doesn't fit
+    while(1) //second pass only when path MTU has just been learned from send error
+    {
+        int tooBig = (mtu != 0) && ((size + overhead) > mtu);
+        if(tooBig && (inner->ip_off & htons(IP_DF))) //too big and fragmentation not allowed
+        {
+            LOG(LOG_DEBUG, "Packet too big for path MTU %u\n", (unsigned int)mtu);
+            DROP(DROP_TOO_BIG, &(buf[IPV4_HEADER_SIZE]), size);
+            //send ICMP destination unreachable - fragmentation needed with tunnel MTU (RFC 1191)
+            ICMP_send(sockfd, &(buf[IPV4_HEADER_SIZE]), size, __atomic_load_n(&(tunnel->local.s_addr), __ATOMIC_RELAXED),
+                ICMP_DEST_UNREACH, ICMP_FRAG_NEEDED, htonl(mtu - overhead));
+            return -1;
+        }
+
+        //decrement TTL and update checksum incrementally
+        Perf_stage(STATS_STAGE_CHECKSUM);
+        Checksum_replace8(&(inner->ip_sum), (uint8_t*)inner, offsetof(struct ip, ip_ttl), inner->ip_ttl - 1);
+
+        if(tooBig) //fragment inner packet, so that the underlay doesn't have to
+            return ipip_fragment(buf, size, t, remote, peer, mtu);
+
+        //fill outer header: copy TOS and don't fragment flag only (set other bits to 0)
+        int sent = ipip_output(sockfd, buf, size, t, inner->ip_tos, inner->ip_off & htons(IP_DF), remote, IPV4_HEADER_PROTO_IPIP);
+        if((sent == IPIP_SEND_TOO_BIG) && (mtu == 0) && ((mtu = Pmtu_get(remote)) != 0))
+        {
+            //path MTU has just been learned from send error, restore TTL and fragment or reject the packet
+            Checksum_replace8(&(inner->ip_sum), (uint8_t*)inner, offsetof(struct ip, ip_ttl), inner->ip_ttl + 1);
+            continue;
+        }
+        if(sent == IPIP_SEND_TOO_BIG)
+            DROP(DROP_TOO_BIG, &(buf[IPV4_HEADER_SIZE]), size);
+        if(sent < 0)
+            return -1;
+        break;
+    }
+
+    if(peer != NULL)
+        ipip_count(&(peer->stats.txPackets), &(peer->stats.txBytes), size + overhead);
+    return 0;
+}
+
+/**
+ * @brief Encapsulate IPv4 packet and send as IPv4 packet, fire entry and return probes
+ * @param tunnel Tunnel the packet was received from
+ * @param buf Packet buffer with additional space for outer header (inner header must at buf + IPV4_HEADER_SIZE)
+ * @param size Size of packet being encapsulated (inner data excluding space left for outer header)
+ * @return 0 if success, -1 otherwise
+**/
+int ipip_encap(struct Tunnel_s *tunnel, uint8_t *buf, int size)
+{
+    in_addr_t endpoint = INADDR_ANY; //remote endpoint, stays INADDR_ANY for IPv6 underlay or when not known
+    PROBE1(ipip_encap_entry, size);
+    int ret = ipip_encapPacket(tunnel, buf, size, &endpoint);
+    PROBE3(ipip_encap_return, size, endpoint, ret);
+    return ret;
+}
+
+/**
+ * @brief Encapsulate IPv6 packet and send as IPv4 packet
+ * @param tunnel Tunnel the packet was received from
+ * @param buf Packet buffer with additional space for outer header (inner header must at buf + IPV4_HEADER_SIZE)
+ * @param size Size of packet being encapsulated (inner data excluding space left for outer header)
+ * @param endpoint Remote endpoint address, set when known
+ * @return 0 if success, -1 otherwise
+**/
+static int ip6ip_encapPacket(struct Tunnel_s *tunnel, uint8_t *buf, int size, in_addr_t *endpoint)
+{
+    struct ip6_hdr *inner = (struct ip6_hdr*)(&buf[IPV4_HEADER_SIZE]); //get inner IP header
+
+    if(((inner->ip6_ctlun.ip6_un2_vfc >> 4) & 0xF) != IPVX_HEADER_VERSION_6) //not IPv6 packet somehow
+    {
+        DROP(DROP_NOT_IP, &(buf[IPV4_HEADER_SIZE]), size);
+        return -1;
+    }
+
+    //when receiving packet its length is restricted to (max IP packet size - IPv4 header size), so that it can be encapsulated
+    //check if packet is too big for encapsulation (or length field in header is broken)
+    if(ntohs(inner->ip6_ctlun.ip6_un1.ip6_un1_plen) != (size - IPV6_HEADER_SIZE))
+    {
+        LOG(LOG_DEBUG, "Packet received on tunnel interface has inconsistent size or is too big to be tunneled\n");
+        DROP(DROP_LENGTH_MISMATCH, &(buf[IPV4_HEADER_SIZE]), size);
+        return -1;
+    }
+
+    //Hop limit behavior according to RFC 4213
+    if(inner->ip6_ctlun.ip6_un1.ip6_un1_hlim == 0) //Hop limit=0, drop packet
+    {
+        DROP(DROP_TTL_ZERO, &(buf[IPV4_HEADER_SIZE]), size);
+        return 0;
+    }
+    else if(inner->ip6_ctlun.ip6_un1.ip6_un1_hlim == 1) //Hop limit=1, will be 0 after decrementation, send ICMP Time Exceeded
+    {
+        LOG(LOG_DEBUG, "Time exceeded during IP6IP encapsulation\n");
+        DROP(DROP_TTL_EXCEEDED, &(buf[IPV4_HEADER_SIZE]), size);
+        //time exceeded, send ICMP response: Time Exceeded
+        return ICMP_send6(sock6fd, &(buf[IPV4_HEADER_SIZE]), size, (ipv6_isEqual(config.local6, in6addr_any)) ? in6addr_any : config.local6,
+                     ICMP6_TIME_EXCEEDED, ICMP6_TIME_EXCEED_TRANSIT, 0);
+    }
+
+    if(config.tun6in6) //IPv6 underlay with fixed remote endpoint
+        return ip6in6_encap(buf, size);
+
+    Perf_stage(STATS_STAGE_ROUTE);
+    in_addr_t remote;
+    int found = ipip_getDestination6(tunnel, inner->ip6_dst, &remote); //get tunnel (outer) destination
+    *endpoint = remote;
+
+    if(found == ROUTE_PENDING) //remote address is being resolved, hold unmodified packet until it is known
+        return ipip_hold(tunnel, buf, size, AF_INET6, &(inner->ip6_dst));
+
+    if(remote == 0) //do not send when remote address is not known
+    {
+        LOG(LOG_DEBUG, "Unknown remote address!\n");
+        DROP(DROP_NO_ROUTE, &(buf[IPV4_HEADER_SIZE]), size);
+        //set ICMP destination unreachable - host unknown
+        return ICMP_send6(sock6fd, &(buf[IPV4_HEADER_SIZE]), size, (ipv6_isEqual(config.local6, in6addr_any)) ? in6addr_any : config.local6,
+                     ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOROUTE, 0);
+        return -1;
+    }
+
+    struct Peer_s *peer;
+    if(ipip_getPeer(tunnel, remote, &peer) < 0)
+    {
+        DROP(DROP_NOT_PEER, &(buf[IPV4_HEADER_SIZE]), size);
+        //set ICMP destination unreachable - no route
+        ICMP_send6(sock6fd, &(buf[IPV4_HEADER_SIZE]), size, (ipv6_isEqual(config.local6, in6addr_any)) ? in6addr_any : config.local6,
+            ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOROUTE, 0);
+        return -1;
+    }
+
+    const struct OuterTemplate_s *t = ipip_selectTemplate((peer != NULL) ? &(peer->template6) : NULL, templates6,
+        __atomic_load_n(&(tunnel->local.s_addr), __ATOMIC_RELAXED), remote, IPV4_HEADER_PROTO_IP6IP);
+    uint16_t mtu = Pmtu_get(remote); //0 if not known, kernel reports interface MTU when the packet doesn't fit
+    while(1) //second pass only when path MTU has just been learned from send error
+    {
+        int tooBig = (mtu != 0) && ((size + overhead) > mtu);
+        if(tooBig && (size > IPV6_MIN_MTU)) //too big, IPv6 sender must reduce packet size (RFC 4213)
+        {
+            LOG(LOG_DEBUG, "Packet too big for path MTU %u\n", (unsigned int)mtu);
+            DROP(DROP_TOO_BIG, &(buf[IPV4_HEADER_SIZE]), size);
+            //send ICMPv6 Packet Too Big with tunnel MTU, but not lower than IPv6 minimum MTU
+            ICMP_send6(sock6fd, &(buf[IPV4_HEADER_SIZE]), size, (ipv6_isEqual(config.local6, in6addr_any)) ? in6addr_any : config.local6,
+                ICMP6_PACKET_TOO_BIG, 0, htonl(((mtu - overhead) < IPV6_MIN_MTU) ? IPV6_MIN_MTU : (mtu - overhead)));
+            return -1;
+        }
+
+        Perf_stage(STATS_STAGE_CHECKSUM);
+        inner->ip6_ctlun.ip6_un1.ip6_un1_hlim--; //decrement hop limit
+
+        if(tooBig) //tunnel MTU is lower than IPv6 minimum MTU: fragment outer packet (RFC 4213)
+            return ip6ip_fragment(buf, size, t, remote, peer, mtu);
+
+        //fill outer header: no TOS specified anyway, no fragmentation flags
+        int sent = ipip_output(sock6in4fd, buf, size, t, 0, 0, remote, IPV4_HEADER_PROTO_IP6IP);
+        if((sent == IPIP_SEND_TOO_BIG) && (mtu == 0) && ((mtu = Pmtu_get(remote)) != 0))
+        {
+            //path MTU has just been learned from send error, restore hop limit and fragment or reject the packet
+            inner->ip6_ctlun.ip6_un1.ip6_un1_hlim++;
+            continue;
+        }
+        if(sent == IPIP_SEND_TOO_BIG)
+            DROP(DROP_TOO_BIG, &(buf[IPV4_HEADER_SIZE]), size);
+        if(sent < 0)
+            return -1;
+        break;
+    }
+
+    if(peer != NULL)
+        ipip_count(&(peer->stats.txPackets), &(peer->stats.txBytes), size + overhead);
+    return 0;
+}
+
+/**
+ * @brief Encapsulate IPv6 packet and send as IPv4 packet, fire entry and return probes
+ * @param tunnel Tunnel the packet was received from
+ * @param buf Packet buffer with additional space for outer header (inner header must at buf + IPV4_HEADER_SIZE)
+ * @param size Size of packet being encapsulated (inner data excluding space left for outer header)
+ * @return 0 if success, -1 otherwise
+**/
+int ip6ip_encap(struct Tunnel_s *tunnel, uint8_t *buf, int size)
+{
+    in_addr_t endpoint = INADDR_ANY; //remote endpoint, stays INADDR_ANY for IPv6 underlay or when not known
+    PROBE1(ip6ip_encap_entry, size);
+    int ret = ip6ip_encapPacket(tunnel, buf, size, &endpoint);
+    PROBE3(ip6ip_encap_return, size, endpoint, ret);
+    return ret;
+}
+
+/**
+ * @brief Find tunnel for received IPv4 underlay packet
+ * @param source Outer source address
+ * @param destination Outer destination address
+ * @param peer Peer the packet was received from or NULL if the peer table is not used
+ * @param packet Received packet (for drop reporting)
+ * @param size Received packet size
+ * @return Tunnel or NULL if the packet doesn't belong to any tunnel or the sender is not a configured peer
+**/
+static struct Tunnel_s* ipip_findTunnel(in_addr_t source, in_addr_t destination, struct Peer_s **peer, const uint8_t *packet, int size)
+{
+    //find tunnel by outer addresses, there is none when the sender or the destination address does not match any tunnel
+    struct Tunnel_s *tunnel = Tunnel_find(source, destination);
+    *peer = NULL;
+    if(tunnel == NULL)
+    {
+        DROP(DROP_NO_TUNNEL, packet, size);
+        return NULL;
+    }
+
+    if(tunnel->remote == INADDR_ANY) //no fixed remote address, check peer table
+    {
+        *peer = Peer_find(source);
+        if((*peer == NULL) && Peer_enabled()) //sender is not a configured peer
+        {
+            DROP(DROP_NOT_PEER, packet, size);
+            return NULL;
+        }
+    }
+    return tunnel;
+}
+
+/**
+ * @brief Pass decapsulated IPv4 packet to its tunnel
+ * @param tunnel Tunnel
+ * @param peer Peer the packet was received from or NULL if the peer table is not used
+ * @param packet Inner packet
+ * @param size Inner packet size
+ * @param outerSize Size of removed outer headers (for counters)
+ * @return 0 if success, -1 otherwise
+**/
+static int ipip_deliver(struct Tunnel_s *tunnel, struct Peer_s *peer, uint8_t *packet, int size, int outerSize)
+{
+    Perf_stage(STATS_STAGE_CHECKSUM);
+    struct ip *inner = (struct ip*)packet; //get inner IP header
+
+    if(size < IPV4_HEADER_SIZE) //the inner packet must contain at least the header
+    {
+        LOG(LOG_DEBUG, "Received IPIP-like packet, but it is too short (%d bytes)\n", size + outerSize);
+        DROP(DROP_TOO_SHORT, packet, size);
+        return -1;
+    }
+
+    if(inner->ip_v != IPVX_HEADER_VERSION_4) //inner packet is not an IPv4 packet
+    {
+        DROP(DROP_NOT_IP, packet, size);
         return -1;
+    }
 
+    //header length is checked first, so that checksum never covers data outside of header
     if(inner->ip_hl != (IPV4_HEADER_SIZE / 4)) //drop packets than don't have standard headers
     {
-        PRINT(LOG_DEBUG, "Blocking IPv4 packet with header length other than %d bytes.\n", IPV4_HEADER_SIZE);
+        LOG(LOG_DEBUG, "Blocking IPv4 packet with header length other than %d bytes.\n", IPV4_HEADER_SIZE);
+        DROP(DROP_HEADER_LENGTH, packet, size);
         return -1;
     }
 
-    //when receiving packet its length is restricted to (max IP packet size - IPv4 header size), so that it can be encapsulated
-    //check if packet is too big for encapsulation (or length field in header is broken)
-    if(ntohs(inner->ip_len) != size)
+    //inner header is verified by kernel again when written to TUN interface
+    if((config.decapCheck != DECAP_CHECK_MINIMAL) && (Checksum_compute(inner, IPV4_HEADER_SIZE) != 0)) //checksum does not match
     {
-        PRINT(LOG_DEBUG, "Packet received on tunnel interface has inconsistent size or is too big to be tunneled\n");
+        LOG(LOG_DEBUG, "Inner packet checksum check failed\n");
+        DROP(DROP_INNER_CHECKSUM, packet, size);
         return -1;
     }
 
-    //TTL behavior according to RFC 2003
-    if(inner->ip_ttl == 0) //TTL=0, drop packet
-        return 0;
-    else if(inner->ip_ttl == 1) //TTL=1, will be 0 after decrementation, send ICMP Time Exceeded
+    if(inner->ip_ttl == 0) //TTL exceeded - drop packet (RFC 2003)
     {
-        //time exceeded, send ICMP response: Time Exceeded
-        PRINT(LOG_DEBUG, "Time exceeded during IPIP encapsulation\n");
-        return ICMP_send(sockfd, &(buf[IPV4_HEADER_SIZE]), size, (config.local.s_addr == 0) ? 0 : config.local.s_addr,
-                    ICMP_TIME_EXCEEDED, ICMP_EXC_TTL, 0);
+        DROP(DROP_TTL_ZERO, packet, size);
+        return 0;
     }
 
-    inner->ip_ttl--; //decrement TTL
-    ipv4_checksum((uint8_t*)inner, inner->ip_hl * 4); //recalculate checksum
-    
-    //fill outer header
-    outer->ip_v = IPVX_HEADER_VERSION_4; //IPv4 packet
-    outer->ip_hl = IPV4_HEADER_SIZE / 4; //header size in 32-bit units
-    outer->ip_tos = inner->ip_tos; //copy TOS
-    //outer->ip_len = size + IPV4_HEADER_SIZE; //whole packet is the inner packet + outer header
-    //kernel fills length field anyway
-    outer->ip_p = IPV4_HEADER_PROTO_IPIP; //IPIP protocol used
-    outer->ip_id = 0; //no fragmentation
-    outer->ip_off = inner->ip_off & htons(IP_DF); //copy don't fragment flag only. Set other bits to 0
-    outer->ip_ttl = config.ttl; //set TTL
-    outer->ip_id = 0; //let kernel fill ID field
-
-    if(config.local.s_addr != 0) //use specified local address?
-        outer->ip_src = config.local;
-    else
-        outer->ip_src.s_addr = 0; //else let kernel fill source IP
-
-    struct sockaddr_in dest;
-    memset(&dest, 0, sizeof(dest));
-    dest.sin_family = AF_INET;
-    dest.sin_addr.s_addr = ipip_getDestination(inner->ip_dst.s_addr); //get tunnel (outer) destination
-
-    if(dest.sin_addr.s_addr == 0) //do not send when remote address is not known
+    if(ntohs(inner->ip_len) != size) //inner packet has different length than specified in header
     {
-        PRINT(LOG_DEBUG, "Unknown remote address!\n");
-        //set ICMP destination unreachable - host unknown
-        ICMP_send(sockfd, &(buf[IPV4_HEADER_SIZE]), size, (config.local.s_addr == 0) ? 0 : config.local.s_addr,
-            ICMP_DEST_UNREACH, ICMP_HOST_UNKNOWN, 0);
+        DROP(DROP_LENGTH_MISMATCH, packet, size);
+        LOG(LOG_DEBUG, "Packet length inconsistent (header claims %d bytes, actually has %d bytes)\n", ntohs(inner->ip_len), size);
         return -1;
     }
 
-    outer->ip_dst.s_addr = dest.sin_addr.s_addr; //fill outer destination field
-
-    if(outer->ip_dst.s_addr == inner->ip_src.s_addr) //drop if tunnel destination is the same as inner packet source (RFC 2003)
+    if((peer != NULL) && !Peer_allowed(peer, inner->ip_src.s_addr)) //inner source address is not allowed for this peer
     {
-        PRINT(LOG_DEBUG, "Dropping packet: tunnel destination = datagram source\n");
+        LOG(LOG_DEBUG, "Inner source address not allowed for peer\n");
+        DROP(DROP_SOURCE_NOT_ALLOWED, packet, size);
+        __atomic_fetch_add(&(peer->stats.rxRejected), 1, __ATOMIC_RELAXED);
         return -1;
     }
+
+    Perf_stage(STATS_STAGE_SEND);
+    int written = write(tunnel->fd, packet, size); //write to TUN interface without outer header
     
-    int sent = sendto(sockfd, buf, size + IPV4_HEADER_SIZE, 0, (struct sockaddr*)(&dest), sizeof(dest)); //send encapsulated packet
-    
-    if(sent < 0) //error
+    if(written < 0) //error
     {
-        DEBUG(LOG_ERR, "Encapsulated packet TX failed");
+        DROP(DROP_WRITE_ERROR, packet, size);
+        Stats_add(STATS_IPV4, STATS_TUN_TX_ERRORS, 1);
+        LOG_ERRNO(LOG_ERR, "Decapsulated packet write failed");
         return -1;
     }
-    else if(sent != (size + IPV4_HEADER_SIZE)) //number of bytes actually sent is different than number of bytes to be sent
+    else if(written != size) //number of bytes actually sent is different than number of bytes to be sent
     {
-        PRINT(LOG_WARNING, "Encapsulated packet TX problem: %d bytes to send, %d actually sent\n", size + IPV4_HEADER_SIZE, sent);
+        DROP(DROP_WRITE_SHORT, packet, size);
+        Stats_add(STATS_IPV4, STATS_TUN_TX_ERRORS, 1);
+        LOG(LOG_WARNING, "Decapsulated packet write problem: %d bytes to write, %d actually written\n", size, written);
         return -1;
     }
 
+    Stats_count(STATS_IPV4, STATS_TUN_TX_PACKETS, size);
+    Latency_done(STATS_DECAP);
+    Perf_done();
+    Capture_written(packet, size);
+    Ipfix_written(packet, size);
+    __atomic_store_n(&(tunnel->rxActivity), tunnel->rxActivity + 1, __ATOMIC_RELAXED); //increments lost between socket threads don't matter
+    if(peer != NULL)
+        ipip_count(&(peer->stats.rxPackets), &(peer->stats.rxBytes), size + outerSize);
     return 0;
 }
 
 /**
- * @brief Encapsulate IPv6 packet and send as IPv4 packet
- * @param buf Packet buffer with additional space for outer header (inner header must at buf + IPV4_HEADER_SIZE)
- * @param size Size of packet being encapsulated (inner data excluding space left for outer header)
+ * @brief Pass decapsulated IPv6 packet to its tunnel
+ * @param tunnel Tunnel
+ * @param peer Peer the packet was received from or NULL if the peer table is not used
+ * @param packet Inner packet
+ * @param size Inner packet size
+ * @param outerSize Size of removed outer headers (for counters)
  * @return 0 if success, -1 otherwise
 **/
-int ip6ip_encap(uint8_t *buf, int size)
-{   
-    struct ip *outer = (struct ip*)buf; //set pointer to outer IP header
-    struct ip6_hdr *inner = (struct ip6_hdr*)(&buf[IPV4_HEADER_SIZE]); //get inner IP header
+static int ip6ip_deliver(struct Tunnel_s *tunnel, struct Peer_s *peer, uint8_t *packet, int size, int outerSize)
+{
+    Perf_stage(STATS_STAGE_CHECKSUM);
+    struct ip6_hdr *inner = (struct ip6_hdr*)packet; //get inner IP header
 
-    if(((inner->ip6_ctlun.ip6_un2_vfc >> 4) & 0xF) != IPVX_HEADER_VERSION_6) //not IPv6 packet somehow
+    if(size < IPV6_HEADER_SIZE) //the inner packet must contain at least the header
+    {
+        LOG(LOG_DEBUG, "Received IP6IP-like packet, but it is too short (%d bytes)\n", size + outerSize);
+        DROP(DROP_TOO_SHORT, packet, size);
         return -1;
+    }
 
-    //when receiving packet its length is restricted to (max IP packet size - IPv4 header size), so that it can be encapsulated
-    //check if packet is too big for encapsulation (or length field in header is broken)
-    if(ntohs(inner->ip6_ctlun.ip6_un1.ip6_un1_plen) != (size - IPV6_HEADER_SIZE))
+    if((inner->ip6_vfc >> 4) != IPVX_HEADER_VERSION_6) //inner packet is not an IPv6 packet
     {
-        PRINT(LOG_DEBUG, "Packet received on tunnel interface has inconsistent size or is too big to be tunneled\n");
+        DROP(DROP_NOT_IP, packet, size);
         return -1;
     }
 
-    //Hop limit behavior according to RFC 4213
-    if(inner->ip6_ctlun.ip6_un1.ip6_un1_hlim == 0) //Hop limit=0, drop packet
-        return 0;
-    else if(inner->ip6_ctlun.ip6_un1.ip6_un1_hlim == 1) //Hop limit=1, will be 0 after decrementation, send ICMP Time Exceeded
+    if(inner->ip6_hlim == 0) //hop limit exceeded - drop packet
     {
-        PRINT(LOG_DEBUG, "Time exceeded during IP6IP encapsulation\n");
-        //time exceeded, send ICMP response: Time Exceeded
-        return ICMP_send6(sock6fd, &(buf[IPV4_HEADER_SIZE]), size, (ipv6_isEqual(config.local6, in6addr_any)) ? in6addr_any : config.local6,
-                     ICMP6_TIME_EXCEEDED, ICMP6_TIME_EXCEED_TRANSIT, 0);
+        DROP(DROP_TTL_ZERO, packet, size);
+        return 0;
     }
 
-    inner->ip6_ctlun.ip6_un1.ip6_un1_hlim--; //decrement hop limit
-    
-    //fill outer header
-    outer->ip_v = IPVX_HEADER_VERSION_4; //IPv4 packet
-    outer->ip_hl = IPV4_HEADER_SIZE / 4; //header size in 32-bit units
-    outer->ip_tos = 0; //no TOS specified anyway
-    //outer->ip_len = size + IPV4_HEADER_SIZE; //whole packet is the inner packet + outer header
-    //kernel fills length field anyway
-    outer->ip_p = IPV4_HEADER_PROTO_IP6IP; //IP6IP protocol used
-    outer->ip_id = 0; //no fragmentation
-    outer->ip_off = 0;
-    outer->ip_ttl = config.ttl; //set TTL
-    outer->ip_id = 0; //let kernel fill the ID field
-
-    if(config.local.s_addr != 0) //use specified local address?
-        outer->ip_src = config.local;
-    else
-        outer->ip_src.s_addr = 0; //else let kernel fill source IP
-
-
-    struct sockaddr_in dest;
-    memset(&dest, 0, sizeof(dest));
-    dest.sin_family = AF_INET;
-    dest.sin_addr.s_addr = ipip_getDestination6(inner->ip6_dst); //get tunnel (outer) destination
+    if(ntohs(inner->ip6_plen) != (size - IPV6_HEADER_SIZE)) //inner packet has different length than specified in header
+    {
+        DROP(DROP_LENGTH_MISMATCH, packet, size);
+        LOG(LOG_DEBUG, "Packet length inconsistent (header claims %d bytes, actually has %d bytes)\n", ntohs(inner->ip6_plen), size - IPV6_HEADER_SIZE);
+        return -1;
+    }
 
-    if(dest.sin_addr.s_addr == 0) //do not send when remote address is not known
+    if((peer != NULL) && !Peer_allowed6(peer, inner->ip6_src)) //inner source address is not allowed for this peer
     {
-        PRINT(LOG_DEBUG, "Unknown remote address!\n");
-        //set ICMP destination unreachable - host unknown
-        return ICMP_send6(sock6fd, &(buf[IPV4_HEADER_SIZE]), size, (ipv6_isEqual(config.local6, in6addr_any)) ? in6addr_any : config.local6,
-                     ICMP6_DST_UNREACH, ICMP6_DST_UNREACH_NOROUTE, 0);
+        LOG(LOG_DEBUG, "Inner source address not allowed for peer\n");
+        DROP(DROP_SOURCE_NOT_ALLOWED, packet, size);
+        __atomic_fetch_add(&(peer->stats.rxRejected), 1, __ATOMIC_RELAXED);
         return -1;
     }
 
-    outer->ip_dst.s_addr = dest.sin_addr.s_addr; //fill outer destination field
-    
-    int sent = sendto(sockfd, buf, size + IPV4_HEADER_SIZE, 0, (struct sockaddr*)(&dest), sizeof(dest)); //send encapsulated packet
+    Perf_stage(STATS_STAGE_SEND);
+    int written = write(tunnel->fd, packet, size); //write to TUN interface without outer header
     
-    if(sent < 0) //error
+    if(written < 0) //error
     {
-        DEBUG(LOG_ERR, "Encapsulated packet TX failed");
+        DROP(DROP_WRITE_ERROR, packet, size);
+        Stats_add(STATS_IPV6, STATS_TUN_TX_ERRORS, 1);
+        LOG_ERRNO(LOG_ERR, "Decapsulated packet write failed");
         return -1;
     }
-    else if(sent != (size + IPV4_HEADER_SIZE)) //number of bytes actually sent is different than number of bytes to be sent
+    else if(written != size) //number of bytes actually sent is different than number of bytes to be sent
     {
-        PRINT(LOG_WARNING, "Encapsulated packet TX problem: %d bytes to send, %d actually sent\n", size + IPV4_HEADER_SIZE, sent);
+        DROP(DROP_WRITE_SHORT, packet, size);
+        Stats_add(STATS_IPV6, STATS_TUN_TX_ERRORS, 1);
+        LOG(LOG_WARNING, "Decapsulated packet write problem: %d bytes to write, %d actually written\n", size, written);
         return -1;
     }
 
+    Stats_count(STATS_IPV6, STATS_TUN_TX_PACKETS, size);
+    Latency_done(STATS_DECAP);
+    Perf_done();
+    Capture_written(packet, size);
+    Ipfix_written(packet, size);
+    __atomic_store_n(&(tunnel->rxActivity), tunnel->rxActivity + 1, __ATOMIC_RELAXED); //increments lost between socket threads don't matter
+    if(peer != NULL)
+        ipip_count(&(peer->stats.rxPackets), &(peer->stats.rxBytes), size + outerSize);
     return 0;
 }
 
@@ -340,80 +1496,57 @@ int ip6ip_encap(uint8_t *buf, int size)
  * @param size Size of encapsulated packet
  * @return 0 if success, -1 otherwise
 **/
-int ipip_decap(uint8_t *buf, int size)
+static int ipip_decapPacket(uint8_t *buf, int size)
 {
     if(size < (2 * IPV4_HEADER_SIZE)) //the encapsulated packet must contain at least both headers
     {
-        PRINT(LOG_DEBUG, "Received IPIP-like packet, but it is too short (%d bytes)\n", size);
+        LOG(LOG_DEBUG, "Received IPIP-like packet, but it is too short (%d bytes)\n", size);
+        DROP(DROP_TOO_SHORT, buf, size);
         return -1;
     }
     
     struct ip *outer = (struct ip*)buf; //set pointer to outer IP header
-    struct ip *inner = (struct ip*)(&buf[IPV4_HEADER_SIZE]); //get inner IP header
-
-    //there is a fixed remote address set, but sender address in received packet is different
-    if((config.remote.s_addr != INADDR_ANY) && (config.remote.s_addr != outer->ip_src.s_addr))
-        return 0;
-
-    //there is a fixed local address set, but destination address in received packet is different
-    if((config.local.s_addr != INADDR_ANY) && (config.local.s_addr != outer->ip_dst.s_addr))
-        return 0;
-
-    if(inner->ip_v != IPVX_HEADER_VERSION_4) //inner packet is not an IPv4 packet
-        return -1;
-
-    uint16_t oldSum = outer->ip_sum; //store original checksum
-    ipv4_checksum((uint8_t*)outer, outer->ip_hl * 4); //recalculate checksum
-    if(oldSum != outer->ip_sum) //checksum does not match
-    {
-        PRINT(LOG_DEBUG, "Outer packet checksum check failed\n");
-        return -1;
-    }
-
-    oldSum = inner->ip_sum; //store original checksum
-    ipv4_checksum((uint8_t*)inner, inner->ip_hl * 4); //recalculate checksum
-    if(oldSum != inner->ip_sum) //checksum does not match
-    {
-        PRINT(LOG_DEBUG, "Inner packet checksum check failed\n");
-        return -1;
-    }
-
 
+    //header length is checked first, so that checksum never covers data outside of header
     if(outer->ip_hl != (IPV4_HEADER_SIZE / 4)) //drop packets than don't have standard headers
     {
-        PRINT(LOG_DEBUG, "Blocking IPv4 packet with header length other than %d bytes.\n", IPV4_HEADER_SIZE);
+        LOG(LOG_DEBUG, "Blocking IPv4 packet with header length other than %d bytes.\n", IPV4_HEADER_SIZE);
+        DROP(DROP_HEADER_LENGTH, buf, size);
         return -1;
     }
 
-    if(inner->ip_hl != (IPV4_HEADER_SIZE / 4)) //drop packets than don't have standard headers
+    //outer header was already verified by kernel before raw socket delivery
+    if((config.decapCheck == DECAP_CHECK_STRICT) && (Checksum_compute(outer, IPV4_HEADER_SIZE) != 0)) //checksum does not match (sum of valid header including checksum is 0xFFFF)
     {
-        PRINT(LOG_DEBUG, "Blocking IPv4 packet with header length other than %d bytes.\n", IPV4_HEADER_SIZE);
+        LOG(LOG_DEBUG, "Outer packet checksum check failed\n");
+        DROP(DROP_OUTER_CHECKSUM, buf, size);
         return -1;
     }
 
-    if(inner->ip_ttl == 0) //TTL exceeded - drop packet (RFC 2003)
+    Perf_stage(STATS_STAGE_ROUTE);
+    struct Peer_s *peer;
+    struct Tunnel_s *tunnel = ipip_findTunnel(outer->ip_src.s_addr, outer->ip_dst.s_addr, &peer, buf, size);
+    if(tunnel == NULL)
         return 0;
+    return ipip_deliver(tunnel, peer, &(buf[IPV4_HEADER_SIZE]), size - IPV4_HEADER_SIZE, IPV4_HEADER_SIZE);
+}
 
-    if(ntohs(inner->ip_len) != (size - IPV4_HEADER_SIZE)) //inner packet has different length than specified in header
-    {
-        PRINT(LOG_DEBUG, "Packet length inconsistent (header claims %d bytes, actually has %d bytes)\n", ntohs(inner->ip_len), size - IPV4_HEADER_SIZE);
-        return -1;
-    }
-
-    int written = write(tunfd, &(buf[IPV4_HEADER_SIZE]), size - IPV4_HEADER_SIZE); //write to TUN interface without outer header
-    
-    if(written < 0) //error
-    {
-        DEBUG(LOG_ERR, "Decapsulated packet write failed");
-        return -1;
-    }
-    else if(written != (size - IPV4_HEADER_SIZE)) //number of bytes actually sent is different than number of bytes to be sent
-    {
-        PRINT(LOG_WARNING, "Decapsulated packet write problem: %d bytes to write, %d actually written\n", size - IPV4_HEADER_SIZE, written);
-        return -1;
-    }
-
-    return 0;
+/**
+ * @brief Decapsulate IPv4 packet and send as IPv4 packet, fire entry and return probes
+ * @param buf Encapsulated packet buffer
+ * @param size Size of encapsulated packet
+ * @return 0 if success, -1 otherwise
+**/
+int ipip_decap(uint8_t *buf, int size)
+{
+    in_addr_t endpoint = (size >= IPV4_HEADER_SIZE) ? ((struct ip*)buf)->ip_src.s_addr : INADDR_ANY; //remote endpoint
+    PROBE1(ipip_decap_entry, size);
+    Stats_count(STATS_IPV4, STATS_RX_PACKETS, size);
+    Capture_received(buf, size, AF_INET, &endpoint);
+    Ipfix_received(AF_INET, &endpoint);
+    int ret = ipip_decapPacket(buf, size);
+    PROBE3(ipip_decap_return, size, endpoint, ret);
+    return ret;
 }
 
 /**
@@ -422,125 +1555,273 @@ int ipip_decap(uint8_t *buf, int size)
  * @param size Size of encapsulated packet
  * @return 0 if success, -1 otherwise
 **/
-int ip6ip_decap(uint8_t *buf, int size)
+static int ip6ip_decapPacket(uint8_t *buf, int size)
 {
     if(size < (IPV4_HEADER_SIZE + IPV6_HEADER_SIZE)) //the encapsulated packet must contain at least both headers
     {
-        PRINT(LOG_DEBUG, "Received IP6IP-like packet, but it is too short (%d bytes)\n", size);
+        LOG(LOG_DEBUG, "Received IP6IP-like packet, but it is too short (%d bytes)\n", size);
+        DROP(DROP_TOO_SHORT, buf, size);
         return -1;
     }
     
     struct ip *outer = (struct ip*)buf; //set pointer to outer IP header
-    struct ip6_hdr *inner = (struct ip6_hdr*)(&buf[IPV4_HEADER_SIZE]); //get inner IP header
-
-    //there is a fixed remote address set, but sender address in received packet is different
-    if((config.remote.s_addr != INADDR_ANY) && (config.remote.s_addr != outer->ip_src.s_addr))
-        return 0;
-
-    //there is a fixed local address set, but destination address in received packet is different
-    if((config.local.s_addr != INADDR_ANY) && (config.local.s_addr != outer->ip_dst.s_addr))
-        return 0;
-
-    if((inner->ip6_vfc >> 4) != IPVX_HEADER_VERSION_6) //inner packet is not an IPv6 packet
-        return -1;
 
-    uint16_t oldSum = outer->ip_sum; //store original checksum
-    ipv4_checksum((uint8_t*)outer, outer->ip_hl * 4); //recalculate checksum
-    if(oldSum != outer->ip_sum) //checksum does not match
+    if(outer->ip_hl != (IPV4_HEADER_SIZE / 4)) //drop packets than don't have standard headers
     {
-        PRINT(LOG_DEBUG, "Outer packet checksum check failed\n");
+        LOG(LOG_DEBUG, "Blocking IPv4 packet with header length other than %d bytes.\n", IPV4_HEADER_SIZE);
+        DROP(DROP_HEADER_LENGTH, buf, size);
         return -1;
     }
 
-    if(outer->ip_hl != (IPV4_HEADER_SIZE / 4)) //drop packets than don't have standard headers
+    //outer header was already verified by kernel before raw socket delivery
+    if((config.decapCheck == DECAP_CHECK_STRICT) && (Checksum_compute(outer, IPV4_HEADER_SIZE) != 0)) //checksum does not match (sum of valid header including checksum is 0xFFFF)
     {
-        PRINT(LOG_DEBUG, "Blocking IPv4 packet with header length other than %d bytes.\n", IPV4_HEADER_SIZE);
+        LOG(LOG_DEBUG, "Outer packet checksum check failed\n");
+        DROP(DROP_OUTER_CHECKSUM, buf, size);
         return -1;
     }
 
-    if(inner->ip6_hlim == 0) //hop limit exceeded - drop packet
+    Perf_stage(STATS_STAGE_ROUTE);
+    struct Peer_s *peer;
+    struct Tunnel_s *tunnel = ipip_findTunnel(outer->ip_src.s_addr, outer->ip_dst.s_addr, &peer, buf, size);
+    if(tunnel == NULL)
         return 0;
+    return ip6ip_deliver(tunnel, peer, &(buf[IPV4_HEADER_SIZE]), size - IPV4_HEADER_SIZE, IPV4_HEADER_SIZE);
+}
+
+/**
+ * @brief Decapsulate IPv6 packet and send as IPv4 packet, fire entry and return probes
+ * @param buf Encapsulated packet buffer
+ * @param size Size of encapsulated packet
+ * @return 0 if success, -1 otherwise
+**/
+int ip6ip_decap(uint8_t *buf, int size)
+{
+    in_addr_t endpoint = (size >= IPV4_HEADER_SIZE) ? ((struct ip*)buf)->ip_src.s_addr : INADDR_ANY; //remote endpoint
+    PROBE1(ip6ip_decap_entry, size);
+    Stats_count(STATS_IPV6, STATS_RX_PACKETS, size);
+    Capture_received(buf, size, AF_INET, &endpoint);
+    Ipfix_received(AF_INET, &endpoint);
+    int ret = ip6ip_decapPacket(buf, size);
+    PROBE3(ip6ip_decap_return, size, endpoint, ret);
+    return ret;
+}
 
-    if(ntohs(inner->ip6_plen) != (size - IPV4_HEADER_SIZE - IPV6_HEADER_SIZE)) //inner packet has different length than specified in header
+/**
+ * @brief Decapsulate received FOU/GUE packets and pass them to their tunnels
+ * @param buf Received data (one or more coalesced UDP payloads)
+ * @param size Received data size
+ * @param segment Size of each UDP payload, the last one can be shorter
+ * @param source Outer source address
+ * @param destination Outer destination address
+**/
+static void fou_decap(uint8_t *buf, int size, int segment, in_addr_t source, in_addr_t destination)
+{
+    Perf_stage(STATS_STAGE_ROUTE);
+    struct Peer_s *peer;
+    struct Tunnel_s *tunnel = ipip_findTunnel(source, destination, &peer, buf, size);
+    if(tunnel == NULL)
+        return;
+
+    uint64_t received = latencyStart; //coalesced packets share the receive timestamp
+    for(int pos = 0; pos < size; pos += segment)
     {
-        PRINT(LOG_DEBUG, "Packet length inconsistent (header claims %d bytes, actually has %d bytes)\n", ntohs(inner->ip6_plen), size - IPV4_HEADER_SIZE - IPV6_HEADER_SIZE);
-        return -1;
+        int len = ((size - pos) < segment) ? (size - pos) : segment;
+        latencyStart = received;
+        uint8_t protocol;
+        uint8_t *inner = Fou_parse(&buf[pos], &len, &protocol);
+        if(inner == NULL)
+        {
+            LOG(LOG_DEBUG, "Received FOU/GUE packet does not contain an IP packet\n");
+            DROP(DROP_BAD_ENCAP_HEADER, &(buf[pos]), ((size - pos) < segment) ? (size - pos) : segment);
+            continue;
+        }
+
+        if((protocol == IPV4_HEADER_PROTO_IPIP) && config.tun4in4)
+        {
+            Stats_count(STATS_IPV4, STATS_RX_PACKETS, len + overhead);
+            ipip_deliver(tunnel, peer, inner, len, overhead);
+        }
+        else if((protocol == IPV4_HEADER_PROTO_IP6IP) && config.tun6in4)
+        {
+            Stats_count(STATS_IPV6, STATS_RX_PACKETS, len + overhead);
+            ip6ip_deliver(tunnel, peer, inner, len, overhead);
+        }
+        else
+        {
+            LOG(LOG_DEBUG, "Received FOU/GUE packet carries protocol %u, but this tunneling mode is disabled\n", (unsigned int)protocol);
+            DROP(DROP_MODE_DISABLED, inner, len);
+        }
     }
+}
 
-    int written = write(tunfd, &(buf[IPV4_HEADER_SIZE]), size - IPV4_HEADER_SIZE); //write to TUN interface without outer header
-    
-    if(written < 0) //error
+
+#define IPIP_EPOLL_EVENTS 64 //maximum number of TUN interface events handled at once
+
+/**
+ * @brief Encapsulate and send packet received from TUN interface
+ * @param tunnel Tunnel
+ * @param buf Packet buffer with space for outer header
+ * @param size Received packet size
+**/
+static void ipip_processTunnel(struct Tunnel_s *tunnel, uint8_t *buf, int size)
+{
+    struct ip *inner = (struct ip*)(&buf[IPV4_HEADER_SIZE]); //get inner IP header (IPv4 temporarily - protocol version is still in the same place)
+
+    __atomic_store_n(&(tunnel->txActivity), tunnel->txActivity + 1, __ATOMIC_RELAXED); //single writer, no atomic increment needed
+    Capture_read(&buf[IPV4_HEADER_SIZE], size);
+    Ipfix_read(&buf[IPV4_HEADER_SIZE], size);
+
+    if(inner->ip_v == IPVX_HEADER_VERSION_4) //this is an IPv4 packet
     {
-        DEBUG(LOG_ERR, "Decapsulated packet write failed");
-        return -1;
+        Stats_count(STATS_IPV4, STATS_TUN_RX_PACKETS, size);
+        if(config.tun4in4 || config.tun4in6) //if enabled
+            ipip_encap(tunnel, buf, size); //encapsulate and send
     }
-    else if(written != (size - IPV4_HEADER_SIZE)) //number of bytes actually sent is different than number of bytes to be sent
+    else if(inner->ip_v == IPVX_HEADER_VERSION_6) //this is an IPv6 packet
     {
-        PRINT(LOG_WARNING, "Decapsulated packet write problem: %d bytes to write, %d actually written\n", size - IPV4_HEADER_SIZE, written);
-        return -1;
+        Stats_count(STATS_IPV6, STATS_TUN_RX_PACKETS, size);
+        if(config.tun6in4 || config.tun6in6) //if enabled
+            ip6ip_encap(tunnel, buf, size); //encapsulate and send
     }
-
-    return 0;
+    //non-IP packets are not processed
 }
 
-
 void *ipip_execTunnel(void *arg)
 {
     uint8_t buf[IP_MAX_PACKET_SIZE]; //create buffer for packets
     int size = 0; //buffer size
+    struct Tunnel_s *tunnel = Tunnel_get(0);
 
+    Reclaim_online();
     while(1)
     {
-        size = read(tunfd, &(buf[IPV4_HEADER_SIZE]), IP_MAX_PACKET_SIZE - IPV4_HEADER_SIZE); //receive packet and leave room for outer IP header (v6 is bigger than v4)
+        Perf_begin(STATS_ENCAP);
+        Reclaim_offline(); //no table pointers are held while waiting for packets
+        size = read(tunnel->fd, &(buf[IPV4_HEADER_SIZE]), IP_MAX_PACKET_SIZE - IPV4_HEADER_SIZE); //receive packet and leave room for outer IP header (v6 is bigger than v4)
+        Reclaim_online();
 
         if(size < 0) //an error
         {
-            DEBUG(LOG_ERR, "Tunnel RX failed");
+            LOG_ERRNO(LOG_ERR, "Tunnel RX failed");
             continue;
         }
         else if(size == 0) //no data
         {
-            PRINT(LOG_WARNING, "There was an RX event, but no data was received\n");
+            LOG(LOG_WARNING, "There was an RX event, but no data was received\n");
             continue;
         }
 
-        struct ip *inner = (struct ip*)(&buf[IPV4_HEADER_SIZE]); //get inner IP header (IPv4 temporarily - protocol version is still in the same place)
+        Perf_stage(STATS_STAGE_VALIDATE);
+        Latency_mark();
+        ipip_processTunnel(tunnel, buf, size);
+    }
+}
+
+/**
+ * @brief Tunnel thread for many TUN interfaces - waits for all of them with epoll
+**/
+void *ipip_execTunnels(void *arg)
+{
+    uint8_t buf[IP_MAX_PACKET_SIZE]; //create buffer for packets
+    int size = 0; //buffer size
+    int epfd = (int)(intptr_t)arg; //epoll descriptor with all TUN interfaces added
+    struct epoll_event events[IPIP_EPOLL_EVENTS];
 
-        if(inner->ip_v == IPVX_HEADER_VERSION_4) //this is an IPv4 packet
+    Reclaim_online();
+    while(1)
+    {
+        Reclaim_offline(); //no table pointers are held while waiting for packets
+        int n = epoll_wait(epfd, events, IPIP_EPOLL_EVENTS, -1);
+        Reclaim_online();
+        if(n < 0)
         {
-            if(config.tun4in4) //if enabled
-                ipip_encap(buf, size); //encapsulate and send
+            if(errno != EINTR)
+                LOG_ERRNO(LOG_ERR, "Tunnel event wait failed");
+            continue;
         }
-        else if(inner->ip_v == IPVX_HEADER_VERSION_6) //this is an IPv6 packet
+
+        for(int i = 0; i < n; i++)
         {
-            if(config.tun6in4) //if enabled
-                ip6ip_encap(buf, size); //encapsulate and send
+            struct Tunnel_s *tunnel = events[i].data.ptr;
+            //descriptors are non-blocking, read until there are no more packets
+            while(1)
+            {
+                Perf_begin(STATS_ENCAP);
+                if((size = read(tunnel->fd, &(buf[IPV4_HEADER_SIZE]), IP_MAX_PACKET_SIZE - IPV4_HEADER_SIZE)) <= 0)
+                    break;
+                Perf_stage(STATS_STAGE_VALIDATE);
+                Latency_mark();
+                ipip_processTunnel(tunnel, buf, size);
+                Reclaim_quiescent(); //the loop may not end under load
+            }
+
+            if((size < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+                LOG_ERRNO(LOG_ERR, "Tunnel RX failed");
         }
-        else //non-IP packet
-            continue; //do not process it
     }
 }
 
+/**
+ * @brief Receive packet from underlay socket, with receive timestamp when latency is measured
+ * @param s Socket descriptor
+ * @param buf Packet buffer
+ * @param size Buffer size
+ * @return Received packet size or -1 on failure
+**/
+static int ipip_receive(int s, uint8_t *buf, int size)
+{
+    if(__builtin_expect(!config.latency, 1))
+        return recv(s, buf, size, 0);
+
+    uint8_t control[LATENCY_CONTROL_SIZE];
+    struct iovec iov = {.iov_base = buf, .iov_len = size};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int received = recvmsg(s, &msg, 0);
+    latencyStart = 0;
+    for(struct cmsghdr *c = CMSG_FIRSTHDR(&msg); (received >= 0) && (c != NULL); c = CMSG_NXTHDR(&msg, c))
+    {
+        if((latencyStart = Latency_parse(c)) != 0)
+            break;
+    }
+    return received;
+}
+
 void *ipip_execSock(void *arg)
 { 
     uint8_t buf[IP_MAX_PACKET_SIZE]; //create buffer for packets
     int size = 0; //buffer size
 
+    Reclaim_online();
     while(1)
     {
-        size = recv(sockfd, buf, IP_MAX_PACKET_SIZE, 0); //receive encapsulated packet
+        Perf_begin(STATS_DECAP);
+        Reclaim_offline(); //no table pointers are held while waiting for packets
+        size = ipip_receive(sockfd, buf, IP_MAX_PACKET_SIZE); //receive encapsulated packet
+        Reclaim_online();
 
         if(size < 0) //an error
         {
-            DEBUG(LOG_ERR, "Socket RX failed");
+            int error = errno;
+            if(ipip_readErrors(sockfd) == 0) //ICMP errors are reported here and read from the error queue
+            {
+                errno = error;
+                LOG_ERRNO(LOG_ERR, "Socket RX failed");
+            }
             continue;
         }
         else if(size == 0) //no data
         {
-            PRINT(LOG_WARNING, "There was an RX event, but no data was received\n");
+            LOG(LOG_WARNING, "There was an RX event, but no data was received\n");
             continue;
         }
 
+        Perf_stage(STATS_STAGE_VALIDATE);
         struct ip *outer = (struct ip*)(buf); //get outer IP header
 
         if(outer->ip_v == IPVX_HEADER_VERSION_4) //is this an IPv4 packet?
@@ -556,21 +1837,31 @@ void *ip6ip_execSock(void *arg)
     uint8_t buf[IP_MAX_PACKET_SIZE]; //create buffer for packets
     int size = 0; //buffer size
 
+    Reclaim_online();
     while(1)
     {
-        size = recv(sock6in4fd, buf, IP_MAX_PACKET_SIZE, 0); //receive encapsulated packet
+        Perf_begin(STATS_DECAP);
+        Reclaim_offline(); //no table pointers are held while waiting for packets
+        size = ipip_receive(sock6in4fd, buf, IP_MAX_PACKET_SIZE); //receive encapsulated packet
+        Reclaim_online();
 
         if(size < 0) //an error
         {
-            DEBUG(LOG_ERR, "Socket RX failed");
+            int error = errno;
+            if(ipip_readErrors(sock6in4fd) == 0) //ICMP errors are reported here and read from the error queue
+            {
+                errno = error;
+                LOG_ERRNO(LOG_ERR, "Socket RX failed");
+            }
             continue;
         }
         else if(size == 0) //no data
         {
-            PRINT(LOG_WARNING, "There was an RX event, but no data was received\n");
+            LOG(LOG_WARNING, "There was an RX event, but no data was received\n");
             continue;
         }
 
+        Perf_stage(STATS_STAGE_VALIDATE);
         struct ip *outer = (struct ip*)(buf); //get outer IP header
 
         if(outer->ip_v == IPVX_HEADER_VERSION_4) //is this an IPv4 packet?
@@ -581,13 +1872,152 @@ void *ip6ip_execSock(void *arg)
     }
 }
 
+/**
+ * @brief IPv6 underlay socket thread - IPv6 raw sockets receive packets without outer header
+ * @param arg Pointer to socket descriptor
+**/
+void *ip6_execSock(void *arg)
+{ 
+    uint8_t buf[IP_MAX_PACKET_SIZE]; //create buffer for packets
+    int size = 0; //buffer size
+    int s = *(int*)arg;
+
+    Reclaim_online();
+    while(1)
+    {
+        Perf_begin(STATS_DECAP);
+        Reclaim_offline(); //no table pointers are held while waiting for packets
+        size = ipip_receive(s, buf, IP_MAX_PACKET_SIZE); //receive inner packet
+        Reclaim_online();
+
+        if(size < 0) //an error
+        {
+            int error = errno;
+            if(ipip_readErrors(s) == 0) //ICMPv6 errors are reported here and read from the error queue
+            {
+                errno = error;
+                LOG_ERRNO(LOG_ERR, "Socket RX failed");
+            }
+            continue;
+        }
+        else if(size == 0) //no data
+        {
+            LOG(LOG_WARNING, "There was an RX event, but no data was received\n");
+            continue;
+        }
+
+        Perf_stage(STATS_STAGE_VALIDATE);
+        Capture_received(NULL, 0, AF_INET6, &(config.remote6)); //outer header is not available
+        Ipfix_received(AF_INET6, &(config.remote6));
+        //socket is connected, so packets come from the remote endpoint only
+        if(s == sock4in6fd)
+        {
+            Stats_count(STATS_IPV4, STATS_RX_PACKETS, size + IPV6_HEADER_SIZE);
+            ipip_deliver(Tunnel_get(0), NULL, buf, size, IPV6_HEADER_SIZE);
+        }
+        else
+        {
+            Stats_count(STATS_IPV6, STATS_RX_PACKETS, size + IPV6_HEADER_SIZE);
+            ip6ip_deliver(Tunnel_get(0), NULL, buf, size, IPV6_HEADER_SIZE);
+        }
+    }
+}
+
+void *fou_execSock(void *arg)
+{ 
+    uint8_t buf[IP_MAX_PACKET_SIZE]; //create buffer for packets (coalesced UDP payloads)
+    int size = 0; //buffer size
+
+    Reclaim_online();
+    while(1)
+    {
+        in_addr_t source, destination;
+        int segment;
+        Perf_begin(STATS_DECAP);
+        Reclaim_offline(); //no table pointers are held while waiting for packets
+        size = Fou_receive(foufd, buf, IP_MAX_PACKET_SIZE, &source, &destination, &segment); //receive encapsulated packets
+        Reclaim_online();
+
+        if(size < 0) //an error
+        {
+            LOG_ERRNO(LOG_ERR, "Socket RX failed");
+            continue;
+        }
+        else if(size == 0) //no data
+        {
+            LOG(LOG_WARNING, "There was an RX event, but no data was received\n");
+            continue;
+        }
+
+        Perf_stage(STATS_STAGE_VALIDATE);
+        Capture_received(NULL, 0, AF_INET, &source); //outer headers were removed by the kernel
+        Ipfix_received(AF_INET, &source);
+        fou_decap(buf, size, segment, source, destination);
+    }
+}
+
 int Ipip_start()
 {
-    pthread_t tunTh, sockTh, sock6Th;
-    if(pthread_create(&tunTh, NULL, &ipip_execTunnel, NULL) < 0) //start threads
+    pthread_t tunTh, sockTh, sock6Th, sock4in6Th, sock6in6Th;
+    if(Tunnel_count() == 1) //single TUN interface, read it directly
     {
-        DEBUG(LOG_ERR, "Tunnel thread creation failed");
-        return -1;
+        if(pthread_create(&tunTh, NULL, &ipip_execTunnel, NULL) < 0) //start threads
+        {
+            DEBUG(LOG_ERR, "Tunnel thread creation failed");
+            return -1;
+        }
+    }
+    else
+    {
+        int epfd = epoll_create1(0);
+        if(epfd < 0)
+        {
+            DEBUG(LOG_ERR, "Tunnel event descriptor creation failed");
+            return -1;
+        }
+        for(uint32_t i = 0; i < Tunnel_count(); i++)
+        {
+            struct Tunnel_s *tunnel = Tunnel_get(i);
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = tunnel;
+            if((fcntl(tunnel->fd, F_SETFL, fcntl(tunnel->fd, F_GETFL) | O_NONBLOCK) < 0) || (epoll_ctl(epfd, EPOLL_CTL_ADD, tunnel->fd, &ev) < 0))
+            {
+                DEBUG(LOG_ERR, "Tunnel event registration failed");
+                close(epfd);
+                return -1;
+            }
+        }
+        if(pthread_create(&tunTh, NULL, &ipip_execTunnels, (void*)(intptr_t)epfd) < 0) //start threads
+        {
+            DEBUG(LOG_ERR, "Tunnel thread creation failed");
+            return -1;
+        }
+    }
+    if(config.tun4in6)
+    {
+        if(pthread_create(&sock4in6Th, NULL, &ip6_execSock, &sock4in6fd) < 0) //start threads
+        {
+            DEBUG(LOG_ERR, "IPv6 socket thread creation failed");
+            return -1;
+        }
+    }
+    if(config.tun6in6)
+    {
+        if(pthread_create(&sock6in6Th, NULL, &ip6_execSock, &sock6in6fd) < 0) //start threads
+        {
+            DEBUG(LOG_ERR, "IPv6 socket thread creation failed");
+            return -1;
+        }
+    }
+    if(config.encap != ENCAP_IPIP)
+    {
+        if(pthread_create(&sockTh, NULL, &fou_execSock, NULL) < 0) //start threads
+        {
+            DEBUG(LOG_ERR, "FOU/GUE socket thread creation failed");
+            return -1;
+        }
+        return 0;
     }
     if(config.tun4in4)
     {
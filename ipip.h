@@ -19,20 +19,41 @@
  * @file ipip.h
  * @brief IPIP tunneling module (4-in-4 and 6-in-4)
  * 
- * Creates all required sockets and handles IPIP encapsulation in decapsulation.
+ * Creates all required sockets and handles IPIP encapsulation in decapsulation for all tunnels (see tunnel.h).
  * Currently supports only 4-in-4 and 6-in-4 tunneling.
 */
 #ifndef IPIP_H_
 #define IPIP_H_
 
 #include <stdint.h>
+#include <netinet/ip.h>
+
+/**
+ * @brief Outer IPv4 header template for one remote endpoint
+**/
+struct OuterTemplate_s
+{
+    struct ip hdr; //outer header with all constant fields filled, version is 0 if the template is empty
+    uint64_t partial; //partial checksum of constant fields (TTL, protocol, source and destination address)
+    uint32_t generation; //runtime settings snapshot the template was built from, older templates are rebuilt
+};
 
 /**
  * @brief Initialize tunneling module
- * @param tun TUN interface descriptor
  * @return 0 on success, -1 on failure
+ * @attention All tunnels must be added to the tunnel table (see tunnel.h) before
+**/
+int Ipip_init();
+
+/**
+ * @brief Build outer header template
+ * @param t Template to build
+ * @param local Local endpoint address (INADDR_ANY lets kernel select it)
+ * @param remote Remote endpoint address
+ * @param protocol Outer header protocol (IPV4_HEADER_PROTO_IPIP or IPV4_HEADER_PROTO_IP6IP)
+ * @attention Calling thread must be online (see reclaim.h)
 **/
-int Ipip_init(int tun);
+void Ipip_buildTemplate(struct OuterTemplate_s *t, in_addr_t local, in_addr_t remote, uint8_t protocol);
 
 /**
  * @brief Start tunneling engine execution (non-blocking)
@@ -0,0 +1,50 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file latency.c
+ * @brief Packet latency measurement module
+**/
+
+#include "latency.h"
+#include <string.h>
+#include <errno.h>
+#include <linux/net_tstamp.h>
+
+__thread uint64_t latencyStart = 0;
+
+int Latency_enable(int s)
+{
+    if(!config.latency)
+        return 0;
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE; //generate and report software timestamps
+    if(setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+    {
+        DEBUG(LOG_WARNING, "Socket receive timestamps can't be enabled");
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t Latency_parse(const struct cmsghdr *c)
+{
+    if((c->cmsg_level != SOL_SOCKET) || (c->cmsg_type != SO_TIMESTAMPING))
+        return 0;
+    struct timespec ts[3]; //software, deprecated, hardware
+    memcpy(ts, CMSG_DATA(c), sizeof(ts));
+    return (uint64_t)ts[0].tv_sec * 1000000000 + ts[0].tv_nsec;
+}
@@ -0,0 +1,90 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file latency.h
+ * @brief Packet latency measurement module
+ *
+ * Decapsulation latency starts at the kernel software receive timestamp of the underlay socket (SO_TIMESTAMPING),
+ * so time spent in the socket queue is included. TUN interfaces have no timestamps, so encapsulation latency starts
+ * when read() returns. Both end when send() or write() returns, which for raw sockets is after the packet has been
+ * passed to the device, close to where the kernel takes a software transmit timestamp, without an error queue read per packet.
+ * The start time is kept in a thread-local variable from receive to send, samples go to histograms in the counter shards.
+*/
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "common.h"
+#include "stats.h"
+
+#define LATENCY_CONTROL_SIZE CMSG_SPACE(sizeof(struct timespec) * 3) //control message space for receive timestamp
+
+extern __thread uint64_t latencyStart; //receive time of packet being processed by calling thread in nanoseconds, 0 if none
+
+/**
+ * @brief Get current time in nanoseconds (same clock as socket timestamps)
+**/
+static inline uint64_t Latency_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Mark packet received now (when latency measurement is enabled)
+**/
+static inline void Latency_mark()
+{
+    if(__builtin_expect(config.latency, 0))
+        latencyStart = Latency_now();
+}
+
+/**
+ * @brief Record latency of packet being processed, if it was marked
+ * @param path Packet path (STATS_ENCAP or STATS_DECAP)
+ * @attention The mark is cleared, so only the first sent fragment of a packet is recorded
+**/
+static inline void Latency_done(int path)
+{
+    uint64_t start = latencyStart;
+    if(__builtin_expect(start == 0, 1))
+        return;
+    latencyStart = 0;
+    uint64_t now = Latency_now();
+    if(now >= start) //wall clock steps back are ignored
+        Stats_latency(path, now - start);
+}
+
+/**
+ * @brief Enable software receive timestamps on socket (when latency measurement is enabled)
+ * @param s Socket descriptor
+ * @return 0 on success, -1 on failure
+**/
+int Latency_enable(int s);
+
+/**
+ * @brief Get receive timestamp from control message
+ * @param c Control message
+ * @return Timestamp in nanoseconds or 0 if this is not a timestamp message
+**/
+uint64_t Latency_parse(const struct cmsghdr *c);
+
+#endif
@@ -0,0 +1,213 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file log.c
+ * @brief Datapath logging module
+ *
+ * Messages are formatted by the calling thread, because arguments often point to thread-local or stack buffers
+ * (inet_ntoa(), strerror(), address strings), which are gone by the time the logging thread gets the record.
+ * Formatting is cheap compared to console or syslog output, which is what blocked packet processing.
+ * Rings are allocated on first use and never released, kiwitun threads live until the process exits.
+**/
+
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define LOG_POLL_INTERVAL 20 //logging thread sleep time when all rings are empty in milliseconds
+
+/**
+ * @brief Log record
+**/
+struct LogRecord_s
+{
+    uint8_t level; //syslog level
+    char text[LOG_RECORD_SIZE - 1]; //formatted message
+};
+
+/**
+ * @brief Per-thread ring
+**/
+struct LogRing_s
+{
+    uint32_t head __attribute__((aligned(64))); //next record to write, written by producer only
+    uint32_t tail __attribute__((aligned(64))); //next record to read, written by consumer only
+    uint64_t dropped; //number of records dropped because the ring was full
+    struct LogRing_s *next; //next ring in ring list
+    struct LogRecord_s records[LOG_RING_SIZE];
+};
+
+static __thread struct LogRing_s *ring = NULL; //calling thread ring
+static struct LogRing_s *rings = NULL; //all rings
+static struct LogSite_s *sites = NULL; //call sites with suppressed messages
+
+/**
+ * @brief Get current monotonic time in milliseconds
+**/
+static inline uint64_t log_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int Log_allow(struct LogSite_s *site)
+{
+    //GCRA: message is allowed if the theoretical arrival time is at most (burst - 1) intervals in the future
+    uint64_t now = log_now();
+    uint64_t tat = __atomic_load_n(&(site->tat), __ATOMIC_RELAXED);
+    while(1)
+    {
+        if(tat > (now + (LOG_SITE_BURST - 1) * LOG_SITE_INTERVAL))
+        {
+            __atomic_fetch_add(&(site->suppressed), 1, __ATOMIC_RELAXED);
+            if(!__atomic_exchange_n(&(site->listed), 1, __ATOMIC_RELAXED)) //first suppression, add site to list
+            {
+                site->next = __atomic_load_n(&sites, __ATOMIC_RELAXED);
+                while(!__atomic_compare_exchange_n(&sites, &(site->next), site, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                    ;
+            }
+            return 0;
+        }
+        if(__atomic_compare_exchange_n(&(site->tat), &tat, ((tat > now) ? tat : now) + LOG_SITE_INTERVAL, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return 1;
+    }
+}
+
+void Log_write(int level, const char *format, ...)
+{
+    struct LogRing_s *r = ring;
+    if(r == NULL) //first message from this thread
+    {
+        r = calloc(1, sizeof(*r));
+        if(r == NULL)
+            return;
+        r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&rings, &(r->next), r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+        ring = r;
+    }
+
+    uint32_t head = r->head;
+    if((head - __atomic_load_n(&(r->tail), __ATOMIC_ACQUIRE)) == LOG_RING_SIZE) //full
+    {
+        __atomic_fetch_add(&(r->dropped), 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct LogRecord_s *rec = &(r->records[head & (LOG_RING_SIZE - 1)]);
+    rec->level = level;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(rec->text, sizeof(rec->text), format, args);
+    va_end(args);
+    __atomic_store_n(&(r->head), head + 1, __ATOMIC_RELEASE); //publish record
+}
+
+/**
+ * @brief Write message out
+**/
+static void log_output(int level, const char *text)
+{
+    if(config.noDaemon && (level <= Runtime_logLevel()))
+    {
+        fputs(text, stdout);
+    }
+    else
+    {
+        syslog(level, "%s", text);
+    }
+}
+
+/**
+ * @brief Report suppressed messages and dropped records
+**/
+static void log_report()
+{
+    char text[LOG_RECORD_SIZE];
+    for(struct LogSite_s *s = __atomic_load_n(&sites, __ATOMIC_ACQUIRE); s != NULL; s = s->next)
+    {
+        uint32_t n = __atomic_exchange_n(&(s->suppressed), 0, __ATOMIC_RELAXED);
+        if(n == 0)
+            continue;
+        int len = strcspn(s->text, "\n"); //message format without line end
+        snprintf(text, sizeof(text), "Suppressed %u messages: %.*s\n", (unsigned int)n, len, s->text);
+        log_output(s->level, text);
+    }
+    for(struct LogRing_s *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+    {
+        uint64_t n = __atomic_exchange_n(&(r->dropped), 0, __ATOMIC_RELAXED);
+        if(n != 0)
+        {
+            snprintf(text, sizeof(text), "Dropped %llu log messages (log ring full)\n", (unsigned long long)n);
+            log_output(LOG_WARNING, text);
+        }
+    }
+}
+
+static void *log_exec(void *arg)
+{
+    uint64_t nextReport = log_now() + 1000;
+    while(1)
+    {
+        int count = 0;
+        for(struct LogRing_s *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+        {
+            uint32_t tail = r->tail;
+            uint32_t head = __atomic_load_n(&(r->head), __ATOMIC_ACQUIRE);
+            for(; tail != head; tail++, count++)
+            {
+                struct LogRecord_s *rec = &(r->records[tail & (LOG_RING_SIZE - 1)]);
+                log_output(rec->level, rec->text);
+            }
+            __atomic_store_n(&(r->tail), tail, __ATOMIC_RELEASE); //release records
+        }
+        if(count != 0)
+            fflush(stdout);
+
+        if(log_now() >= nextReport) //once per second
+        {
+            log_report();
+            fflush(stdout);
+            nextReport = log_now() + 1000;
+        }
+
+        if(count == 0)
+        {
+            struct timespec ts = {.tv_sec = 0, .tv_nsec = LOG_POLL_INTERVAL * 1000000};
+            nanosleep(&ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+int Log_start()
+{
+    pthread_t th;
+    if(pthread_create(&th, NULL, &log_exec, NULL) != 0)
+    {
+        PRINT(LOG_ERR, "Logging thread creation failed\n");
+        return -1;
+    }
+    pthread_detach(th);
+    return 0;
+}
@@ -0,0 +1,111 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file log.h
+ * @brief Datapath logging module
+ *
+ * PRINT and DEBUG write to the console or syslog synchronously, which is fine for setup, but not for packet processing.
+ * Datapath threads use LOG and LOG_ERRNO instead: the message is formatted into a fixed-size record of a per-thread
+ * ring (single producer, single consumer, no locks) and the logging thread writes it out.
+ * Each call site is rate limited (LOG_SITE_BURST messages, then one per LOG_SITE_INTERVAL milliseconds),
+ * the number of suppressed messages is reported by the logging thread.
+ * When built with LOG_NO_DEBUG defined (KIWITUN_NO_DEBUG_LOG CMake option), debug level call sites are compiled out.
+*/
+#ifndef LOG_H_
+#define LOG_H_
+
+#include <stdint.h>
+#include "common.h"
+
+#define LOG_RING_SIZE 256 //number of records in a per-thread ring (must be a power of 2)
+#define LOG_RECORD_SIZE 256 //record size in bytes, longer messages are truncated
+#define LOG_SITE_BURST 10 //number of messages from one call site written back-to-back
+#define LOG_SITE_INTERVAL 1000 //interval between messages from one call site after burst in milliseconds
+
+/**
+ * @brief Call site rate limit state
+**/
+struct LogSite_s
+{
+    uint64_t tat; //theoretical arrival time of next message in milliseconds (GCRA)
+    uint32_t suppressed; //number of messages suppressed since last report
+    uint8_t listed; //site is in the suppressed site list
+    uint8_t level; //message level
+    const char *text; //message format, for suppression reports
+    struct LogSite_s *next; //next site in the suppressed site list
+};
+
+#define LOG_FIRST_(first, ...) first
+
+#define LOG_SITE_(lvl, msg, ...) {\
+    if((lvl) <= Runtime_logLevel()){\
+        static struct LogSite_s logSite_ = {.level = (lvl), .text = (msg)};\
+        if(Log_allow(&logSite_))\
+            Log_write(lvl, __VA_ARGS__);}\
+}
+
+//levels are selected by token pasting, so that compiled out call sites don't depend on optimization
+#define LOG_AT_LOG_EMERG LOG_SITE_
+#define LOG_AT_LOG_ALERT LOG_SITE_
+#define LOG_AT_LOG_CRIT LOG_SITE_
+#define LOG_AT_LOG_ERR LOG_SITE_
+#define LOG_AT_LOG_WARNING LOG_SITE_
+#define LOG_AT_LOG_NOTICE LOG_SITE_
+#define LOG_AT_LOG_INFO LOG_SITE_
+#ifdef LOG_NO_DEBUG
+#define LOG_AT_LOG_DEBUG(lvl, msg, ...) {if(0) Log_write(lvl, __VA_ARGS__);} //never executed, but arguments are still checked and used
+#else
+#define LOG_AT_LOG_DEBUG LOG_SITE_
+#endif
+
+/**
+ * @brief Write datapath log message, printf-like
+ * @param lvl Syslog level (LOG_ERR, LOG_DEBUG etc., must be given by name)
+**/
+#define LOG(lvl, ...) LOG_AT_##lvl(lvl, LOG_FIRST_(__VA_ARGS__, 0), __VA_ARGS__)
+
+/**
+ * @brief Write datapath log message with errno description, perror-like
+ * @param lvl Syslog level (LOG_ERR, LOG_DEBUG etc., must be given by name)
+ * @param arg Message
+**/
+#define LOG_ERRNO(lvl, arg) LOG_AT_##lvl(lvl, arg, "%s: %s\n", arg, strerror(errno))
+
+/**
+ * @brief Check call site rate limit
+ * @param site Call site
+ * @return 1 if the message can be written, 0 if it is suppressed
+**/
+int Log_allow(struct LogSite_s *site);
+
+/**
+ * @brief Format message into calling thread ring
+ * @param level Syslog level
+ * @param format printf format
+ * @attention Message is dropped (and counted) if the ring is full
+**/
+void Log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Start logging thread
+ * @return 0 on success, -1 on failure
+ * @attention Messages written before are kept in rings (until they are full) and written out when the thread starts
+**/
+int Log_start();
+
+#endif
@@ -19,13 +19,14 @@
  * @file main.c
  * @brief Main file - program entry.
  * 
- * Sets up everything, handles hostname resolution and daemonization.
+ * Sets up everything and handles daemonization and signals.
 */
 
 #include <stdio.h>
 #include "tun.h"
 #include "ipip.h"
 #include <signal.h>
+#include <pthread.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
@@ -34,50 +35,46 @@
 #include <arpa/inet.h>
 #include "common.h"
 #include "route.h"
+#include "peer.h"
+#include "tunnel.h"
+#include "fou.h"
+#include "icmp.h"
+#include "resolver.h"
+#include "log.h"
+#include "stats.h"
+#include "capture.h"
+#include "ipfix.h"
+#include "control.h"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <sys/stat.h>
 #include <syslog.h>
 
-int tunfd = 0; //tun descriptor
+static volatile sig_atomic_t reload = 0; //SIGHUP received, reload peer table
+static volatile sig_atomic_t toggleCapture = 0; //SIGUSR1 received, start or stop packet capture
 
 //SIGINT handler
 void sigintHandler(int signum)
 {
-    close(tunfd);
+    Tunnel_closeAll();
+    Stats_close();
+    Control_close();
     closelog();
     PRINT(LOG_INFO, "Terminating...\n");
     exit(0);
 }
 
-//alarm handler for hostname resolving
-void alarmHandler(int signum)
+//SIGHUP handler, peer table is reloaded and counters are printed by the main thread
+void sighupHandler(int signum)
 {
-    if(signum == SIGALRM)
-    {
-        struct addrinfo hints, *results;
-        memset(&hints, 0, sizeof(hints));
-        hints.ai_family = AF_INET;
-        if(getaddrinfo(config.hostname, NULL, &hints, &results) >= 0) //get address for hostname
-        {
-            config.remote.s_addr = ((struct sockaddr_in*)(results->ai_addr))->sin_addr.s_addr; //store first address
-            if(config.debug) //print if verbose output
-            {
-                char tmp[50];
-                inet_ntop(AF_INET, &(config.remote), tmp, 50);
-                PRINT(LOG_DEBUG, "%s is at %s\n", config.hostname, tmp);
-            }
-        }
-        else //no address was found
-        {
-            DEBUG(LOG_WARNING, "Hostname resolution failed");
-        }
-        
-        
-        if(config.hostnameRefresh) //there is a non-zero refresh time configured
-            alarm(config.hostnameRefresh * 60); //set next alarm
-    }
+    reload = 1;
+}
+
+//SIGUSR1 handler, packet capture is toggled by the main thread
+void sigusr1Handler(int signum)
+{
+    toggleCapture = 1;
 }
 
 /**
@@ -146,13 +143,43 @@ int main(int argc, char **argv)
     //initial settings
     config.ttl = DEFAULT_IPV4_TTL;
     config.hostnameRefresh = DEFAULT_HOSTNAME_REFRESH;
+    config.failoverTimeout = 0;
     config.debug = 0;
     config.hostname = NULL;
     config.ifName = NULL;
     config.noDaemon = 0;
     config.tun4in4 = 0;
     config.tun6in4 = 0;
+    config.tun4in6 = 0;
+    config.tun6in6 = 0;
     config.logLevel = 255;
+    config.routeMode = ROUTE_MODE_MIRROR;
+    config.routePublish = 0;
+    config.routeShmName = ROUTE_SHM_DEFAULT_NAME;
+    config.decapCheck = DECAP_CHECK_STRICT;
+    config.peerFile = NULL;
+    config.tunnelFile = NULL;
+    config.encap = ENCAP_IPIP;
+    config.fouPort = FOU_DEFAULT_PORT;
+    config.icmpInterval = ICMP_DEFAULT_INTERVAL;
+    config.icmpBurst = ICMP_DEFAULT_BURST;
+    config.icmpRate = ICMP_DEFAULT_RATE;
+    config.statsShmName = STATS_SHM_DEFAULT_NAME;
+    config.dropSample = 0;
+    config.latency = 0;
+    config.perfSample = 0;
+    config.captureFile = NULL;
+    config.capturePackets = CAPTURE_DEFAULT_PACKETS;
+    config.captureSample = 1;
+    config.captureDrops = 0;
+    config.captureEndpoint = INADDR_ANY;
+    config.captureEndpoint6 = in6addr_any;
+    config.flowExport = NULL;
+    config.flowPort = IPFIX_DEFAULT_PORT;
+    config.flowSample = 1;
+    config.flowIdle = IPFIX_DEFAULT_IDLE;
+    config.flowActive = IPFIX_DEFAULT_ACTIVE;
+    config.controlPath = NULL;
     setAddress(&(config.local), "0.0.0.0");
     setAddress(&(config.remote), "0.0.0.0");
     setAddress6(&(config.local6), "::");
@@ -177,6 +204,12 @@ int main(int argc, char **argv)
 
     config.logLevel = (config.logLevel > LOG_DEBUG) ? LOG_DEBUG : config.logLevel;    
 
+    if(Runtime_publish(config.ttl, config.logLevel) < 0) //first runtime settings snapshot
+    {
+        printf("Memory allocation failed\n");
+        exit(-1);
+    }
+
     if(!config.noDaemon) //daemonization enabled
     {
         setlogmask(LOG_UPTO(config.logLevel)); //set max level to log
@@ -186,6 +219,7 @@ int main(int argc, char **argv)
 
     PRINT(LOG_DEBUG, "Starting kiwitun with following settings:\n");
     PRINT(LOG_DEBUG, "4-in-4 tunneling: %d\n6-in-4 tunneling: %d\n", (int)config.tun4in4, (int)config.tun6in4);
+    PRINT(LOG_DEBUG, "4-in-6 tunneling: %d\n6-in-6 tunneling: %d\n", (int)config.tun4in6, (int)config.tun6in6);
     PRINT(LOG_DEBUG, "Local address: ");
     printAddress(LOG_DEBUG, &(config.local));
     PRINT(LOG_DEBUG, "\nRemote address: ");
@@ -195,6 +229,10 @@ int main(int argc, char **argv)
     }
     else
         printAddress(LOG_DEBUG, &(config.remote));
+    PRINT(LOG_DEBUG, "\nLocal IPv6 address: ");
+    printAddress6(LOG_DEBUG, &(config.local6));
+    PRINT(LOG_DEBUG, "\nRemote IPv6 address: ");
+    printAddress6(LOG_DEBUG, &(config.remote6));
     
     PRINT(LOG_DEBUG, "\nDebugging output: %d\nStart as a daemon: %d\n", (int)config.debug, (int)(!config.noDaemon));
     PRINT(LOG_DEBUG, "Interface name: ");
@@ -207,29 +245,62 @@ int main(int argc, char **argv)
         PRINT(LOG_DEBUG, "not specified\n");
     }
     PRINT(LOG_DEBUG, "TTL/hop limit: %d\nHostname resolution interval: %u minutes\n", (int)config.ttl, (unsigned int)config.hostnameRefresh);
+    PRINT(LOG_DEBUG, "Hostname address failover timeout: %u s\n", (unsigned int)config.failoverTimeout);
+    PRINT(LOG_DEBUG, "Route mode: %s\n", (config.routeMode == ROUTE_MODE_ON_DEMAND) ? "on-demand" : ((config.routeMode == ROUTE_MODE_SHARED) ? "shared" : "mirror"));
+    PRINT(LOG_DEBUG, "Publish routes: %d\nShared memory route segment: %s\n", (int)config.routePublish, config.routeShmName);
+    PRINT(LOG_DEBUG, "Decapsulation check: %s\n", (config.decapCheck == DECAP_CHECK_MINIMAL) ? "minimal" : ((config.decapCheck == DECAP_CHECK_OUTER_TRUST) ? "outer-trust" : "strict"));
+    PRINT(LOG_DEBUG, "Peer file: %s\n", (config.peerFile != NULL) ? config.peerFile : "not used");
+    PRINT(LOG_DEBUG, "Tunnel file: %s\n", (config.tunnelFile != NULL) ? config.tunnelFile : "not used");
+    PRINT(LOG_DEBUG, "Encapsulation: %s\n", (config.encap == ENCAP_GUE) ? "gue" : ((config.encap == ENCAP_FOU) ? "fou" : "ipip"));
+    if(config.encap != ENCAP_IPIP)
+        PRINT(LOG_DEBUG, "FOU/GUE port: %u\n", (unsigned int)config.fouPort);
+    PRINT(LOG_DEBUG, "ICMP error limit: %u ms interval, burst %u per destination, %u per second globally\n",
+        (unsigned int)config.icmpInterval, (unsigned int)config.icmpBurst, (unsigned int)config.icmpRate);
+    PRINT(LOG_DEBUG, "Shared memory counter segment: %s\nDrop sampling: %u\nLatency measurement: %d\nPerformance counter sampling: %u\n", config.statsShmName, (unsigned int)config.dropSample, (int)config.latency, (unsigned int)config.perfSample);
+    PRINT(LOG_DEBUG, "Capture file: %s\nCapture ring size: %u\nCapture sampling: %u\n", (config.captureFile != NULL) ? config.captureFile : "none", (unsigned int)config.capturePackets, (unsigned int)config.captureSample);
+    PRINT(LOG_DEBUG, "Flow collector: %s port %u\nFlow sampling: %u\nFlow timeouts: %u s idle, %u s active\n", (config.flowExport != NULL) ? config.flowExport : "none", (unsigned int)config.flowPort, (unsigned int)config.flowSample, (unsigned int)config.flowIdle, (unsigned int)config.flowActive);
+    PRINT(LOG_DEBUG, "Control socket: %s\n", (config.controlPath != NULL) ? config.controlPath : "none");
 
     struct sigaction sa;
-    sa.sa_handler = &alarmHandler;
+    sa.sa_handler = &sigintHandler;
+    sigfillset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    if(sigaction(SIGINT, &sa, NULL) < 0) //attach SIGINT handler
+    {
+        DEBUG(LOG_ERR, "SIGINT handler attachment failure");
+        exit(-1);
+    }
+
+    sa.sa_handler = &sighupHandler;
     sigfillset(&sa.sa_mask);
     sa.sa_flags = 0;
-    if(sigaction(SIGALRM, &sa, NULL) < 0) //attach alarm handler
+    if(sigaction(SIGHUP, &sa, NULL) < 0) //attach SIGHUP handler
     {
-        DEBUG(LOG_ERR, "Alarm handler attachment failure");
+        DEBUG(LOG_ERR, "SIGHUP handler attachment failure");
         exit(-1);
     }
 
-    sa.sa_handler = &sigintHandler;
+    sa.sa_handler = &sigusr1Handler;
     sigfillset(&sa.sa_mask);
     sa.sa_flags = 0;
-    if(sigaction(SIGINT, &sa, NULL) < 0) //attach SIGINT handler
+    if(sigaction(SIGUSR1, &sa, NULL) < 0) //attach SIGUSR1 handler
     {
-        DEBUG(LOG_ERR, "SIGINT handler attachment failure");
+        DEBUG(LOG_ERR, "SIGUSR1 handler attachment failure");
         exit(-1);
     }
 
-    if(config.hostname != NULL) //there is a remote hostname configured
+    //block SIGHUP and SIGUSR1 in all threads created from now on, the main thread unblocks them only while waiting for signals
+    sigset_t hup, waitMask;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    sigaddset(&hup, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &hup, &waitMask);
+    sigdelset(&waitMask, SIGHUP);
+    sigdelset(&waitMask, SIGUSR1);
+
+    if(Log_start() < 0) //write out datapath log messages in background
     {
-        alarmHandler(SIGALRM); //call alarm handler to resolve hostname
+        exit(-1);
     }
 
     if(Route_init() < 0) //initialize routing module
@@ -237,22 +308,62 @@ int main(int argc, char **argv)
         exit(-1);
     }
 
-    //create tun interface
-    char ifName[IFNAMSIZ] = "\0"; //NULL for automatic interface name selection
-    if(config.ifName != NULL) //there is a name specified
-        strcpy(ifName, config.ifName);
+    if(!config.tun4in4 && !config.tun6in4 && !config.tun4in6 && !config.tun6in6) //no tunneling, run as a route publisher only
+    {
+        PRINT(LOG_INFO, "Started succesfully as a route publisher\n");
+        while(1)
+        {
+            pause();
+        }
+    }
 
-    tunfd = Tun_create(ifName); //use provided interface name if available
-    if(tunfd < 0) //creation failure
+    if(config.tunnelFile != NULL) //create all tun interfaces listed in tunnel file
     {
-       DEBUG(LOG_ERR, "TUN interface creation failed");
-       exit(-1);
+        if(Tunnel_load(config.tunnelFile) < 0)
+            exit(-1);
     }
+    else
+    {
+        //create tun interface
+        char ifName[IFNAMSIZ] = "\0"; //NULL for automatic interface name selection
+        if(config.ifName != NULL) //there is a name specified
+            strcpy(ifName, config.ifName);
 
-    PRINT(LOG_INFO, "\n\nTunnel interface name is %s\n", ifName);
+        int tunfd = Tun_create(ifName); //use provided interface name if available
+        if(tunfd < 0) //creation failure
+        {
+           DEBUG(LOG_ERR, "TUN interface creation failed");
+           exit(-1);
+        }
+
+        PRINT(LOG_INFO, "\n\nTunnel interface name is %s\n", ifName);
+
+        if(Tunnel_add(tunfd, ifName, config.local.s_addr, config.remote.s_addr) < 0)
+            exit(-1);
+    }
+
+    if((config.peerFile != NULL) && (Peer_load(config.peerFile) < 0)) //load peer table
+    {
+        exit(-1);
+    }
+
+    //counters are kept in private memory if the segment can't be created
+    Stats_init(config.statsShmName);
+
+    //capture ring is mapped before datapath threads start
+    if((config.captureFile != NULL) && (Capture_init(config.captureFile, config.capturePackets) < 0))
+    {
+        exit(-1);
+    }
+
+    //flow accounting is enabled before datapath threads start
+    if((config.flowExport != NULL) && (Ipfix_start(config.flowExport, config.flowPort) < 0))
+    {
+        exit(-1);
+    }
 
     //initialize tunneling
-    if(Ipip_init(tunfd) < 0)
+    if(Ipip_init() < 0)
     {
         DEBUG(LOG_ERR, "IPIP tunnel creation failed");
         exit(-1);
@@ -265,11 +376,46 @@ int main(int argc, char **argv)
         exit(-1);
     }
 
+    //runtime control, tunnel endpoints are known now
+    if((config.controlPath != NULL) && (Control_start(config.controlPath) < 0))
+    {
+        exit(-1);
+    }
+
+    //resolve remote endpoint hostname in background, packets are dropped until it is resolved
+    if((config.hostname != NULL) && (Resolver_start() < 0))
+    {
+        exit(-1);
+    }
+
     PRINT(LOG_INFO, "Started succesfully\n");
 
     while(1)
     {
-        pause(); //pause thread and wait for signals
+        sigsuspend(&waitMask); //pause thread and wait for signals
+        if(reload)
+        {
+            reload = 0;
+            if(config.peerFile != NULL)
+            {
+                Peer_load(config.peerFile); //current peer table is kept on failure
+                Peer_print(LOG_INFO);
+            }
+            Stats_print(LOG_INFO);
+        }
+        if(toggleCapture)
+        {
+            toggleCapture = 0;
+            if(config.captureFile == NULL)
+            {
+                PRINT(LOG_WARNING, "Packet capture is not configured (--capture)\n");
+            }
+            else
+            {
+                Capture_enable(!captureEnabled);
+                PRINT(LOG_INFO, "Packet capture %s\n", captureEnabled ? "started" : "stopped");
+            }
+        }
     }
 
     return 0;
@@ -0,0 +1,340 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file ortc.c
+ * @brief Routing table compression module
+ *
+ * ORTC works in three passes over a binary trie built from input prefixes:
+ * 1. Normalization - every node gets either 0 or 2 children, new leaves inherit next hop from the closest covering prefix.
+ * 2. Bottom-up - every leaf gets a set containing its next hop, every internal node gets intersection of children sets
+ *    or union of them if the intersection is empty.
+ * 3. Top-down - a node needs a prefix only if the next hop inherited from above is not in its set.
+ * Original paper: R. Draves, C. King, S. Venkatachary, B. Zill, "Constructing Optimal IP Routing Tables", IEEE INFOCOM 1999.
+**/
+
+#include "ortc.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ORTC_POOL_INITIAL_SIZE 4096 //initial number of elements in a pool, pools are doubled when full
+
+/**
+ * @brief Binary trie node
+**/
+struct OrtcNode_s
+{
+    uint32_t child[2]; //child node indexes, 0 if there is no child (root is never a child)
+    uint32_t nextHop; //next hop of a prefix ending here (or inherited next hop for leaves after normalization)
+    uint32_t setOffset; //next hop set offset in set pool
+    uint32_t setLength; //next hop set length
+    uint8_t hasRoute; //a prefix ends at this node
+};
+
+/**
+ * @brief Compression context
+**/
+struct OrtcContext_s
+{
+    struct OrtcNode_s *nodes; //node pool, node 0 is the root
+    uint32_t nodeCount;
+    uint32_t nodeMax;
+    uint32_t *sets; //next hop set pool, each set is sorted in ascending order
+    uint64_t setCount;
+    uint64_t setMax;
+    struct OrtcPrefix_s *out; //output prefixes
+    uint64_t outCount;
+    uint64_t outMax;
+    uint8_t path[ORTC_MAX_ADDRESS_BITS / 8]; //address of currently visited node
+};
+
+/**
+ * @brief Allocate new trie node
+ * @return Node index or 0 on failure
+**/
+static uint32_t ortc_newNode(struct OrtcContext_s *ctx)
+{
+    if(ctx->nodeCount == ctx->nodeMax)
+    {
+        struct OrtcNode_s *n = realloc(ctx->nodes, (uint64_t)ctx->nodeMax * 2 * sizeof(struct OrtcNode_s));
+        if(n == NULL)
+            return 0;
+        ctx->nodes = n;
+        ctx->nodeMax *= 2;
+    }
+    memset(&(ctx->nodes[ctx->nodeCount]), 0, sizeof(struct OrtcNode_s));
+    return ctx->nodeCount++;
+}
+
+/**
+ * @brief Reserve space in set pool
+ * @return 0 on success, -1 on failure
+**/
+static int ortc_reserveSet(struct OrtcContext_s *ctx, uint64_t size)
+{
+    if((ctx->setCount + size) <= ctx->setMax)
+        return 0;
+
+    uint64_t max = (ctx->setMax > size) ? (ctx->setMax * 2) : (ctx->setMax + size + ORTC_POOL_INITIAL_SIZE);
+    uint32_t *s = realloc(ctx->sets, max * sizeof(uint32_t));
+    if(s == NULL)
+        return -1;
+    ctx->sets = s;
+    ctx->setMax = max;
+    return 0;
+}
+
+/**
+ * @brief Insert prefix into trie
+ * @return 0 on success, -1 on failure
+**/
+static int ortc_insert(struct OrtcContext_s *ctx, const struct OrtcPrefix_s *p)
+{
+    uint32_t n = 0;
+    for(uint8_t i = 0; i < p->length; i++)
+    {
+        uint8_t bit = (p->address[i / 8] >> (7 - (i % 8))) & 1;
+        if(ctx->nodes[n].child[bit] == 0)
+        {
+            uint32_t c = ortc_newNode(ctx);
+            if(c == 0)
+                return -1;
+            ctx->nodes[n].child[bit] = c;
+        }
+        n = ctx->nodes[n].child[bit];
+    }
+    if(!ctx->nodes[n].hasRoute) //first prefix wins
+    {
+        ctx->nodes[n].hasRoute = 1;
+        ctx->nodes[n].nextHop = p->nextHop;
+    }
+    return 0;
+}
+
+/**
+ * @brief First pass: make every node have 0 or 2 children and propagate next hops to leaves
+ * @return 0 on success, -1 on failure
+**/
+static int ortc_normalize(struct OrtcContext_s *ctx, uint32_t n, uint32_t inherited)
+{
+    if(ctx->nodes[n].hasRoute)
+        inherited = ctx->nodes[n].nextHop;
+
+    if((ctx->nodes[n].child[0] == 0) && (ctx->nodes[n].child[1] == 0)) //leaf
+    {
+        ctx->nodes[n].nextHop = inherited;
+        return 0;
+    }
+
+    for(uint8_t i = 0; i < 2; i++)
+    {
+        if(ctx->nodes[n].child[i] == 0) //missing child, create leaf covering the rest of this prefix
+        {
+            uint32_t c = ortc_newNode(ctx);
+            if(c == 0)
+                return -1;
+            ctx->nodes[n].child[i] = c;
+            ctx->nodes[c].nextHop = inherited;
+        }
+        else if(ortc_normalize(ctx, ctx->nodes[n].child[i], inherited) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Second pass: calculate next hop sets bottom-up
+ * @return 0 on success, -1 on failure
+**/
+static int ortc_buildSets(struct OrtcContext_s *ctx, uint32_t n)
+{
+    uint32_t c0 = ctx->nodes[n].child[0], c1 = ctx->nodes[n].child[1];
+
+    if(c0 == 0) //leaf (normalized trie has 0 or 2 children)
+    {
+        if(ortc_reserveSet(ctx, 1) < 0)
+            return -1;
+        ctx->sets[ctx->setCount] = ctx->nodes[n].nextHop;
+        ctx->nodes[n].setOffset = ctx->setCount;
+        ctx->nodes[n].setLength = 1;
+        ctx->setCount++;
+        return 0;
+    }
+
+    if((ortc_buildSets(ctx, c0) < 0) || (ortc_buildSets(ctx, c1) < 0))
+        return -1;
+
+    uint32_t la = ctx->nodes[c0].setLength, lb = ctx->nodes[c1].setLength;
+    if(ortc_reserveSet(ctx, (uint64_t)la + lb) < 0)
+        return -1;
+
+    uint32_t *a = &(ctx->sets[ctx->nodes[c0].setOffset]);
+    uint32_t *b = &(ctx->sets[ctx->nodes[c1].setOffset]);
+    uint32_t *r = &(ctx->sets[ctx->setCount]);
+    uint32_t i = 0, j = 0, k = 0;
+
+    //intersection first
+    while((i < la) && (j < lb))
+    {
+        if(a[i] < b[j])
+            i++;
+        else if(a[i] > b[j])
+            j++;
+        else
+        {
+            r[k++] = a[i];
+            i++;
+            j++;
+        }
+    }
+
+    if(k == 0) //empty intersection, use union
+    {
+        i = 0;
+        j = 0;
+        while((i < la) || (j < lb))
+        {
+            if((j == lb) || ((i < la) && (a[i] < b[j])))
+                r[k++] = a[i++];
+            else if((i == la) || (b[j] < a[i]))
+                r[k++] = b[j++];
+            else
+            {
+                r[k++] = a[i];
+                i++;
+                j++;
+            }
+        }
+    }
+
+    ctx->nodes[n].setOffset = ctx->setCount;
+    ctx->nodes[n].setLength = k;
+    ctx->setCount += k;
+    return 0;
+}
+
+/**
+ * @brief Check if next hop is in node's set
+**/
+static int ortc_inSet(struct OrtcContext_s *ctx, uint32_t n, uint32_t nextHop)
+{
+    uint32_t *s = &(ctx->sets[ctx->nodes[n].setOffset]);
+    uint32_t lo = 0, hi = ctx->nodes[n].setLength;
+    while(lo < hi) //binary search, sets are sorted
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if(s[mid] == nextHop)
+            return 1;
+        else if(s[mid] < nextHop)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return 0;
+}
+
+/**
+ * @brief Third pass: select next hops top-down and emit prefixes
+ * @return 0 on success, -1 on failure
+**/
+static int ortc_assign(struct OrtcContext_s *ctx, uint32_t n, uint8_t depth, uint32_t inherited)
+{
+    uint32_t nextHop = inherited;
+    if(!ortc_inSet(ctx, n, inherited)) //inherited next hop is not good here, a prefix is needed
+    {
+        nextHop = ctx->sets[ctx->nodes[n].setOffset];
+        if(ctx->outCount == ctx->outMax)
+        {
+            uint64_t max = ctx->outMax ? (ctx->outMax * 2) : ORTC_POOL_INITIAL_SIZE;
+            struct OrtcPrefix_s *o = realloc(ctx->out, max * sizeof(struct OrtcPrefix_s));
+            if(o == NULL)
+                return -1;
+            ctx->out = o;
+            ctx->outMax = max;
+        }
+        struct OrtcPrefix_s *p = &(ctx->out[ctx->outCount++]);
+        memcpy(p->address, ctx->path, sizeof(p->address));
+        p->length = depth;
+        p->nextHop = nextHop;
+    }
+
+    for(uint8_t i = 0; i < 2; i++)
+    {
+        uint32_t c = ctx->nodes[n].child[i];
+        if(c == 0)
+            break;
+
+        if(i)
+            ctx->path[depth / 8] |= (0x80 >> (depth % 8));
+        if(ortc_assign(ctx, c, depth + 1, nextHop) < 0)
+            return -1;
+        if(i)
+            ctx->path[depth / 8] &= ~(0x80 >> (depth % 8));
+    }
+    return 0;
+}
+
+int64_t Ortc_compress(const struct OrtcPrefix_s *in, uint64_t count, uint8_t bits, struct OrtcPrefix_s **out)
+{
+    struct OrtcContext_s ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    *out = NULL;
+
+    if(bits > ORTC_MAX_ADDRESS_BITS)
+        return -1;
+
+    if(count == 0)
+        return 0;
+
+    ctx.nodeMax = ORTC_POOL_INITIAL_SIZE;
+    ctx.nodes = malloc(ctx.nodeMax * sizeof(struct OrtcNode_s));
+    if(ctx.nodes == NULL)
+        return -1;
+    memset(&(ctx.nodes[0]), 0, sizeof(struct OrtcNode_s)); //root
+    ctx.nodeCount = 1;
+
+    int ret = 0;
+    for(uint64_t i = 0; i < count; i++)
+    {
+        if(in[i].length > bits)
+            continue;
+        if(ortc_insert(&ctx, &in[i]) < 0)
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    if((ret == 0) && (ortc_normalize(&ctx, 0, 0) < 0))
+        ret = -1;
+    if((ret == 0) && (ortc_buildSets(&ctx, 0) < 0))
+        ret = -1;
+    if((ret == 0) && (ortc_assign(&ctx, 0, 0, 0) < 0)) //addresses not covered at all have next hop 0
+        ret = -1;
+
+    free(ctx.nodes);
+    free(ctx.sets);
+
+    if(ret < 0)
+    {
+        free(ctx.out);
+        return -1;
+    }
+
+    *out = ctx.out;
+    return ctx.outCount;
+}
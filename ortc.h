@@ -0,0 +1,55 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file ortc.h
+ * @brief Routing table compression module
+ *
+ * Implements the Optimal Routing Table Constructor (ORTC) algorithm by Draves, King, Venkatachary and Zill.
+ * Produces the smallest prefix set that gives the same longest prefix match result as the input set for every address.
+ * Address family independent - works on addresses stored as byte arrays, MSByte first.
+*/
+#ifndef ORTC_H_
+#define ORTC_H_
+
+#include <stdint.h>
+
+#define ORTC_MAX_ADDRESS_BITS 128 //maximum supported address length
+
+/**
+ * @brief Prefix with next hop identifier
+**/
+struct OrtcPrefix_s
+{
+    uint8_t address[ORTC_MAX_ADDRESS_BITS / 8]; //prefix address, MSByte first, bits beyond length must be zero
+    uint8_t length; //prefix length in bits
+    uint32_t nextHop; //next hop identifier, 0 means no route
+};
+
+/**
+ * @brief Compress prefix set to minimal equivalent prefix set
+ * @param in Input prefixes
+ * @param count Input prefix count
+ * @param bits Address length in bits (32 for IPv4, 128 for IPv6)
+ * @param out Pointer to store output prefix array at. Allocated by this function, must be freed by the caller.
+ * @return Output prefix count or -1 on failure
+ * @attention Addresses not covered by any input prefix are treated as having next hop 0. If there are many input prefixes
+ * with the same address and length, the first one is used.
+**/
+int64_t Ortc_compress(const struct OrtcPrefix_s *in, uint64_t count, uint8_t bits, struct OrtcPrefix_s **out);
+
+#endif
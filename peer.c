@@ -0,0 +1,358 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file peer.c
+ * @brief Peer table module
+ *
+ * The hash table stores only remote addresses and peer indexes, so that probing touches as little memory as possible.
+ * Loaded tables are never modified. A reload builds a new table and replaces the current one with an atomic pointer store,
+ * so lookups need no locks. The replaced table is released after a grace period (Reclaim_synchronize()), when no packet
+ * processing thread can still hold its peers. Its counters are final then and are added to the new table,
+ * so increments made through the old table during the reload are not lost.
+**/
+
+#include "peer.h"
+#include "common.h"
+#include "reclaim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#define PEER_LINE_MAX 4096 //maximum peer file line length
+#define PEER_MIN_SLOTS 16 //minimum hash table size
+
+/**
+ * @brief Hash table slot
+**/
+struct PeerSlot_s
+{
+    in_addr_t remote; //remote address, 0 if the slot is empty
+    uint32_t index; //peer index
+};
+
+/**
+ * @brief Peer table
+**/
+struct PeerTable_s
+{
+    struct Peer_s *peers; //peers in file order
+    uint32_t count; //number of peers
+    struct PeerSlot_s *slots; //hash table
+    uint32_t mask; //hash table size - 1 (size is a power of 2)
+};
+
+static struct PeerTable_s *table = NULL; //current table, NULL if peers are not used
+static pthread_mutex_t loadMutex = PTHREAD_MUTEX_INITIALIZER; //peer table reload mutex
+
+/**
+ * @brief Get hash table start index for remote address
+**/
+static inline uint32_t peer_hash(in_addr_t remote, uint32_t mask)
+{
+    return ((remote * 2654435761U) >> 16) & mask; //multiplicative hash
+}
+
+static void peer_freeTable(struct PeerTable_s *t)
+{
+    if(t == NULL)
+        return;
+    free(t->peers);
+    free(t->slots);
+    free(t);
+}
+
+/**
+ * @brief Find peer in given table
+**/
+static struct Peer_s* peer_find(struct PeerTable_s *t, in_addr_t remote)
+{
+    for(uint32_t i = peer_hash(remote, t->mask); ; i = (i + 1) & t->mask) //linear probing, table is never full
+    {
+        if(t->slots[i].remote == remote)
+            return &(t->peers[t->slots[i].index]);
+        if(t->slots[i].remote == 0)
+            return NULL;
+    }
+}
+
+/**
+ * @brief Parse allowed prefix and add it to peer
+ * @return 0 on success, -1 on failure
+**/
+static int peer_addPrefix(struct Peer_s *p, char *s)
+{
+    char *slash = strchr(s, '/');
+    long len = -1;
+    if(slash != NULL)
+    {
+        *slash = 0;
+        char *end;
+        len = strtol(slash + 1, &end, 10);
+        if((*end != 0) || (end == (slash + 1)))
+            return -1;
+    }
+
+    struct in_addr a;
+    struct in6_addr a6;
+    if(inet_pton(AF_INET, s, &a) == 1)
+    {
+        if(len < 0)
+            len = 32;
+        if((len > 32) || (p->prefixCount == PEER_MAX_PREFIXES))
+            return -1;
+        p->mask[p->prefixCount].s_addr = (len == 0) ? 0 : htonl(0xFFFFFFFFU << (32 - len));
+        p->prefix[p->prefixCount].s_addr = a.s_addr & p->mask[p->prefixCount].s_addr;
+        p->prefixCount++;
+    }
+    else if(inet_pton(AF_INET6, s, &a6) == 1)
+    {
+        if(len < 0)
+            len = 128;
+        if((len > 128) || (p->prefix6Count == PEER_MAX_PREFIXES))
+            return -1;
+        struct in6_addr m = {0};
+        for(uint8_t i = 0; len > 0; i++, len -= 8)
+            m.s6_addr[i] = (len >= 8) ? 0xFF : (uint8_t)(0xFF << (8 - len));
+        p->mask6[p->prefix6Count] = m;
+        p->prefix6[p->prefix6Count] = ipv6_and(a6, m);
+        p->prefix6Count++;
+    }
+    else
+        return -1;
+
+    return 0;
+}
+
+/**
+ * @brief Read peer file
+ * @return Peer table or NULL on failure
+**/
+static struct PeerTable_s* peer_read(const char *file)
+{
+    FILE *f = fopen(file, "r");
+    if(f == NULL)
+    {
+        DEBUG(LOG_ERR, "Peer file open failed");
+        return NULL;
+    }
+
+    struct PeerTable_s *t = calloc(1, sizeof(*t));
+    char *line = malloc(PEER_LINE_MAX);
+    uint32_t capacity = 0;
+    uint32_t lineNumber = 0;
+    if((t == NULL) || (line == NULL))
+    {
+        PRINT(LOG_ERR, "Peer table allocation failed\n");
+        goto fail;
+    }
+
+    while(fgets(line, PEER_LINE_MAX, f) != NULL)
+    {
+        lineNumber++;
+        char *save;
+        char *token = strtok_r(line, " \t\r\n", &save);
+        if((token == NULL) || (token[0] == '#')) //empty line or comment
+            continue;
+
+        if(t->count == capacity)
+        {
+            capacity = capacity ? (capacity * 2) : PEER_MIN_SLOTS;
+            struct Peer_s *p = realloc(t->peers, capacity * sizeof(*p));
+            if(p == NULL)
+            {
+                PRINT(LOG_ERR, "Peer table allocation failed\n");
+                goto fail;
+            }
+            t->peers = p;
+        }
+
+        struct Peer_s *p = &(t->peers[t->count]);
+        memset(p, 0, sizeof(*p));
+        struct in_addr remote;
+        if((inet_pton(AF_INET, token, &remote) != 1) || (remote.s_addr == INADDR_ANY))
+        {
+            PRINT(LOG_ERR, "Peer file %s, line %u: invalid remote address %s\n", file, (unsigned int)lineNumber, token);
+            goto fail;
+        }
+        p->remote = remote.s_addr;
+
+        while((token = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+        {
+            if(token[0] == '#') //comment till the end of line
+                break;
+            if(peer_addPrefix(p, token) < 0)
+            {
+                PRINT(LOG_ERR, "Peer file %s, line %u: invalid allowed prefix %s (or more than %d prefixes)\n", file, (unsigned int)lineNumber, token, PEER_MAX_PREFIXES);
+                goto fail;
+            }
+        }
+
+        Reclaim_online(); //templates are built from the runtime settings snapshot
+        Ipip_buildTemplate(&(p->template), config.local.s_addr, p->remote, IPV4_HEADER_PROTO_IPIP);
+        Ipip_buildTemplate(&(p->template6), config.local.s_addr, p->remote, IPV4_HEADER_PROTO_IP6IP);
+        Reclaim_offline();
+        t->count++;
+    }
+
+    //hash table at least twice as big as the peer count keeps probe sequences short
+    uint32_t slots = PEER_MIN_SLOTS;
+    while(slots < (2 * t->count))
+        slots *= 2;
+    t->mask = slots - 1;
+    t->slots = calloc(slots, sizeof(*(t->slots)));
+    if(t->slots == NULL)
+    {
+        PRINT(LOG_ERR, "Peer table allocation failed\n");
+        goto fail;
+    }
+
+    for(uint32_t k = 0; k < t->count; k++)
+    {
+        if(peer_find(t, t->peers[k].remote) != NULL)
+        {
+            PRINT(LOG_ERR, "Peer file %s: duplicate peer ", file);
+            printAddress(LOG_ERR, (struct in_addr*)&(t->peers[k].remote));
+            PRINT(LOG_ERR, "\n");
+            goto fail;
+        }
+        uint32_t i = peer_hash(t->peers[k].remote, t->mask);
+        while(t->slots[i].remote != 0)
+            i = (i + 1) & t->mask;
+        t->slots[i].remote = t->peers[k].remote;
+        t->slots[i].index = k;
+    }
+
+    free(line);
+    fclose(f);
+    return t;
+
+fail:
+    free(line);
+    fclose(f);
+    peer_freeTable(t);
+    return NULL;
+}
+
+int Peer_load(const char *file)
+{
+    struct PeerTable_s *t = peer_read(file);
+    if(t == NULL)
+        return -1;
+
+    pthread_mutex_lock(&loadMutex);
+    struct PeerTable_s *old = table;
+    __atomic_store_n(&table, t, __ATOMIC_RELEASE);
+    if(old != NULL)
+    {
+        Reclaim_synchronize(); //wait for packets that may still use old peers
+        for(uint32_t k = 0; k < t->count; k++) //keep counters of peers that are still configured
+        {
+            struct Peer_s *p = peer_find(old, t->peers[k].remote);
+            if(p != NULL)
+            {
+                //new table is already in use, so old counters are added rather than copied
+                __atomic_fetch_add(&(t->peers[k].stats.txPackets), p->stats.txPackets, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&(t->peers[k].stats.txBytes), p->stats.txBytes, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&(t->peers[k].stats.rxPackets), p->stats.rxPackets, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&(t->peers[k].stats.rxBytes), p->stats.rxBytes, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&(t->peers[k].stats.rxRejected), p->stats.rxRejected, __ATOMIC_RELAXED);
+            }
+        }
+        peer_freeTable(old);
+    }
+    pthread_mutex_unlock(&loadMutex);
+
+    PRINT(LOG_INFO, "Loaded %u peers from %s\n", (unsigned int)t->count, file);
+    return 0;
+}
+
+int Peer_enabled()
+{
+    return __atomic_load_n(&table, __ATOMIC_RELAXED) != NULL;
+}
+
+struct Peer_s* Peer_find(in_addr_t remote)
+{
+    struct PeerTable_s *t = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+    if((t == NULL) || (remote == 0))
+        return NULL;
+    return peer_find(t, remote);
+}
+
+int Peer_allowed(const struct Peer_s *peer, in_addr_t source)
+{
+    for(uint8_t i = 0; i < peer->prefixCount; i++)
+    {
+        if((source & peer->mask[i].s_addr) == peer->prefix[i].s_addr)
+            return 1;
+    }
+    return 0;
+}
+
+int Peer_allowed6(const struct Peer_s *peer, struct in6_addr source)
+{
+    for(uint8_t i = 0; i < peer->prefix6Count; i++)
+    {
+        if(ipv6_isEqual(ipv6_and(source, peer->mask6[i]), peer->prefix6[i]))
+            return 1;
+    }
+    return 0;
+}
+
+void Peer_print(int logLevel)
+{
+    pthread_mutex_lock(&loadMutex); //table can't be released while printing
+    struct PeerTable_s *t = table;
+    if(t == NULL)
+    {
+        pthread_mutex_unlock(&loadMutex);
+        return;
+    }
+
+    PRINT(logLevel, "Peer table (%u peers):\n", (unsigned int)t->count);
+    for(uint32_t k = 0; k < t->count; k++)
+    {
+        struct Peer_s *p = &(t->peers[k]);
+        printAddress(logLevel, (struct in_addr*)&(p->remote));
+        PRINT(logLevel, ": TX %llu packets, %llu bytes; RX %llu packets, %llu bytes, %llu rejected\n",
+            (unsigned long long)__atomic_load_n(&(p->stats.txPackets), __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&(p->stats.txBytes), __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&(p->stats.rxPackets), __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&(p->stats.rxBytes), __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&(p->stats.rxRejected), __ATOMIC_RELAXED));
+        for(uint8_t i = 0; i < p->prefixCount; i++)
+        {
+            PRINT(logLevel, "  allowed ");
+            printAddress(logLevel, &(p->prefix[i]));
+            PRINT(logLevel, "/");
+            printAddress(logLevel, &(p->mask[i]));
+            PRINT(logLevel, "\n");
+        }
+        for(uint8_t i = 0; i < p->prefix6Count; i++)
+        {
+            PRINT(logLevel, "  allowed ");
+            printAddress6(logLevel, &(p->prefix6[i]));
+            PRINT(logLevel, "/");
+            printAddress6(logLevel, &(p->mask6[i]));
+            PRINT(logLevel, "\n");
+        }
+    }
+    pthread_mutex_unlock(&loadMutex);
+}
@@ -0,0 +1,113 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file peer.h
+ * @brief Peer table module
+ *
+ * Keeps the table of remote endpoints (peers) for point-to-multipoint operation.
+ * Peers are loaded from a file and can be reloaded at runtime. Each peer has its allowed inner source prefixes,
+ * counters and prebuilt outer header templates. Peers are found by remote address in an open addressing hash table.
+ * Routing to peers is still done by the routing table, the peer table decides which remote endpoints are accepted.
+ *
+ * Peer file format - one peer per line, empty lines and lines starting with # are ignored:
+ * <remote IPv4 address> [allowed prefix] [allowed prefix] ...
+ * Allowed prefixes are IPv4 or IPv6 addresses with optional prefix length (e.g. 10.1.0.0/16, 2001:db8::/32).
+ * Packets are accepted from a peer only if their inner source address matches one of its prefixes.
+*/
+#ifndef PEER_H_
+#define PEER_H_
+
+#include "ipip.h"
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define PEER_MAX_PREFIXES 16 //maximum number of allowed prefixes per peer and address family
+
+/**
+ * @brief Peer counters
+**/
+struct PeerStats_s
+{
+    uint64_t txPackets; //packets sent to the peer
+    uint64_t txBytes; //bytes sent to the peer (outer header included)
+    uint64_t rxPackets; //packets received from the peer and decapsulated
+    uint64_t rxBytes; //bytes received from the peer (outer header included)
+    uint64_t rxRejected; //packets received from the peer with inner source address not allowed
+};
+
+/**
+ * @brief Peer table entry
+**/
+struct Peer_s
+{
+    in_addr_t remote; //remote endpoint address
+    struct OuterTemplate_s template; //IPIP outer header template
+    struct OuterTemplate_s template6; //IP6IP outer header template
+    struct PeerStats_s stats; //counters, updated atomically
+    uint8_t prefixCount; //number of allowed IPv4 prefixes
+    uint8_t prefix6Count; //number of allowed IPv6 prefixes
+    struct in_addr prefix[PEER_MAX_PREFIXES], mask[PEER_MAX_PREFIXES]; //allowed IPv4 prefixes
+    struct in6_addr prefix6[PEER_MAX_PREFIXES], mask6[PEER_MAX_PREFIXES]; //allowed IPv6 prefixes
+};
+
+/**
+ * @brief Load peer table from file and replace the current one
+ * @param file Peer file path
+ * @return 0 on success, -1 on failure (current peer table is kept)
+ * @attention Counters of peers present in both tables are kept. Waits until packet processing threads release the old table,
+ * must not be called from them
+**/
+int Peer_load(const char *file);
+
+/**
+ * @brief Check if peer table is in use
+ * @return 1 if a peer table was loaded, 0 otherwise
+**/
+int Peer_enabled();
+
+/**
+ * @brief Find peer by remote endpoint address
+ * @param remote Remote endpoint address
+ * @return Peer or NULL if not found
+ * @attention Returned peer is valid while the calling thread is online (see reclaim.h)
+**/
+struct Peer_s* Peer_find(in_addr_t remote);
+
+/**
+ * @brief Check if IPv4 source address is allowed for given peer
+ * @param peer Peer
+ * @param source Inner source address
+ * @return 1 if allowed, 0 if not
+**/
+int Peer_allowed(const struct Peer_s *peer, in_addr_t source);
+
+/**
+ * @brief Check if IPv6 source address is allowed for given peer
+ * @param peer Peer
+ * @param source Inner source address
+ * @return 1 if allowed, 0 if not
+**/
+int Peer_allowed6(const struct Peer_s *peer, struct in6_addr source);
+
+/**
+ * @brief Print peer table with counters
+ * @param logLevel Logging level
+**/
+void Peer_print(int logLevel);
+
+#endif
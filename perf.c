@@ -0,0 +1,193 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file perf.c
+ * @brief Per-stage performance counter module
+ *
+ * Counters are read with read() on the group leader, which returns all group members at once.
+ * Counter groups are opened on the first measured packet of a thread and stay open until the process exits.
+**/
+
+#include "perf.h"
+#include "log.h"
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define PERF_CALIBRATION 16 //number of back-to-back reads to determine the cost of reading counters
+#define PERF_NONE 0xFF //event is not available
+
+/**
+ * @brief Per-thread measurement state
+**/
+struct PerfThread_s
+{
+    int fd; //group leader descriptor
+    int8_t state; //0 - group not opened yet, 1 - open, -1 - could not be opened
+    uint8_t count; //number of events in group
+    uint8_t index[STATS_EVENTS]; //group index of each event, PERF_NONE if not available
+    uint64_t events; //bit mask of available events
+    uint32_t skipped; //packets since the last measured one
+    uint8_t path; //path of measured packet
+    uint64_t last[STATS_EVENTS]; //counter values at the start of current stage
+    uint64_t overhead[STATS_EVENTS]; //counter increase caused by reading counters
+    uint64_t value[STATS_STAGES][STATS_EVENTS]; //stage counts of measured packet
+};
+
+__thread int8_t perfStage = -1;
+static __thread struct PerfThread_s perf = {.state = 0};
+
+/**
+ * @brief Open counter
+ * @param type Event type (PERF_TYPE_...)
+ * @param event Event (PERF_COUNT_...)
+ * @param group Group leader descriptor or -1 for a new group
+ * @param user Count in user space only
+ * @return Descriptor or -1 on failure
+**/
+static int perf_open(uint32_t type, uint64_t event, int group, int user)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = event;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = user;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC); //calling thread, any CPU
+}
+
+/**
+ * @brief Read counters
+ * @param value Counter values, 0 for events that are not available
+ * @return 0 on success, -1 on failure
+**/
+static int perf_read(uint64_t value[STATS_EVENTS])
+{
+    uint64_t buf[1 + STATS_EVENTS]; //number of events and values
+    if(read(perf.fd, buf, sizeof(buf)) < (ssize_t)((1 + perf.count) * sizeof(uint64_t)))
+        return -1;
+    for(int e = 0; e < STATS_EVENTS; e++)
+        value[e] = (perf.index[e] != PERF_NONE) ? buf[1 + perf.index[e]] : 0;
+    return 0;
+}
+
+/**
+ * @brief Open counter group of calling thread and calibrate it
+ * @return 0 on success, -1 on failure
+**/
+static int perf_init()
+{
+    static const uint64_t hardware[STATS_EVENTS] = {0, PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES};
+    int user = 0;
+    perf.fd = perf_open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, -1, user);
+    if((perf.fd < 0) && ((errno == EACCES) || (errno == EPERM))) //kernel counting not permitted
+    {
+        user = 1;
+        perf.fd = perf_open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, -1, user);
+    }
+    if(perf.fd < 0)
+    {
+        LOG_ERRNO(LOG_WARNING, "Performance counter group opening failed");
+        perf.state = -1;
+        return -1;
+    }
+
+    memset(perf.index, PERF_NONE, sizeof(perf.index));
+    perf.index[STATS_EVENT_TIME] = 0;
+    perf.count = 1;
+    perf.events = 1 << STATS_EVENT_TIME;
+    for(int e = STATS_EVENT_CYCLES; e < STATS_EVENTS; e++)
+    {
+        if(perf_open(PERF_TYPE_HARDWARE, hardware[e], perf.fd, user) < 0) //no PMU (e.g. virtual machine) or event not supported
+            continue;
+        perf.index[e] = perf.count++;
+        perf.events |= 1 << e;
+    }
+    LOG(LOG_INFO, "Performance counters opened (events 0x%x, %s)\n", (unsigned int)perf.events, user ? "user space only" : "including kernel");
+
+    for(int i = 0; i < PERF_CALIBRATION; i++)
+    {
+        uint64_t a[STATS_EVENTS], b[STATS_EVENTS];
+        if((perf_read(a) < 0) || (perf_read(b) < 0))
+        {
+            LOG_ERRNO(LOG_WARNING, "Performance counter reading failed");
+            perf.state = -1; //descriptors are left open, as they would be on success
+            return -1;
+        }
+        for(int e = 0; e < STATS_EVENTS; e++)
+        {
+            if((i == 0) || ((b[e] - a[e]) < perf.overhead[e]))
+                perf.overhead[e] = b[e] - a[e];
+        }
+    }
+    perf.state = 1;
+    return 0;
+}
+
+void Perf_start(int path)
+{
+    perfStage = -1; //discard unfinished measurement
+    if(++perf.skipped < config.perfSample)
+        return;
+    perf.skipped = 0;
+    if((perf.state == 0) && (perf_init() < 0))
+        return;
+    if((perf.state < 0) || (perf_read(perf.last) < 0))
+        return;
+    memset(perf.value, 0, sizeof(perf.value));
+    perf.path = path;
+    perfStage = STATS_STAGE_READ;
+}
+
+void Perf_switch(int stage)
+{
+    uint64_t now[STATS_EVENTS];
+    if(perf_read(now) < 0)
+    {
+        perfStage = -1;
+        return;
+    }
+    for(int e = 0; e < STATS_EVENTS; e++)
+    {
+        uint64_t delta = now[e] - perf.last[e];
+        perf.value[perfStage][e] += (delta > perf.overhead[e]) ? (delta - perf.overhead[e]) : 0;
+    }
+    memcpy(perf.last, now, sizeof(now));
+    perfStage = stage;
+}
+
+void Perf_finish()
+{
+    Perf_switch(perfStage);
+    if(perfStage < 0)
+        return;
+    perfStage = -1;
+
+    struct StatsPerf_s *p = &(stats_shard()->perf[perf.path]);
+    __atomic_store_n(&(p->events), perf.events, __ATOMIC_RELAXED);
+    for(int s = 0; s < STATS_STAGES; s++)
+    {
+        for(int e = 0; e < STATS_EVENTS; e++)
+            stats_increase(&(p->value[s][e]), perf.value[s][e]);
+    }
+    stats_increase(&(p->packets), 1);
+}
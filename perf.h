@@ -0,0 +1,85 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file perf.h
+ * @brief Per-stage performance counter module
+ *
+ * With --perf-sample=n, every n-th packet of each datapath thread is measured stage by stage (StatsStage_e):
+ * the thread reads its perf_event_open() counter group (task clock, cycles, instructions, cache misses)
+ * at each stage boundary and adds the differences to its counter shard. The cost of reading the counters is
+ * calibrated when the group is opened and subtracted. Kernel work (system calls) is included when permitted.
+ * Between measured packets, a stage boundary costs a thread-local load and a branch.
+*/
+#ifndef PERF_H_
+#define PERF_H_
+
+#include <stdint.h>
+#include "common.h"
+#include "stats.h"
+
+extern __thread int8_t perfStage; //stage being measured by calling thread, -1 if no packet is measured
+
+/**
+ * @brief Start measurement (every n-th call)
+ * @param path Packet path (STATS_ENCAP or STATS_DECAP)
+**/
+void Perf_start(int path);
+
+/**
+ * @brief Close current stage and start another
+ * @param stage Stage (StatsStage_e)
+**/
+void Perf_switch(int stage);
+
+/**
+ * @brief Close current stage and add measured packet to counter shard
+**/
+void Perf_finish();
+
+/**
+ * @brief Mark packet receive start, measurement starts for every n-th packet of calling thread
+ * @param path Packet path (STATS_ENCAP or STATS_DECAP)
+ * @attention Measurement that was not finished (e.g. packet was dropped) is discarded
+**/
+static inline void Perf_begin(int path)
+{
+    if(__builtin_expect(config.perfSample != 0, 0))
+        Perf_start(path);
+}
+
+/**
+ * @brief Mark stage boundary
+ * @param stage Stage that starts (StatsStage_e)
+**/
+static inline void Perf_stage(int stage)
+{
+    if(__builtin_expect(perfStage >= 0, 0))
+        Perf_switch(stage);
+}
+
+/**
+ * @brief Mark packet sent (written), measured packet is counted
+ * @attention Only the first sent fragment of a packet is measured
+**/
+static inline void Perf_done()
+{
+    if(__builtin_expect(perfStage >= 0, 0))
+        Perf_finish();
+}
+
+#endif
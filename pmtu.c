@@ -0,0 +1,101 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file pmtu.c
+ * @brief Path MTU cache module
+ *
+ * The cache is direct-mapped. Each slot is a single 64-bit word (remote address, MTU, expiry time),
+ * so it is read and written atomically without locks. Colliding endpoints evict each other,
+ * which only means the path MTU is learned again, as after expiry.
+ * IPv6 endpoints are kept in a separate cache, keyed by a 32-bit hash of the address.
+**/
+
+#include "pmtu.h"
+#include "common.h"
+#include <time.h>
+
+#define PMTU_CACHE_SIZE 1024 //number of cache slots (must be a power of 2)
+#define PMTU_TIMEOUT_MINUTES ((PMTU_TIMEOUT + 59) / 60 + 1) //maximum minutes left for a valid entry
+
+//slot layout: key - IPv4 address or IPv6 address hash (bits 63-32), MTU (bits 31-16), expiry time in monotonic minutes modulo 2^16 (bits 15-0)
+static uint64_t cache[PMTU_CACHE_SIZE];
+static uint64_t cache6[PMTU_CACHE_SIZE];
+
+/**
+ * @brief Get current monotonic time in seconds
+**/
+static inline uint32_t pmtu_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static inline uint64_t* pmtu_slot(uint64_t *c, uint32_t key)
+{
+    return &c[((key * 2654435761U) >> 16) & (PMTU_CACHE_SIZE - 1)]; //multiplicative hash
+}
+
+static uint16_t pmtu_get(uint64_t *c, uint32_t key)
+{
+    uint64_t s = __atomic_load_n(pmtu_slot(c, key), __ATOMIC_RELAXED);
+    if((s == 0) || ((uint32_t)(s >> 32) != key))
+        return 0;
+
+    //times are compared modulo 2^16, entries live much shorter than the wrap-around period (45 days)
+    uint16_t left = (uint16_t)(s & 0xFFFF) - (uint16_t)(pmtu_now() / 60);
+    if((left == 0) || (left > PMTU_TIMEOUT_MINUTES)) //expired
+        return 0;
+    return (s >> 16) & 0xFFFF;
+}
+
+static void pmtu_update(uint64_t *c, uint32_t key, uint16_t mtu, uint16_t min)
+{
+    if(mtu < min)
+        mtu = min;
+    uint16_t expires = (pmtu_now() + PMTU_TIMEOUT + 59) / 60; //rounded up to full minutes, so the entry lives at least PMTU_TIMEOUT seconds
+    __atomic_store_n(pmtu_slot(c, key), ((uint64_t)key << 32) | ((uint64_t)mtu << 16) | expires, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Get IPv6 address cache key
+**/
+static inline uint32_t pmtu_key6(const struct in6_addr *remote)
+{
+    return remote->s6_addr32[0] ^ remote->s6_addr32[1] ^ remote->s6_addr32[2] ^ remote->s6_addr32[3];
+}
+
+uint16_t Pmtu_get(in_addr_t remote)
+{
+    return pmtu_get(cache, remote);
+}
+
+void Pmtu_update(in_addr_t remote, uint16_t mtu)
+{
+    pmtu_update(cache, remote, mtu, PMTU_MIN);
+}
+
+uint16_t Pmtu_get6(const struct in6_addr *remote)
+{
+    return pmtu_get(cache6, pmtu_key6(remote));
+}
+
+void Pmtu_update6(const struct in6_addr *remote, uint16_t mtu)
+{
+    pmtu_update(cache6, pmtu_key6(remote), mtu, PMTU_MIN6);
+}
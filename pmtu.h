@@ -0,0 +1,64 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file pmtu.h
+ * @brief Path MTU cache module
+ *
+ * Keeps path MTU to remote endpoints learned from ICMP Fragmentation Needed messages and local send errors.
+ * Entries are soft state (RFC 2003, RFC 4213): they expire after PMTU_TIMEOUT seconds and the path MTU is unknown again,
+ * so that a path MTU increase is eventually detected.
+*/
+#ifndef PMTU_H_
+#define PMTU_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define PMTU_TIMEOUT 600 //path MTU entry lifetime in seconds (RFC 1191 recommends 10 minutes)
+#define PMTU_MIN 88 //minimum accepted path MTU: minimum IPv4 MTU (68 bytes) plus outer header
+#define PMTU_MIN6 1280 //minimum accepted IPv6 path MTU (minimum IPv6 link MTU)
+
+/**
+ * @brief Get path MTU to remote endpoint
+ * @param remote Remote endpoint address
+ * @return Path MTU or 0 if not known
+**/
+uint16_t Pmtu_get(in_addr_t remote);
+
+/**
+ * @brief Store path MTU to remote endpoint
+ * @param remote Remote endpoint address
+ * @param mtu Path MTU, values below PMTU_MIN are raised to PMTU_MIN
+**/
+void Pmtu_update(in_addr_t remote, uint16_t mtu);
+
+/**
+ * @brief Get path MTU to IPv6 remote endpoint
+ * @param remote Remote endpoint address
+ * @return Path MTU or 0 if not known
+**/
+uint16_t Pmtu_get6(const struct in6_addr *remote);
+
+/**
+ * @brief Store path MTU to IPv6 remote endpoint
+ * @param remote Remote endpoint address
+ * @param mtu Path MTU, values below PMTU_MIN6 are raised to PMTU_MIN6
+**/
+void Pmtu_update6(const struct in6_addr *remote, uint16_t mtu);
+
+#endif
@@ -0,0 +1,92 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file probe.h
+ * @brief Static tracepoints (USDT probes)
+ *
+ * Probes are described in the .note.stapsdt ELF section in the format of <sys/sdt.h> (SystemTap SDT version 3),
+ * so they are found by bpftrace, perf, SystemTap and gdb, e.g. bpftrace -e 'usdt:./kiwitun:kiwitun:drop { @[arg0] = count(); }'.
+ * The header is self-contained, there is no build or runtime dependency on SystemTap.
+ * A disabled probe is a single nop instruction, a tracer replaces it with a breakpoint when attached.
+ * All arguments are passed as signed 64-bit values, pointers and addresses included.
+ * When built with PROBE_DISABLE defined (KIWITUN_NO_PROBES CMake option) or for non-ELF targets, probes are compiled out.
+*/
+#ifndef PROBE_H_
+#define PROBE_H_
+
+#include <stdint.h>
+
+#define PROBE_PROVIDER "kiwitun" //USDT provider name
+
+#if defined(PROBE_DISABLE) || !defined(__ELF__) || !(defined(__x86_64__) || defined(__aarch64__))
+
+#define PROBE0(name) {}
+#define PROBE1(name, a1) {}
+#define PROBE2(name, a1, a2) {}
+#define PROBE3(name, a1, a2, a3) {}
+#define PROBE4(name, a1, a2, a3, a4) {}
+
+#else
+
+#define PROBE_ARG_(a) "nor"((int64_t)(uintptr_t)(a))
+
+//note layout: probe address, base address, semaphore address (none), provider, name, argument description
+#define PROBE_(name, args, ...) __asm__ __volatile__(\
+    "990: nop\n"\
+    ".pushsection .note.stapsdt,\"\",\"note\"\n"\
+    ".balign 4\n"\
+    ".4byte 992f-991f, 994f-993f, 3\n"\
+    "991: .asciz \"stapsdt\"\n"\
+    "992: .balign 4\n"\
+    "993: .8byte 990b\n"\
+    ".8byte _.stapsdt.base\n"\
+    ".8byte 0\n"\
+    ".asciz \"" PROBE_PROVIDER "\"\n"\
+    ".asciz \"" #name "\"\n"\
+    ".asciz \"" args "\"\n"\
+    "994: .balign 4\n"\
+    ".popsection\n"\
+    ".ifndef _.stapsdt.base\n"\
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"\
+    ".weak _.stapsdt.base\n"\
+    ".hidden _.stapsdt.base\n"\
+    "_.stapsdt.base: .space 1\n"\
+    ".size _.stapsdt.base, 1\n"\
+    ".popsection\n"\
+    ".endif\n"\
+    :: __VA_ARGS__)
+
+/**
+ * @brief Fire probe without arguments
+ * @param name Probe name (identifier)
+**/
+#define PROBE0(name) PROBE_(name, "")
+
+/**
+ * @brief Fire probe with arguments
+ * @param name Probe name (identifier)
+ * @param a1... Integer or pointer arguments
+**/
+#define PROBE1(name, a1) PROBE_(name, "-8@%0", PROBE_ARG_(a1))
+#define PROBE2(name, a1, a2) PROBE_(name, "-8@%0 -8@%1", PROBE_ARG_(a1), PROBE_ARG_(a2))
+#define PROBE3(name, a1, a2, a3) PROBE_(name, "-8@%0 -8@%1 -8@%2", PROBE_ARG_(a1), PROBE_ARG_(a2), PROBE_ARG_(a3))
+#define PROBE4(name, a1, a2, a3, a4) PROBE_(name, "-8@%0 -8@%1 -8@%2 -8@%3", PROBE_ARG_(a1), PROBE_ARG_(a2), PROBE_ARG_(a3), PROBE_ARG_(a4))
+
+#endif
+
+#endif
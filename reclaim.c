@@ -0,0 +1,68 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file reclaim.c
+ * @brief Memory reclamation module for lock-free tables
+ *
+ * The grace period counter starts at 1, so a thread period of 0 always means offline. A writer increments the counter
+ * and waits until each thread is either offline or has seen the new value. Thread states are thread-local
+ * and stay in the thread list, kiwitun threads live until the process exits.
+**/
+
+#include "reclaim.h"
+#include <time.h>
+#include <pthread.h>
+
+__thread struct ReclaimThread_s *reclaimThread = NULL;
+uint64_t reclaimPeriod = 1;
+static __thread struct ReclaimThread_s self; //calling thread state
+static struct ReclaimThread_s *threads = NULL; //all reader threads
+static pthread_mutex_t reclaimMutex = PTHREAD_MUTEX_INITIALIZER; //grace period mutex
+
+struct ReclaimThread_s* Reclaim_register()
+{
+    struct ReclaimThread_s *t = &self;
+    t->period = 0;
+    t->next = __atomic_load_n(&threads, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&threads, &(t->next), t, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    reclaimThread = t;
+    return t;
+}
+
+void Reclaim_synchronize()
+{
+    pthread_mutex_lock(&reclaimMutex);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); //new table pointers are visible before the grace period starts
+    uint64_t period = __atomic_add_fetch(&reclaimPeriod, 1, __ATOMIC_SEQ_CST);
+    for(struct ReclaimThread_s *t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next)
+    {
+        if(t == reclaimThread)
+            continue;
+        while(1)
+        {
+            uint64_t p = __atomic_load_n(&(t->period), __ATOMIC_RELAXED);
+            if((p == 0) || (p == period))
+                break;
+            struct timespec ts = {.tv_sec = 0, .tv_nsec = RECLAIM_POLL_INTERVAL * 1000000};
+            nanosleep(&ts, NULL);
+        }
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); //old tables are freed only after the readers are done
+    pthread_mutex_unlock(&reclaimMutex);
+}
@@ -0,0 +1,92 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file reclaim.h
+ * @brief Memory reclamation module for lock-free tables
+ *
+ * Tables read without locks (tunnel hash table, peer table) are replaced with an atomic pointer store.
+ * The replaced table can be freed only when no thread can still use it. Packet processing threads report quiescent states
+ * (points where they hold no table pointers) by going offline before every blocking call and online after it.
+ * Reclaim_synchronize() waits until each online thread has passed a quiescent state (quiescent-state-based reclamation),
+ * so readers pay only two stores and two fences per blocking call.
+ * Only threads that announce themselves with Reclaim_online() are waited for, so other threads must not read these tables.
+*/
+#ifndef RECLAIM_H_
+#define RECLAIM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RECLAIM_POLL_INTERVAL 1 //grace period check interval in milliseconds
+
+/**
+ * @brief Reader thread state
+**/
+struct ReclaimThread_s
+{
+    uint64_t period __attribute__((aligned(64))); //grace period seen at the last quiescent state, 0 when offline
+    struct ReclaimThread_s *next; //next thread in thread list
+};
+
+extern __thread struct ReclaimThread_s *reclaimThread; //calling thread state, NULL if not registered
+extern uint64_t reclaimPeriod; //current grace period
+
+/**
+ * @brief Register calling thread as a reader
+ * @return Thread state
+**/
+struct ReclaimThread_s* Reclaim_register();
+
+/**
+ * @brief Announce that the calling thread starts reading tables (registers the thread on first call)
+**/
+static inline void Reclaim_online()
+{
+    struct ReclaimThread_s *t = reclaimThread;
+    if(__builtin_expect(t == NULL, 0))
+        t = Reclaim_register();
+    __atomic_store_n(&(t->period), __atomic_load_n(&reclaimPeriod, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); //announcement is visible before any table pointer is loaded
+}
+
+/**
+ * @brief Announce that the calling thread holds no table pointers until the next Reclaim_online() (e.g. before blocking)
+**/
+static inline void Reclaim_offline()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); //all table reads are done before the announcement
+    __atomic_store_n(&(reclaimThread->period), 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Report quiescent state of an online thread (no table pointers held), for loops that don't block for long
+**/
+static inline void Reclaim_quiescent()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    __atomic_store_n(&(reclaimThread->period), __atomic_load_n(&reclaimPeriod, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Wait until no reader can use tables replaced before this call
+ * @attention Must not be called by an online thread other than the caller itself (which is not waited for)
+**/
+void Reclaim_synchronize();
+
+#endif
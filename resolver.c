@@ -0,0 +1,275 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file resolver.c
+ * @brief Remote endpoint hostname resolver module
+ *
+ * A records are queried directly (res_search()) to get their TTLs. Names not found in DNS (e.g. listed in /etc/hosts)
+ * are resolved with getaddrinfo() and refreshed every --refresh minutes.
+ * The resolver thread wakes up every second to check the active address, so no timers or signals are needed.
+**/
+
+#include "resolver.h"
+#include "tunnel.h"
+#include "common.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <resolv.h>
+#include <arpa/nameser.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+/**
+ * @brief Set of addresses of remote endpoint hostname
+**/
+struct ResolverSet_s
+{
+    in_addr_t addr[RESOLVER_MAX_ADDRESSES]; //addresses in order returned by resolver
+    uint8_t count; //number of addresses
+    uint32_t ttl; //time to next resolution in seconds
+};
+
+static in_addr_t unreachable = INADDR_ANY; //address reported unreachable, INADDR_ANY if none
+
+/**
+ * @brief Get current monotonic time in seconds
+**/
+static inline uint32_t resolver_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * @brief Add address to set if not present yet
+**/
+static void resolver_add(struct ResolverSet_s *set, in_addr_t addr)
+{
+    for(uint8_t i = 0; i < set->count; i++)
+    {
+        if(set->addr[i] == addr)
+            return;
+    }
+    if(set->count < RESOLVER_MAX_ADDRESSES)
+        set->addr[set->count++] = addr;
+}
+
+/**
+ * @brief Resolve hostname with DNS query and get record TTLs
+ * @param set Address set to fill
+ * @return 0 on success, -1 on failure
+**/
+static int resolver_query(struct ResolverSet_s *set)
+{
+    uint8_t answer[NS_PACKETSZ * 4];
+    int len = res_search(config.hostname, ns_c_in, ns_t_a, answer, sizeof(answer));
+    if(len < 0)
+        return -1;
+
+    ns_msg msg;
+    if(ns_initparse(answer, (len > (int)sizeof(answer)) ? (int)sizeof(answer) : len, &msg) < 0) //truncated answer is parsed as far as possible
+        return -1;
+
+    uint32_t ttl = UINT32_MAX;
+    for(int i = 0; i < ns_msg_count(msg, ns_s_an); i++)
+    {
+        ns_rr rr;
+        if(ns_parserr(&msg, ns_s_an, i, &rr) < 0)
+            break;
+        //CNAME records are followed by the name server, only A records at the end of the chain are used
+        if((ns_rr_type(rr) != ns_t_a) || (ns_rr_rdlen(rr) != 4))
+            continue;
+        in_addr_t addr;
+        memcpy(&addr, ns_rr_rdata(rr), 4);
+        resolver_add(set, addr);
+        if(ns_rr_ttl(rr) < ttl)
+            ttl = ns_rr_ttl(rr);
+    }
+    if(set->count == 0)
+        return -1;
+    set->ttl = ttl;
+    return 0;
+}
+
+/**
+ * @brief Resolve hostname with system resolver (no TTLs)
+ * @param set Address set to fill
+ * @return 0 on success, -1 on failure
+**/
+static int resolver_getaddrinfo(struct ResolverSet_s *set)
+{
+    struct addrinfo hints, *results;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_RAW; //one result per address
+    if(getaddrinfo(config.hostname, NULL, &hints, &results) != 0)
+        return -1;
+
+    for(struct addrinfo *r = results; r != NULL; r = r->ai_next)
+        resolver_add(set, ((struct sockaddr_in*)(r->ai_addr))->sin_addr.s_addr);
+    freeaddrinfo(results);
+    if(set->count == 0)
+        return -1;
+    set->ttl = UINT32_MAX;
+    return 0;
+}
+
+/**
+ * @brief Resolve hostname
+ * @param set Address set to fill
+ * @return 0 on success, -1 on failure
+**/
+static int resolver_resolve(struct ResolverSet_s *set)
+{
+    set->count = 0;
+    if((resolver_query(set) < 0) && (resolver_getaddrinfo(set) < 0))
+        return -1;
+
+    //TTL is honored, but refresh interval is the upper limit
+    if(config.hostnameRefresh && (set->ttl > (config.hostnameRefresh * 60)))
+        set->ttl = config.hostnameRefresh * 60;
+    if(set->ttl < RESOLVER_MIN_TTL)
+        set->ttl = RESOLVER_MIN_TTL;
+
+    //address list is formatted first, so that it is a single syslog record
+    char list[RESOLVER_MAX_ADDRESSES * (INET_ADDRSTRLEN + 1)];
+    int len = 0;
+    for(uint8_t i = 0; i < set->count; i++)
+    {
+        list[len++] = ' ';
+        inet_ntop(AF_INET, &(set->addr[i]), &(list[len]), sizeof(list) - len);
+        len += strlen(&(list[len]));
+    }
+    list[len] = 0;
+    if(set->ttl != UINT32_MAX)
+    {
+        PRINT(LOG_DEBUG, "%s is at%s (next resolution in %u s)\n", config.hostname, list, (unsigned int)set->ttl);
+    }
+    else
+    {
+        PRINT(LOG_DEBUG, "%s is at%s\n", config.hostname, list);
+    }
+    return 0;
+}
+
+/**
+ * @brief Make address active
+**/
+static void resolver_activate(in_addr_t addr)
+{
+    char tmp[INET_ADDRSTRLEN];
+    if(Tunnel_setRemote(0, addr) < 0)
+    {
+        PRINT(LOG_ERR, "Remote endpoint change to %s failed\n", inet_ntop(AF_INET, &addr, tmp, sizeof(tmp)));
+    }
+    else
+    {
+        PRINT(LOG_INFO, "Remote endpoint is %s\n", inet_ntop(AF_INET, &addr, tmp, sizeof(tmp)));
+    }
+}
+
+static void *resolver_exec(void *arg)
+{
+    struct Tunnel_s *tunnel = Tunnel_get(0);
+    struct ResolverSet_s set = {.count = 0};
+    uint8_t active = 0; //active address index
+    uint32_t next = 0; //next resolution time
+    uint32_t lastRx = resolver_now(); //time of last received packet (or address change)
+    uint32_t rx = 0, tx = 0; //activity counters seen at last check
+    uint8_t sent = 0; //packets were sent since last received packet
+
+    while(1)
+    {
+        uint32_t now = resolver_now();
+        if(now >= next)
+        {
+            struct ResolverSet_s s;
+            if(resolver_resolve(&s) < 0)
+            {
+                PRINT(LOG_WARNING, "Hostname %s resolution failed\n", config.hostname);
+                next = now + RESOLVER_RETRY; //current addresses are kept
+            }
+            else
+            {
+                next = (s.ttl == UINT32_MAX) ? UINT32_MAX : (now + s.ttl);
+                //keep active address if it is still there, round-robin DNS would change it on every resolution otherwise
+                uint8_t i = 0;
+                while((i < s.count) && ((set.count == 0) || (s.addr[i] != set.addr[active])))
+                    i++;
+                set = s;
+                if(i == s.count)
+                {
+                    active = 0;
+                    resolver_activate(set.addr[0]);
+                    lastRx = now;
+                    sent = 0;
+                }
+                else
+                    active = i;
+            }
+        }
+
+        //failover: ICMP error was received, or (if enabled) packets were sent, but no packets have been received since the timeout
+        uint32_t r = __atomic_load_n(&(tunnel->rxActivity), __ATOMIC_RELAXED);
+        uint32_t t = __atomic_load_n(&(tunnel->txActivity), __ATOMIC_RELAXED);
+        if(r != rx)
+        {
+            lastRx = now;
+            sent = 0;
+        }
+        else if(t != tx)
+            sent = 1;
+        rx = r;
+        tx = t;
+        in_addr_t failed = __atomic_exchange_n(&unreachable, INADDR_ANY, __ATOMIC_RELAXED);
+        if((set.count > 1) && ((config.failoverTimeout && sent && ((now - lastRx) >= config.failoverTimeout)) || (failed == set.addr[active])))
+        {
+            char tmp[INET_ADDRSTRLEN];
+            PRINT(LOG_WARNING, "Remote endpoint %s is not responding\n", inet_ntop(AF_INET, &(set.addr[active]), tmp, sizeof(tmp)));
+            active = (active + 1) % set.count;
+            resolver_activate(set.addr[active]);
+            lastRx = now;
+            sent = 0;
+        }
+
+        sleep(1);
+    }
+    return NULL;
+}
+
+int Resolver_start()
+{
+    pthread_t th;
+    if(pthread_create(&th, NULL, &resolver_exec, NULL) != 0)
+    {
+        PRINT(LOG_ERR, "Resolver thread creation failed\n");
+        return -1;
+    }
+    pthread_detach(th);
+    return 0;
+}
+
+void Resolver_unreachable(in_addr_t remote)
+{
+    __atomic_store_n(&unreachable, remote, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,52 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file resolver.h
+ * @brief Remote endpoint hostname resolver module
+ *
+ * Resolves the remote endpoint hostname in its own thread, so that a slow DNS server never stalls packet processing.
+ * The hostname is resolved again when the shortest record TTL expires (but at least every --refresh minutes).
+ * All returned addresses are kept. One of them is the active remote endpoint of the tunnel, set with Tunnel_setRemote().
+ * When the underlay reports the active address unreachable (ICMP error), the next address becomes active.
+ * With --failover-timeout, the next address becomes active also when packets are sent to the active one,
+ * but nothing comes back for the timeout. This is off by default, as one-way traffic would switch addresses all the time.
+*/
+#ifndef RESOLVER_H_
+#define RESOLVER_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define RESOLVER_MAX_ADDRESSES 8 //maximum number of addresses kept for hostname
+#define RESOLVER_MIN_TTL 10 //minimum time between resolutions in seconds
+#define RESOLVER_RETRY 30 //time to next resolution after failure in seconds
+
+/**
+ * @brief Start resolver thread for remote endpoint hostname of the first tunnel
+ * @return 0 on success, -1 on failure
+**/
+int Resolver_start();
+
+/**
+ * @brief Report remote endpoint address unreachable (ICMP error received from the underlay)
+ * @param remote Remote endpoint address
+ * @attention Can be called from any thread, the resolver thread switches to the next address if this one is active
+**/
+void Resolver_unreachable(in_addr_t remote);
+
+#endif
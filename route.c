@@ -27,6 +27,9 @@
 **/
 
 #include "route.h"
+#include "ortc.h"
+#include "routeshm.h"
+#include "probe.h"
 #include <net/if.h>
 #include <stdio.h>
 #include <string.h>
@@ -41,10 +44,18 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
 
 #define NETLINK_BUF_SIZE 16384 //buffer size for netlink messages
 #define ROUTING_TABLE_BLOCK_SIZE 256 //number of entries in one routing table block (routing table is made of N routing table blocks)
 
+#define ROUTE_CACHE_INITIAL_SIZE 256 //initial number of slots in on-demand route cache (must be a power of 2)
+#define ROUTE_CACHE_IDLE_TIMEOUT 300 //time in seconds after which unused on-demand route cache entries are removed
+#define ROUTE_CACHE_CLEANUP_INTERVAL 10 //on-demand route cache cleanup interval in seconds
+#define ROUTE_PENDING_TIMEOUT 2 //time in seconds after which unanswered route request is repeated
+#define ROUTE_REQUEST_QUEUE_SIZE 256 //maximum number of queued route requests
+
 /**
  * @brief Convert netmask in CIDR notation to IPv4 address
  * @param n CIDR netmask
@@ -75,23 +86,32 @@ struct in6_addr CIDR_TO_ADDR6(uint8_t n)
 
 
 /**
- * @brief Structure of local IPv4 routing table entry 
+ * @brief On-demand route cache entry state
+**/
+#define ROUTE_CACHE_EMPTY 0 //slot is empty
+#define ROUTE_CACHE_PENDING 1 //route request was sent, no answer yet
+#define ROUTE_CACHE_RESOLVED 2 //route is resolved (gateway may be zero if there is no route)
+
+/**
+ * @brief Structure of on-demand route cache entry
+ * IPv4 addresses are stored as IPv4-mapped IPv6 addresses
 **/
-struct Route_s
+struct RouteCacheEntry_s
 {
-    struct in_addr address;
-    struct in_addr netmask;
-    struct in_addr gateway;
+    struct in6_addr address; //destination address
+    struct in6_addr gateway; //tunnel endpoint address
+    time_t requested; //time of last route request
+    time_t used; //time of last lookup
+    uint8_t state; //entry state
 };
 
 /**
- * @brief Structure of local IPv6 routing table entry 
+ * @brief Structure of on-demand route request
 **/
-struct Route6_s
+struct RouteRequest_s
 {
-    struct in6_addr address;
-    struct in6_addr netmask;
-    struct in6_addr gateway;
+    int family; //AF_INET or AF_INET6
+    struct in6_addr address; //destination address (IPv4-mapped for IPv4)
 };
 
 struct RouteHelper_s
@@ -118,6 +138,31 @@ pthread_mutex_t	routes6Mutex = PTHREAD_MUTEX_INITIALIZER; //IPv6 routing table a
 #define LOCK_ROUTES6() (pthread_mutex_lock(&routes6Mutex))
 #define UNLOCK_ROUTES6() (pthread_mutex_unlock(&routes6Mutex))
 
+//lookup tables are built from compressed routing tables and sorted by netmask (in descending order) first, then by destination
+struct Route_s *fib = NULL; //IPv4 lookup table
+uint64_t fibEntries = 0; //number of entries in IPv4 lookup table
+pthread_mutex_t	fibMutex = PTHREAD_MUTEX_INITIALIZER; //IPv4 lookup table access mutex
+#define LOCK_FIB() (pthread_mutex_lock(&fibMutex))
+#define UNLOCK_FIB() (pthread_mutex_unlock(&fibMutex))
+
+//on-demand mode: open addressing hash table with linear probing, IPv4 and IPv6 destinations share one table
+struct RouteCacheEntry_s *cache = NULL; //on-demand route cache
+uint32_t cacheSize = 0; //number of slots in route cache
+uint32_t cacheEntries = 0; //number of used slots in route cache
+struct RouteRequest_s requests[ROUTE_REQUEST_QUEUE_SIZE]; //route request queue
+uint16_t requestHead = 0, requestCount = 0; //route request queue head and element count
+pthread_mutex_t	cacheMutex = PTHREAD_MUTEX_INITIALIZER; //route cache and request queue access mutex
+pthread_cond_t requestCond = PTHREAD_COND_INITIALIZER; //signaled when a route request is queued
+#define LOCK_CACHE() (pthread_mutex_lock(&cacheMutex))
+#define UNLOCK_CACHE() (pthread_mutex_unlock(&cacheMutex))
+static void (*resolveCallback)(int family, const void *address) = NULL; //called when on-demand route request is finished
+
+struct Route6_s *fib6 = NULL; //IPv6 lookup table
+uint64_t fib6Entries = 0; //number of entries in IPv6 lookup table
+pthread_mutex_t	fib6Mutex = PTHREAD_MUTEX_INITIALIZER; //IPv6 lookup table access mutex
+#define LOCK_FIB6() (pthread_mutex_lock(&fib6Mutex))
+#define UNLOCK_FIB6() (pthread_mutex_unlock(&fib6Mutex))
+
 
 
 
@@ -156,20 +201,168 @@ int sort_compare6(const void *a, const void *b)
     return 0; //dummy
 }
 
-//sort IPv4 routing table
-void route_sort()
+/**
+ * @brief Publish current lookup tables in shared memory (if enabled)
+**/
+static void route_publish()
+{
+    if(!config.routePublish)
+        return;
+
+    LOCK_FIB();
+    LOCK_FIB6();
+    RouteShm_publish(fib, fibEntries, fib6, fib6Entries);
+    UNLOCK_FIB6();
+    UNLOCK_FIB();
+}
+
+/**
+ * @brief Build IPv4 lookup table from compressed routing table
+ * @return 0 on success, -1 on failure (the previous lookup table is kept)
+**/
+int route_compress()
 {
     LOCK_ROUTES();
-    qsort(routes, routeEntries, sizeof(*routes), sort_compare4);
+    uint64_t count = routeEntries;
+    struct OrtcPrefix_s *in = malloc((count + 1) * sizeof(struct OrtcPrefix_s));
+    if(in == NULL)
+    {
+        UNLOCK_ROUTES();
+        PRINT(LOG_ERR, "IPv4 routing table compression failed\n");
+        return -1;
+    }
+    for(uint64_t i = 0; i < count; i++)
+    {
+        memset(&in[i], 0, sizeof(struct OrtcPrefix_s));
+        memcpy(in[i].address, &(routes[i].address.s_addr), sizeof(in_addr_t)); //network byte order is MSByte first
+        in[i].length = __builtin_popcount(routes[i].netmask.s_addr);
+        in[i].nextHop = routes[i].gateway.s_addr; //gateway address is used as next hop identifier directly, 0 means no gateway
+    }
     UNLOCK_ROUTES();
+
+    struct OrtcPrefix_s *out;
+    int64_t n = Ortc_compress(in, count, 32, &out);
+    free(in);
+    if(n < 0)
+    {
+        PRINT(LOG_ERR, "IPv4 routing table compression failed\n");
+        return -1;
+    }
+
+    struct Route_s *table = malloc((n + 1) * sizeof(struct Route_s));
+    if(table == NULL)
+    {
+        free(out);
+        PRINT(LOG_ERR, "IPv4 routing table compression failed\n");
+        return -1;
+    }
+    for(int64_t i = 0; i < n; i++)
+    {
+        memcpy(&(table[i].address.s_addr), out[i].address, sizeof(in_addr_t));
+        table[i].netmask.s_addr = (out[i].length == 0) ? 0 : CIDR_TO_ADDR4(out[i].length);
+        table[i].gateway.s_addr = out[i].nextHop;
+    }
+    free(out);
+    qsort(table, n, sizeof(*table), sort_compare4);
+
+    LOCK_FIB();
+    struct Route_s *old = fib;
+    fib = table;
+    fibEntries = n;
+    UNLOCK_FIB();
+    free(old);
+
+    PRINT(LOG_DEBUG, "IPv4 routing table: %llu routes, %lld after compression\n", (unsigned long long)count, (long long)n);
+    return 0;
+}
+
+/**
+ * @brief Compare IPv6 gateways (for gateway identifier table)
+**/
+int gateway_compare6(const void *a, const void *b)
+{
+    return ipv6_compare(*(struct in6_addr*)a, *(struct in6_addr*)b);
 }
 
-//sort IPv6 routing table
-void route_sort6()
+/**
+ * @brief Build IPv6 lookup table from compressed routing table
+ * @return 0 on success, -1 on failure (the previous lookup table is kept)
+**/
+int route_compress6()
 {
     LOCK_ROUTES6();
-    qsort(routes6, route6Entries, sizeof(*routes6), sort_compare6);
+    uint64_t count = route6Entries;
+    struct OrtcPrefix_s *in = malloc((count + 1) * sizeof(struct OrtcPrefix_s));
+    //gateway identifier table: next hop identifier is an index in this table, in6addr_any is always at index 0
+    struct in6_addr *gateways = malloc((count + 1) * sizeof(struct in6_addr));
+    if((in == NULL) || (gateways == NULL))
+    {
+        UNLOCK_ROUTES6();
+        free(in);
+        free(gateways);
+        PRINT(LOG_ERR, "IPv6 routing table compression failed\n");
+        return -1;
+    }
+    gateways[0] = in6addr_any;
+    for(uint64_t i = 0; i < count; i++)
+        gateways[i + 1] = routes6[i].gateway;
+    qsort(gateways, count + 1, sizeof(struct in6_addr), gateway_compare6); //in6addr_any is the lowest address, so it stays at index 0
+    uint64_t gatewayCount = 0;
+    for(uint64_t i = 0; i <= count; i++) //remove duplicates
+    {
+        if((gatewayCount == 0) || !ipv6_isEqual(gateways[gatewayCount - 1], gateways[i]))
+            gateways[gatewayCount++] = gateways[i];
+    }
+
+    for(uint64_t i = 0; i < count; i++)
+    {
+        memset(&in[i], 0, sizeof(struct OrtcPrefix_s));
+        memcpy(in[i].address, &(routes6[i].address), sizeof(struct in6_addr));
+        in[i].length = 0;
+        for(uint8_t k = 0; k < 4; k++)
+            in[i].length += __builtin_popcount(routes6[i].netmask.__in6_u.__u6_addr32[k]);
+        struct in6_addr *g = bsearch(&(routes6[i].gateway), gateways, gatewayCount, sizeof(struct in6_addr), gateway_compare6);
+        in[i].nextHop = g - gateways;
+    }
     UNLOCK_ROUTES6();
+
+    struct OrtcPrefix_s *out;
+    int64_t n = Ortc_compress(in, count, 128, &out);
+    free(in);
+    if(n < 0)
+    {
+        free(gateways);
+        PRINT(LOG_ERR, "IPv6 routing table compression failed\n");
+        return -1;
+    }
+
+    struct Route6_s *table = malloc((n + 1) * sizeof(struct Route6_s));
+    if(table == NULL)
+    {
+        free(out);
+        free(gateways);
+        PRINT(LOG_ERR, "IPv6 routing table compression failed\n");
+        return -1;
+    }
+    for(int64_t i = 0; i < n; i++)
+    {
+        memcpy(&(table[i].address), out[i].address, sizeof(struct in6_addr));
+        table[i].netmask = CIDR_TO_ADDR6(out[i].length);
+        table[i].gateway = gateways[out[i].nextHop];
+    }
+    free(out);
+    free(gateways);
+    qsort(table, n, sizeof(*table), sort_compare6);
+
+    LOCK_FIB6();
+    struct Route6_s *old = fib6;
+    fib6 = table;
+    fib6Entries = n;
+    UNLOCK_FIB6();
+    free(old);
+
+    PRINT(LOG_DEBUG, "IPv6 routing table: %llu routes, %lld after compression\n", (unsigned long long)count, (long long)n);
+    return 0;
 }
 
 /**
@@ -369,7 +562,7 @@ void route_removeAndShift6(struct Route6_s *r)
     LOCK_ROUTES6();
     for(uint64_t i = 0; i < route6Entries; i++)
     {
-        if(ipv6_compare(routes6[i].address, r->address) && ipv6_compare(routes6[i].netmask, r->netmask) && ipv6_compare(routes6[i].gateway, r->gateway))
+        if(ipv6_isEqual(routes6[i].address, r->address) && ipv6_isEqual(routes6[i].netmask, r->netmask) && ipv6_isEqual(routes6[i].gateway, r->gateway))
         {
             //matching route found
             for(uint64_t j = i; j < (route6Entries - 1); j++)
@@ -385,6 +578,185 @@ void route_removeAndShift6(struct Route6_s *r)
 
 
 
+/**
+ * @brief Apply single rtnetlink route message to routing tables without rebuilding lookup tables
+ * @param nl Netlink message
+ * @return Family of updated table (AF_INET or AF_INET6) or AF_UNSPEC if nothing was changed
+**/
+int route_apply(struct nlmsghdr *nl)
+{
+    struct RouteHelper_s route; //received route buffer
+    int family = AF_UNSPEC; //received route family
+
+    route_parse(nl, &route, &family); //parse route
+    if(family == AF_INET) //IPv4 route
+    {
+        if(nl->nlmsg_type == RTM_NEWROUTE) //this is a new route
+        {
+            PROBE4(route_add, AF_INET, &(route.r.route4.address), &(route.r.route4.netmask), &(route.r.route4.gateway));
+            route_insert(&route.r.route4); //insert route
+        }
+        else if(nl->nlmsg_type == RTM_DELROUTE) //this route needs to be deleted
+        {
+            PROBE4(route_delete, AF_INET, &(route.r.route4.address), &(route.r.route4.netmask), &(route.r.route4.gateway));
+            route_removeAndShift(&route.r.route4); //remove route
+        }
+        else
+            return AF_UNSPEC;
+    }
+    else if(family == AF_INET6) //IPv6 route
+    {
+        if(nl->nlmsg_type == RTM_NEWROUTE) //this is a new route
+        {
+            PROBE4(route_add, AF_INET6, &(route.r.route6.address), &(route.r.route6.netmask), &(route.r.route6.gateway));
+            route_insert6(&route.r.route6); //insert route
+        }
+        else if(nl->nlmsg_type == RTM_DELROUTE) //this route needs to be deleted
+        {
+            PROBE4(route_delete, AF_INET6, &(route.r.route6.address), &(route.r.route6.netmask), &(route.r.route6.gateway));
+            route_removeAndShift6(&route.r.route6); //remove route
+        }
+        else
+            return AF_UNSPEC;
+    }
+    return family;
+}
+
+void Route_update(struct nlmsghdr *nl)
+{
+    int family = route_apply(nl);
+    if(family == AF_INET)
+        route_compress();
+    else if(family == AF_INET6)
+        route_compress6();
+    else
+        return;
+    route_publish();
+}
+
+int Route_add(struct in_addr address, uint8_t prefixLen, struct in_addr gateway)
+{
+    if(prefixLen > 32)
+        return -1;
+
+    struct Route_s r;
+    r.netmask.s_addr = (prefixLen == 0) ? 0 : CIDR_TO_ADDR4(prefixLen);
+    r.address.s_addr = address.s_addr & r.netmask.s_addr;
+    r.gateway = gateway;
+    return route_insert(&r);
+}
+
+int Route_add6(struct in6_addr address, uint8_t prefixLen, struct in6_addr gateway)
+{
+    if(prefixLen > 128)
+        return -1;
+
+    struct Route6_s r;
+    r.netmask = CIDR_TO_ADDR6(prefixLen);
+    r.address = ipv6_and(address, r.netmask);
+    r.gateway = gateway;
+    return route_insert6(&r);
+}
+
+int Route_remove(struct in_addr address, uint8_t prefixLen, struct in_addr gateway)
+{
+    if(prefixLen > 32)
+        return -1;
+
+    struct Route_s r;
+    r.netmask.s_addr = (prefixLen == 0) ? 0 : CIDR_TO_ADDR4(prefixLen);
+    r.address.s_addr = address.s_addr & r.netmask.s_addr;
+    r.gateway = gateway;
+    route_removeAndShift(&r);
+    return 0;
+}
+
+int Route_remove6(struct in6_addr address, uint8_t prefixLen, struct in6_addr gateway)
+{
+    if(prefixLen > 128)
+        return -1;
+
+    struct Route6_s r;
+    r.netmask = CIDR_TO_ADDR6(prefixLen);
+    r.address = ipv6_and(address, r.netmask);
+    r.gateway = gateway;
+    route_removeAndShift6(&r);
+    return 0;
+}
+
+void Route_rebuild()
+{
+    route_compress();
+    route_compress6();
+    route_publish(); //publish both tables at once, so that readers never see them out of sync
+}
+
+void Route_flush()
+{
+    LOCK_ROUTES();
+    free(routes);
+    routes = NULL;
+    routeBlocks = 0;
+    routeEntries = 0;
+    UNLOCK_ROUTES();
+
+    LOCK_ROUTES6();
+    free(routes6);
+    routes6 = NULL;
+    route6Blocks = 0;
+    route6Entries = 0;
+    UNLOCK_ROUTES6();
+
+    LOCK_FIB();
+    free(fib);
+    fib = NULL;
+    fibEntries = 0;
+    UNLOCK_FIB();
+
+    LOCK_FIB6();
+    free(fib6);
+    fib6 = NULL;
+    fib6Entries = 0;
+    UNLOCK_FIB6();
+}
+
+void Route_getStats(struct RouteStats_s *stats)
+{
+    LOCK_ROUTES();
+    stats->entries = routeEntries;
+    stats->memory = (size_t)routeBlocks * ROUTING_TABLE_BLOCK_SIZE * sizeof(struct Route_s);
+    UNLOCK_ROUTES();
+
+    LOCK_ROUTES6();
+    stats->entries6 = route6Entries;
+    stats->memory6 = (size_t)route6Blocks * ROUTING_TABLE_BLOCK_SIZE * sizeof(struct Route6_s);
+    UNLOCK_ROUTES6();
+
+    if(config.routeMode == ROUTE_MODE_SHARED) //lookup tables are in shared memory, not owned by this process
+    {
+        RouteShm_getCounts(&(stats->lookupEntries), &(stats->lookupEntries6));
+        stats->lookupMemory = 0;
+        stats->lookupMemory6 = 0;
+    }
+    else
+    {
+        LOCK_FIB();
+        stats->lookupEntries = fibEntries;
+        stats->lookupMemory = fibEntries * sizeof(struct Route_s);
+        UNLOCK_FIB();
+
+        LOCK_FIB6();
+        stats->lookupEntries6 = fib6Entries;
+        stats->lookupMemory6 = fib6Entries * sizeof(struct Route6_s);
+        UNLOCK_FIB6();
+    }
+
+    LOCK_CACHE();
+    stats->cacheEntries = cacheEntries;
+    stats->cacheMemory = (size_t)cacheSize * sizeof(struct RouteCacheEntry_s);
+    UNLOCK_CACHE();
+}
+
 void Route_print()
 {
     LOCK_ROUTES();
@@ -409,6 +781,12 @@ void Route_print()
         inet_ntop(AF_INET6, &(routes6[i].gateway), tmp, 200);
         printf(" via %s\n", tmp);
     }
+    LOCK_FIB();
+    LOCK_FIB6();
+    printf("IPv4 routes: %llu, compressed: %llu\nIPv6 routes: %llu, compressed: %llu\n", (unsigned long long)routeEntries, (unsigned long long)fibEntries,
+        (unsigned long long)route6Entries, (unsigned long long)fib6Entries);
+    UNLOCK_FIB6();
+    UNLOCK_FIB();
     UNLOCK_ROUTES();
     UNLOCK_ROUTES6();
 }
@@ -467,33 +845,39 @@ int64_t route_receive(int s, uint8_t *buf, size_t maxBuf, int seq)
 
 in_addr_t Route_get(in_addr_t address)
 {
-    LOCK_ROUTES();
-    for(uint64_t i = 0; i < routeEntries; i++)
+    if(config.routeMode == ROUTE_MODE_SHARED) //no local lookup table
+        return RouteShm_get(address);
+
+    LOCK_FIB();
+    for(uint64_t i = 0; i < fibEntries; i++)
     {
-        if((address & routes[i].netmask.s_addr) == routes[i].address.s_addr) //route is matching
+        if((address & fib[i].netmask.s_addr) == fib[i].address.s_addr) //route is matching
         {
-            in_addr_t ret = routes[i].gateway.s_addr;
-            UNLOCK_ROUTES();
+            in_addr_t ret = fib[i].gateway.s_addr;
+            UNLOCK_FIB();
             return ret;    
         }
     }
-    UNLOCK_ROUTES();
+    UNLOCK_FIB();
     return 0; //no matching route
 }
 
 struct in6_addr Route_get6(struct in6_addr address)
 {
-    LOCK_ROUTES6();
-    for(uint64_t i = 0; i < route6Entries; i++)
+    if(config.routeMode == ROUTE_MODE_SHARED) //no local lookup table
+        return RouteShm_get6(address);
+
+    LOCK_FIB6();
+    for(uint64_t i = 0; i < fib6Entries; i++)
     {
-        if(ipv6_isEqual(ipv6_and(address, routes6[i].netmask), routes6[i].address)) //route is matching
+        if(ipv6_isEqual(ipv6_and(address, fib6[i].netmask), fib6[i].address)) //route is matching
         {
-            struct in6_addr ret = routes6[i].gateway;
-            UNLOCK_ROUTES6();
+            struct in6_addr ret = fib6[i].gateway;
+            UNLOCK_FIB6();
             return ret;    
         }
     }
-    UNLOCK_ROUTES6();
+    UNLOCK_FIB6();
     return in6addr_any; //no matching route
 }
 
@@ -507,6 +891,440 @@ in_addr_t Route_unmap(struct in6_addr address)
     return 0; //address not found
 }
 
+/**
+ * @brief Store IPv4 address as IPv4-mapped IPv6 address
+**/
+static struct in6_addr route_map(in_addr_t address)
+{
+    struct in6_addr ret = {0};
+    ret.__in6_u.__u6_addr16[5] = 0xFFFF;
+    ret.__in6_u.__u6_addr32[3] = address;
+    return ret;
+}
+
+/**
+ * @brief Calculate route cache hash for given address
+**/
+static uint32_t route_cacheHash(struct in6_addr *address)
+{
+    uint32_t h = address->__in6_u.__u6_addr32[0] ^ address->__in6_u.__u6_addr32[1] ^ address->__in6_u.__u6_addr32[2];
+    h = (h * 0x9E3779B1U) ^ address->__in6_u.__u6_addr32[3];
+    h ^= h >> 16;
+    h *= 0x85EBCA6BU;
+    h ^= h >> 13;
+    return h;
+}
+
+/**
+ * @brief Find route cache slot for given address
+ * @return Slot index or -1 if not found
+ * @attention Cache must be locked
+**/
+static int64_t route_cacheFind(struct in6_addr *address)
+{
+    if(cacheSize == 0)
+        return -1;
+    uint32_t mask = cacheSize - 1;
+    for(uint32_t i = route_cacheHash(address) & mask; cache[i].state != ROUTE_CACHE_EMPTY; i = (i + 1) & mask)
+    {
+        if(ipv6_isEqual(cache[i].address, *address))
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief Resize route cache and rehash all entries
+ * @param size New slot count (power of 2)
+ * @return 0 on success, -1 on failure
+ * @attention Cache must be locked
+**/
+static int route_cacheResize(uint32_t size)
+{
+    struct RouteCacheEntry_s *n = calloc(size, sizeof(struct RouteCacheEntry_s));
+    if(n == NULL)
+    {
+        PRINT(LOG_ERR, "Route cache memory allocation failed\n");
+        return -1;
+    }
+    for(uint32_t i = 0; i < cacheSize; i++)
+    {
+        if(cache[i].state == ROUTE_CACHE_EMPTY)
+            continue;
+        uint32_t k = route_cacheHash(&(cache[i].address)) & (size - 1);
+        while(n[k].state != ROUTE_CACHE_EMPTY)
+            k = (k + 1) & (size - 1);
+        n[k] = cache[i];
+    }
+    free(cache);
+    cache = n;
+    cacheSize = size;
+    return 0;
+}
+
+/**
+ * @brief Remove route cache entry and shift following entries back (no tombstones needed)
+ * @param i Slot index
+ * @attention Cache must be locked
+**/
+static void route_cacheRemove(uint32_t i)
+{
+    uint32_t mask = cacheSize - 1;
+    uint32_t j = i;
+    while(1)
+    {
+        cache[i].state = ROUTE_CACHE_EMPTY;
+        while(1)
+        {
+            j = (j + 1) & mask;
+            if(cache[j].state == ROUTE_CACHE_EMPTY)
+            {
+                cacheEntries--;
+                return;
+            }
+            uint32_t k = route_cacheHash(&(cache[j].address)) & mask; //home slot of entry j
+            //move entry j to i only if its home slot is not cyclically in (i, j]
+            if((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+                continue;
+            break;
+        }
+        cache[i] = cache[j];
+        i = j;
+    }
+}
+
+/**
+ * @brief Queue route request for resolver thread
+ * @attention Cache must be locked
+**/
+static void route_request(int family, struct in6_addr *address)
+{
+    if(requestCount == ROUTE_REQUEST_QUEUE_SIZE) //queue full, entry will be requested again after timeout
+        return;
+    struct RouteRequest_s *r = &requests[(requestHead + requestCount) % ROUTE_REQUEST_QUEUE_SIZE];
+    r->family = family;
+    r->address = *address;
+    requestCount++;
+    pthread_cond_signal(&requestCond);
+}
+
+/**
+ * @brief Look up route in on-demand cache, request it if not found
+ * @param family AF_INET or AF_INET6
+ * @param address Destination address (IPv4-mapped for IPv4)
+ * @param gateway Gateway buffer
+ * @return ROUTE_FOUND, ROUTE_NOT_FOUND or ROUTE_PENDING
+**/
+static int route_cacheLookup(int family, struct in6_addr *address, struct in6_addr *gateway)
+{
+    time_t now = time(NULL);
+    LOCK_CACHE();
+    int64_t i = route_cacheFind(address);
+    if(i >= 0)
+    {
+        cache[i].used = now;
+        if(cache[i].state == ROUTE_CACHE_RESOLVED)
+        {
+            *gateway = cache[i].gateway;
+            UNLOCK_CACHE();
+            return ipv6_isEqual(*gateway, in6addr_any) ? ROUTE_NOT_FOUND : ROUTE_FOUND;
+        }
+        if((now - cache[i].requested) >= ROUTE_PENDING_TIMEOUT) //request lost, ask again
+        {
+            cache[i].requested = now;
+            route_request(family, address);
+        }
+        UNLOCK_CACHE();
+        return ROUTE_PENDING;
+    }
+
+    if(((cacheEntries + 1) * 2) > cacheSize) //keep load factor below 0.5
+    {
+        if(route_cacheResize(cacheSize ? (cacheSize * 2) : ROUTE_CACHE_INITIAL_SIZE) < 0)
+        {
+            UNLOCK_CACHE();
+            return ROUTE_NOT_FOUND;
+        }
+    }
+
+    uint32_t k = route_cacheHash(address) & (cacheSize - 1);
+    while(cache[k].state != ROUTE_CACHE_EMPTY)
+        k = (k + 1) & (cacheSize - 1);
+    cache[k].address = *address;
+    cache[k].gateway = in6addr_any;
+    cache[k].state = ROUTE_CACHE_PENDING;
+    cache[k].requested = now;
+    cache[k].used = now;
+    cacheEntries++;
+    route_request(family, address);
+    UNLOCK_CACHE();
+    return ROUTE_PENDING;
+}
+
+/**
+ * @brief Remove all route cache entries covered by given prefix
+ * @param prefix Prefix address (IPv4-mapped for IPv4)
+ * @param netmask Prefix netmask (IPv4 netmask must have 96 leading ones)
+**/
+static void route_cacheInvalidate(struct in6_addr prefix, struct in6_addr netmask)
+{
+    LOCK_CACHE();
+    for(uint32_t i = 0; i < cacheSize; )
+    {
+        if((cache[i].state != ROUTE_CACHE_EMPTY) && ipv6_isEqual(ipv6_and(cache[i].address, netmask), prefix))
+            route_cacheRemove(i); //entry was replaced with the next one, check this slot again
+        else
+            i++;
+    }
+    UNLOCK_CACHE();
+}
+
+/**
+ * @brief Remove idle entries and shrink route cache
+**/
+static void route_cacheCleanup()
+{
+    time_t now = time(NULL);
+    LOCK_CACHE();
+    for(uint32_t i = 0; i < cacheSize; )
+    {
+        if((cache[i].state != ROUTE_CACHE_EMPTY) && ((now - cache[i].used) >= ROUTE_CACHE_IDLE_TIMEOUT))
+            route_cacheRemove(i);
+        else
+            i++;
+    }
+    uint32_t size = cacheSize;
+    while((size > ROUTE_CACHE_INITIAL_SIZE) && ((cacheEntries * 8) < size)) //memory follows the number of active destinations
+        size /= 2;
+    if(size != cacheSize)
+        route_cacheResize(size);
+    UNLOCK_CACHE();
+}
+
+/**
+ * @brief Get prefix of any route change message (regardless of route type)
+ * @param nl Netlink message
+ * @param prefix Prefix address (IPv4-mapped for IPv4)
+ * @param netmask Prefix netmask (with 96 leading ones for IPv4)
+ * @return 0 on success, -1 if this is not an IPv4/IPv6 route message
+**/
+static int route_parsePrefix(struct nlmsghdr *nl, struct in6_addr *prefix, struct in6_addr *netmask)
+{
+    if((nl->nlmsg_type != RTM_NEWROUTE) && (nl->nlmsg_type != RTM_DELROUTE))
+        return -1;
+
+    struct rtmsg *rt = (struct rtmsg *)NLMSG_DATA(nl);
+    struct rtattr *rtAttr = (struct rtattr *)RTM_RTA(rt);
+    int len = RTM_PAYLOAD(nl);
+
+    if((rt->rtm_family != AF_INET) && (rt->rtm_family != AF_INET6))
+        return -1;
+
+    *prefix = (rt->rtm_family == AF_INET) ? route_map(INADDR_ANY) : in6addr_any;
+    *netmask = CIDR_TO_ADDR6((rt->rtm_family == AF_INET) ? (96 + rt->rtm_dst_len) : rt->rtm_dst_len);
+
+    for (; RTA_OK(rtAttr, len); rtAttr = RTA_NEXT(rtAttr, len))
+    {
+        if(rtAttr->rta_type == RTA_DST)
+        {
+            if(rt->rtm_family == AF_INET)
+                *prefix = route_map(*(in_addr_t*)RTA_DATA(rtAttr));
+            else
+                *prefix = *(struct in6_addr*)RTA_DATA(rtAttr);
+        }
+    }
+    *prefix = ipv6_and(*prefix, *netmask);
+    return 0;
+}
+
+/**
+ * @brief Ask kernel for route to given destination
+ * @param s Netlink socket
+ * @param seq Request sequence number
+ * @param r Route request
+ * @param gateway Resolved gateway or in6addr_any (IPv4-mapped for IPv4)
+ * @return 0 on success, -1 on failure
+**/
+static int route_resolve(int s, uint32_t seq, struct RouteRequest_s *r, struct in6_addr *gateway)
+{
+    uint8_t buf[NETLINK_BUF_SIZE];
+    memset(buf, 0, NLMSG_SPACE(sizeof(struct rtmsg)) + RTA_SPACE(sizeof(struct in6_addr)));
+
+    struct nlmsghdr *nl = (struct nlmsghdr*)buf;
+    nl->nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+    nl->nlmsg_type = RTM_GETROUTE;
+    nl->nlmsg_flags = NLM_F_REQUEST;
+    nl->nlmsg_seq = seq;
+
+    struct rtmsg *rt = (struct rtmsg*)NLMSG_DATA(nl);
+    rt->rtm_family = r->family;
+    rt->rtm_dst_len = (r->family == AF_INET) ? 32 : 128;
+    rt->rtm_flags = RTM_F_FIB_MATCH; //return matching routing table entry instead of resolved host route, so default routes can be recognized
+
+    struct rtattr *rta = (struct rtattr*)((uint8_t*)nl + NLMSG_ALIGN(nl->nlmsg_len));
+    rta->rta_type = RTA_DST;
+    if(r->family == AF_INET)
+    {
+        rta->rta_len = RTA_LENGTH(sizeof(in_addr_t));
+        memcpy(RTA_DATA(rta), &(r->address.__in6_u.__u6_addr32[3]), sizeof(in_addr_t));
+    }
+    else
+    {
+        rta->rta_len = RTA_LENGTH(sizeof(struct in6_addr));
+        memcpy(RTA_DATA(rta), &(r->address), sizeof(struct in6_addr));
+    }
+    nl->nlmsg_len = NLMSG_ALIGN(nl->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+
+    if(send(s, nl, nl->nlmsg_len, 0) < 0)
+    {
+        DEBUG(LOG_ERR, "Netlink write failed");
+        return -1;
+    }
+
+    *gateway = in6addr_any;
+    while(1)
+    {
+        int size = recv(s, buf, NETLINK_BUF_SIZE, 0);
+        if(size < 0)
+        {
+            DEBUG(LOG_ERR, "Netlink read failed");
+            return -1;
+        }
+        for(nl = (struct nlmsghdr*)buf; NLMSG_OK(nl, size); nl = NLMSG_NEXT(nl, size))
+        {
+            if(nl->nlmsg_seq != seq) //reply to an older request
+                continue;
+            if(nl->nlmsg_type == NLMSG_ERROR) //no route (or request rejected)
+                return 0;
+
+            struct RouteHelper_s route;
+            int family;
+            route_parse(nl, &route, &family);
+            if(family == AF_INET)
+                *gateway = route_map(route.r.route4.gateway.s_addr);
+            else if(family == AF_INET6)
+                *gateway = route.r.route6.gateway;
+            //AF_UNSPEC: default or non-unicast route, treated as no route
+            if((family == AF_INET) && (route.r.route4.gateway.s_addr == INADDR_ANY))
+                *gateway = in6addr_any;
+            return 0;
+        }
+    }
+}
+
+/**
+ * @brief On-demand route resolver thread
+**/
+void *route_resolver(void *arg)
+{
+    int s = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if(s < 0)
+    {
+        DEBUG(LOG_ERR, "Netlink socket open failed");
+        return (void*)-1;
+    }
+
+    struct timeval tv = {.tv_sec = 1, .tv_usec = 0}; //do not block forever if the kernel does not answer
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    uint32_t seq = 0;
+    time_t lastCleanup = time(NULL);
+
+    while(1)
+    {
+        LOCK_CACHE();
+        while(requestCount == 0)
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += ROUTE_CACHE_CLEANUP_INTERVAL;
+            if(pthread_cond_timedwait(&requestCond, &cacheMutex, &ts) != 0)
+                break;
+        }
+        struct RouteRequest_s r;
+        int pending = (requestCount > 0);
+        if(pending)
+        {
+            r = requests[requestHead];
+            requestHead = (requestHead + 1) % ROUTE_REQUEST_QUEUE_SIZE;
+            requestCount--;
+        }
+        UNLOCK_CACHE();
+
+        if((time(NULL) - lastCleanup) >= ROUTE_CACHE_CLEANUP_INTERVAL)
+        {
+            route_cacheCleanup();
+            lastCleanup = time(NULL);
+        }
+
+        if(!pending)
+            continue;
+
+        struct in6_addr gateway;
+        if(route_resolve(s, ++seq, &r, &gateway) < 0)
+            continue; //entry stays pending and is requested again after timeout
+
+        LOCK_CACHE();
+        int64_t i = route_cacheFind(&(r.address));
+        if((i >= 0) && (cache[i].state == ROUTE_CACHE_PENDING)) //entry might have been invalidated in the meantime
+        {
+            cache[i].gateway = gateway;
+            cache[i].state = ROUTE_CACHE_RESOLVED;
+        }
+        UNLOCK_CACHE();
+
+        if(resolveCallback != NULL)
+        {
+            if(r.family == AF_INET)
+                resolveCallback(AF_INET, &(r.address.__in6_u.__u6_addr32[3]));
+            else
+                resolveCallback(AF_INET6, &(r.address));
+        }
+    }
+    return (void*)-1;
+}
+
+int Route_lookup(in_addr_t address, in_addr_t *gateway)
+{
+    int ret;
+    if(config.routeMode != ROUTE_MODE_ON_DEMAND)
+    {
+        *gateway = Route_get(address);
+        ret = (*gateway != 0) ? ROUTE_FOUND : ROUTE_NOT_FOUND;
+    }
+    else
+    {
+        struct in6_addr a = route_map(address), g;
+        ret = route_cacheLookup(AF_INET, &a, &g);
+        *gateway = (ret == ROUTE_FOUND) ? g.__in6_u.__u6_addr32[3] : 0;
+    }
+    PROBE3(route_lookup, address, *gateway, ret);
+    return ret;
+}
+
+int Route_lookup6(struct in6_addr address, struct in6_addr *gateway)
+{
+    int ret;
+    if(config.routeMode != ROUTE_MODE_ON_DEMAND)
+    {
+        *gateway = Route_get6(address);
+        ret = ipv6_isEqual(*gateway, in6addr_any) ? ROUTE_NOT_FOUND : ROUTE_FOUND;
+    }
+    else
+    {
+        ret = route_cacheLookup(AF_INET6, &address, gateway);
+        if(ret != ROUTE_FOUND)
+            *gateway = in6addr_any;
+    }
+    PROBE3(route_lookup6, &address, gateway, ret);
+    return ret;
+}
+
+void Route_setCallback(void (*callback)(int family, const void *address))
+{
+    resolveCallback = callback;
+}
+
 int route_NLrequestAll(int s, uint8_t *buf, size_t maxBuf, sa_family_t family)
 {
     struct nlmsghdr *nl = (struct nlmsghdr*)buf; //netlink header
@@ -528,7 +1346,7 @@ int route_NLrequestAll(int s, uint8_t *buf, size_t maxBuf, sa_family_t family)
         return -1;
     }
 
-    int64_t len = route_receive(s, buf, maxBuf, seq);
+    return route_receive(s, buf, maxBuf, seq);
 }
 
 void *route_listenForUpdates(void *arg)
@@ -537,7 +1355,7 @@ void *route_listenForUpdates(void *arg)
     memset(&addr, 0, sizeof(addr));
     addr.nl_family = AF_NETLINK;
     addr.nl_groups = RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE;
-    addr.nl_pid = getpid();
+    addr.nl_pid = 0; //let kernel assign port ID, process PID may be already used by another netlink socket
 
     int s = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
     if(s < 0)
@@ -557,8 +1375,6 @@ void *route_listenForUpdates(void *arg)
 
     int size = 0; //received data size
     struct nlmsghdr *nl; //received netlink header
-    struct RouteHelper_s route; //received route buffer
-    int family = AF_UNSPEC; //received route family
 
     while(1)
     {
@@ -577,32 +1393,31 @@ void *route_listenForUpdates(void *arg)
             continue;
         }
 
-        route_parse(nl, &route, &family); //parse route
-        if(family == AF_INET) //IPv4 route
+        if(config.routeMode == ROUTE_MODE_ON_DEMAND) //no local routing table, invalidate cached routes only
         {
-            if(nl->nlmsg_type == RTM_NEWROUTE) //this is a new route
+            struct in6_addr prefix, netmask;
+            for(; NLMSG_OK(nl, size); nl = NLMSG_NEXT(nl, size))
             {
-                route_insert(&route.r.route4); //insert route
-                route_sort(); //sort table
-            }
-            else if(nl->nlmsg_type == RTM_DELROUTE) //this route needs to be deleted
-            {
-                route_removeAndShift(&route.r.route4); //remove route
+                if(route_parsePrefix(nl, &prefix, &netmask) == 0)
+                    route_cacheInvalidate(prefix, netmask);
             }
+            continue;
         }
-        else if(family == AF_INET6) //IPv6 route
+
+        int changed = 0, changed6 = 0; //rebuild lookup tables once for all messages in this datagram
+        for(; NLMSG_OK(nl, size); nl = NLMSG_NEXT(nl, size))
         {
-            if(nl->nlmsg_type == RTM_NEWROUTE) //this is a new route
-            {
-                route_insert6(&route.r.route6); //insert route
-                route_sort6(); //sort table
-            }
-            else if(nl->nlmsg_type == RTM_DELROUTE) //this route needs to be deleted
-            {
-                route_removeAndShift6(&route.r.route6); //remove route
-            }
+            int family = route_apply(nl); //parse route and update routing table
+            changed |= (family == AF_INET);
+            changed6 |= (family == AF_INET6);
         }
-        
+        if(changed)
+            route_compress();
+        if(changed6)
+            route_compress6();
+        if(changed || changed6)
+            route_publish();
+
     }
     return (void*)-1;
 }
@@ -613,10 +1428,7 @@ void *route_listenForUpdates(void *arg)
 **/
 int route_getAll()
 {
-    free(routes);
-    free(routes6);
-    routeEntries = 0;
-    route6Entries = 0;
+    Route_flush();
     
     int s; //netlink socket handler
     uint8_t buf[NETLINK_BUF_SIZE]; //netlink data buffer
@@ -647,6 +1459,7 @@ int route_getAll()
         route_parse(nl, &route, &family); //parse and add routes
         if(family == AF_INET) //check if family matches
         {
+            PROBE4(route_add, AF_INET, &(route.r.route4.address), &(route.r.route4.netmask), &(route.r.route4.gateway));
             route_insert(&route.r.route4); //insert route
         }
     }
@@ -675,23 +1488,48 @@ int route_getAll()
         route_parse(nl, &route, &family); //parse and add routes
         if(family == AF_INET6) //check if family matches
         {
+            PROBE4(route_add, AF_INET6, &(route.r.route6.address), &(route.r.route6.netmask), &(route.r.route6.gateway));
             route_insert6(&route.r.route6); //insert route
         }
     }
 
     close(s); //close netlink socket
 
-    route_sort(); //sort route table by netmask (in descending order) first, then by destionation (in ascendig order)
-    route_sort6();
+    Route_rebuild();
 
     return 0;
 }
 
 int Route_init()
 {
-    if(route_getAll() < 0) //get all routes
+    if(config.routeMode == ROUTE_MODE_SHARED) //routes are maintained by another instance, no netlink socket is needed
+    {
+        RouteShm_attach(config.routeShmName);
+        return 0;
+    }
+
+    if(config.routePublish && (RouteShm_create(config.routeShmName) < 0))
         return -1;
 
+    if(config.routeMode == ROUTE_MODE_ON_DEMAND) //start with empty route cache
+    {
+        pthread_t resolver;
+        if(pthread_create(&resolver, NULL, &route_resolver, NULL) != 0) //create resolver thread
+        {
+            DEBUG(LOG_ERR, "Resolver thread creation failed");
+            return -1;
+        }
+        PRINT(LOG_INFO, "Routes are resolved on demand\n");
+    }
+    else if(route_getAll() < 0) //get all routes
+        return -1;
+
+    struct RouteStats_s stats;
+    Route_getStats(&stats);
+    if(config.routeMode != ROUTE_MODE_ON_DEMAND)
+        PRINT(LOG_INFO, "Routing table: %llu IPv4 routes (%llu after compression), %llu IPv6 routes (%llu after compression)\n",
+        (unsigned long long)stats.entries, (unsigned long long)stats.lookupEntries, (unsigned long long)stats.entries6, (unsigned long long)stats.lookupEntries6);
+
     pthread_t listener;
     
     if(pthread_create(&listener, NULL, &route_listenForUpdates, NULL) < 0) //create listener thread
@@ -25,6 +25,8 @@
  * 1. IPv4 gateway for IPv4 destination
  * 2. IPv6 (or IPv4-mapped IPv6) gateway for IPv6 destination
  * Additionally decodes IPv4-mapped IPv6 to standard IPv4.
+ * Lookups use a compressed copy of the routing table (see ortc.h) that gives the same results as the full table.
+ * In on-demand mode no routing table is stored - routes are asked from the kernel on cache miss and cached until a route changes.
 */
 #ifndef ROUTE_H_
 #define ROUTE_H_
@@ -32,6 +34,50 @@
 #include "common.h"
 #include <stdint.h>
 #include <netinet/in.h>
+#include <stddef.h>
+#include <linux/netlink.h>
+
+/**
+ * @brief Structure of local IPv4 routing table entry 
+**/
+struct Route_s
+{
+    struct in_addr address;
+    struct in_addr netmask;
+    struct in_addr gateway;
+};
+
+/**
+ * @brief Structure of local IPv6 routing table entry 
+**/
+struct Route6_s
+{
+    struct in6_addr address;
+    struct in6_addr netmask;
+    struct in6_addr gateway;
+};
+
+/**
+ * @brief Routing table statistics
+**/
+struct RouteStats_s
+{
+    uint64_t entries; //number of IPv4 routes stored
+    uint64_t entries6; //number of IPv6 routes stored
+    size_t memory; //memory reserved for IPv4 routing table in bytes
+    size_t memory6; //memory reserved for IPv6 routing table in bytes
+    uint64_t lookupEntries; //number of IPv4 lookup table entries (after compression)
+    uint64_t lookupEntries6; //number of IPv6 lookup table entries (after compression)
+    size_t lookupMemory; //memory used by IPv4 lookup table in bytes
+    size_t lookupMemory6; //memory used by IPv6 lookup table in bytes
+    uint64_t cacheEntries; //number of on-demand route cache entries (IPv4 and IPv6)
+    size_t cacheMemory; //memory used by on-demand route cache in bytes
+};
+
+#define ROUTE_NOT_FOUND 0 //there is no route for given destination
+#define ROUTE_FOUND 1 //route found
+#define ROUTE_PENDING 2 //route is being resolved (on-demand mode only), lookup should be repeated after resolution callback
+
 
 /**
  * @brief Get tunnel IPv4 endpoint address for given IPv4 destination address
@@ -45,6 +91,31 @@ in_addr_t Route_get(in_addr_t address);
 **/
 struct in6_addr Route_get6(struct in6_addr address);
 
+/**
+ * @brief Look up tunnel IPv4 endpoint address for given IPv4 destination address
+ * @param address Destination address
+ * @param gateway Tunnel endpoint address or 0 (INADDR_ANY) if not found
+ * @return ROUTE_FOUND, ROUTE_NOT_FOUND or ROUTE_PENDING
+ * @attention In on-demand mode ROUTE_PENDING is returned on cache miss and the route is resolved asynchronously
+**/
+int Route_lookup(in_addr_t address, in_addr_t *gateway);
+
+/**
+ * @brief Look up tunnel IPv6 endpoint address for given IPv6 destination address
+ * @param address Destination address
+ * @param gateway Tunnel endpoint address or in6addr_any if not found
+ * @return ROUTE_FOUND, ROUTE_NOT_FOUND or ROUTE_PENDING
+ * @attention In on-demand mode ROUTE_PENDING is returned on cache miss and the route is resolved asynchronously
+**/
+int Route_lookup6(struct in6_addr address, struct in6_addr *gateway);
+
+/**
+ * @brief Set function called when on-demand route resolution is finished (successfully or not)
+ * @param callback Function taking address family (AF_INET or AF_INET6) and destination address (in_addr_t or struct in6_addr)
+ * @attention Callback is called from resolver thread
+**/
+void Route_setCallback(void (*callback)(int family, const void *address));
+
 /**
  * @brief Unmap IPv4-mapped IPv6 address
  * @param address IPv6 address with IPv4 address inside
@@ -63,4 +134,65 @@ int Route_init();
 **/
 void Route_print();
 
+/**
+ * @brief Process single rtnetlink route message (RTM_NEWROUTE or RTM_DELROUTE) and update routing tables
+ * @param nl Netlink message
+ * @attention This is the path used by the route update listener
+**/
+void Route_update(struct nlmsghdr *nl);
+
+/**
+ * @brief Add IPv4 route without sorting the table
+ * @param address Destination address
+ * @param prefixLen Destination prefix length (CIDR)
+ * @param gateway Tunnel endpoint address
+ * @return 0 on success, -1 on failure
+ * @attention Route_rebuild() must be called after adding routes
+**/
+int Route_add(struct in_addr address, uint8_t prefixLen, struct in_addr gateway);
+
+/**
+ * @brief Add IPv6 route without sorting the table
+ * @param address Destination address
+ * @param prefixLen Destination prefix length (CIDR)
+ * @param gateway Tunnel endpoint address
+ * @return 0 on success, -1 on failure
+ * @attention Route_rebuild() must be called after adding routes
+**/
+int Route_add6(struct in6_addr address, uint8_t prefixLen, struct in6_addr gateway);
+
+/**
+ * @brief Remove IPv4 route
+ * @param address Destination address
+ * @param prefixLen Destination prefix length (CIDR)
+ * @param gateway Tunnel endpoint address
+ * @return 0 on success, -1 on failure
+**/
+int Route_remove(struct in_addr address, uint8_t prefixLen, struct in_addr gateway);
+
+/**
+ * @brief Remove IPv6 route
+ * @param address Destination address
+ * @param prefixLen Destination prefix length (CIDR)
+ * @param gateway Tunnel endpoint address
+ * @return 0 on success, -1 on failure
+**/
+int Route_remove6(struct in6_addr address, uint8_t prefixLen, struct in6_addr gateway);
+
+/**
+ * @brief Rebuild (compress) lookup tables after routes were added with Route_add()/Route_add6()
+**/
+void Route_rebuild();
+
+/**
+ * @brief Remove all routes and release routing table memory
+**/
+void Route_flush();
+
+/**
+ * @brief Get routing table statistics
+ * @param stats Structure to store statistics in
+**/
+void Route_getStats(struct RouteStats_s *stats);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,335 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file routeshm.c
+ * @brief Shared memory route table module
+ *
+ * Segment layout: header (one page), then table areas. Each slot points to its own table area, which contains
+ * IPv4 entries followed by IPv6 entries. When an area is too small, a new one is appended at the end of the segment.
+ * The segment never shrinks, so readers can map the maximum size once and never remap.
+**/
+
+#include "routeshm.h"
+#include "common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ROUTE_SHM_MAGIC 0x4B525453 //"KRTS"
+#define ROUTE_SHM_VERSION 1 //segment layout version
+#define ROUTE_SHM_HEADER_SIZE 4096 //space reserved for segment header
+#define ROUTE_SHM_MAP_SIZE (1ULL << 30) //maximum segment size (only address space is reserved, pages are allocated on use)
+#define ROUTE_SHM_ATTACH_INTERVAL 1 //minimum time in seconds between attach attempts when the segment is not available
+#define ROUTE_SHM_ALIGN(x) (((x) + 63) & ~63ULL) //align table areas to cache line size
+
+/**
+ * @brief Lookup table slot
+**/
+struct RouteShmSlot_s
+{
+    uint64_t offset; //table area offset from segment start
+    uint64_t capacity; //table area size in bytes
+    uint64_t count; //IPv4 entry count, IPv4 entries are at the area start
+    uint64_t count6; //IPv6 entry count, IPv6 entries follow IPv4 entries (aligned)
+};
+
+/**
+ * @brief Segment header
+**/
+struct RouteShmHeader_s
+{
+    uint32_t magic; //ROUTE_SHM_MAGIC, written last when the segment is initialized
+    uint32_t version; //ROUTE_SHM_VERSION
+    uint64_t size; //segment size in bytes
+    uint64_t generation; //incremented on every publish, active slot is generation % 2
+    struct RouteShmSlot_s slot[2];
+};
+
+static uint8_t *shm = NULL; //mapped segment, NULL if not mapped
+static int shmFd = -1; //segment descriptor (publisher only)
+static char *shmName = NULL; //segment name (reader only, for retrying)
+static time_t lastAttach = 0; //last attach attempt time
+static pthread_mutex_t attachMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t publishMutex = PTHREAD_MUTEX_INITIALIZER;
+
+int RouteShm_create(const char *name)
+{
+    shmFd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if(shmFd < 0)
+    {
+        DEBUG(LOG_ERR, "Shared memory segment creation failed");
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(shmFd, &st) < 0)
+    {
+        DEBUG(LOG_ERR, "Shared memory segment creation failed");
+        close(shmFd);
+        return -1;
+    }
+    if((st.st_size < ROUTE_SHM_HEADER_SIZE) && (ftruncate(shmFd, ROUTE_SHM_HEADER_SIZE) < 0))
+    {
+        DEBUG(LOG_ERR, "Shared memory segment creation failed");
+        close(shmFd);
+        return -1;
+    }
+
+    uint8_t *s = mmap(NULL, ROUTE_SHM_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shmFd, 0);
+    if(s == MAP_FAILED)
+    {
+        DEBUG(LOG_ERR, "Shared memory segment mapping failed");
+        close(shmFd);
+        return -1;
+    }
+
+    struct RouteShmHeader_s *h = (struct RouteShmHeader_s*)s;
+    //reuse segment left by a previous publisher, so that attached readers keep working across restarts
+    if((h->magic != ROUTE_SHM_MAGIC) || (h->version != ROUTE_SHM_VERSION) || (h->size != (uint64_t)st.st_size))
+    {
+        uint64_t generation = h->generation;
+        h->magic = 0;
+        memset(h->slot, 0, sizeof(h->slot));
+        h->version = ROUTE_SHM_VERSION;
+        h->size = (st.st_size < ROUTE_SHM_HEADER_SIZE) ? ROUTE_SHM_HEADER_SIZE : st.st_size; //never shrink, readers may have it mapped
+        __atomic_store_n(&(h->generation), generation + 2, __ATOMIC_RELEASE); //invalidate reads in progress, keep active slot parity
+        __atomic_store_n(&(h->magic), ROUTE_SHM_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    shm = s;
+    PRINT(LOG_INFO, "Publishing routes in shared memory segment %s\n", name);
+    return 0;
+}
+
+int RouteShm_publish(const struct Route_s *table, uint64_t count, const struct Route6_s *table6, uint64_t count6)
+{
+    if(shm == NULL)
+        return -1;
+
+    struct RouteShmHeader_s *h = (struct RouteShmHeader_s*)shm;
+
+    pthread_mutex_lock(&publishMutex);
+    uint64_t generation = h->generation;
+    struct RouteShmSlot_s *slot = &(h->slot[(generation + 1) & 1]); //inactive slot
+    uint64_t offset6 = ROUTE_SHM_ALIGN(count * sizeof(struct Route_s));
+    uint64_t size = offset6 + count6 * sizeof(struct Route6_s);
+
+    if(slot->capacity < size) //table area too small, append a new one (the old one is abandoned)
+    {
+        uint64_t offset = h->size;
+        uint64_t capacity = ROUTE_SHM_ALIGN(size * 2);
+        if((offset + capacity) > ROUTE_SHM_MAP_SIZE)
+        {
+            pthread_mutex_unlock(&publishMutex);
+            PRINT(LOG_ERR, "Shared memory segment is full, routing table not published\n");
+            return -1;
+        }
+        if(ftruncate(shmFd, offset + capacity) < 0)
+        {
+            pthread_mutex_unlock(&publishMutex);
+            DEBUG(LOG_ERR, "Shared memory segment resizing failed");
+            return -1;
+        }
+        __atomic_store_n(&(h->size), offset + capacity, __ATOMIC_RELEASE);
+        slot->offset = offset;
+        slot->capacity = capacity;
+    }
+
+    if(count)
+        memcpy(shm + slot->offset, table, count * sizeof(struct Route_s));
+    if(count6)
+        memcpy(shm + slot->offset + offset6, table6, count6 * sizeof(struct Route6_s));
+    slot->count = count;
+    slot->count6 = count6;
+
+    __atomic_store_n(&(h->generation), generation + 1, __ATOMIC_RELEASE); //switch readers to the new slot
+    pthread_mutex_unlock(&publishMutex);
+    return 0;
+}
+
+/**
+ * @brief Try to map shared memory segment for reading
+ * @return 0 on success, -1 on failure
+ * @attention Must be called with attachMutex locked
+**/
+static int routeshm_map()
+{
+    lastAttach = time(NULL);
+
+    int fd = shm_open(shmName, O_RDONLY, 0);
+    if(fd < 0)
+        return -1;
+
+    struct stat st;
+    if((fstat(fd, &st) < 0) || (st.st_size < ROUTE_SHM_HEADER_SIZE))
+    {
+        close(fd);
+        return -1;
+    }
+
+    uint8_t *s = mmap(NULL, ROUTE_SHM_MAP_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); //mapping stays valid
+    if(s == MAP_FAILED)
+        return -1;
+
+    struct RouteShmHeader_s *h = (struct RouteShmHeader_s*)s;
+    if((__atomic_load_n(&(h->magic), __ATOMIC_ACQUIRE) != ROUTE_SHM_MAGIC) || (h->version != ROUTE_SHM_VERSION))
+    {
+        munmap(s, ROUTE_SHM_MAP_SIZE);
+        return -1;
+    }
+
+    __atomic_store_n(&shm, s, __ATOMIC_RELEASE);
+    PRINT(LOG_INFO, "Attached to shared memory route segment %s\n", shmName);
+    return 0;
+}
+
+/**
+ * @brief Get mapped segment, try to attach if not mapped yet
+ * @return Segment header or NULL if not available
+**/
+static const struct RouteShmHeader_s* routeshm_header()
+{
+    uint8_t *s = __atomic_load_n(&shm, __ATOMIC_ACQUIRE);
+    if(s != NULL)
+        return (const struct RouteShmHeader_s*)s;
+
+    if(shmName == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&attachMutex);
+    if((shm == NULL) && ((time(NULL) - lastAttach) >= ROUTE_SHM_ATTACH_INTERVAL))
+        routeshm_map();
+    pthread_mutex_unlock(&attachMutex);
+    return (const struct RouteShmHeader_s*)__atomic_load_n(&shm, __ATOMIC_ACQUIRE);
+}
+
+int RouteShm_attach(const char *name)
+{
+    pthread_mutex_lock(&attachMutex);
+    shmName = strdup(name);
+    if(shmName == NULL)
+    {
+        pthread_mutex_unlock(&attachMutex);
+        PRINT(LOG_ERR, "malloc failure\n");
+        return -1;
+    }
+    int ret = routeshm_map();
+    pthread_mutex_unlock(&attachMutex);
+    if(ret < 0)
+        PRINT(LOG_WARNING, "Shared memory route segment %s is not available yet, retrying on lookups\n", name);
+    return ret;
+}
+
+in_addr_t RouteShm_get(in_addr_t address)
+{
+    const struct RouteShmHeader_s *h = routeshm_header();
+    if(h == NULL)
+        return 0;
+
+    while(1)
+    {
+        uint64_t generation = __atomic_load_n(&(h->generation), __ATOMIC_ACQUIRE);
+        const struct RouteShmSlot_s *slot = &(h->slot[generation & 1]);
+        uint64_t size = __atomic_load_n(&(h->size), __ATOMIC_ACQUIRE);
+        uint64_t offset = __atomic_load_n(&(slot->offset), __ATOMIC_RELAXED);
+        uint64_t count = __atomic_load_n(&(slot->count), __ATOMIC_RELAXED);
+        in_addr_t gateway = 0;
+
+        //slot may be rewritten while reading, never leave the segment
+        if((offset <= size) && (count <= ((size - offset) / sizeof(struct Route_s))))
+        {
+            const struct Route_s *table = (const struct Route_s*)((const uint8_t*)h + offset);
+            for(uint64_t i = 0; i < count; i++)
+            {
+                if((address & table[i].netmask.s_addr) == table[i].address.s_addr) //route is matching
+                {
+                    gateway = table[i].gateway.s_addr;
+                    break;
+                }
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&(h->generation), __ATOMIC_RELAXED) == generation) //tables were not changed while reading
+            return gateway;
+    }
+}
+
+struct in6_addr RouteShm_get6(struct in6_addr address)
+{
+    const struct RouteShmHeader_s *h = routeshm_header();
+    if(h == NULL)
+        return in6addr_any;
+
+    while(1)
+    {
+        uint64_t generation = __atomic_load_n(&(h->generation), __ATOMIC_ACQUIRE);
+        const struct RouteShmSlot_s *slot = &(h->slot[generation & 1]);
+        uint64_t size = __atomic_load_n(&(h->size), __ATOMIC_ACQUIRE);
+        uint64_t offset = __atomic_load_n(&(slot->offset), __ATOMIC_RELAXED);
+        uint64_t count = __atomic_load_n(&(slot->count), __ATOMIC_RELAXED);
+        uint64_t count6 = __atomic_load_n(&(slot->count6), __ATOMIC_RELAXED);
+        struct in6_addr gateway = in6addr_any;
+
+        if((offset <= size) && (count <= ((size - offset) / sizeof(struct Route_s))))
+        {
+            offset += ROUTE_SHM_ALIGN(count * sizeof(struct Route_s));
+            if((offset <= size) && (count6 <= ((size - offset) / sizeof(struct Route6_s))))
+            {
+                const struct Route6_s *table = (const struct Route6_s*)((const uint8_t*)h + offset);
+                for(uint64_t i = 0; i < count6; i++)
+                {
+                    if(ipv6_isEqual(ipv6_and(address, table[i].netmask), table[i].address)) //route is matching
+                    {
+                        gateway = table[i].gateway;
+                        break;
+                    }
+                }
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&(h->generation), __ATOMIC_RELAXED) == generation)
+            return gateway;
+    }
+}
+
+void RouteShm_getCounts(uint64_t *count, uint64_t *count6)
+{
+    *count = 0;
+    *count6 = 0;
+    const struct RouteShmHeader_s *h = routeshm_header();
+    if(h == NULL)
+        return;
+
+    uint64_t generation;
+    do
+    {
+        generation = __atomic_load_n(&(h->generation), __ATOMIC_ACQUIRE);
+        *count = __atomic_load_n(&(h->slot[generation & 1].count), __ATOMIC_RELAXED);
+        *count6 = __atomic_load_n(&(h->slot[generation & 1].count6), __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    }
+    while(__atomic_load_n(&(h->generation), __ATOMIC_RELAXED) != generation);
+}
@@ -0,0 +1,80 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file routeshm.h
+ * @brief Shared memory route table module
+ *
+ * One instance (the publisher) keeps the kernel routing table mirror and copies its lookup tables to a POSIX shared memory segment.
+ * Other instances map the segment read-only and perform lookups without locks and without their own netlink mirror.
+ * The segment contains two table slots. The publisher always writes the inactive slot and then increments the generation counter,
+ * which selects the active slot. Readers repeat the lookup if the generation changed while they were reading.
+*/
+#ifndef ROUTESHM_H_
+#define ROUTESHM_H_
+
+#include "route.h"
+#include <stdint.h>
+
+/**
+ * @brief Create (or reuse) shared memory segment and become its publisher
+ * @param name Segment name
+ * @return 0 on success, -1 on failure
+**/
+int RouteShm_create(const char *name);
+
+/**
+ * @brief Publish lookup tables to the shared memory segment
+ * @param table IPv4 lookup table
+ * @param count IPv4 lookup table entry count
+ * @param table6 IPv6 lookup table
+ * @param count6 IPv6 lookup table entry count
+ * @return 0 on success, -1 on failure (readers keep using the previous tables)
+ * @attention Tables must be sorted by netmask, longest first
+**/
+int RouteShm_publish(const struct Route_s *table, uint64_t count, const struct Route6_s *table6, uint64_t count6);
+
+/**
+ * @brief Attach to shared memory segment created by a publisher
+ * @param name Segment name
+ * @return 0 on success, -1 on failure
+ * @attention If the segment does not exist yet, attaching is retried on lookups
+**/
+int RouteShm_attach(const char *name);
+
+/**
+ * @brief Get gateway for given IPv4 address from the shared memory segment
+ * @param address Destination address
+ * @return Gateway address or 0 if there is no route (or the segment is not available)
+**/
+in_addr_t RouteShm_get(in_addr_t address);
+
+/**
+ * @brief Get gateway for given IPv6 address from the shared memory segment
+ * @param address Destination address
+ * @return Gateway address or in6addr_any if there is no route (or the segment is not available)
+**/
+struct in6_addr RouteShm_get6(struct in6_addr address);
+
+/**
+ * @brief Get number of lookup table entries currently available in the shared memory segment
+ * @param count Pointer to store IPv4 entry count at
+ * @param count6 Pointer to store IPv6 entry count at
+**/
+void RouteShm_getCounts(uint64_t *count, uint64_t *count6);
+
+#endif
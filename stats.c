@@ -0,0 +1,180 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file stats.c
+ * @brief Datapath counters module
+ *
+ * The segment is recreated on every start (readers compare the PID and start time to notice a restart).
+ * Until it is created, or when creation fails, shards live in a private segment, so updating counters never needs a check.
+**/
+
+#include "stats.h"
+#include "common.h"
+#include "drop.h"
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+__thread struct StatsShard_s *statsShard = NULL;
+__thread uint8_t statsShared = 0;
+
+static struct StatsSegment_s privateSegment; //used when there is no shared memory segment
+static struct StatsSegment_s *segment = &privateSegment;
+static const char *segmentName = NULL; //shared memory segment name, NULL if not created
+
+struct StatsShard_s* Stats_attach()
+{
+    uint32_t index = __atomic_fetch_add(&(segment->shards), 1, __ATOMIC_RELAXED);
+    if(index >= (STATS_MAX_SHARDS - 1)) //the last shard is shared by all threads above the limit, so it is updated atomically
+    {
+        index = STATS_MAX_SHARDS - 1;
+        statsShared = 1;
+    }
+    statsShard = &(segment->shard[index]);
+    return statsShard;
+}
+
+int Stats_init(const char *name)
+{
+    shm_unlink(name); //segment left by a previous run may be mapped by readers, don't reuse it
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(fd < 0)
+    {
+        DEBUG(LOG_ERR, "Counter segment creation failed");
+        return -1;
+    }
+    if(ftruncate(fd, sizeof(struct StatsSegment_s)) < 0)
+    {
+        DEBUG(LOG_ERR, "Counter segment creation failed");
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+
+    struct StatsSegment_s *s = mmap(NULL, sizeof(struct StatsSegment_s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(s == MAP_FAILED)
+    {
+        DEBUG(LOG_ERR, "Counter segment mapping failed");
+        shm_unlink(name);
+        return -1;
+    }
+
+    s->version = STATS_VERSION;
+    s->pid = getpid();
+    s->started = time(NULL);
+    s->shards = 0;
+    __atomic_store_n(&(s->magic), STATS_MAGIC, __ATOMIC_RELEASE);
+    segment = s;
+    segmentName = name;
+    return 0;
+}
+
+void Stats_close()
+{
+    if(segmentName != NULL)
+        shm_unlink(segmentName);
+}
+
+void Stats_print(int logLevel)
+{
+    static const char *names[STATS_COUNTERS] = STATS_NAMES;
+    uint32_t shards = __atomic_load_n(&(segment->shards), __ATOMIC_RELAXED);
+    if(shards > STATS_MAX_SHARDS)
+        shards = STATS_MAX_SHARDS;
+
+    PRINT(logLevel, "Counters (IPv4, IPv6):\n");
+    for(int c = 0; c < STATS_COUNTERS; c++)
+    {
+        uint64_t total[STATS_FAMILIES] = {0, 0};
+        for(uint32_t i = 0; i < shards; i++)
+        {
+            for(int f = 0; f < STATS_FAMILIES; f++)
+                total[f] += __atomic_load_n(&(segment->shard[i].counter[f][c]), __ATOMIC_RELAXED);
+        }
+        PRINT(logLevel, " %s: %llu, %llu\n", names[c], (unsigned long long)total[STATS_IPV4], (unsigned long long)total[STATS_IPV6]);
+    }
+
+    static const char *dropNames[DROP_REASONS] = DROP_NAMES;
+    PRINT(logLevel, "Dropped packets:\n");
+    for(int r = 1; r < DROP_REASONS; r++)
+    {
+        uint64_t total = 0;
+        for(uint32_t i = 0; i < shards; i++)
+            total += __atomic_load_n(&(segment->shard[i].drop[r]), __ATOMIC_RELAXED);
+        if(total != 0) //only reasons that occurred
+            PRINT(logLevel, " %s: %llu\n", dropNames[r], (unsigned long long)total);
+    }
+
+    static const char *pathNames[STATS_PATHS] = {"encapsulation", "decapsulation"};
+    static const char *stageNames[STATS_STAGES] = STATS_STAGE_NAMES;
+    static const char *eventNames[STATS_EVENTS] = STATS_EVENT_NAMES;
+    for(int p = 0; (p < STATS_PATHS) && config.perfSample; p++)
+    {
+        uint64_t packets = 0, events = 0, value[STATS_STAGES][STATS_EVENTS];
+        memset(value, 0, sizeof(value));
+        for(uint32_t i = 0; i < shards; i++)
+        {
+            const struct StatsPerf_s *perf = &(segment->shard[i].perf[p]);
+            packets += __atomic_load_n(&(perf->packets), __ATOMIC_RELAXED);
+            events |= __atomic_load_n(&(perf->events), __ATOMIC_RELAXED);
+            for(int s = 0; s < STATS_STAGES; s++)
+            {
+                for(int e = 0; e < STATS_EVENTS; e++)
+                    value[s][e] += __atomic_load_n(&(perf->value[s][e]), __ATOMIC_RELAXED);
+            }
+        }
+        if(packets == 0)
+            continue;
+        PRINT(logLevel, "Per-packet cost of %s (%llu packets measured):\n", pathNames[p], (unsigned long long)packets);
+        for(int s = 0; s < STATS_STAGES; s++)
+        {
+            PRINT(logLevel, " %s:", stageNames[s]);
+            for(int e = 0; e < STATS_EVENTS; e++)
+            {
+                if(events & (1 << e))
+                    PRINT(logLevel, " %llu %s", (unsigned long long)(value[s][e] / packets), eventNames[e]);
+            }
+            PRINT(logLevel, "\n");
+        }
+    }
+
+    for(int p = 0; (p < STATS_PATHS) && config.latency; p++)
+    {
+        uint64_t bucket[STATS_LATENCY_BUCKETS];
+        uint64_t count = 0, max = 0;
+        memset(bucket, 0, sizeof(bucket));
+        for(uint32_t i = 0; i < shards; i++)
+        {
+            const struct StatsHistogram_s *h = &(segment->shard[i].latency[p]);
+            for(int b = 0; b < STATS_LATENCY_BUCKETS; b++)
+                bucket[b] += __atomic_load_n(&(h->bucket[b]), __ATOMIC_RELAXED);
+            uint64_t m = __atomic_load_n(&(h->max), __ATOMIC_RELAXED);
+            if(m > max)
+                max = m;
+        }
+        for(int b = 0; b < STATS_LATENCY_BUCKETS; b++)
+            count += bucket[b];
+        PRINT(logLevel, "Latency of %s (%llu packets): p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n", pathNames[p], (unsigned long long)count,
+            Stats_percentile(bucket, count, 0.5, max) / 1000.0, Stats_percentile(bucket, count, 0.99, max) / 1000.0,
+            Stats_percentile(bucket, count, 0.999, max) / 1000.0, max / 1000.0);
+    }
+}
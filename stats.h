@@ -0,0 +1,305 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file stats.h
+ * @brief Datapath counters module
+ *
+ * Every thread updating counters gets its own shard (cache line aligned, so threads never share a line).
+ * A counter is updated with a plain load and store by its only writer, without locks, atomic read-modify-write or syscalls.
+ * Packet drops are counted per reason (DropReason_e, see drop.h) in the same shards.
+ * With --latency, shards also hold log-linear (HDR-style) latency histograms: values below 2^STATS_LATENCY_SUB_BITS ns
+ * have their own buckets, every higher power of 2 is split into 2^STATS_LATENCY_SUB_BITS linear buckets,
+ * so the relative error is bounded (6.25%) at any magnitude, and recording a sample is a few instructions.
+ * With --perf-sample, shards also hold per-stage sums of performance counter deltas of measured packets (see perf.h).
+ * Shards are placed in a POSIX shared memory segment (--stats-shm), which the kiwitun-stat tool maps read-only and sums up.
+ * The segment layout is described here, so that the tool needs this header only.
+*/
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define STATS_MAGIC 0x4B535453 //"KSTS"
+#define STATS_VERSION 5 //segment layout version
+#define STATS_MAX_SHARDS 64 //maximum number of shards, threads above the limit share the last one (with atomic updates)
+
+#define STATS_IPV4 0 //IPv4 inner packets
+#define STATS_IPV6 1 //IPv6 inner packets
+#define STATS_FAMILIES 2 //number of inner packet families
+#define STATS_DROP_REASONS 32 //space for drop reason counters (drop reasons are numbered from 1)
+
+#define STATS_ENCAP 0 //TUN interface read to underlay send
+#define STATS_DECAP 1 //underlay receive to TUN interface write
+#define STATS_PATHS 2 //number of latency histograms
+#define STATS_LATENCY_SUB_BITS 4 //log2 of number of linear buckets per power of 2
+#define STATS_LATENCY_BUCKETS ((32 - STATS_LATENCY_SUB_BITS + 1) << STATS_LATENCY_SUB_BITS) //buckets for 0 to 2^32-1 ns (4.3 s), longer are clamped
+
+/**
+ * @brief Per-family counters
+**/
+enum StatsCounter_e
+{
+    STATS_TUN_RX_PACKETS = 0, //packets read from TUN interfaces
+    STATS_TUN_RX_BYTES,
+    STATS_TX_PACKETS, //encapsulated packets sent to the underlay (outer fragments count separately)
+    STATS_TX_BYTES, //including outer headers
+    STATS_TX_ERRORS, //underlay send failures
+    STATS_RX_PACKETS, //encapsulated packets received from the underlay (FOU/GUE: only of known tunnels and with valid header)
+    STATS_RX_BYTES, //including outer headers
+    STATS_TUN_TX_PACKETS, //decapsulated packets written to TUN interfaces
+    STATS_TUN_TX_BYTES,
+    STATS_TUN_TX_ERRORS, //TUN interface write failures
+    STATS_ICMP_SENT, //ICMP errors sent about packets of this family
+    STATS_ICMP_LIMITED, //ICMP errors suppressed by per-destination limit
+    STATS_ICMP_GLOBAL_LIMITED, //ICMP errors suppressed by global limit
+    STATS_COUNTERS, //number of counters per family
+};
+
+//counter names, in StatsCounter_e order
+#define STATS_NAMES {"tun_rx_packets", "tun_rx_bytes", "tx_packets", "tx_bytes", "tx_errors",\
+    "rx_packets", "rx_bytes", "tun_tx_packets", "tun_tx_bytes", "tun_tx_errors", "icmp_sent", "icmp_limited", "icmp_global_limited"}
+
+/**
+ * @brief Packet processing stages measured with performance counters
+**/
+enum StatsStage_e
+{
+    STATS_STAGE_READ = 0, //TUN interface read or underlay socket receive
+    STATS_STAGE_VALIDATE, //header checks before lookup
+    STATS_STAGE_ROUTE, //encapsulation: route, peer and path MTU lookup, decapsulation: tunnel and peer lookup
+    STATS_STAGE_CHECKSUM, //encapsulation: TTL decrement and outer header, decapsulation: inner header checks and checksum
+    STATS_STAGE_SEND, //underlay socket send or TUN interface write
+    STATS_STAGES, //number of stages
+};
+
+//stage names, in StatsStage_e order
+#define STATS_STAGE_NAMES {"read", "validate", "route", "checksum", "send"}
+
+/**
+ * @brief Performance counter events
+**/
+enum StatsEvent_e
+{
+    STATS_EVENT_TIME = 0, //task clock in nanoseconds (software event, always available)
+    STATS_EVENT_CYCLES, //CPU cycles
+    STATS_EVENT_INSTRUCTIONS, //retired instructions
+    STATS_EVENT_CACHE_MISSES, //last level cache misses
+    STATS_EVENTS, //number of events
+};
+
+//event names, in StatsEvent_e order
+#define STATS_EVENT_NAMES {"time_ns", "cycles", "instructions", "cache_misses"}
+
+/**
+ * @brief Latency histogram
+**/
+struct StatsHistogram_s
+{
+    uint64_t sum; //sum of samples in nanoseconds
+    uint64_t max; //maximum sample in nanoseconds
+    uint64_t bucket[STATS_LATENCY_BUCKETS]; //number of samples in each bucket, the sum is the number of samples
+};
+
+/**
+ * @brief Per-stage performance counter sums
+**/
+struct StatsPerf_s
+{
+    uint64_t events; //bit mask of events available to this thread (1 << StatsEvent_e)
+    uint64_t packets; //number of measured packets
+    uint64_t value[STATS_STAGES][STATS_EVENTS]; //sums of event counts of measured packets
+};
+
+/**
+ * @brief Counter shard, written by a single thread
+**/
+struct StatsShard_s
+{
+    uint64_t counter[STATS_FAMILIES][STATS_COUNTERS];
+    uint64_t drop[STATS_DROP_REASONS]; //dropped packets by reason
+    struct StatsHistogram_s latency[STATS_PATHS]; //packet latency (only with --latency)
+    struct StatsPerf_s perf[STATS_PATHS]; //per-stage performance counters (only with --perf-sample)
+} __attribute__((aligned(64)));
+
+/**
+ * @brief Shared memory segment
+**/
+struct StatsSegment_s
+{
+    uint32_t magic; //STATS_MAGIC, written last when the segment is initialized
+    uint32_t version; //STATS_VERSION
+    uint32_t pid; //kiwitun process ID
+    uint32_t shards; //number of shards in use (can exceed STATS_MAX_SHARDS, extra threads use the last shard)
+    uint64_t started; //start time (UNIX time in seconds)
+    struct StatsShard_s shard[STATS_MAX_SHARDS];
+};
+
+extern __thread struct StatsShard_s *statsShard; //calling thread shard, NULL before the first update
+extern __thread uint8_t statsShared; //calling thread shares the last shard
+
+/**
+ * @brief Get shard for calling thread
+ * @return Shard
+**/
+struct StatsShard_s* Stats_attach();
+
+/**
+ * @brief Add value to calling thread counter
+ * @param c Counter in calling thread shard
+ * @param value Value to add
+**/
+static inline void stats_increase(uint64_t *c, uint64_t value)
+{
+    if(__builtin_expect(statsShared, 0))
+        __atomic_fetch_add(c, value, __ATOMIC_RELAXED);
+    else
+        __atomic_store_n(c, *c + value, __ATOMIC_RELAXED); //single writer, readers see whole 64-bit values
+}
+
+/**
+ * @brief Get calling thread shard
+**/
+static inline struct StatsShard_s* stats_shard()
+{
+    struct StatsShard_s *s = statsShard;
+    if(__builtin_expect(s == NULL, 0)) //first update from this thread
+        s = Stats_attach();
+    return s;
+}
+
+/**
+ * @brief Add value to counter
+ * @param family Inner packet family (STATS_IPV4 or STATS_IPV6)
+ * @param counter Counter (StatsCounter_e)
+ * @param value Value to add
+**/
+static inline void Stats_add(int family, int counter, uint64_t value)
+{
+    stats_increase(&(stats_shard()->counter[family][counter]), value);
+}
+
+/**
+ * @brief Count dropped packet
+ * @param reason Drop reason (DropReason_e)
+**/
+static inline void Stats_drop(int reason)
+{
+    stats_increase(&(stats_shard()->drop[reason]), 1);
+}
+
+/**
+ * @brief Get latency histogram bucket
+ * @param ns Latency in nanoseconds
+ * @return Bucket index
+**/
+static inline int Stats_latencyBucket(uint64_t ns)
+{
+    if(ns > UINT32_MAX)
+        ns = UINT32_MAX;
+    if(ns < (1 << STATS_LATENCY_SUB_BITS)) //linear range
+        return ns;
+    int e = 63 - __builtin_clzll(ns); //power of 2
+    return ((e - STATS_LATENCY_SUB_BITS + 1) << STATS_LATENCY_SUB_BITS) + ((ns >> (e - STATS_LATENCY_SUB_BITS)) & ((1 << STATS_LATENCY_SUB_BITS) - 1));
+}
+
+/**
+ * @brief Get highest latency in histogram bucket
+ * @param bucket Bucket index
+ * @return Latency in nanoseconds
+**/
+static inline uint64_t Stats_latencyValue(int bucket)
+{
+    if(bucket < (1 << STATS_LATENCY_SUB_BITS)) //linear range
+        return bucket;
+    int e = (bucket >> STATS_LATENCY_SUB_BITS) + STATS_LATENCY_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1 << STATS_LATENCY_SUB_BITS) - 1);
+    return (((1 << STATS_LATENCY_SUB_BITS) + sub + 1) << (e - STATS_LATENCY_SUB_BITS)) - 1;
+}
+
+/**
+ * @brief Get latency percentile from histogram buckets
+ * @param bucket Bucket counts
+ * @param count Number of samples (sum of bucket counts)
+ * @param q Quantile (0.5 for median, 0.99 etc.)
+ * @param max Maximum sample in nanoseconds, bucket upper bounds are clamped to it
+ * @return Highest latency in the bucket containing the quantile in nanoseconds, 0 if there are no samples
+**/
+static inline uint64_t Stats_percentile(const uint64_t *bucket, uint64_t count, double q, uint64_t max)
+{
+    uint64_t rank = (uint64_t)(q * count);
+    if((rank < (q * count)) || (rank == 0)) //round up, at least one sample
+        rank++;
+    uint64_t seen = 0;
+    for(int i = 0; i < STATS_LATENCY_BUCKETS; i++)
+    {
+        seen += bucket[i];
+        if(seen >= rank)
+            return (Stats_latencyValue(i) < max) ? Stats_latencyValue(i) : max;
+    }
+    return 0;
+}
+
+/**
+ * @brief Record packet latency
+ * @param path Packet path (STATS_ENCAP or STATS_DECAP)
+ * @param ns Latency in nanoseconds
+**/
+static inline void Stats_latency(int path, uint64_t ns)
+{
+    struct StatsHistogram_s *h = &(stats_shard()->latency[path]);
+    stats_increase(&(h->bucket[Stats_latencyBucket(ns)]), 1);
+    stats_increase(&(h->sum), ns);
+    uint64_t max = __atomic_load_n(&(h->max), __ATOMIC_RELAXED);
+    //new maximum is rare, so compare-and-swap (needed for the shared last shard) is used for all shards
+    while((ns > max) && !__atomic_compare_exchange_n(&(h->max), &max, ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * @brief Count packet
+ * @param family Inner packet family (STATS_IPV4 or STATS_IPV6)
+ * @param packets Packet counter (StatsCounter_e), the byte counter must follow it
+ * @param bytes Packet size
+**/
+static inline void Stats_count(int family, int packets, int bytes)
+{
+    Stats_add(family, packets, 1);
+    Stats_add(family, packets + 1, bytes);
+}
+
+/**
+ * @brief Create shared memory counter segment
+ * @param name Segment name
+ * @return 0 on success, -1 on failure (counters are kept in private memory then)
+ * @attention Must be called before any thread updates counters
+**/
+int Stats_init(const char *name);
+
+/**
+ * @brief Remove shared memory counter segment
+**/
+void Stats_close();
+
+/**
+ * @brief Print (log) counter totals
+ * @param logLevel Log level
+**/
+void Stats_print(int logLevel);
+
+#endif
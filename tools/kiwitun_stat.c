@@ -0,0 +1,424 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file kiwitun_stat.c
+ * @brief Counter reader (kiwitun-stat)
+ *
+ * Maps the counter segment of a running kiwitun read-only and prints the sums of all shards,
+ * as a table, as per-second rates or in Prometheus text exposition format (e.g. for node_exporter textfile collector).
+ * Latency percentiles are computed from the summed histograms (in rate mode: from samples taken in the interval).
+ * Per-stage performance counter sums are divided by the number of measured packets (in rate mode: of the interval).
+ * Needs no privileges beyond read access to the segment (/dev/shm).
+*/
+
+#include "stats.h"
+#include "drop.h"
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char *names[STATS_COUNTERS] = STATS_NAMES;
+static const char *familyNames[STATS_FAMILIES] = {"ipv4", "ipv6"};
+static const char *dropNames[DROP_REASONS] = DROP_NAMES;
+static const char *pathNames[STATS_PATHS] = {"encap", "decap"};
+static const char *stageNames[STATS_STAGES] = STATS_STAGE_NAMES;
+static const char *eventNames[STATS_EVENTS] = STATS_EVENT_NAMES;
+
+/**
+ * @brief Summed latency histogram
+**/
+struct StatLatency_s
+{
+    uint64_t bucket[STATS_LATENCY_BUCKETS];
+    uint64_t count; //number of samples
+    uint64_t sum; //sum of samples in nanoseconds
+    uint64_t max; //maximum sample in nanoseconds
+};
+
+/**
+ * @brief Map counter segment
+ * @param name Segment name
+ * @return Segment or NULL on failure
+**/
+static const struct StatsSegment_s* stat_map(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if(fd < 0)
+    {
+        fprintf(stderr, "Can't open counter segment %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if((fstat(fd, &st) < 0) || (st.st_size < (off_t)sizeof(struct StatsSegment_s)))
+    {
+        fprintf(stderr, "Counter segment %s is too small\n", name);
+        close(fd);
+        return NULL;
+    }
+    const struct StatsSegment_s *s = mmap(NULL, sizeof(struct StatsSegment_s), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(s == MAP_FAILED)
+    {
+        fprintf(stderr, "Can't map counter segment %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    if((__atomic_load_n(&(s->magic), __ATOMIC_ACQUIRE) != STATS_MAGIC) || (s->version != STATS_VERSION))
+    {
+        fprintf(stderr, "Counter segment %s has unknown format\n", name);
+        return NULL;
+    }
+    return s;
+}
+
+/**
+ * @brief Sum counters of all shards
+ * @param s Segment
+ * @param total Sums
+**/
+static void stat_sum(const struct StatsSegment_s *s, uint64_t total[STATS_FAMILIES][STATS_COUNTERS])
+{
+    uint32_t shards = __atomic_load_n(&(s->shards), __ATOMIC_RELAXED);
+    if(shards > STATS_MAX_SHARDS)
+        shards = STATS_MAX_SHARDS;
+    memset(total, 0, sizeof(uint64_t) * STATS_FAMILIES * STATS_COUNTERS);
+    for(uint32_t i = 0; i < shards; i++)
+    {
+        for(int f = 0; f < STATS_FAMILIES; f++)
+        {
+            for(int c = 0; c < STATS_COUNTERS; c++)
+                total[f][c] += __atomic_load_n(&(s->shard[i].counter[f][c]), __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * @brief Sum drop counters of all shards
+ * @param s Segment
+ * @param drops Sums, indexed by drop reason
+**/
+static void stat_sumDrops(const struct StatsSegment_s *s, uint64_t drops[DROP_REASONS])
+{
+    uint32_t shards = __atomic_load_n(&(s->shards), __ATOMIC_RELAXED);
+    if(shards > STATS_MAX_SHARDS)
+        shards = STATS_MAX_SHARDS;
+    memset(drops, 0, sizeof(uint64_t) * DROP_REASONS);
+    for(uint32_t i = 0; i < shards; i++)
+    {
+        for(int r = 1; r < DROP_REASONS; r++)
+            drops[r] += __atomic_load_n(&(s->shard[i].drop[r]), __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Sum latency histograms of all shards
+ * @param s Segment
+ * @param latency Sums, indexed by packet path
+**/
+static void stat_sumLatency(const struct StatsSegment_s *s, struct StatLatency_s latency[STATS_PATHS])
+{
+    uint32_t shards = __atomic_load_n(&(s->shards), __ATOMIC_RELAXED);
+    if(shards > STATS_MAX_SHARDS)
+        shards = STATS_MAX_SHARDS;
+    memset(latency, 0, sizeof(struct StatLatency_s) * STATS_PATHS);
+    for(int p = 0; p < STATS_PATHS; p++)
+    {
+        for(uint32_t i = 0; i < shards; i++)
+        {
+            const struct StatsHistogram_s *h = &(s->shard[i].latency[p]);
+            for(int b = 0; b < STATS_LATENCY_BUCKETS; b++)
+                latency[p].bucket[b] += __atomic_load_n(&(h->bucket[b]), __ATOMIC_RELAXED);
+            latency[p].sum += __atomic_load_n(&(h->sum), __ATOMIC_RELAXED);
+            uint64_t max = __atomic_load_n(&(h->max), __ATOMIC_RELAXED);
+            if(max > latency[p].max)
+                latency[p].max = max;
+        }
+        for(int b = 0; b < STATS_LATENCY_BUCKETS; b++)
+            latency[p].count += latency[p].bucket[b];
+    }
+}
+
+/**
+ * @brief Sum per-stage performance counters of all shards
+ * @param s Segment
+ * @param perf Sums, indexed by packet path
+**/
+static void stat_sumPerf(const struct StatsSegment_s *s, struct StatsPerf_s perf[STATS_PATHS])
+{
+    uint32_t shards = __atomic_load_n(&(s->shards), __ATOMIC_RELAXED);
+    if(shards > STATS_MAX_SHARDS)
+        shards = STATS_MAX_SHARDS;
+    memset(perf, 0, sizeof(struct StatsPerf_s) * STATS_PATHS);
+    for(int p = 0; p < STATS_PATHS; p++)
+    {
+        for(uint32_t i = 0; i < shards; i++)
+        {
+            const struct StatsPerf_s *h = &(s->shard[i].perf[p]);
+            perf[p].packets += __atomic_load_n(&(h->packets), __ATOMIC_RELAXED);
+            perf[p].events |= __atomic_load_n(&(h->events), __ATOMIC_RELAXED);
+            for(int st = 0; st < STATS_STAGES; st++)
+            {
+                for(int e = 0; e < STATS_EVENTS; e++)
+                    perf[p].value[st][e] += __atomic_load_n(&(h->value[st][e]), __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+static void stat_printTable(uint64_t total[STATS_FAMILIES][STATS_COUNTERS])
+{
+    printf("%-20s %16s %16s\n", "", "IPv4", "IPv6");
+    for(int c = 0; c < STATS_COUNTERS; c++)
+        printf("%-20s %16llu %16llu\n", names[c], (unsigned long long)total[STATS_IPV4][c], (unsigned long long)total[STATS_IPV6][c]);
+}
+
+static void stat_printDrops(uint64_t drops[DROP_REASONS])
+{
+    printf("\n%-24s %20s\n", "Dropped", "Packets");
+    for(int r = 1; r < DROP_REASONS; r++)
+        printf("%-24s %20llu\n", dropNames[r], (unsigned long long)drops[r]);
+}
+
+static void stat_printLatency(struct StatLatency_s latency[STATS_PATHS])
+{
+    if((latency[STATS_ENCAP].count == 0) && (latency[STATS_DECAP].count == 0)) //not measured
+        return;
+    printf("\n%-8s %16s %12s %12s %12s %12s\n", "Latency", "Packets", "p50 [us]", "p99 [us]", "p99.9 [us]", "max [us]");
+    for(int p = 0; p < STATS_PATHS; p++)
+    {
+        const struct StatLatency_s *l = &latency[p];
+        printf("%-8s %16llu %12.1f %12.1f %12.1f %12.1f\n", pathNames[p], (unsigned long long)l->count,
+            Stats_percentile(l->bucket, l->count, 0.5, l->max) / 1000.0, Stats_percentile(l->bucket, l->count, 0.99, l->max) / 1000.0,
+            Stats_percentile(l->bucket, l->count, 0.999, l->max) / 1000.0, l->max / 1000.0);
+    }
+}
+
+static void stat_printPerf(struct StatsPerf_s perf[STATS_PATHS])
+{
+    for(int p = 0; p < STATS_PATHS; p++)
+    {
+        if(perf[p].packets == 0) //not measured
+            continue;
+        printf("\n%-8s", pathNames[p]);
+        for(int e = 0; e < STATS_EVENTS; e++)
+            printf(" %14s", eventNames[e]);
+        printf("   (per packet, %llu packets measured)\n", (unsigned long long)perf[p].packets);
+        for(int s = 0; s <= STATS_STAGES; s++)
+        {
+            printf("%-8s", (s < STATS_STAGES) ? stageNames[s] : "total");
+            for(int e = 0; e < STATS_EVENTS; e++)
+            {
+                uint64_t value = 0;
+                for(int st = 0; st < STATS_STAGES; st++)
+                {
+                    if((s == STATS_STAGES) || (s == st))
+                        value += perf[p].value[st][e];
+                }
+                if(perf[p].events & (1 << e))
+                    printf(" %14llu", (unsigned long long)(value / perf[p].packets));
+                else
+                    printf(" %14s", "-"); //not available
+            }
+            printf("\n");
+        }
+    }
+}
+
+static void stat_printPrometheus(const struct StatsSegment_s *s, uint64_t total[STATS_FAMILIES][STATS_COUNTERS], uint64_t drops[DROP_REASONS],
+    struct StatLatency_s latency[STATS_PATHS], struct StatsPerf_s perf[STATS_PATHS])
+{
+    printf("# HELP kiwitun_start_time_seconds Start time of kiwitun since UNIX epoch\n");
+    printf("# TYPE kiwitun_start_time_seconds gauge\n");
+    printf("kiwitun_start_time_seconds %llu\n", (unsigned long long)s->started);
+    for(int c = 0; c < STATS_COUNTERS; c++)
+    {
+        printf("# TYPE kiwitun_%s_total counter\n", names[c]);
+        for(int f = 0; f < STATS_FAMILIES; f++)
+            printf("kiwitun_%s_total{family=\"%s\"} %llu\n", names[c], familyNames[f], (unsigned long long)total[f][c]);
+    }
+    printf("# TYPE kiwitun_drops_total counter\n");
+    for(int r = 1; r < DROP_REASONS; r++)
+        printf("kiwitun_drops_total{reason=\"%s\"} %llu\n", dropNames[r], (unsigned long long)drops[r]);
+    if((perf[STATS_ENCAP].packets != 0) || (perf[STATS_DECAP].packets != 0))
+    {
+        printf("# TYPE kiwitun_stage_measured_packets_total counter\n");
+        for(int p = 0; p < STATS_PATHS; p++)
+            printf("kiwitun_stage_measured_packets_total{path=\"%s\"} %llu\n", pathNames[p], (unsigned long long)perf[p].packets);
+        for(int e = 0; e < STATS_EVENTS; e++)
+        {
+            if(!((perf[STATS_ENCAP].events | perf[STATS_DECAP].events) & (1 << e))) //not available
+                continue;
+            printf("# TYPE kiwitun_stage_%s_total counter\n", eventNames[e]);
+            for(int p = 0; p < STATS_PATHS; p++)
+            {
+                for(int s = 0; s < STATS_STAGES; s++)
+                    printf("kiwitun_stage_%s_total{path=\"%s\",stage=\"%s\"} %llu\n", eventNames[e], pathNames[p], stageNames[s], (unsigned long long)perf[p].value[s][e]);
+            }
+        }
+    }
+    if((latency[STATS_ENCAP].count == 0) && (latency[STATS_DECAP].count == 0)) //not measured
+        return;
+    static const double quantiles[] = {0.5, 0.99, 0.999};
+    printf("# TYPE kiwitun_latency_seconds summary\n");
+    for(int p = 0; p < STATS_PATHS; p++)
+    {
+        const struct StatLatency_s *l = &latency[p];
+        for(unsigned int q = 0; q < (sizeof(quantiles) / sizeof(*quantiles)); q++)
+            printf("kiwitun_latency_seconds{path=\"%s\",quantile=\"%g\"} %.9f\n", pathNames[p], quantiles[q], Stats_percentile(l->bucket, l->count, quantiles[q], l->max) / 1e9);
+        printf("kiwitun_latency_seconds{path=\"%s\",quantile=\"1\"} %.9f\n", pathNames[p], l->max / 1e9);
+        printf("kiwitun_latency_seconds_sum{path=\"%s\"} %.9f\n", pathNames[p], l->sum / 1e9);
+        printf("kiwitun_latency_seconds_count{path=\"%s\"} %llu\n", pathNames[p], (unsigned long long)l->count);
+    }
+}
+
+static const char usage[] = "Usage: kiwitun-stat [options]\n"\
+                        " -s, --shm=name\t\tcounter segment name (default " STATS_SHM_DEFAULT_NAME ")\n"\
+                        " -p, --prometheus\tprint in Prometheus text exposition format\n"\
+                        " -i, --interval=seconds\tprint per-second rates every given number of seconds\n"\
+                        " -h, --help\t\tprint help page\n";
+
+int main(int argc, char **argv)
+{
+    struct option options[] =
+    {
+        {"shm", required_argument, 0, 's'},
+        {"prometheus", no_argument, 0, 'p'},
+        {"interval", required_argument, 0, 'i'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    const char *name = STATS_SHM_DEFAULT_NAME;
+    int prometheus = 0;
+    int interval = 0;
+
+    int c;
+    while((c = getopt_long(argc, argv, "s:pi:h", options, NULL)) != -1)
+    {
+        switch(c)
+        {
+            case 's':
+            name = optarg;
+            break;
+            case 'p':
+            prometheus = 1;
+            break;
+            case 'i':
+            interval = atoi(optarg);
+            if(interval < 1)
+            {
+                printf("Interval must be at least 1 second.\n");
+                return -1;
+            }
+            break;
+            case 'h':
+            printf("%s", usage);
+            return 0;
+            default:
+            printf("%s", usage);
+            return -1;
+        }
+    }
+
+    const struct StatsSegment_s *s = stat_map(name);
+    if(s == NULL)
+        return -1;
+    if((kill(s->pid, 0) < 0) && (errno == ESRCH))
+        fprintf(stderr, "kiwitun (PID %u) is not running, counters are stale\n", (unsigned int)s->pid);
+
+    uint64_t total[STATS_FAMILIES][STATS_COUNTERS];
+    uint64_t drops[DROP_REASONS];
+    static struct StatLatency_s latency[STATS_PATHS], lastLatency[STATS_PATHS];
+    struct StatsPerf_s perf[STATS_PATHS], lastPerf[STATS_PATHS];
+    stat_sum(s, total);
+    stat_sumDrops(s, drops);
+    stat_sumLatency(s, latency);
+    stat_sumPerf(s, perf);
+    if(interval == 0)
+    {
+        if(prometheus)
+            stat_printPrometheus(s, total, drops, latency, perf);
+        else
+        {
+            stat_printTable(total);
+            stat_printDrops(drops);
+            stat_printLatency(latency);
+            stat_printPerf(perf);
+        }
+        return 0;
+    }
+
+    while(1)
+    {
+        uint64_t last[STATS_FAMILIES][STATS_COUNTERS];
+        uint64_t lastDrops[DROP_REASONS];
+        memcpy(last, total, sizeof(last));
+        memcpy(lastDrops, drops, sizeof(lastDrops));
+        memcpy(lastLatency, latency, sizeof(lastLatency));
+        memcpy(lastPerf, perf, sizeof(lastPerf));
+        sleep(interval);
+        stat_sum(s, total);
+        stat_sumDrops(s, drops);
+        stat_sumLatency(s, latency);
+        stat_sumPerf(s, perf);
+        uint64_t rate[STATS_FAMILIES][STATS_COUNTERS];
+        for(int f = 0; f < STATS_FAMILIES; f++)
+        {
+            for(int c = 0; c < STATS_COUNTERS; c++)
+                rate[f][c] = (total[f][c] - last[f][c]) / interval;
+        }
+        uint64_t dropRate[DROP_REASONS];
+        for(int r = 0; r < DROP_REASONS; r++)
+            dropRate[r] = (drops[r] - lastDrops[r]) / interval;
+        struct StatLatency_s *recent = lastLatency; //samples taken in the interval, maximum is the highest non-empty bucket
+        for(int p = 0; p < STATS_PATHS; p++)
+        {
+            recent[p].count = 0;
+            for(int b = 0; b < STATS_LATENCY_BUCKETS; b++)
+            {
+                recent[p].bucket[b] = latency[p].bucket[b] - lastLatency[p].bucket[b];
+                recent[p].count += recent[p].bucket[b];
+            }
+            recent[p].max = Stats_percentile(recent[p].bucket, recent[p].count, 1.0, latency[p].max);
+        }
+        for(int p = 0; p < STATS_PATHS; p++) //packets measured in the interval
+        {
+            lastPerf[p].packets = perf[p].packets - lastPerf[p].packets;
+            lastPerf[p].events = perf[p].events;
+            for(int st = 0; st < STATS_STAGES; st++)
+            {
+                for(int e = 0; e < STATS_EVENTS; e++)
+                    lastPerf[p].value[st][e] = perf[p].value[st][e] - lastPerf[p].value[st][e];
+            }
+        }
+        printf("\nPer second:\n");
+        stat_printTable(rate);
+        stat_printDrops(dropRate);
+        stat_printLatency(recent);
+        stat_printPerf(lastPerf);
+        fflush(stdout);
+    }
+    return 0;
+}
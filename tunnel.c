@@ -0,0 +1,342 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file tunnel.c
+ * @brief Tunnel table module
+ *
+ * Tunnels are stored in a fixed array, so that tunnel pointers stay valid. The hash table maps (remote, local) address pairs
+ * to tunnel indexes and is rebuilt whenever a tunnel is added or its remote address changes. The new hash table replaces
+ * the current one with an atomic pointer store, so lookups need no locks. The replaced one is released after a grace period
+ * (Reclaim_synchronize()), when no packet processing thread can still be probing it.
+**/
+
+#include "tunnel.h"
+#include "tun.h"
+#include "common.h"
+#include "reclaim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#define TUNNEL_LINE_MAX 256 //maximum tunnel file line length
+#define TUNNEL_MIN_SLOTS 16 //minimum hash table size
+
+//kinds of keys present in hash table, so that lookups skip wildcard probes that can't match
+#define TUNNEL_KEY_EXACT 1 //remote and local address set
+#define TUNNEL_KEY_ANY_LOCAL 2 //remote address set, any local address
+#define TUNNEL_KEY_ANY_REMOTE 4 //local address set, any remote address
+#define TUNNEL_KEY_ANY 8 //any remote and local address
+
+/**
+ * @brief Hash table slot
+**/
+struct TunnelSlot_s
+{
+    in_addr_t remote; //remote address
+    in_addr_t local; //local address
+    uint32_t index; //tunnel index + 1, 0 if the slot is empty
+};
+
+/**
+ * @brief Hash table
+**/
+struct TunnelHash_s
+{
+    struct TunnelSlot_s *slots;
+    uint32_t mask; //hash table size - 1 (size is a power of 2)
+    uint8_t keys; //kinds of keys present (TUNNEL_KEY_...)
+};
+
+static struct Tunnel_s tunnels[TUNNEL_MAX_COUNT]; //tunnel table
+static uint32_t tunnelCount = 0; //number of tunnels
+static struct TunnelHash_s *hash = NULL; //current hash table
+static pthread_mutex_t tunnelMutex = PTHREAD_MUTEX_INITIALIZER; //tunnel table modification mutex
+
+/**
+ * @brief Get hash table start index for address pair
+**/
+static inline uint32_t tunnel_hash(in_addr_t remote, in_addr_t local, uint32_t mask)
+{
+    return ((((uint64_t)remote << 32) | local) * 0x9E3779B97F4A7C15ULL >> 40) & mask; //multiplicative hash
+}
+
+/**
+ * @brief Find slot for address pair
+ * @return Matching slot or empty slot where the pair should be inserted
+**/
+static struct TunnelSlot_s* tunnel_probe(struct TunnelHash_s *h, in_addr_t remote, in_addr_t local)
+{
+    for(uint32_t i = tunnel_hash(remote, local, h->mask); ; i = (i + 1) & h->mask) //linear probing, table is never full
+    {
+        struct TunnelSlot_s *s = &(h->slots[i]);
+        if((s->index == 0) || ((s->remote == remote) && (s->local == local)))
+            return s;
+    }
+}
+
+/**
+ * @brief Rebuild hash table from tunnel table
+ * @return 0 on success, -1 on failure (duplicate address pair or allocation failure)
+ * @attention Tunnel mutex must be held
+**/
+static int tunnel_rebuild()
+{
+    struct TunnelHash_s *h = malloc(sizeof(*h));
+    if(h == NULL)
+        return -1;
+
+    //hash table at least twice as big as the tunnel count keeps probe sequences short
+    uint32_t slots = TUNNEL_MIN_SLOTS;
+    while(slots < (2 * tunnelCount))
+        slots *= 2;
+    h->mask = slots - 1;
+    h->keys = 0;
+    h->slots = calloc(slots, sizeof(*(h->slots)));
+    if(h->slots == NULL)
+    {
+        free(h);
+        return -1;
+    }
+
+    for(uint32_t k = 0; k < tunnelCount; k++)
+    {
+        in_addr_t remote = tunnels[k].remote, local = tunnels[k].local.s_addr;
+        struct TunnelSlot_s *s = tunnel_probe(h, remote, local);
+        if(s->index != 0)
+        {
+            PRINT(LOG_ERR, "Tunnels %s and %s have the same local and remote address\n", tunnels[s->index - 1].name, tunnels[k].name);
+            free(h->slots);
+            free(h);
+            return -1;
+        }
+        s->remote = remote;
+        s->local = local;
+        s->index = k + 1;
+        if(remote != INADDR_ANY)
+            h->keys |= (local != INADDR_ANY) ? TUNNEL_KEY_EXACT : TUNNEL_KEY_ANY_LOCAL;
+        else
+            h->keys |= (local != INADDR_ANY) ? TUNNEL_KEY_ANY_REMOTE : TUNNEL_KEY_ANY;
+    }
+
+    struct TunnelHash_s *old = hash;
+    __atomic_store_n(&hash, h, __ATOMIC_RELEASE);
+    if(old != NULL)
+    {
+        Reclaim_synchronize(); //wait for lookups that may have loaded the old pointer
+        free(old->slots);
+        free(old);
+    }
+    return 0;
+}
+
+int Tunnel_add(int fd, const char *name, in_addr_t local, in_addr_t remote)
+{
+    pthread_mutex_lock(&tunnelMutex);
+    if(tunnelCount == TUNNEL_MAX_COUNT)
+    {
+        pthread_mutex_unlock(&tunnelMutex);
+        PRINT(LOG_ERR, "Too many tunnels (maximum is %d)\n", TUNNEL_MAX_COUNT);
+        return -1;
+    }
+
+    struct Tunnel_s *t = &(tunnels[tunnelCount]);
+    t->fd = fd;
+    strncpy(t->name, name, IFNAMSIZ - 1);
+    t->name[IFNAMSIZ - 1] = 0;
+    t->local.s_addr = local;
+    t->remote = remote;
+    tunnelCount++;
+    if(tunnel_rebuild() < 0)
+    {
+        tunnelCount--;
+        pthread_mutex_unlock(&tunnelMutex);
+        return -1;
+    }
+    pthread_mutex_unlock(&tunnelMutex);
+    return tunnelCount - 1;
+}
+
+/**
+ * @brief Parse tunnel file address
+ * @return 0 on success, -1 on failure
+**/
+static int tunnel_parseAddress(const char *s, in_addr_t *addr)
+{
+    if(strcmp(s, "any") == 0)
+    {
+        *addr = INADDR_ANY;
+        return 0;
+    }
+    struct in_addr a;
+    if(inet_pton(AF_INET, s, &a) != 1)
+        return -1;
+    *addr = a.s_addr;
+    return 0;
+}
+
+int Tunnel_load(const char *file)
+{
+    FILE *f = fopen(file, "r");
+    if(f == NULL)
+    {
+        DEBUG(LOG_ERR, "Tunnel file open failed");
+        return -1;
+    }
+
+    char line[TUNNEL_LINE_MAX];
+    uint32_t lineNumber = 0;
+    while(fgets(line, sizeof(line), f) != NULL)
+    {
+        lineNumber++;
+        char *comment = strchr(line, '#');
+        if(comment != NULL)
+            *comment = 0;
+
+        char *save;
+        char *name = strtok_r(line, " \t\r\n", &save);
+        if(name == NULL) //empty line
+            continue;
+        char *remote = strtok_r(NULL, " \t\r\n", &save);
+        char *local = strtok_r(NULL, " \t\r\n", &save);
+        in_addr_t remoteAddr, localAddr = INADDR_ANY;
+        if((strlen(name) >= IFNAMSIZ) || (remote == NULL) || (tunnel_parseAddress(remote, &remoteAddr) < 0)
+        || ((local != NULL) && (tunnel_parseAddress(local, &localAddr) < 0)) || (strtok_r(NULL, " \t\r\n", &save) != NULL))
+        {
+            PRINT(LOG_ERR, "Tunnel file %s, line %u: expected \"<interface name> <remote address|any> [local address|any]\"\n", file, (unsigned int)lineNumber);
+            fclose(f);
+            return -1;
+        }
+
+        char ifName[IFNAMSIZ];
+        strcpy(ifName, name);
+        int fd = Tun_create(ifName);
+        if(fd < 0)
+        {
+            DEBUG(LOG_ERR, "TUN interface creation failed");
+            fclose(f);
+            return -1;
+        }
+
+        if(Tunnel_add(fd, ifName, localAddr, remoteAddr) < 0)
+        {
+            close(fd);
+            fclose(f);
+            return -1;
+        }
+        PRINT(LOG_INFO, "Tunnel interface %s created\n", ifName);
+    }
+
+    fclose(f);
+    if(tunnelCount == 0)
+    {
+        PRINT(LOG_ERR, "Tunnel file %s contains no tunnels\n", file);
+        return -1;
+    }
+    return 0;
+}
+
+uint32_t Tunnel_count()
+{
+    return __atomic_load_n(&tunnelCount, __ATOMIC_ACQUIRE);
+}
+
+struct Tunnel_s* Tunnel_get(uint32_t index)
+{
+    if(index >= Tunnel_count())
+        return NULL;
+    return &(tunnels[index]);
+}
+
+struct Tunnel_s* Tunnel_find(in_addr_t source, in_addr_t destination)
+{
+    struct TunnelHash_s *h = __atomic_load_n(&hash, __ATOMIC_ACQUIRE);
+    if(h == NULL)
+        return NULL;
+
+    struct TunnelSlot_s *s;
+    if((h->keys & TUNNEL_KEY_EXACT) && ((s = tunnel_probe(h, source, destination))->index != 0))
+        return &(tunnels[s->index - 1]);
+    if((h->keys & TUNNEL_KEY_ANY_LOCAL) && ((s = tunnel_probe(h, source, INADDR_ANY))->index != 0))
+        return &(tunnels[s->index - 1]);
+    if((h->keys & TUNNEL_KEY_ANY_REMOTE) && ((s = tunnel_probe(h, INADDR_ANY, destination))->index != 0))
+        return &(tunnels[s->index - 1]);
+    if((h->keys & TUNNEL_KEY_ANY) && ((s = tunnel_probe(h, INADDR_ANY, INADDR_ANY))->index != 0))
+        return &(tunnels[s->index - 1]);
+    return NULL;
+}
+
+int Tunnel_setRemote(uint32_t index, in_addr_t remote)
+{
+    pthread_mutex_lock(&tunnelMutex);
+    if(index >= tunnelCount)
+    {
+        pthread_mutex_unlock(&tunnelMutex);
+        return -1;
+    }
+
+    in_addr_t old = tunnels[index].remote;
+    if(old == remote)
+    {
+        pthread_mutex_unlock(&tunnelMutex);
+        return 0;
+    }
+    __atomic_store_n(&(tunnels[index].remote), remote, __ATOMIC_RELAXED);
+    if(tunnel_rebuild() < 0)
+    {
+        __atomic_store_n(&(tunnels[index].remote), old, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&tunnelMutex);
+        return -1;
+    }
+    pthread_mutex_unlock(&tunnelMutex);
+    return 0;
+}
+
+int Tunnel_setLocal(uint32_t index, in_addr_t local)
+{
+    pthread_mutex_lock(&tunnelMutex);
+    if(index >= tunnelCount)
+    {
+        pthread_mutex_unlock(&tunnelMutex);
+        return -1;
+    }
+
+    in_addr_t old = tunnels[index].local.s_addr;
+    if(old == local)
+    {
+        pthread_mutex_unlock(&tunnelMutex);
+        return 0;
+    }
+    __atomic_store_n(&(tunnels[index].local.s_addr), local, __ATOMIC_RELAXED);
+    if(tunnel_rebuild() < 0)
+    {
+        __atomic_store_n(&(tunnels[index].local.s_addr), old, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&tunnelMutex);
+        return -1;
+    }
+    pthread_mutex_unlock(&tunnelMutex);
+    return 0;
+}
+
+void Tunnel_closeAll()
+{
+    for(uint32_t k = 0; k < Tunnel_count(); k++)
+        close(tunnels[k].fd);
+}
@@ -0,0 +1,117 @@
+/*
+    This file is part of kiwitun.
+
+    Kiwitun is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    Kiwitun is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with kiwitun.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * @file tunnel.h
+ * @brief Tunnel table module
+ *
+ * Keeps all tunnels served by this process. Each tunnel is a TUN interface with its own local and remote endpoint address.
+ * All tunnels share the same raw sockets. Received encapsulated packets are passed to the tunnel
+ * matching their outer source and destination address, found in a hash table. Tunnels with unset (any) addresses match any address,
+ * the most specific tunnel is used: exact match, then any local address, then any remote address, then both any.
+ *
+ * Tunnel file format - one tunnel per line, empty lines and text after # are ignored:
+ * <interface name> <remote IPv4 address or "any"> [local IPv4 address or "any"]
+ * Tunnels with "any" remote address use the routing table (and the peer table) to select remote endpoints.
+*/
+#ifndef TUNNEL_H_
+#define TUNNEL_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include <linux/if.h>
+
+#define TUNNEL_MAX_COUNT 4096 //maximum number of tunnels
+
+/**
+ * @brief Tunnel
+**/
+struct Tunnel_s
+{
+    int fd; //TUN interface descriptor
+    char name[IFNAMSIZ]; //TUN interface name
+    struct in_addr local; //local endpoint address, INADDR_ANY for any, changed only with Tunnel_setLocal()
+    in_addr_t remote; //remote endpoint address, INADDR_ANY for any (routing table is used), changed only with Tunnel_setRemote()
+    //activity counters for remote endpoint failover, updated without atomic increments (lost updates don't matter),
+    //kept in separate cache lines, as they are written by different threads
+    uint32_t txActivity __attribute__((aligned(64))); //number of packets sent
+    uint32_t rxActivity __attribute__((aligned(64))); //number of packets received
+};
+
+/**
+ * @brief Add tunnel with already created TUN interface
+ * @param fd TUN interface descriptor
+ * @param name TUN interface name
+ * @param local Local endpoint address (INADDR_ANY for any)
+ * @param remote Remote endpoint address (INADDR_ANY for any)
+ * @return Tunnel index on success, -1 on failure
+ * @attention Tunnels must be added before tunneling is started
+**/
+int Tunnel_add(int fd, const char *name, in_addr_t local, in_addr_t remote);
+
+/**
+ * @brief Create TUN interfaces and add tunnels listed in file
+ * @param file Tunnel file path
+ * @return 0 on success, -1 on failure
+**/
+int Tunnel_load(const char *file);
+
+/**
+ * @brief Get tunnel count
+ * @return Number of tunnels
+**/
+uint32_t Tunnel_count();
+
+/**
+ * @brief Get tunnel by index
+ * @param index Tunnel index
+ * @return Tunnel or NULL if index is out of range
+**/
+struct Tunnel_s* Tunnel_get(uint32_t index);
+
+/**
+ * @brief Find tunnel for received encapsulated packet
+ * @param source Outer source address
+ * @param destination Outer destination address
+ * @return Most specific matching tunnel or NULL if there is none
+**/
+struct Tunnel_s* Tunnel_find(in_addr_t source, in_addr_t destination);
+
+/**
+ * @brief Change tunnel remote endpoint address (e.g. after hostname resolution)
+ * @param index Tunnel index
+ * @param remote New remote endpoint address
+ * @return 0 on success, -1 on failure (previous address is kept)
+ * @attention Waits until packet processing threads release the old hash table, must not be called from them
+**/
+int Tunnel_setRemote(uint32_t index, in_addr_t remote);
+
+/**
+ * @brief Change tunnel local endpoint address
+ * @param index Tunnel index
+ * @param local New local endpoint address (INADDR_ANY for any)
+ * @return 0 on success, -1 on failure (previous address is kept)
+ * @attention Waits until packet processing threads release the old hash table, must not be called from them
+**/
+int Tunnel_setLocal(uint32_t index, in_addr_t local);
+
+/**
+ * @brief Close all TUN interfaces
+**/
+void Tunnel_closeAll();
+
+#endif